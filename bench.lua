@@ -0,0 +1,296 @@
+-- ***************************************************************
+--
+-- Copyright 2016 by Sean Conner.  All Rights Reserved.
+--
+-- This library is free software; you can redistribute it and/or modify it
+-- under the terms of the GNU Lesser General Public License as published by
+-- the Free Software Foundation; either version 3 of the License, or (at your
+-- option) any later version.
+--
+-- This library is distributed in the hope that it will be useful, but
+-- WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+-- or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+-- License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License
+-- along with this library; if not, see <http://www.gnu.org/licenses/>.
+--
+-- Comments, questions and criticisms can be sent to: sean@conman.org
+--
+-- luacheck: ignore 611
+-- ***************************************************************
+--
+-- Throughput benchmarks.  Run with "make bench", or directly as
+--
+--      lua bench.lua [seconds] [pattern]
+--
+-- where seconds is the minimum CPU time per benchmark (default 0.5, or
+-- the BENCH_TIME environment variable) and pattern limits the benchmarks
+-- run to those whose name matches.  The modules in the current directory
+-- are used in preference to any installed ones, so run it from the top
+-- of the source tree after building cbor_c.so.
+--
+-- For each benchmark, the number of operations per second, the MB/s of
+-- CBOR data encoded or decoded, the CBOR data items per second, and the
+-- bytes of memory allocated per operation (while the garbage collector is
+-- stopped) are printed.
+--
+-- ***************************************************************
+
+do
+  local function local_module(file)
+    local f = io.open(file,"r")
+    if f then
+      f:close()
+      return true
+    end
+  end
+
+  if local_module("cbor_c.so") then
+    package.preload['org.conman.cbor_c'] = function()
+      return assert(package.loadlib("./cbor_c.so","luaopen_org_conman_cbor_c"))()
+    end
+  end
+
+  for _,name in ipairs { "cbor" , "cbor_s" } do
+    if local_module(name .. ".lua") then
+      package.preload['org.conman.' .. name] = function()
+        return assert(loadfile(name .. ".lua"))()
+      end
+    end
+  end
+end
+
+local cbor_c = require "org.conman.cbor_c"
+local cbor   = require "org.conman.cbor"
+local cbor_s = require "org.conman.cbor_s"
+
+local MINTIME = tonumber(arg and arg[1]) or tonumber(os.getenv("BENCH_TIME")) or 0.5
+local PATTERN = arg and arg[2]
+
+-- ***********************************************************************
+
+local function hextobin(hbin)
+  return (hbin:gsub("%x%x",function(pair) return string.char(tonumber(pair,16)) end))
+end
+
+-- ***********************************************************************
+-- Count the CBOR data items in a Lua value (a MAP counts its keys and
+-- values as well).
+-- ***********************************************************************
+
+local function items(value)
+  if type(value) ~= 'table' then
+    return 1
+  end
+
+  local n = 1
+  for k,v in pairs(value) do
+    if type(k) ~= 'number' then
+      n = n + items(k)
+    end
+    n = n + items(v)
+  end
+  return n
+end
+
+-- ***********************************************************************
+-- Corpora.  Everything is generated from fixed data, so the results are
+-- comparable from run to run.
+-- ***********************************************************************
+
+local CORPUS = {}
+
+CORPUS.smallmap = {
+  id     = 12345,
+  name   = "sensor-0042",
+  ok     = true,
+  temp   = 21.5,
+  tags   = { "indoor" , "north" },
+}
+
+do
+  local deep = { "bottom" }
+  for _ = 1 , 200 do
+    deep = { deep }
+  end
+  CORPUS.deep = deep
+end
+
+CORPUS.bigtext = string.rep("The quick brown fox jumps over the lazy dog. ",24000)
+CORPUS.bigbin  = string.rep("\0\1\2\3\4\5\6\7\128\255",100000)
+
+do
+  local floats = {}
+  for i = 1 , 2000 do
+    floats[i] = math.sin(i) * 1000.0
+  end
+  CORPUS.floats = floats
+end
+
+do
+  local names  = { "temperature" , "humidity" , "pressure" , "windspeed" }
+  local units  = { "celsius" , "percent" , "hectopascal" , "metres/second" }
+  local recs   = {}
+  for i = 1 , 500 do
+    recs[i] = {
+      sensor = names[i % #names + 1],
+      unit   = units[i % #units + 1],
+      site   = "observatory-" .. (i % 7),
+      value  = i,
+    }
+  end
+  CORPUS.stringref = recs
+end
+
+-- ***********************************************************************
+-- RFC-7049 Appendix A (the ones both modules can encode and decode).
+-- ***********************************************************************
+
+local APPENDIX_A =
+{
+  "00" , "01" , "0A" , "17" , "1818" , "1819" , "1864" , "1903E8" ,
+  "1A000F4240" , "1B000000E8D4A51000" , "20" , "29" , "3863" , "3903E7" ,
+  "F90000" , "F98000" , "F93C00" , "FB3FF199999999999A" , "F93E00" ,
+  "F97BFF" , "FA47C35000" , "FA7F7FFFFF" , "FB7E37E43C8800759C" ,
+  "F90001" , "F90400" , "F9C400" , "FBC010666666666666" , "F97C00" ,
+  "F97E00" , "F9FC00" , "F4" , "F5" , "F6" , "F0" , "F818" , "F8FF" ,
+  "C074323031332D30332D32315432303A30343A30305A" , "C11A514B67B0" ,
+  "C1FB41D452D9EC200000" , "D74401020304" , "D818456449455446" ,
+  "D82076687474703A2F2F7777772E6578616D706C652E636F6D" , "40" ,
+  "4401020304" , "60" , "6161" , "6449455446" , "62225C" , "62C3BC" ,
+  "63E6B0B4" , "64F0908591" , "80" , "83010203" , "8301820203820405" ,
+  "98190102030405060708090A0B0C0D0E0F101112131415161718181819" , "A0" ,
+  "A201020304" , "A26161016162820203" , "826161A161626163" ,
+  "A56161614161626142616361436164614461656145" , "5F42010243030405FF" ,
+  "7F657374726561646D696E67FF" , "9FFF" , "9F018202039F0405FFFF" ,
+  "9F01820203820405FF" , "83018202039F0405FF" , "83019F0203FF820405" ,
+  "9F0102030405060708090A0B0C0D0E0F101112131415161718181819FF" ,
+  "BF61610161629F0203FFFF" , "826161BF61626163FF" , "BF6346756EF563416D7421FF" ,
+}
+
+for i = 1 , #APPENDIX_A do
+  APPENDIX_A[i] = hextobin(APPENDIX_A[i])
+end
+
+-- ***********************************************************************
+-- Run f() until MINTIME seconds of CPU have been used, and report.  bytes
+-- is the amount of CBOR data handled per call, and nitems the number of
+-- CBOR data items.
+-- ***********************************************************************
+
+local function bench(name,bytes,nitems,f)
+  if PATTERN and not name:match(PATTERN) then
+    return
+  end
+
+  f() -- warm up, and make sure it works
+
+  local n     = 0
+  local batch = 1
+  local start = os.clock()
+  local used
+
+  repeat
+    for _ = 1 , batch do f() end
+    n     = n + batch
+    batch = batch * 2
+    used  = os.clock() - start
+  until used >= MINTIME
+
+  -- --------------------------------------------------------------------
+  -- Measure memory separately, with the collector stopped so nothing is
+  -- reclaimed while we're counting.
+  -- --------------------------------------------------------------------
+
+  local runs = math.min(n,100)
+  collectgarbage()
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  for _ = 1 , runs do f() end
+  local alloc = (collectgarbage("count") - before) * 1024 / runs
+  collectgarbage("restart")
+  collectgarbage()
+
+  io.stdout:write(string.format(
+        "%-32s %12.0f ops/s %10.2f MB/s %14.0f items/s %12.0f bytes/op\n",
+        name,
+        n / used,
+        n * bytes / used / 1048576,
+        n * nitems / used,
+        alloc
+  ))
+end
+
+-- ***********************************************************************
+
+io.stdout:write(string.format("%s, cbor %s, %.2f seconds minimum per benchmark\n\n",
+        _VERSION,cbor._VERSION,MINTIME))
+
+local NAMES = { "smallmap" , "deep" , "bigtext" , "bigbin" , "floats" , "stringref" }
+
+for _,cname in ipairs(NAMES) do
+  local value  = CORPUS[cname]
+  local blob   = cbor.encode(value)
+  local nitems = items(value)
+
+  bench("cbor.encode   " .. cname,#blob,nitems,function() return cbor.encode(value) end)
+  bench("cbor_s.encode " .. cname,#blob,nitems,function() return cbor_s.encode(value) end)
+  bench("cbor.decode   " .. cname,#blob,nitems,function() return cbor.decode(blob) end)
+  bench("cbor_s.decode " .. cname,#blob,nitems,function() return cbor_s.decode(blob) end)
+  bench("cbor_c.skip   " .. cname,#blob,nitems,function() return cbor_c.skip(blob) end)
+end
+
+-- ***********************************************************************
+-- String references only pay off with cbor.lua, so they get their own
+-- benchmark.
+-- ***********************************************************************
+
+do
+  local value  = CORPUS.stringref
+  local blob   = cbor.encode(value,nil,{})
+  local nitems = items(value)
+
+  bench("cbor.encode   stringref+stref",#blob,nitems,function() return cbor.encode(value,nil,{}) end)
+  bench("cbor.decode   stringref+stref",#blob,nitems,function() return cbor.decode(blob) end)
+end
+
+-- ***********************************************************************
+-- The C primitive (one header at a time) against a full decode, over the
+-- RFC-7049 Appendix A vectors.
+-- ***********************************************************************
+
+do
+  local bytes  = 0
+  local nitems = 0
+
+  for _,blob in ipairs(APPENDIX_A) do
+    bytes  = bytes + #blob
+    nitems = nitems + items(cbor.decode(blob))
+  end
+
+  bench("cbor_c.decode appendix-a",bytes,nitems,function()
+    for _,blob in ipairs(APPENDIX_A) do
+      local pos = 1
+      while pos <= #blob do
+        local ctype,info,value,npos = cbor_c.decode(blob,pos)
+        if (ctype == 0x40 or ctype == 0x60) and info ~= 31 then
+          npos = npos + value
+        end
+        pos = npos
+      end
+    end
+  end)
+
+  bench("cbor.decode   appendix-a",bytes,nitems,function()
+    for _,blob in ipairs(APPENDIX_A) do
+      cbor.decode(blob)
+    end
+  end)
+
+  bench("cbor_s.decode appendix-a",bytes,nitems,function()
+    for _,blob in ipairs(APPENDIX_A) do
+      cbor_s.decode(blob)
+    end
+  end)
+end
@@ -88,7 +88,11 @@
 --              indefinite array or map.
 --
 -- luacheck: globals isnumber isinteger isfloat decode encode pdecode pencode
--- luacheck: globals TYPE TAG SIMPLE _VERSION __ENCODE_MAP _ENV
+-- luacheck: globals decoder view path extract keys decode_seq encode_seq writer
+-- luacheck: globals stats limits schema index archive encode_canonical
+-- luacheck: globals encode_packed
+-- luacheck: globals tojson fromjson raw numbers bignum recycle
+-- luacheck: globals TYPE TAG SIMPLE _VERSION __ENCODE_MAP _ENV _M
 -- luacheck: globals null undefined
 -- luacheck: ignore 611
 -- ********************************************************************
@@ -96,7 +100,6 @@
 local math     = require "math"
 local string   = require "string"
 local table    = require "table"
-local lpeg     = require "lpeg"
 local cbor_c   = require "org.conman.cbor_c"
 
 local LUA_VERSION  = _VERSION
@@ -128,23 +131,19 @@ end
 
 _VERSION = cbor_c._VERSION
 
+local M = _M or _ENV -- the module table, for the native encoder
+local ENCODER        -- encoding context for cbor_c.encode_all()
+local CANONICAL      -- the same, but with MAP keys sorted
+local PACKED         -- the same, but with references where they save space
+
 -- ***********************************************************************
 -- UTF-8 defintion from RFC-3629.  There's a deviation from the RFC
 -- specification in that I only allow certain codes from the US-ASCII C0
--- range (control codes) that are in common use.
--- ***********************************************************************
-
-local UTF8 = (
-                 lpeg.R("\7\13"," ~")
-               + lpeg.R("\194\223") * lpeg.R("\128\191")
-               + lpeg.P("\224")     * lpeg.R("\160\191") * lpeg.R("\128\191")
-               + lpeg.R("\225\236") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.P("\237")     * lpeg.R("\128\159") * lpeg.R("\128\191")
-               + lpeg.R("\238\239") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.P("\240")     * lpeg.R("\144\191") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.R("\241\243") * lpeg.R("\128\191") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.P("\224")     * lpeg.R("\128\142") * lpeg.R("\128\191") * lpeg.R("\128\191")
-             )^0
+-- range (control codes) that are in common use.  The check itself is
+-- done natively by cbor_c.isutf8().
+-- ***********************************************************************
+
+local UTF8 = cbor_c.isutf8
              
 -- ***********************************************************************
 
@@ -216,6 +215,20 @@ local function mstrlen(ref)
   end
 end
 
+-- ***********************************************************************
+-- usage:       t = pooled(conv)
+-- desc:        Take a table from conv._pool
+-- input:       conv (table) conversion routines (passed to decode())
+-- return:      t (table) recycled table, nil if none
+-- ***********************************************************************
+
+local function pooled(conv)
+  local pool = conv and conv._pool
+  if type(pool) == 'table' then
+    return table.remove(pool)
+  end
+end
+
 -- ***********************************************************************
 -- usage:       value2,pos2,ctype2 = decbintext(packet,pos,info,value,conv,ref,ctype)
 -- desc:        Decode a CBOR BIN or CBOR TEXT into a Lua string
@@ -280,25 +293,14 @@ end
 -- usage:       blob = encbintext(value,sref,stref,ctype)
 -- desc:        Encode a string into a CBOR BIN or TYPE
 -- input:       value (string) Lua string to encode
---              sref (table) shared references
---              stref (table) string references
+--              sref (table/userdata) shared references
+--              stref (table/userdata) string references (see cbor_c.refs())
 --              ctype (integer) either 0x40 (BIN) or 0x60 (TEXT)
 -- return:      blob (binary) encoded string
 -- ***********************************************************************
 
 local function encbintext(value,sref,stref,ctype)
-  if stref then
-    if not stref[value] then
-      if #value >= mstrlen(stref) then
-        table.insert(stref,value)
-        stref[value] = #stref - 1
-      end
-    else
-      return TAG._nthstring(stref[value],sref,stref)
-    end
-  end
-  
-  return cbor_c.encode(ctype,#value) .. value
+  return cbor_c.encode_all(value,sref,stref,ENCODER,ctype)
 end
 
 -- ***********************************************************************
@@ -392,7 +394,7 @@ TYPE =
     if not s then
       return "\127"
     else
-      assert(UTF8:match(s) > #s,"TEXT: not UTF-8 text")
+      assert(UTF8(s),"TEXT: not UTF-8 text")
       return encbintext(s,sref,stref,0x60)
     end
   end,
@@ -410,23 +412,7 @@ TYPE =
       return cbor_c.encode(0x80,array)
     end
     
-    local res = ""
-    
-    if sref then
-      if sref[array] then
-        return TAG._sharedref(sref[array],sref,stref)
-      end
-      
-      res = TAG._shareable(array)
-      table.insert(sref,array)
-      sref[array] = #sref - 1
-    end
-    
-    res = res .. cbor_c.encode(0x80,#array)
-    for _,item in ipairs(array) do
-      res = res .. encode(item,sref,stref)
-    end
-    return res
+    return cbor_c.encode_all(array,sref,stref,ENCODER,0x80)
   end,
   
   [0x80] = function(packet,pos,_,value,conv,ref)
@@ -434,12 +420,17 @@ TYPE =
     -- ---------------------------------------------------------------------
     -- Per [1], shared references need to exist before the decoding process.
     -- ref._sharedref.REF will be such a reference.  If it doesn't exist,
-    -- then just create a table.
+    -- then take one from conv._pool, or just create a table.  Once used,
+    -- it's cleared so it doesn't leak into the next ARRAY or MAP.
     --
     -- [1] http://cbor.schmorp.de/value-sharing
+    --
+    -- A new table is presized from the count, which can't be more than
+    -- the remaining input could hold.
     -- ---------------------------------------------------------------------
     
-    local acc = ref._sharedref.REF or {}
+    local acc = ref._sharedref.REF or pooled(conv) or cbor_c.newtable(math.min(value,#packet - pos + 1))
+    ref._sharedref.REF = nil
     
     for i = 1 , value do
       local avalue,npos,ctype = decode(packet,pos,conv,ref)
@@ -459,32 +450,12 @@ TYPE =
       return cbor_c.encode(0xA0,map)
     end
     
-    local ref = ""
-    
-    if sref then
-      if sref[map] then
-        return TAG._sharedref(sref[map],sref,stref)
-      end
-      
-      ref = TAG._shareable(map)
-      table.insert(sref,map)
-      sref[map] = #sref - 1
-    end
-    
-    local res = ""
-    local cnt = 0
-    
-    for key,value in pairs(map) do
-      res = res .. encode(key,sref,stref)
-      res = res .. encode(value,sref,stref)
-      cnt = cnt + 1
-    end
-    
-    return ref .. cbor_c.encode(0xA0,cnt) .. res
+    return cbor_c.encode_all(map,sref,stref,ENCODER,0xA0)
   end,
   
   [0xA0] = function(packet,pos,_,value,conv,ref)
-    local acc = ref._sharedref.REF or {} -- see comment above
+    local acc = ref._sharedref.REF or pooled(conv) or cbor_c.newtable(0,math.min(value,(#packet - pos + 1) / 2)) -- see comment above
+    ref._sharedref.REF = nil
     for _ = 1 , value do
       local nvalue,npos,nctype = decode(packet,pos,conv,ref,true)
       if nctype == '__break' then return acc,npos,'MAP' end
@@ -806,6 +777,14 @@ TAG = setmetatable(
     [25] = function(packet,pos,conv,ref)
       local value,npos,ctype = decode(packet,pos,conv,ref)
       if ctype == 'UINT' then
+        if type(ref._stringref) == 'userdata' then
+          local svalue,sctype = ref._stringref:get(value)
+          if not svalue then
+            throw(pos,"_nthstring: invalid index %d",value)
+          end
+          return svalue,npos,sctype
+        end
+        
         value = value + 1
         if not ref._stringref[value] then
           throw(pos,"_nthstring: invalid index %d",value - 1)
@@ -1030,6 +1009,14 @@ TAG = setmetatable(
     
     [256] = function(packet,pos,conv,ref)
       local prev = ref._stringref
+      
+      if type(prev) == 'userdata' then
+        prev:push()
+        local value,npos,ctype = decode(packet,pos,conv,ref)
+        prev:pop()
+        return value,npos,ctype
+      end
+      
       ref._stringref = {}
       local value,npos,ctype = decode(packet,pos,conv,ref)
       ref._stringref = prev
@@ -1173,6 +1160,49 @@ TAG = setmetatable(
   }
 )
 
+-- ***********************************************************************
+-- RFC-8746 typed arrays.  These all work the same, so they're generated
+-- here instead of being listed out above.  The value is an array of
+-- numbers, packed into (or unpacked from) a BIN by cbor_c.
+-- ***********************************************************************
+
+for tag,name in pairs {
+  [64] = '_uint8',     [65] = '_uint16be',  [66] = '_uint32be',  [67] = '_uint64be',
+  [68] = '_uint8clamped',
+                       [69] = '_uint16le',  [70] = '_uint32le',  [71] = '_uint64le',
+  [72] = '_sint8',     [73] = '_sint16be',  [74] = '_sint32be',  [75] = '_sint64be',
+                       [77] = '_sint16le',  [78] = '_sint32le',  [79] = '_sint64le',
+  [80] = '_float16be', [81] = '_float32be', [82] = '_float64be',
+  [84] = '_float16le', [85] = '_float32le', [86] = '_float64le',
+} do
+  TAG[name] = function(value,sref,stref)
+    assert(type(value) == 'table',name .. " expects an array")
+    return cbor_c.encode(0xC0,tag) .. TYPE.BIN(cbor_c.encode_typed(tag,value),sref,stref)
+  end
+  
+  TAG[tag] = function(packet,pos,conv,ref)
+    local value,npos,ctype = decode(packet,pos,conv,ref)
+    if ctype ~= 'BIN' then
+      throw(pos,"%s: wanted BIN, got %s",name,ctype)
+    end
+    
+    local array = cbor_c.decode_typed(tag,value)
+    if not array then
+      throw(pos,"%s: bad length %d",name,#value)
+    end
+    
+    return array,npos,name
+  end
+end
+
+-- ***********************************************************************
+-- The native decoder does the work of the common TAG handlers (and of the
+-- __index method, for tags without one) itself, as long as they haven't
+-- been replaced.
+-- ***********************************************************************
+
+cbor_c.tags(TAG)
+
 -- ***********************************************************************
 --
 --                         CBOR SIMPLE data types
@@ -1271,6 +1301,19 @@ SIMPLE = setmetatable(
 --              references.  You need to know what you are doing to use this
 --              parameter.  You have been warned.
 --
+--              If conv._raw is a table, the value of any MAP key found in
+--              it (as a key) isn't decoded, but returned as a raw value
+--              (see cbor.raw()) holding the encoded bytes, which
+--              cbor.encode() will copy back out as is.  Like cbor.view(),
+--              this doesn't work with packets using _stringref or
+--              _sharedref.
+--
+--              If conv._pool is an array of tables, ARRAYs and MAPs are
+--              decoded into tables taken from it before new ones are made
+--              (see cbor.recycle()).  If conv._into is a table and the
+--              packet is an ARRAY or MAP, it's cleared and decoded into;
+--              with conv._pool, the tables inside it go back to the pool.
+--
 --              The iskey is true if the value is being used as a key in a
 --              map, and is passed to the conversion routine; this too,
 --              is an internal use only variable and you need to know what
@@ -1291,14 +1334,13 @@ function decode(packet,pos,conv,ref,iskey)
   conv = conv or {}
   ref  = ref  or { _stringref = {} , _sharedref = {} }
   
-  local ctype,info,value,npos = cbor_c.decode(packet,pos)
-  local value2,npos2,ctype2 = TYPE[ctype](packet,npos,info,value,conv,ref)
-  
-  if conv[ctype2] then
-    value2 = conv[ctype2](value2,iskey)
-  end
+  -- ---------------------------------------------------------------------
+  -- The entire data item is decoded in C, which only calls back into Lua
+  -- for TAG handlers and conversion routines.  The TYPE[] decoding
+  -- functions are equivalent, but aren't used here.
+  -- ---------------------------------------------------------------------
   
-  return value2,npos2,ctype2
+  return cbor_c.decode_all(packet,pos,conv,ref,iskey,TAG,null,undefined)
 end
 
 -- ***********************************************************************
@@ -1323,6 +1365,533 @@ function pdecode(packet,pos,conv,ref)
   end
 end
 
+-- ***********************************************************************
+-- Usage:       items,pos2[,epos,err] = cbor.decode_seq(packet[,pos][,max][,conv][,ref])
+-- Desc:        Decode a CBOR sequence (RFC-8742)---CBOR items back to back
+-- Input:       packet (binary) CBOR binary blob
+--              pos (integer/optional) starting point for decoding
+--              max (integer/optional) maximum number of items to decode
+--              conv (table/optional) table of conversion routines (see cbor.decode())
+--              ref (table/optional) reference table (see cbor.decode())
+-- Return:      items (table) array of decoded values, count in field 'n'
+--              pos2 (integer) offset past the last decoded item
+--              epos (integer/optional) position of error
+--              err (string/optional) error message (if any)
+--
+-- Note:        Decoding stops at the end of the packet, after max items,
+--              or at the first item that fails to decode, in which case
+--              items has every item before it, and pos2 is the start of
+--              the failed item.  If ref isn't given, each item is decoded
+--              with a fresh reference table.
+-- ***********************************************************************
+
+function decode_seq(packet,pos,max,conv,ref)
+  return cbor_c.decode_seq(packet,pos,conv,ref,max,TAG,null,undefined)
+end
+
+-- ***********************************************************************
+-- Usage:       dec = cbor.decoder([conv][,ref])
+-- Desc:        Create a decoder for CBOR data arriving in pieces
+-- Input:       conv (table/optional) table of conversion routines (see cbor.decode())
+--              ref (table/optional) reference table (see cbor.decode())
+-- Return:      dec (table) decoder object
+--
+-- Usage:       items = dec:feed(data)
+-- Desc:        Feed more data to the decoder
+-- Input:       data (binary) CBOR binary blob (any amount)
+-- Return:      items (table) array of decoded values (see notes)
+--
+-- Usage:       size = dec:buffered()
+-- Desc:        Return the amount of data held for a partial item
+-- Return:      size (integer) number of bytes
+--
+-- Note:        Partial items are scanned as data arrives, so the scan
+--              resumes on the next call to dec:feed(); each item is
+--              decoded once it's complete.  Errors are thrown as with
+--              cbor.decode(), except scanning errors, where pos is the
+--              offset in the stream.  Items completed before a scanning
+--              error are returned, and the error thrown on the next call.
+--
+--              The number of values is in field 'n' of the returned
+--              array, as a value may be nil.
+-- ***********************************************************************
+
+function decoder(conv,ref)
+  local dec = cbor_c.decoder()
+  
+  return {
+    feed = function(_,data)
+      local items = dec:feed(data)
+      for i = 1 , items.n do
+        items[i] = decode(items[i],1,conv,ref)
+      end
+      return items
+    end,
+    
+    buffered = function()
+      return dec:buffered()
+    end,
+  }
+end
+
+-- ***********************************************************************
+-- Usage:       stats = cbor.stats([enable])
+-- Desc:        Return (and optionally enable, reset or disable) decoding
+--              statistics
+-- Input:       enable (boolean/optional) true to enable (and reset),
+--              false to disable
+-- Return:      stats (table) counters, nil if never enabled
+--
+-- Note:        See cbor_c.stats() for the fields.  The statistics are
+--              those before enable is applied, so cbor.stats(true) can be
+--              used to fetch and reset them.  Statistics are off by
+--              default, and cost next to nothing when off.
+-- ***********************************************************************
+
+function stats(enable)
+  return cbor_c.stats(enable)
+end
+
+-- ***********************************************************************
+-- Usage:       old = cbor.limits([limits])
+-- Desc:        Return (and optionally set) the decoding limits
+-- Input:       limits (table/optional) new limits
+--                      * depth (integer/optional) maximum nesting depth
+--                      * items (integer/optional) maximum data items
+--                      * bytes (integer/optional) maximum BIN or TEXT length
+--                      * refs  (integer/optional) maximum string and shared references
+--                        (strings are recorded for references whether or
+--                        not the data uses them)
+-- Return:      old (table) previous limits
+--
+-- Note:        Missing fields are unlimited, except depth, which is
+--              1000 by default (and can't be set higher).  The limits
+--              are checked against each header as it is read, so hostile
+--              input fails at the offending item, whose position is in
+--              the error.  The limits apply to a single cbor.decode(),
+--              and to each item of cbor.decode_seq().
+-- ***********************************************************************
+
+function limits(new)
+  return cbor_c.limits(new)
+end
+
+-- ***********************************************************************
+-- Usage:       sc = cbor.schema(fields)
+-- Desc:        Compile a schema for records of a fixed shape
+-- Input:       fields (table) array of { name , type [, tag] } (see cbor_c.schema())
+-- Return:      sc (table) schema object
+--
+-- Usage:       blob = sc:encode(rec)
+-- Desc:        Encode a record
+-- Input:       rec (table) record
+-- Return:      blob (binary) CBOR encoded record
+--
+-- Usage:       rec,pos2,ctype = sc:decode(packet[,pos])
+-- Desc:        Decode a record
+-- Input:       packet (binary) CBOR binary blob
+--              pos (integer/optional) starting point for decoding
+-- Return:      rec (any) decoded record
+--              pos2 (integer) offset past decoded data
+--              ctype (enum/cbor) CBOR type of value
+--
+-- Note:        Records that don't fit the schema are handed to
+--              cbor.encode() and cbor.decode(), so the schema is an
+--              optimization, not a validation.
+-- ***********************************************************************
+
+function schema(fields)
+  local sc = cbor_c.schema(fields)
+  
+  return {
+    encode = function(_,rec)
+      return type(rec) == 'table' and sc:encode(rec) or encode(rec)
+    end,
+    
+    decode = function(_,packet,pos)
+      local rec,npos = sc:decode(packet,pos)
+      if rec then
+        return rec,npos,'MAP'
+      else
+        return decode(packet,pos)
+      end
+    end,
+  }
+end
+
+-- ***********************************************************************
+--
+--                              LAZY VIEWS
+--
+-- A view is an empty proxy table for an encoded ARRAY or MAP.  The offsets
+-- of the items are found (via cbor_c.skip()) only as far as needed, and
+-- only the items actually touched are decoded.  Nested ARRAYs and MAPs are
+-- returned as views as well.  The state of each view is kept in VIEWS[].
+--
+-- ***********************************************************************
+
+local VIEWS = setmetatable({},{ __mode = "k" })
+local VARRAY
+local VMAP
+
+-- ***********************************************************************
+-- usage:       value = view_item(packet,pos,conv,ref[,iskey])
+-- desc:        Return a view for an ARRAY or MAP, or the decoded value
+-- input:       packet (binary) binary blob
+--              pos (integer) byte position in packet
+--              conv (table) conversion routines (passed to decode())
+--              ref (table) reference table
+--              iskey (boolean/optional) is a key
+-- return:      value (any) view or decoded value
+-- ***********************************************************************
+
+local function view_item(packet,pos,conv,ref,iskey)
+  local ctype,info,value,npos = cbor_c.decode(packet,pos)
+  
+  if not iskey and (ctype == 0x80 or ctype == 0xA0) then
+    local self  = setmetatable({},ctype == 0x80 and VARRAY or VMAP)
+    local width = ctype == 0x80 and 1 or 2
+    
+    VIEWS[self] =
+    {
+      packet = packet,
+      pos    = pos,
+      conv   = conv,
+      ref    = ref,
+      count  = info < 31 and value * width or nil,
+      nextp  = npos,
+      n      = 0,   -- number of items indexed
+      elem   = {},  -- offsets of items
+      have   = {},  -- item has been decoded
+      values = {},  -- decoded items
+      lookup = {},  -- MAP key to item number
+    }
+    return self
+  else
+    return (decode(packet,pos,conv,ref,iskey))
+  end
+end
+
+-- ***********************************************************************
+-- usage:       view_index(state[,upto])
+-- desc:        Index the offsets of the items of a view
+-- input:       state (table) state of view
+--              upto (integer/optional) item to index, nil for all
+-- ***********************************************************************
+
+local function view_index(state,upto)
+  while not upto or state.n < upto do
+    if state.count then
+      if state.n == state.count then return end
+    elseif state.packet:byte(state.nextp) == 0xFF then
+      state.count = state.n
+      return
+    end
+    
+    state.n             = state.n + 1
+    state.elem[state.n] = state.nextp
+    state.nextp         = cbor_c.skip(state.packet,state.nextp)
+  end
+end
+
+-- ***********************************************************************
+
+local function view_value(state,i,iskey)
+  if not state.have[i] then
+    state.values[i] = view_item(state.packet,state.elem[i],state.conv,state.ref,iskey)
+    state.have[i]   = true
+  end
+  return state.values[i]
+end
+
+-- ***********************************************************************
+
+local function view_tocbor(self)
+  local state = VIEWS[self]
+  return state.packet:sub(state.pos,cbor_c.skip(state.packet,state.pos) - 1)
+end
+
+local function view_newindex()
+  error("cbor.view: read only")
+end
+
+-- ***********************************************************************
+
+VARRAY =
+{
+  __index = function(self,idx)
+    local state = VIEWS[self]
+    if type(idx) ~= 'number' or math.type(idx) ~= 'integer' or idx < 1 then
+      return nil
+    end
+    view_index(state,idx)
+    if idx > state.n then return nil end
+    return view_value(state,idx)
+  end,
+  
+  __len = function(self)
+    local state = VIEWS[self]
+    view_index(state)
+    return state.n
+  end,
+  
+  __ipairs = function(self)
+    local state = VIEWS[self]
+    return function(_,i)
+      i = i + 1
+      view_index(state,i)
+      if i <= state.n then
+        return i,view_value(state,i)
+      end
+    end,self,0
+  end,
+  
+  __newindex = view_newindex,
+  __tocbor   = view_tocbor,
+}
+
+VARRAY.__pairs = VARRAY.__ipairs
+
+-- ***********************************************************************
+
+VMAP =
+{
+  __index = function(self,key)
+    local state = VIEWS[self]
+    
+    if state.lookup[key] then
+      return view_value(state,state.lookup[key] + 1)
+    end
+    
+    while true do
+      local i = state.n + 1
+      view_index(state,i + 1)
+      if i > state.n then return nil end
+      local k = view_value(state,i,true)
+      if k ~= nil and state.lookup[k] == nil then
+        state.lookup[k] = i
+      end
+      if k == key then
+        return view_value(state,i + 1)
+      end
+    end
+  end,
+  
+  __pairs = function(self)
+    local state = VIEWS[self]
+    local i     = -1
+    return function()
+      i = i + 2
+      view_index(state,i + 1)
+      if i < state.n then
+        local k = view_value(state,i,true)
+        if k ~= nil and state.lookup[k] == nil then
+          state.lookup[k] = i
+        end
+        return k,view_value(state,i + 1)
+      end
+    end,self,nil
+  end,
+  
+  __len = function(self)
+    local state = VIEWS[self]
+    view_index(state)
+    return math.floor(state.n / 2)
+  end,
+  
+  __newindex = view_newindex,
+  __tocbor   = view_tocbor,
+}
+
+-- ***********************************************************************
+-- Usage:       value = cbor.view(packet[,pos][,conv][,ref])
+-- Desc:        Return a lazy view of a CBOR ARRAY or MAP
+-- Input:       packet (binary) CBOR binary blob
+--              pos (integer/optional) starting point for decoding
+--              conv (table/optional) table of conversion routines (see cbor.decode())
+--              ref (table/optional) reference table (see cbor.decode())
+-- Return:      value (any) view of ARRAY or MAP, otherwise the decoded value
+--
+-- Note:        Items are only decoded when indexed, and nested ARRAYs and
+--              MAPs are returned as views themselves.  Indexing works
+--              as expected, and views are read-only.  The length of a MAP
+--              view is its number of pairs.  Encoding a view will copy
+--              the original encoded bytes.
+--
+--              Lua 5.1 doesn't call __len, __pairs or __ipairs for
+--              tables, so there # returns 0, and pairs() and ipairs()
+--              return nothing for a view.  With Lua 5.2, ipairs() and
+--              pairs() work; with Lua 5.3 or higher, ipairs() works
+--              through __index and pairs() through __pairs.
+--
+--              conv is applied to the decoded items, but not to ARRAYs
+--              and MAPs returned as views.  As items are decoded out of
+--              order, packets using _stringref or _sharedref can't be
+--              viewed.
+-- ***********************************************************************
+
+function view(packet,pos,conv,ref)
+  pos  = pos  or 1
+  conv = conv or {}
+  ref  = ref  or { _stringref = {} , _sharedref = {} }
+  return view_item(packet,pos,conv,ref)
+end
+
+-- ***********************************************************************
+-- Usage:       p = cbor.path(steps)
+-- Desc:        Compile a path for cbor.extract()
+-- Input:       steps (array) keys (string) or indices (integer)
+-- Return:      p (table) compiled path
+--
+-- Note:        String keys are encoded once here, and compared against
+--              the encoded MAP keys as raw bytes.  Integers index ARRAYs
+--              (starting from 1) or match integer MAP keys.
+-- ***********************************************************************
+
+local PATH = {}
+
+function path(steps)
+  local p = setmetatable({},PATH)
+  
+  for i,step in ipairs(steps) do
+    if type(step) == 'string' then
+      p[i] = encode(step)
+    elseif type(step) == 'number' and math.type(step) == 'integer' then
+      p[i] = step
+    else
+      error(string.format("cbor.path: bad step %d (%s)",i,type(step)))
+    end
+  end
+  
+  return p
+end
+
+-- ***********************************************************************
+-- Usage:       value,pos2,ctype = cbor.extract(packet,path[,pos][,conv][,ref])
+-- Desc:        Decode a single item somewhere inside a CBOR data item
+-- Input:       packet (binary) CBOR binary blob
+--              path (table) path to item (see cbor.path())
+--              pos (integer/optional) starting point for decoding
+--              conv (table/optional) table of conversion routines (see cbor.decode())
+--              ref (table/optional) reference table (see cbor.decode())
+-- Return:      value (any) the decoded item
+--              pos2 (integer) offset past decoded item
+--              ctype (enum/cbor) CBOR type of value
+--
+-- Note:        Nothing is returned if the item doesn't exist.  The path
+--              can be a compiled path, or a plain array which is compiled
+--              on each call.  Only the item found is decoded.
+-- ***********************************************************************
+
+function extract(packet,p,pos,conv,ref)
+  if getmetatable(p) ~= PATH then
+    p = path(p)
+  end
+  
+  local ipos = cbor_c.locate(packet,pos or 1,p)
+  if ipos then
+    return decode(packet,ipos,conv,ref)
+  end
+end
+
+-- ***********************************************************************
+-- Usage:       s[,epos,err] = cbor.index(packet[,key])
+-- Desc:        Build a packed index of a CBOR sequence
+-- Input:       packet (binary) CBOR sequence (string or mmap)
+--              key (table/optional) path to a key field in each item
+--                      (array or cbor.path())
+-- Return:      s (binary) packed index (see cbor_c.index())
+--              epos (integer/optional) position of error
+--              err (string/optional) error message
+--
+-- Note:        On error, the index covers every item before the error.
+--              Save s alongside the data, and use cbor.archive() to
+--              read it back.
+-- ***********************************************************************
+
+function index(packet,key)
+  local idx,epos,err = cbor_c.index(packet)
+  
+  if key and getmetatable(key) ~= PATH then
+    key = path(key)
+  end
+  
+  return idx:pack(packet,key),epos,err
+end
+
+-- ***********************************************************************
+-- Usage:       ar[,err] = cbor.archive(packet,packed)
+-- Desc:        Open a CBOR sequence for random access
+-- Input:       packet (binary) CBOR sequence (string or mmap)
+--              packed (binary) packed index from cbor.index() (string or mmap)
+-- Return:      ar (table) archive object, nil on error
+--              err (string/optional) error message
+--
+-- Usage:       n = ar:count()
+-- Desc:        Return the number of items
+-- Return:      n (integer) number of items
+--
+-- Usage:       value,pos2,ctype = ar:get(i[,conv][,ref])
+-- Desc:        Decode an item
+-- Input:       i (integer) item number (1-based)
+--              conv (table/optional) table of conversion routines (see cbor.decode())
+--              ref (table/optional) reference table (see cbor.decode())
+-- Return:      value (any) decoded item, nothing if there's no item i
+--              pos2 (integer) offset past decoded item
+--              ctype (enum/cbor) CBOR type of value
+--
+-- Usage:       value,i = ar:find(key[,conv][,ref])
+-- Desc:        Decode the first item with a given key
+-- Input:       key (any) key value
+--              conv (table/optional) table of conversion routines (see cbor.decode())
+--              ref (table/optional) reference table (see cbor.decode())
+-- Return:      value (any) decoded item, nothing if not found
+--              i (integer) item number
+--
+-- Usage:       list = ar:items(key)
+-- Desc:        Return the numbers of all items with a given key
+-- Input:       key (any) key value
+-- Return:      list (array) item numbers, nil if none
+--
+-- Note:        Keys are compared by their encoding (as cbor.encode()
+--              produces it), so they need to have been encoded the same
+--              way in the data.  Neither the data nor the index is read
+--              beyond what each call needs, so with cbor_c.mmap() a
+--              lookup in a huge archive is only a few reads.
+-- ***********************************************************************
+
+function archive(packet,packed)
+  local idx,err = cbor_c.loadindex(packed)
+  
+  if not idx then
+    return nil,err
+  end
+  
+  return {
+    count = function()
+      return #idx
+    end,
+    
+    get = function(_,i,conv,ref)
+      local pos = idx:item(i)
+      if pos then
+        return decode(packet,pos,conv,ref)
+      end
+    end,
+    
+    find = function(_,key,conv,ref)
+      local list = idx:find(encode(key))
+      if list then
+        return (decode(packet,idx:item(list[1]),conv,ref)),list[1]
+      end
+    end,
+    
+    items = function(_,key)
+      return idx:find(encode(key))
+    end,
+  }
+end
+
 -- ***********************************************************************
 
 local function generic(value,sref,stref)
@@ -1407,7 +1976,7 @@ __ENCODE_MAP =
   end,
   
   ['string'] = function(value,sref,stref)
-    if UTF8:match(value) > #value then
+    if UTF8(value) then
       return TYPE.TEXT(value,sref,stref)
     else
       return TYPE.BIN(value,sref,stref)
@@ -1420,6 +1989,130 @@ __ENCODE_MAP =
   ['thread']   = generic,
 }
 
+-- ***********************************************************************
+-- The native encoder will handle any type whose __ENCODE_MAP entry is
+-- still the stock function; replaced entries are called as before.  The
+-- same goes for strings if TYPE.TEXT() or TYPE.BIN() have been replaced,
+-- and for tables if TYPE.ARRAY() or TYPE.MAP() have been replaced.
+-- ***********************************************************************
+
+ENCODER = setmetatable({
+  STOCK     = {},
+  STOCKTYPE =
+  {
+    TEXT  = TYPE.TEXT,
+    BIN   = TYPE.BIN,
+    ARRAY = TYPE.ARRAY,
+    MAP   = TYPE.MAP,
+  },
+},{ __index = M })
+
+for luatype,f in pairs(__ENCODE_MAP) do
+  ENCODER.STOCK[luatype] = f
+end
+
+CANONICAL = setmetatable({ canonical = true },{ __index = ENCODER })
+PACKED    = setmetatable({ packed    = true },{ __index = ENCODER })
+
+-- ***********************************************************************
+-- Usage:       mt = cbor.keys(list[,ordered])
+-- Desc:        Create a metatable for MAPs with a fixed set of keys
+-- Input:       list (array) keys (strings)
+--              ordered (boolean/optional) encode keys in list order
+-- Return:      mt (table) metatable
+--
+-- Note:        The keys are encoded once.  Encoding a table with this
+--              metatable copies the pre-encoded keys into the output.  If
+--              ordered, the keys in list are encoded first, in order,
+--              followed by any other keys.
+-- ***********************************************************************
+
+function keys(list,ordered)
+  local ks = cbor_c.keys(list,ordered)
+  
+  return {
+    __cborkeys = ks,
+    __tocbor   = function(map,sref,stref)
+      return cbor_c.encode_all(map,sref,stref,ENCODER,0xA0,ks)
+    end,
+  }
+end
+
+-- ***********************************************************************
+-- Usage:       cbor.recycle(pool,t)
+-- Desc:        Return a decoded table, and the tables inside it, to a pool
+-- Input:       pool (table) array of tables (see conv._pool in cbor.decode())
+--              t (table) table no longer in use
+-- ***********************************************************************
+
+function recycle(pool,t)
+  return cbor_c.recycle(pool,t)
+end
+
+-- ***********************************************************************
+-- Usage:       r = cbor.raw(blob[,validate])
+-- Desc:        Wrap an encoded CBOR data item to be encoded as is
+-- Input:       blob (binary) a single CBOR encoded data item
+--              validate (boolean/optional) check blob is a single item
+-- Return:      r (table) raw value, the encoded item at r[1]
+--
+-- Note:        The encoder copies blob into its output without looking
+--              at it.  When string references are used, the item is put
+--              in a new _stringref namespace.
+-- ***********************************************************************
+
+function raw(blob,validate)
+  return cbor_c.raw(blob,validate)
+end
+
+-- ***********************************************************************
+-- Usage:       conv = cbor.numbers([exact])
+-- Desc:        Return a conversion table for bignums and fractions
+-- Input:       exact (boolean/optional) return text when a Lua number
+--                      can't hold the value exactly
+-- Return:      conv (table) conversion functions for _pbignum, _nbignum,
+--                      _decimalfraction and _bigfloat
+--
+-- Note:        The functions can be copied into a larger conversion table.
+-- ***********************************************************************
+
+function numbers(exact)
+  local function big(value,neg)
+    local n,isexact = cbor_c.bigtonumber(value,neg)
+    if exact and not isexact then
+      return cbor_c.bigtostring(value,neg)
+    end
+    return n
+  end
+  
+  return {
+    _pbignum         = function(value) return big(value,false) end,
+    _nbignum         = function(value) return big(value,true)  end,
+    _decimalfraction = function(value)
+      return cbor_c.fraction(value[1],value[2],10,exact)
+    end,
+    _bigfloat        = function(value)
+      if math.type(value[1]) ~= 'integer' then
+        return value[2] * 2.0^value[1]
+      end
+      return cbor_c.fraction(value[1],value[2],2,exact)
+    end,
+  }
+end
+
+-- ***********************************************************************
+-- Usage:       r = cbor.bignum(text)
+-- Desc:        Return a bignum for a decimal integer
+-- Input:       text (string) decimal integer, optionally signed
+-- Return:      r (table) raw value of the _pbignum or _nbignum
+-- ***********************************************************************
+
+function bignum(text)
+  local bin,neg = cbor_c.bigfromstring(text)
+  return cbor_c.raw(cbor_c.encode(0xC0,neg and 3 or 2)
+                 .. cbor_c.encode(0x40,#bin) .. bin)
+end
+
 -- ***********************************************************************
 -- Usage:       blob = cbor.encode(value[,sref][,stref])
 -- Desc:        Encode a Lua type into a CBOR type
@@ -1430,19 +2123,7 @@ __ENCODE_MAP =
 -- ***********************************************************************
 
 function encode(value,sref,stref)
-  if value == null then
-    return SIMPLE.null()
-  elseif value == undefined then
-    return SIMPLE.undefined()
-  end
-  
-  local res = ""
-  
-  if stref and not stref.SEEN then
-    res = TAG._stringref(nil,nil,stref)
-  end
-  
-  return res .. __ENCODE_MAP[type(value)](value,sref,stref)
+  return cbor_c.encode_all(value,sref,stref,ENCODER)
 end
 
 -- ***********************************************************************
@@ -1464,6 +2145,93 @@ function pencode(value,sref,stref)
   end
 end
 
+-- ***********************************************************************
+-- Usage:       blob = cbor.encode_seq(list[,sref][,stref])
+-- Desc:        Encode an array of values as a CBOR sequence (RFC-8742)
+-- Input:       list (table) array of values (count in field 'n', if present)
+--              sref (table/optional) shared reference table
+--              stref (table/optional) shared string reference table
+-- Return:      blob (binary) CBOR encoded values, back to back
+-- ***********************************************************************
+
+function encode_seq(list,sref,stref)
+  return cbor_c.encode_seq(list,sref,stref,ENCODER)
+end
+
+-- ***********************************************************************
+-- Usage:       blob = cbor.encode_canonical(value)
+-- Desc:        Encode a Lua type using deterministic encoding (RFC-8949)
+-- Input:       value (any)
+-- Return:      blob (binary) CBOR encoded value
+--
+-- Note:        MAP keys are sorted by their encoded bytes.  References
+--              aren't supported, as sorting would renumber them.
+-- ***********************************************************************
+
+function encode_canonical(value)
+  return cbor_c.encode_all(value,nil,nil,CANONICAL)
+end
+
+-- ***********************************************************************
+-- Usage:       blob = cbor.encode_packed(value)
+-- Desc:        Encode a Lua type, using references where they save space
+-- Input:       value (any)
+-- Return:      blob (binary) CBOR encoded value
+--
+-- Note:        Tables encoded more than once are shared (_sharedref) if
+--              that's smaller, as are tables found inside themselves.
+--              String references (_stringref) are used if they make the
+--              result smaller.
+-- ***********************************************************************
+
+function encode_packed(value)
+  return cbor_c.encode_all(value,nil,nil,PACKED)
+end
+
+-- ***********************************************************************
+-- Usage:       json,pos2 = cbor.tojson(packet[,pos][,depth])
+-- Desc:        Convert a CBOR data item straight to JSON text
+-- Input:       packet (binary) CBOR binary blob
+--              pos (integer/optional) starting point
+--              depth (integer/optional) maximum nesting depth
+-- Return:      json (string) JSON text
+--              pos2 (integer) offset past the CBOR item
+--
+-- Note:        No Lua values are created along the way.  See
+--              cbor_c.tojson() for the mapping.
+-- ***********************************************************************
+
+function tojson(packet,pos,depth)
+  return cbor_c.tojson(packet,pos,depth)
+end
+
+-- ***********************************************************************
+-- Usage:       blob,pos2 = cbor.fromjson(json[,pos][,depth])
+-- Desc:        Convert JSON text straight to CBOR
+-- Input:       json (string) JSON text
+--              pos (integer/optional) starting point
+--              depth (integer/optional) maximum nesting depth
+-- Return:      blob (binary) CBOR encoded value
+--              pos2 (integer) offset past the JSON value
+-- ***********************************************************************
+
+function fromjson(json,pos,depth)
+  return cbor_c.fromjson(json,pos,depth)
+end
+
+-- ***********************************************************************
+-- Usage:       w = cbor.writer(sink[,size])
+-- Desc:        Create an encoder that streams its output to a sink
+-- Input:       sink (function/table/userdata) function or object with a
+--                      write() method (like a file)
+--              size (integer/optional) high-water mark for flushing
+-- Return:      w (userdata) writer (see cbor_c.writer())
+-- ***********************************************************************
+
+function writer(sink,size)
+  return cbor_c.writer(sink,ENCODER,size)
+end
+
 -- ***********************************************************************
 
 if LUA_VERSION >= "Lua 5.2" then
@@ -19,10 +19,23 @@
 *
 *************************************************************************/
 
+#if defined(__unix__) || defined(__APPLE__)
+#  define _POSIX_C_SOURCE 200112L
+#  define CBOR_HAVE_MMAP
+#  define CBOR_HAVE_PTHREAD
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <locale.h>
 #include <assert.h>
 
 #include <lua.h>
@@ -30,10 +43,39 @@
 
 #include "dnf.h"
 
+#ifdef CBOR_HAVE_MMAP
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#ifdef CBOR_HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+
+#if defined(__AVX2__) || defined(__F16C__)
+#  include <immintrin.h>
+#elif defined(__SSSE3__)
+#  include <tmmintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 501
 #  error You need to compile against Lua 5.1 or higher
 #endif
 
+#if LUA_VERSION_NUM == 501
+#  define lua_rawlen(L,idx)     lua_objlen((L),(idx))
+#  define lua_absindex(L,idx)   (((idx) > 0) || ((idx) <= LUA_REGISTRYINDEX) ? (idx) : lua_gettop(L) + (idx) + 1)
+#endif
+
 /**************************************************************************/
 
 typedef union
@@ -55,23 +97,21 @@ typedef union
 } buffer__u;
 
 /***************************************************************************
-* Push a CBOR encoded float value onto the stack (passed in as an integer so
-* we can push things like +-inf or any nubmer of NaNs).  The number of bytes
-* to use is passed in (since floats are encoded in 2, 4 or 8 bytes
-* respectively).
+* Store a CBOR encoded value into dst (passed in as an integer so we can
+* store things like +-inf or any nubmer of NaNs).  The number of bytes to
+* use is passed in (since floats are encoded in 2, 4 or 8 bytes
+* respectively).  Returns the number of bytes stored in dst, which needs
+* room for at least sizeof(buffer__u) bytes.
 ****************************************************************************/
 
-static void cbor_cL_pushvalueN(
-        lua_State              *L,
+static size_t cbor_ci_putvalueN(
+        uint8_t                *dst,
         int                     typeinfo,
         unsigned long long int  value,
         size_t                  len
 )
 {
-  buffer__u result;
-  size_t    idx = sizeof(buffer__u);
-  
-  assert(L != NULL);
+  assert(dst != NULL);
   assert(
              ((len == 1) && ((typeinfo & 0x1F) == 24))
           || ((len == 2) && ((typeinfo & 0x1F) == 25))
@@ -79,25 +119,25 @@ static void cbor_cL_pushvalueN(
           || ((len == 8) && ((typeinfo & 0x1F) == 27))
         );
   
-  for (uint8_t b = (uint8_t)value ; len > 0 ; b = (uint8_t)(value >>= 8) , len--)
-    result.b[--idx] = b;
+  dst[0] = typeinfo;
+  for (size_t idx = len ; idx > 0 ; idx-- , value >>= 8)
+    dst[idx] = (uint8_t)value;
   
-  result.b[--idx] = typeinfo;
-  lua_pushlstring(L,&result.c[idx],sizeof(buffer__u) - idx);
+  return len + 1;
 }
 
 /*************************************************************************
-* Push a CBOR encoded value onto the Lua stack.  This will use the minimal
-* encoding for a value.
+* Store a CBOR encoded value into dst, using the minimal encoding for the
+* value.  Returns the number of bytes stored.
 **************************************************************************/
 
-static void cbor_cL_pushvalue(
-        lua_State              *L,
+static size_t cbor_ci_putvalue(
+        uint8_t                *dst,
         int                     type,
         unsigned long long int  value
 )
 {
-  assert(L             != NULL);
+  assert(dst           != NULL);
   assert((type & 0x1F) == 0);
   
   /*-----------------------------------------------
@@ -106,29 +146,176 @@ static void cbor_cL_pushvalue(
   
   if (value < 24)
   {
-    char t = (char)type | (char)value;
-    lua_pushlstring(L,&t,1);
+    dst[0] = (uint8_t)type | (uint8_t)value;
+    return 1;
   }
   
   /*----------------------------------------------------------------------
   ; larger values will take 1 additional byte (info of 24), 2 bytes (25),
   ; four bytes (26) or eight bytes (27), stored in network-byte order (MSB
-  ; first).  We do this by filling in the character array backwards, filling
-  ; it with the next 8 bits in network-byte-order.  When we hit a zero byte,
-  ; we stop with the loop since there's no more to do.
+  ; first).
   ;------------------------------------------------------------------------*/
   
+  else if (value < 256uLL)
+    return cbor_ci_putvalueN(dst,type | 24,value,1);
+  else if (value < 65536uLL)
+    return cbor_ci_putvalueN(dst,type | 25,value,2);
+  else if (value < 4294967296uLL)
+    return cbor_ci_putvalueN(dst,type | 26,value,4);
+  else
+    return cbor_ci_putvalueN(dst,type | 27,value,8);
+}
+
+/*************************************************************************
+* Convert a double to half-precision, returning false if it can't be done
+* without losing precision.  Normal halfs (and zeros) are handled directly
+* from the bits of the double; subnormals, infinities and NaNs are left to
+* dnf_tohalf().
+**************************************************************************/
+
+static bool cbor_ci_tohalf(unsigned short *ph,double value)
+{
+  double__u    d = { .d = value };
+  unsigned int exp = (unsigned int)((d.i >> 52) & 0x7FFuLL);
+  dnf__s       cv;
+  
+  assert(ph != NULL);
+  
+  /*---------------------------------------------------------------------
+  ; An exponent of -14 to 15 is a normal half, and it's exact if only the
+  ; top 10 bits of the fraction are used.
+  ;----------------------------------------------------------------------*/
+  
+  if ((exp >= 1023 - 14) && (exp <= 1023 + 15))
+  {
+    if ((d.i & 0x000003FFFFFFFFFFuLL) != 0uLL)
+      return false;
+    *ph = (unsigned short)(
+                  ((d.i >> 48) & 0x8000uLL)
+                | ((unsigned long long int)(exp - (1023 - 15)) << 10)
+                | ((d.i >> 42) & 0x03FFuLL)
+          );
+    return true;
+  }
+  
+  else if ((d.i & 0x7FFFFFFFFFFFFFFFuLL) == 0uLL)
+  {
+    *ph = (unsigned short)(d.i >> 48);
+    return true;
+  }
+  
+  else if (((exp >= 1023 - 24) && (exp < 1023 - 14)) || (exp == 0x7FF))
+  {
+    dnf_fromdouble(&cv,value);
+    return dnf_tohalf(ph,cv) == 0;
+  }
+  
   else
+    return false;
+}
+
+/*************************************************************************
+* Convert a double to single-precision, returning false if it can't be
+* done without losing precision.  As with cbor_ci_tohalf(), only the
+* subnormals, infinities and NaNs go through dnf_tosingle().
+**************************************************************************/
+
+static bool cbor_ci_tosingle(float__u *pf,double value)
+{
+  double__u    d = { .d = value };
+  unsigned int exp = (unsigned int)((d.i >> 52) & 0x7FFuLL);
+  dnf__s       cv;
+  
+  assert(pf != NULL);
+  
+  if ((exp >= 1023 - 126) && (exp <= 1023 + 127))
   {
-    if (value < 256uLL)
-      cbor_cL_pushvalueN(L,type | 24,value,1);
-    else if (value < 65536uLL)
-      cbor_cL_pushvalueN(L,type | 25,value,2);
-    else if (value < 4294967296uLL)
-      cbor_cL_pushvalueN(L,type | 26,value,4);
-    else
-      cbor_cL_pushvalueN(L,type | 27,value,8);
+    if ((d.i & 0x000000001FFFFFFFuLL) != 0uLL)
+      return false;
+    pf->i = (uint32_t)(
+                  ((d.i >> 32) & 0x80000000uLL)
+                | ((unsigned long long int)(exp - (1023 - 127)) << 23)
+                | ((d.i >> 29) & 0x007FFFFFuLL)
+            );
+    return true;
+  }
+  
+  else if ((d.i & 0x7FFFFFFFFFFFFFFFuLL) == 0uLL)
+  {
+    pf->i = (uint32_t)(d.i >> 32);
+    return true;
+  }
+  
+  else if (((exp >= 1023 - 149) && (exp < 1023 - 126)) || (exp == 0x7FF))
+  {
+    dnf_fromdouble(&cv,value);
+    return dnf_tosingle(&pf->f,cv) == 0;
   }
+  
+  else
+    return false;
+}
+
+/*************************************************************************
+* Store a CBOR encoded floating point value into dst, using the smallest
+* encoding that doesn't lose precision.  Returns the number of bytes stored.
+**************************************************************************/
+
+static size_t cbor_ci_putfloat(uint8_t *dst,double value)
+{
+  unsigned short h;
+  double__u      d;
+  float__u       f;
+  
+  assert(dst != NULL);
+  
+  d.d = value;
+  if (cbor_ci_tohalf(&h,d.d))
+    return cbor_ci_putvalueN(dst,0xE0 | 25,(unsigned long long int)h,2);
+  else if (cbor_ci_tosingle(&f,d.d))
+    return cbor_ci_putvalueN(dst,0xE0 | 26,(unsigned long long int)f.i,4);
+  else
+    return cbor_ci_putvalueN(dst,0xE0 | 27,d.i,8);
+}
+
+/***************************************************************************
+* Push a CBOR encoded value with a given size onto the stack (see
+* cbor_ci_putvalueN()).
+****************************************************************************/
+
+static void cbor_cL_pushvalueN(
+        lua_State              *L,
+        int                     typeinfo,
+        unsigned long long int  value,
+        size_t                  len
+)
+{
+  buffer__u result;
+  
+  assert(L != NULL);
+  
+  len = cbor_ci_putvalueN(result.b,typeinfo,value,len);
+  lua_pushlstring(L,result.c,len);
+}
+
+/*************************************************************************
+* Push a CBOR encoded value onto the Lua stack.  This will use the minimal
+* encoding for a value.
+**************************************************************************/
+
+static void cbor_cL_pushvalue(
+        lua_State              *L,
+        int                     type,
+        unsigned long long int  value
+)
+{
+  buffer__u result;
+  size_t    len;
+  
+  assert(L != NULL);
+  
+  len = cbor_ci_putvalue(result.b,type,value);
+  lua_pushlstring(L,result.c,len);
 }
 
 /******************************************************************
@@ -216,7 +403,6 @@ static int cbor_clua_encodeE(lua_State *L)
   unsigned short h;
   double__u      d;
   float__u       f;
-  dnf__s         cv;
   int            type;
   
   type = luaL_checkinteger(L,1);
@@ -242,14 +428,9 @@ static int cbor_clua_encodeE(lua_State *L)
     
     else
     {
-      d.d = luaL_checknumber(L,3);
-      dnf_fromdouble(&cv,d.d);
-      if (dnf_tohalf(&h,cv) == 0)
-        cbor_cL_pushvalueN(L,type | 25,(unsigned long long int)h,2);
-      else if (dnf_tosingle(&f.f,cv) == 0)
-        cbor_cL_pushvalueN(L,type | 26,(unsigned long long int)f.i,4);
-      else
-        cbor_cL_pushvalueN(L,type | 27,d.i,8);
+      buffer__u result;
+      size_t    len = cbor_ci_putfloat(result.b,luaL_checknumber(L,3));
+      lua_pushlstring(L,result.c,len);
     }
   }
   else
@@ -264,17 +445,13 @@ static int cbor_clua_encodeE(lua_State *L)
     unsigned long long int value = luaL_checknumber(L,2);
     if (value == 25)
     {
-      d.d = luaL_checknumber(L,3);
-      dnf_fromdouble(&cv,d.d);
-      if (dnf_tohalf(&h,cv) != 0)
+      if (!cbor_ci_tohalf(&h,luaL_checknumber(L,3)))
         return luaL_error(L,"cannot convert to half-precision");
       cbor_cL_pushvalueN(L,type | 25,(unsigned long long int)h,2);
     }
     else if (value == 26)
     {
-      d.d = luaL_checknumber(L,3);
-      dnf_fromdouble(&cv,d.d);
-      if (dnf_tosingle(&f.f,cv) != 0)
+      if (!cbor_ci_tosingle(&f,luaL_checknumber(L,3)))
         return luaL_error(L,"cannot convert to single-preccision");
       cbor_cL_pushvalueN(L,type | 26,(unsigned long long int)f.i,4);
     }
@@ -324,6 +501,218 @@ static int cbor_clua_encode(lua_State *L)
   return luaL_error(L,"invalid type %d",lua_tointeger(L,1));
 }
 
+/**************************************************************************
+* Parse the header of a CBOR data item starting at *ppos (0-based).  On
+* success, *ppos is advanced past the header and any extension bytes, and
+* the major type, info and value are returned.  Info values less than 24
+* are returned as the value; an info of 31 (indefinite) returns a value of
+* 0.  Floating point values are returned as raw bits---it's up to the
+* caller to convert them.  On error, *ppos is not changed.
+***************************************************************************/
+
+enum
+{
+  CBOR_OKAY,
+  CBOR_ENOINPUT,
+  CBOR_EMOREINPUT,
+  CBOR_EINVALID,
+  CBOR_ETOODEEP,
+};
+
+static char const *const m_cbor_errors[] =
+{
+  "okay",
+  "no input",
+  "no more input",
+  "invalid data",
+  "nesting too deep",
+};
+
+static int cbor_ci_header(
+        int                    *ptype,
+        int                    *pinfo,
+        unsigned long long int *pvalue,
+        char const             *packet,
+        size_t                  packlen,
+        size_t                 *ppos
+)
+{
+  unsigned long long int value;
+  size_t                 pos;
+  size_t                 len;
+  int                    info;
+  
+  assert(ptype  != NULL);
+  assert(pinfo  != NULL);
+  assert(pvalue != NULL);
+  assert(packet != NULL);
+  assert(ppos   != NULL);
+  
+  pos = *ppos;
+  
+  if (pos >= packlen)
+    return CBOR_ENOINPUT;
+  
+  *ptype = (unsigned char)packet[pos] & 0xE0;
+  *pinfo = info = packet[pos] & 0x1F;
+  
+  if (info < 24)
+  {
+    *pvalue = info;
+    *ppos   = pos + 1;
+    return CBOR_OKAY;
+  }
+  else if (info == 31)
+  {
+    *pvalue = 0;
+    *ppos   = pos + 1;
+    return CBOR_OKAY;
+  }
+  else if (info > 27)
+    return CBOR_EINVALID;
+  
+  len = 1u << (info - 24);
+  
+  if (len > packlen - pos - 1)
+    return CBOR_EMOREINPUT;
+  
+  for (value = 0 ; len > 0 ; len--)
+    value = (value << 8) | (unsigned long long)((unsigned char)packet[++pos]);
+  
+  *pvalue = value;
+  *ppos   = pos + 1;
+  return CBOR_OKAY;
+}
+
+/**************************************************************************
+* Convert the raw bits of a half-precision float into a double.  As with
+* cbor_ci_tohalf(), normals and zeros are handled directly, and the rest
+* are left to dnf.
+***************************************************************************/
+
+static double cbor_ci_fromhalf(unsigned short h)
+{
+  unsigned int exp = (h >> 10) & 0x1F;
+  double__u    d;
+  dnf__s       cv;
+  
+  if ((exp > 0) && (exp < 0x1F))
+    d.i = ((unsigned long long int)(h & 0x8000) << 48)
+        | ((unsigned long long int)(exp + (1023 - 15)) << 52)
+        | ((unsigned long long int)(h & 0x03FF) << 42);
+  else if ((h & 0x7FFF) == 0)
+    d.i = (unsigned long long int)h << 48;
+  else
+  {
+    dnf_fromhalf(&cv,h);
+    dnf_todouble(&d.d,cv);
+  }
+  
+  return d.d;
+}
+
+/**************************************************************************/
+
+static double cbor_ci_fromsingle(uint32_t i)
+{
+  unsigned int exp = (i >> 23) & 0xFF;
+  double__u    d;
+  float__u     f;
+  dnf__s       cv;
+  
+  if ((exp > 0) && (exp < 0xFF))
+    d.i = ((unsigned long long int)(i & 0x80000000uL) << 32)
+        | ((unsigned long long int)(exp + (1023 - 127)) << 52)
+        | ((unsigned long long int)(i & 0x007FFFFFuL) << 29);
+  else if ((i & 0x7FFFFFFFuL) == 0)
+    d.i = (unsigned long long int)i << 32;
+  else
+  {
+    f.i = i;
+    dnf_fromsingle(&cv,f.f);
+    dnf_todouble(&d.d,cv);
+  }
+  
+  return d.d;
+}
+
+/**************************************************************************
+* Convert the raw bits of a CBOR half, single or double (info of 25, 26 or
+* 27 respectively) into a double.
+***************************************************************************/
+
+static double cbor_ci_double(int info,unsigned long long int value)
+{
+  double__u d;
+  
+  assert((info >= 25) && (info <= 27));
+  
+  if (info == 25)
+    return cbor_ci_fromhalf((unsigned short)value);
+  else if (info == 26)
+    return cbor_ci_fromsingle((uint32_t)value);
+  
+  d.i = value;
+  return d.d;
+}
+
+/**************************************************************************
+* Push a CBOR UINT or NINT value onto the Lua stack.  Lua 5.3 and higher
+* get an integer (which may wrap for values past 2^63, just as
+* cbor_c.decode() does); earlier versions get a number.
+***************************************************************************/
+
+static void cbor_cL_pushuint(lua_State *L,unsigned long long int value)
+{
+  assert(L != NULL);
+  
+#if LUA_VERSION_NUM < 503
+  lua_pushnumber(L,value);
+#else
+  lua_pushinteger(L,(lua_Integer)value);
+#endif
+}
+
+static void cbor_cL_pushnint(lua_State *L,unsigned long long int value)
+{
+  assert(L != NULL);
+  
+#if LUA_VERSION_NUM < 503
+  lua_pushnumber(L,-1.0 - (lua_Number)value);
+#else
+  lua_pushinteger(L,(lua_Integer)~value); /* -1 - value */
+#endif
+}
+
+/**************************************************************************
+* Everything that decodes (or scans) CBOR data accepts either a Lua string
+* or a memory mapped file from cbor_c.mmap().  The mapping stays valid as
+* long as the userdata exists, which it will for the duration of the call.
+***************************************************************************/
+
+#define CBOR_MMAP	"org.conman.cbor_c:mmap"
+
+typedef struct
+{
+  char const *data;
+  size_t      size;
+} mmap__s;
+
+static char const *cbor_cL_checkblob(lua_State *L,int idx,size_t *plen)
+{
+  assert(L    != NULL);
+  assert(plen != NULL);
+  
+  if (lua_type(L,idx) == LUA_TUSERDATA)
+  {
+    mmap__s *m = luaL_checkudata(L,idx,CBOR_MMAP);
+    *plen = m->size;
+    return m->data;
+  }
+  
+  return luaL_checklstring(L,idx,plen);
+}
+
 /******************************************************************
 * Usage:	ctype,info,value,pos2 = cbor_c.decode(blob,pos)
 * Desc:		Decode a CBOR-encoded value
@@ -340,117 +729,9503 @@ static int cbor_clua_encode(lua_State *L)
 static int cbor_clua_decode(lua_State *L)
 {
   size_t                  packlen;
-  const char             *packet = luaL_checklstring(L,1,&packlen);
-  size_t                  pos    = luaL_checkinteger(L,2);
+  const char             *packet = cbor_cL_checkblob(L,1,&packlen);
+  lua_Integer             ipos   = luaL_checkinteger(L,2);
+  size_t                  pos;
   int                     type;
   int                     info;
   unsigned long long int  value;
-  size_t                  i;
-  size_t                  len;
-
+  int                     rc;
+  
   assert(L != NULL);
-    
-  if (pos > packlen)
+  
+  if ((ipos < 1) || ((size_t)ipos > packlen))
     return luaL_error(L,"no input");
   
-  pos--;
-  lua_pushinteger(L,type = packet[pos] & 0xE0);
-  lua_pushinteger(L,info = packet[pos] & 0x1F);
+  pos = (size_t)ipos - 1;
+  rc  = cbor_ci_header(&type,&info,&value,packet,packlen,&pos);
+  
+  if (rc != CBOR_OKAY)
+    return luaL_error(L,"%s",m_cbor_errors[rc]);
+  
+  lua_pushinteger(L,type);
+  lua_pushinteger(L,info);
   
   /*----------------------------------------------------------------------
-  ; Info values less than 24 and 31 are inherent---the data is just there. 
-  ; So we handle these directly here---the value is either the info value,
-  ; or a HUGE_VAL (in the case of info=31).  Info values 24 to 27 have
-  ; extention bytes (1, 2, 4 or 8).  Get the length for these and carry on.
+  ; Info values less than 24 and 31 are inherent---the data is just there.
+  ; The value is either the info value, or a HUGE_VAL (in the case of
+  ; info=31).  The 0xE0 type with infos of 25, 26 and 27 encode actual
+  ; floating point values, so convert those to a double.
   ;-----------------------------------------------------------------------*/
   
-  if (info < 24)
-  {
-    lua_pushinteger(L,info);
-    lua_pushinteger(L,pos + 2);
-    return 4;
-  }
-  else if (info == 24)
-    len = 1;
-  else if (info == 25)
-    len = 2;
-  else if (info == 26)
-   len = 4;
-  else if (info == 27)
-   len = 8;
-  else if (info == 31)
-  {
+  if (info == 31)
     lua_pushnumber(L,HUGE_VAL);
-    lua_pushinteger(L,pos + 2);
-    return 4;
-  }
+  else if ((type == 0xE0) && (info >= 25))
+    lua_pushnumber(L,cbor_ci_double(info,value));
   else
-    return luaL_error(L,"invalid data");
-  
-  /*---------------------
-  ; Sanity checking
-  ;--------------------*/
+    cbor_cL_pushuint(L,value);
   
-  if (pos + len + 1 > packlen)
-    return luaL_error(L,"no more input");
+  lua_pushinteger(L,pos + 1);
+  return 4;
+}
+
+/**************************************************************************
+*
+*                          REFERENCE CONTEXTS
+*
+* A reference context is a reusable, native replacement for the Lua tables
+* used for _stringref/_nthstring [1] and _shareable/_sharedref [2].  Counts
+* are kept as we go, and strings are found via a hash over their bytes.
+* The strings themselves (and shared tables) are anchored in the user value
+* of the context, so the pointers we keep stay valid.
+*
+* Strings are kept in namespaces; push() starts a new one (as tag 256 does)
+* and pop() drops every string recorded since.  Since strings are removed
+* in the reverse order they were added, each one is at the head of its hash
+* chain when it's removed.
+*
+* [1] http://cbor.schmorp.de/stringref
+* [2] http://cbor.schmorp.de/value-sharing
+*
+***************************************************************************/
+
+#define CBOR_REFS	"org.conman.cbor_c:refs"
+
+typedef struct
+{
+  char const *s;
+  size_t      len;
+  uint32_t    hash;
+  size_t      next;     /* next in chain (index + 1), 0 for end */
+  bool        text;
+} strent__s;
+
+typedef struct
+{
+  strent__s *ent;       /* strings, by index */
+  size_t     count;
+  size_t     cap;
+  size_t    *head;      /* hash chains (index + 1) */
+  size_t     hsize;     /* always a power of 2 */
+  size_t    *ns;        /* saved namespace bases */
+  size_t     nsdepth;
+  size_t     nscap;
+  size_t     nsopen;    /* namespaces pushed by the decoder, not yet popped */
+  size_t     base;      /* start of current namespace */
+  size_t     tcount;    /* number of shared tables */
+  bool       seen;      /* tag 256 has been encoded */
+} refs__s;
+
+/**************************************************************************/
+
+static void *cbor_cL_realloc(lua_State *L,void *p,size_t osize,size_t nsize)
+{
+  lua_Alloc  allocf;
+  void      *ud;
+  void      *np;
   
-  /*----------------------------------------------
-  ; Read len bytes of a network-byte-order value.
-  ;-----------------------------------------------*/
+  assert(L != NULL);
   
-  for (value = 0 , i = 0 ; i < len ; i++)
-    value = (value << 8) | (unsigned long long)((unsigned char)packet[++pos]);
+  allocf = lua_getallocf(L,&ud);
+  np     = (*allocf)(ud,p,osize,nsize);
+  if ((np == NULL) && (nsize > 0))
+    luaL_error(L,"not enough memory");
+  return np;
+}
+
+/**************************************************************************
+* FNV-1a
+***************************************************************************/
+
+static uint32_t cbor_ci_hash(char const *s,size_t len)
+{
+  uint32_t h = 2166136261uL;
   
-  /*----------------------------------------------------------------------
-  ; The 0xE0 type encodes actual floating point values.  If we've just read
-  ; in one of these, convert to a double.
-  ;-----------------------------------------------------------------------*/
+  assert(s != NULL);
   
-  if ((type == 0xE0) && (len > 1))
+  while(len--)
   {
-    double__u d;
-    float__u  f;
-    dnf__s    cv;
-    
-    if (len == 2)
-    {
-      dnf_fromhalf(&cv,value);
-      dnf_todouble(&d.d,cv);
-    }
-    else if (len == 4)
-    {
-      f.i = value;
-      dnf_fromsingle(&cv,f.f);
-      dnf_todouble(&d.d,cv);
-    }
-    else if (len == 8)
-      d.i = value;
-    
-    lua_pushnumber(L,d.d);
-    lua_pushinteger(L,pos + 2);
-    return 4;
+    h ^= (unsigned char)*s++;
+    h *= 16777619uL;
   }
-  
-# if LUA_VERSION_NUM < 503  
-    lua_pushnumber(L,value);
-# else
-    lua_pushinteger(L,value);
-# endif
-  
-  lua_pushinteger(L,pos + 2);
-  return 4;
+  return h;
 }
 
-/**************************************************************************/
+/**************************************************************************
+* Return the context at idx, or NULL if it isn't one.
+***************************************************************************/
 
-static const luaL_Reg cbor_c_reg[] =
+static refs__s *cbor_cL_torefs(lua_State *L,int idx)
 {
-  { "encode"	, cbor_clua_encode	} ,
-  { "decode"	, cbor_clua_decode	} ,
-  { NULL	, NULL			}
-};
+  refs__s *r;
+  
+  assert(L != NULL);
+  
+  r = lua_touserdata(L,idx);
+  if ((r == NULL) || !lua_getmetatable(L,idx))
+    return NULL;
+  luaL_getmetatable(L,CBOR_REFS);
+  if (!lua_rawequal(L,-1,-2))
+    r = NULL;
+  lua_pop(L,2);
+  return r;
+}
 
-int luaopen_org_conman_cbor_c(lua_State *L)
+/**************************************************************************
+* Push the anchor table n (1 for strings, 2 for shared tables) of the
+* context at idx.
+***************************************************************************/
+
+static void cbor_cL_refs_anchor(lua_State *L,int idx,int n)
+{
+  assert(L != NULL);
+  assert((n == 1) || (n == 2));
+  
+#if LUA_VERSION_NUM == 501
+  lua_getfenv(L,idx);
+#else
+  lua_getuservalue(L,idx);
+#endif
+  lua_rawgeti(L,-1,n);
+  lua_replace(L,-2);
+}
+
+/**************************************************************************/
+
+static void cbor_cL_refs_newanchors(lua_State *L,int idx)
+{
+  assert(L != NULL);
+  
+  idx = lua_absindex(L,idx);
+  lua_createtable(L,2,0);
+  lua_newtable(L);
+  lua_rawseti(L,-2,1);
+  lua_newtable(L);
+  lua_rawseti(L,-2,2);
+#if LUA_VERSION_NUM == 501
+  lua_setfenv(L,idx);
+#else
+  lua_setuservalue(L,idx);
+#endif
+}
+
+/**************************************************************************
+* Return the number of strings in the current namespace.
+***************************************************************************/
+
+static size_t cbor_ci_refs_count(refs__s const *r)
+{
+  assert(r != NULL);
+  return r->count - r->base;
+}
+
+/**************************************************************************
+* Find a string in the current namespace.  Returns the index (0-based,
+* within the namespace) + 1, or 0 if not found.
+***************************************************************************/
+
+static size_t cbor_ci_refs_find(
+        refs__s const *r,
+        char const    *s,
+        size_t         len,
+        uint32_t       hash
+)
+{
+  assert(r != NULL);
+  assert(s != NULL);
+  
+  if (r->hsize == 0)
+    return 0;
+  
+  for (size_t i = r->head[hash & (r->hsize - 1)] ; i > r->base ; i = r->ent[i - 1].next)
+  {
+    strent__s const *e = &r->ent[i - 1];
+    if ((e->hash == hash) && (e->len == len) && (memcmp(e->s,s,len) == 0))
+      return i - r->base;
+  }
+  
+  return 0;
+}
+
+/**************************************************************************
+* Add the string at sidx to the context at ridx.
+***************************************************************************/
+
+static void cbor_cL_refs_add(
+        lua_State *L,
+        refs__s   *r,
+        int        ridx,
+        int        sidx,
+        uint32_t   hash,
+        bool       text
+)
+{
+  strent__s *e;
+  size_t     b;
+  
+  assert(L != NULL);
+  assert(r != NULL);
+  assert(lua_type(L,sidx) == LUA_TSTRING);
+  
+  sidx = lua_absindex(L,sidx);
+  
+  if (r->count == r->cap)
+  {
+    size_t ncap = r->cap ? r->cap * 2 : 64;
+    r->ent = cbor_cL_realloc(L,r->ent,r->cap * sizeof(strent__s),ncap * sizeof(strent__s));
+    r->cap = ncap;
+  }
+  
+  if (r->count >= r->hsize)
+  {
+    size_t nsize = r->hsize ? r->hsize * 2 : 64;
+    r->head  = cbor_cL_realloc(L,r->head,r->hsize * sizeof(size_t),nsize * sizeof(size_t));
+    r->hsize = nsize;
+    memset(r->head,0,nsize * sizeof(size_t));
+    for (size_t i = 0 ; i < r->count ; i++)
+    {
+      b               = r->ent[i].hash & (nsize - 1);
+      r->ent[i].next  = r->head[b];
+      r->head[b]      = i + 1;
+    }
+  }
+  
+  cbor_cL_refs_anchor(L,ridx,1);
+  lua_pushvalue(L,sidx);
+  lua_rawseti(L,-2,r->count + 1);
+  lua_pop(L,1);
+  
+  e       = &r->ent[r->count];
+  e->s    = lua_tolstring(L,sidx,&e->len);
+  e->hash = hash;
+  e->text = text;
+  b       = hash & (r->hsize - 1);
+  e->next = r->head[b];
+  r->head[b] = ++r->count;
+}
+
+/******************************************************************
+* Usage:	ctx = cbor_c.refs()
+* Desc:		Create a reference context
+* Return:	ctx (userdata) reference context
+*
+* Note:		A context can be used in place of the sref and stref tables
+*		when encoding, and as ref._stringref when decoding.
+*******************************************************************/
+
+static int cbor_clua_refs(lua_State *L)
+{
+  refs__s *r;
+  
+  assert(L != NULL);
+  
+  r = lua_newuserdata(L,sizeof(refs__s));
+  memset(r,0,sizeof(refs__s));
+  luaL_getmetatable(L,CBOR_REFS);
+  lua_setmetatable(L,-2);
+  cbor_cL_refs_newanchors(L,-1);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	ctx:reset()
+* Desc:		Clear all references, keeping the memory for reuse
+*******************************************************************/
+
+static int cbor_clua_refs_reset(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  
+  if (r->hsize > 0)
+    memset(r->head,0,r->hsize * sizeof(size_t));
+  r->count   = 0;
+  r->nsdepth = 0;
+  r->nsopen  = 0;
+  r->base    = 0;
+  r->tcount  = 0;
+  r->seen    = false;
+  cbor_cL_refs_newanchors(L,1);
+  return 0;
+}
+
+/******************************************************************
+* Usage:	ctx:push()
+* Desc:		Start a new string namespace (as per tag 256)
+*******************************************************************/
+
+static int cbor_clua_refs_push(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  
+  if (r->nsdepth == r->nscap)
+  {
+    size_t ncap = r->nscap ? r->nscap * 2 : 8;
+    r->ns    = cbor_cL_realloc(L,r->ns,r->nscap * sizeof(size_t),ncap * sizeof(size_t));
+    r->nscap = ncap;
+  }
+  
+  r->ns[r->nsdepth++] = r->base;
+  r->base             = r->count;
+  return 0;
+}
+
+/******************************************************************
+* Usage:	ctx:pop()
+* Desc:		End the current string namespace, dropping its strings
+*******************************************************************/
+
+static int cbor_clua_refs_pop(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  
+  if (r->nsdepth == 0)
+    return luaL_error(L,"no namespace to pop");
+  
+  cbor_cL_refs_anchor(L,1,1);
+  while(r->count > r->base)
+  {
+    strent__s *e = &r->ent[--r->count];
+    size_t     b = e->hash & (r->hsize - 1);
+    
+    assert(r->head[b] == r->count + 1);
+    r->head[b] = e->next;
+    lua_pushnil(L);
+    lua_rawseti(L,-2,r->count + 1);
+  }
+  
+  r->base = r->ns[--r->nsdepth];
+  return 0;
+}
+
+/******************************************************************
+* Usage:	value,ctype = ctx:get(n)
+* Desc:		Return a string from the current namespace
+* Input:	n (integer) index (0-based) of string
+* Return:	value (string) string, nil if none
+*		ctype (enum/cbor) 'TEXT' or 'BIN'
+*******************************************************************/
+
+static int cbor_clua_refs_get(lua_State *L)
+{
+  refs__s     *r = luaL_checkudata(L,1,CBOR_REFS);
+  lua_Integer  n = luaL_checkinteger(L,2);
+  
+  if ((n < 0) || ((size_t)n >= cbor_ci_refs_count(r)))
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+  
+  cbor_cL_refs_anchor(L,1,1);
+  lua_rawgeti(L,-1,r->base + n + 1);
+  lua_pushstring(L,r->ent[r->base + n].text ? "TEXT" : "BIN");
+  return 2;
+}
+
+/******************************************************************
+* Usage:	count = #ctx
+* Desc:		Return the number of strings in the current namespace
+*******************************************************************/
+
+static int cbor_clua_refs___len(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  lua_pushinteger(L,cbor_ci_refs_count(r));
+  return 1;
+}
+
+/**************************************************************************
+* ctx.SEEN mirrors stref.SEEN (see TAG._stringref in cbor.lua); any other
+* key is a method.
+***************************************************************************/
+
+static int cbor_clua_refs___index(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  
+  if ((lua_type(L,2) == LUA_TSTRING) && (strcmp(lua_tostring(L,2),"SEEN") == 0))
+  {
+    lua_pushboolean(L,r->seen);
+    return 1;
+  }
+  
+  lua_getmetatable(L,1);
+  lua_pushvalue(L,2);
+  lua_rawget(L,-2);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_refs___newindex(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  
+  if ((lua_type(L,2) != LUA_TSTRING) || (strcmp(lua_tostring(L,2),"SEEN") != 0))
+    return luaL_error(L,"cannot set field");
+  r->seen = lua_toboolean(L,3);
+  return 0;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_refs___gc(lua_State *L)
+{
+  refs__s *r = luaL_checkudata(L,1,CBOR_REFS);
+  
+  cbor_cL_realloc(L,r->ent,r->cap * sizeof(strent__s),0);
+  cbor_cL_realloc(L,r->head,r->hsize * sizeof(size_t),0);
+  cbor_cL_realloc(L,r->ns,r->nscap * sizeof(size_t),0);
+  memset(r,0,sizeof(refs__s));
+  return 0;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_refs_meta[] =
+{
+  { "reset"		, cbor_clua_refs_reset		} ,
+  { "push"		, cbor_clua_refs_push		} ,
+  { "pop"		, cbor_clua_refs_pop		} ,
+  { "get"		, cbor_clua_refs_get		} ,
+  { "__len"		, cbor_clua_refs___len		} ,
+  { "__index"		, cbor_clua_refs___index	} ,
+  { "__newindex"	, cbor_clua_refs___newindex	} ,
+  { "__gc"		, cbor_clua_refs___gc		} ,
+  { NULL		, NULL				}
+};
+
+/**************************************************************************
+*
+*                          DECODING STATISTICS
+*
+* Optional counters for the native decoder, enabled with cbor_c.stats(true).
+* The counters live in a userdata in the registry which, once created, is
+* never removed---disabling just clears a flag---so a decoder can hold a
+* pointer to it for the duration of a call.  When disabled, the decoder
+* sees a NULL pointer, and the only cost is a test of that pointer.
+*
+***************************************************************************/
+
+#define CBOR_STATS	"org.conman.cbor_c:stats"
+
+typedef struct
+{
+  bool                   on;
+  unsigned long long int calls;
+  unsigned long long int items[8];      /* by major type */
+  unsigned long long int bytes;
+  unsigned long long int tables;
+  unsigned long long int reused;
+  unsigned long long int strings;
+  unsigned long long int stringrefs;
+  unsigned long long int tags;
+  unsigned long long int convs;
+  double                 convtime;
+} stats__s;
+
+static char const *const m_majors[] =
+{
+  "UINT",
+  "NINT",
+  "BIN",
+  "TEXT",
+  "ARRAY",
+  "MAP",
+  "TAG",
+  "SIMPLE",
+};
+
+/**************************************************************************
+* Return the statistics block if statistics are enabled, NULL otherwise.
+***************************************************************************/
+
+static stats__s *cbor_cL_stats(lua_State *L)
+{
+  stats__s *st;
+  
+  assert(L != NULL);
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_STATS);
+  st = lua_touserdata(L,-1);
+  lua_pop(L,1);
+  return (st != NULL) && st->on ? st : NULL;
+}
+
+/**************************************************************************
+* Push the per-tag counts table (the user value of the statistics block).
+***************************************************************************/
+
+static void cbor_cL_stats_tags(lua_State *L)
+{
+  assert(L != NULL);
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_STATS);
+#if LUA_VERSION_NUM == 501
+  lua_getfenv(L,-1);
+#else
+  lua_getuservalue(L,-1);
+#endif
+  lua_remove(L,-2);
+}
+
+/**************************************************************************
+* Count a call to a TAG handler.
+***************************************************************************/
+
+static void cbor_cL_stats_tag(lua_State *L,stats__s *st,unsigned long long int value)
+{
+  assert(L  != NULL);
+  assert(st != NULL);
+  
+  st->tags++;
+  cbor_cL_stats_tags(L);
+  cbor_cL_pushuint(L,value);
+  lua_pushvalue(L,-1);
+  lua_rawget(L,-3);
+  lua_pushinteger(L,lua_tointeger(L,-1) + 1);
+  lua_remove(L,-2);
+  lua_rawset(L,-3);
+  lua_pop(L,1);
+}
+
+/******************************************************************
+* Usage:	stats = cbor_c.stats([enable])
+* Desc:		Return (and optionally enable, reset or disable) the
+*		decoding statistics
+* Input:	enable (boolean/optional) true to enable (and reset),
+*		false to disable
+* Return:	stats (table) counters, nil if statistics were never enabled
+*
+* Note:		The statistics returned are as they were before enable
+*		was applied, so cbor_c.stats(true) is "fetch and reset".
+*		The fields are:
+*
+*			enabled (boolean) statistics are being collected
+*			calls (integer) calls to the native decoder
+*			items (table) items decoded, by major type
+*			bytes (integer) bytes copied into BIN and TEXT strings
+*			tables (integer) tables created for ARRAYs and MAPs
+*			reused (integer) tables taken from conv._pool
+*			strings (integer) strings created
+*			stringrefs (integer) strings recorded as references
+*			tags (table) TAG handler calls, indexed by tag
+*			convs (integer) conversion routines called
+*			convtime (number) CPU seconds spent in conversion routines
+*
+* Note:		Calls made by TAG handlers back into cbor.decode() are
+*		counted as calls.
+*******************************************************************/
+
+static int cbor_clua_stats(lua_State *L)
+{
+  stats__s *st;
+  size_t    i;
+  
+  assert(L != NULL);
+  
+  lua_settop(L,1);
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_STATS);
+  st = lua_touserdata(L,2);
+  
+  if (st == NULL)
+    lua_pushnil(L);
+  else
+  {
+    lua_createtable(L,0,11);
+    lua_pushboolean(L,st->on);
+    lua_setfield(L,-2,"enabled");
+    cbor_cL_pushuint(L,st->calls);
+    lua_setfield(L,-2,"calls");
+    lua_createtable(L,0,8);
+    for (i = 0 ; i < 8 ; i++)
+    {
+      cbor_cL_pushuint(L,st->items[i]);
+      lua_setfield(L,-2,m_majors[i]);
+    }
+    lua_setfield(L,-2,"items");
+    cbor_cL_pushuint(L,st->bytes);
+    lua_setfield(L,-2,"bytes");
+    cbor_cL_pushuint(L,st->tables);
+    lua_setfield(L,-2,"tables");
+    cbor_cL_pushuint(L,st->reused);
+    lua_setfield(L,-2,"reused");
+    cbor_cL_pushuint(L,st->strings);
+    lua_setfield(L,-2,"strings");
+    cbor_cL_pushuint(L,st->stringrefs);
+    lua_setfield(L,-2,"stringrefs");
+    cbor_cL_pushuint(L,st->convs);
+    lua_setfield(L,-2,"convs");
+    lua_pushnumber(L,st->convtime);
+    lua_setfield(L,-2,"convtime");
+    
+    lua_newtable(L);
+    cbor_cL_stats_tags(L);
+    lua_pushnil(L);
+    while(lua_next(L,-2) != 0)
+    {
+      lua_pushvalue(L,-2);
+      lua_insert(L,-2);
+      lua_rawset(L,-5);
+    }
+    lua_pop(L,1);
+    lua_setfield(L,-2,"tags");
+  }
+  
+  if (lua_isnil(L,1))
+    return 1;
+  
+  if (st == NULL)
+  {
+    if (!lua_toboolean(L,1))
+      return 1;
+    
+    st = lua_newuserdata(L,sizeof(stats__s));
+    lua_pushvalue(L,-1);
+    lua_setfield(L,LUA_REGISTRYINDEX,CBOR_STATS);
+    lua_pop(L,1);
+  }
+  
+  if (lua_toboolean(L,1))
+  {
+    memset(st,0,sizeof(stats__s));
+    st->on = true;
+    lua_getfield(L,LUA_REGISTRYINDEX,CBOR_STATS);
+    lua_newtable(L);
+#if LUA_VERSION_NUM == 501
+    lua_setfenv(L,-2);
+#else
+    lua_setuservalue(L,-2);
+#endif
+    lua_pop(L,1);
+  }
+  else
+    st->on = false;
+  
+  lua_settop(L,3);
+  return 1;
+}
+
+/**************************************************************************
+*
+*                            DECODING LIMITS
+*
+* Limits on what the native decoder will accept, set with cbor_c.limits().
+* They're checked against the headers as they're read, before anything is
+* allocated, so hostile input (say, an ARRAY claiming 2^64 items) fails at
+* the offending header.  Like the statistics above, the limits live in a
+* userdata in the registry that is never removed once created.
+*
+***************************************************************************/
+
+#define CBOR_LIMITS	"org.conman.cbor_c:limits"
+
+#ifndef CBOR_MAXDEPTH
+#  define CBOR_MAXDEPTH 1000
+#endif
+
+typedef struct
+{
+  int                    depth;
+  unsigned long long int items;
+  unsigned long long int bytes;
+  unsigned long long int refs;
+} limits__s;
+
+static limits__s const m_limits =
+{
+  CBOR_MAXDEPTH,
+  ULLONG_MAX,
+  ULLONG_MAX,
+  ULLONG_MAX,
+};
+
+/**************************************************************************
+* Return the current limits.
+***************************************************************************/
+
+static limits__s const *cbor_cL_limits(lua_State *L)
+{
+  limits__s const *lim;
+  
+  assert(L != NULL);
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_LIMITS);
+  lim = lua_touserdata(L,-1);
+  lua_pop(L,1);
+  return lim != NULL ? lim : &m_limits;
+}
+
+/**************************************************************************
+* Push a limit, nil if there isn't one.
+***************************************************************************/
+
+static void cbor_cL_pushlimit(lua_State *L,unsigned long long int value)
+{
+  if (value == ULLONG_MAX)
+    lua_pushnil(L);
+  else
+    cbor_cL_pushuint(L,value);
+}
+
+/**************************************************************************
+* Read a limit from field name of the table at idx, ULLONG_MAX if missing.
+***************************************************************************/
+
+static unsigned long long int cbor_cL_getlimit(lua_State *L,int idx,char const *name)
+{
+  unsigned long long int value;
+  lua_Number             n = 0;
+  
+  lua_getfield(L,idx,name);
+  if (lua_isnil(L,-1))
+    value = ULLONG_MAX;
+  else
+  {
+    if (!lua_isnumber(L,-1) || !((n = lua_tonumber(L,-1)) >= 0))
+      return luaL_error(L,"limits: bad value for %s",name);
+    value = n < (lua_Number)ULLONG_MAX ? (unsigned long long int)n : ULLONG_MAX;
+  }
+  lua_pop(L,1);
+  return value;
+}
+
+/******************************************************************
+* Usage:	old = cbor_c.limits([limits])
+* Desc:		Return (and optionally set) the decoding limits
+* Input:	limits (table/optional) new limits, with the fields
+*
+*			depth (integer/optional) maximum nesting depth
+*				(at most CBOR_MAXDEPTH)
+*			items (integer/optional) maximum data items per call
+*			bytes (integer/optional) maximum length of a BIN or TEXT
+*			refs (integer/optional) maximum string and shared
+*				references (strings are recorded whether or
+*				not the data uses string references)
+*
+* Return:	old (table) limits in effect before the call
+*
+* Note:		Missing fields are unlimited, except depth, which
+*		defaults to CBOR_MAXDEPTH (1000 unless changed when
+*		compiling).  The returned table can be passed back in to
+*		restore the limits.
+*******************************************************************/
+
+static int cbor_clua_limits(lua_State *L)
+{
+  limits__s const        *cur;
+  limits__s              *lim;
+  unsigned long long int  depth;
+  
+  assert(L != NULL);
+  
+  lua_settop(L,1);
+  cur = cbor_cL_limits(L);
+  
+  lua_createtable(L,0,4);
+  lua_pushinteger(L,cur->depth);
+  lua_setfield(L,-2,"depth");
+  cbor_cL_pushlimit(L,cur->items);
+  lua_setfield(L,-2,"items");
+  cbor_cL_pushlimit(L,cur->bytes);
+  lua_setfield(L,-2,"bytes");
+  cbor_cL_pushlimit(L,cur->refs);
+  lua_setfield(L,-2,"refs");
+  
+  if (lua_isnil(L,1))
+    return 1;
+  
+  luaL_checktype(L,1,LUA_TTABLE);
+  
+  if (cur == &m_limits)
+  {
+    lim = lua_newuserdata(L,sizeof(limits__s));
+    lua_setfield(L,LUA_REGISTRYINDEX,CBOR_LIMITS);
+  }
+  else
+    lim = (limits__s *)cur;
+  
+  depth      = cbor_cL_getlimit(L,1,"depth");
+  lim->depth = depth > CBOR_MAXDEPTH ? CBOR_MAXDEPTH : depth < 1 ? 1 : (int)depth;
+  lim->items = cbor_cL_getlimit(L,1,"items");
+  lim->bytes = cbor_cL_getlimit(L,1,"bytes");
+  lim->refs  = cbor_cL_getlimit(L,1,"refs");
+  return 1;
+}
+
+/**************************************************************************
+*
+*                              RAW VALUES
+*
+* A raw value wraps a CBOR data item that's already encoded, which the
+* encoder copies into the output as is.  It's a table with the encoded item
+* at [1] and a shared metatable, so wrapping a string costs one table.
+*
+***************************************************************************/
+
+#define CBOR_RAW	"org.conman.cbor_c:raw"
+
+static int cbor_cL_skip(lua_State *,char const *,size_t,size_t *);
+
+/**************************************************************************
+* Replace the string at the top of the stack with a raw value.
+***************************************************************************/
+
+static void cbor_cL_toraw(lua_State *L)
+{
+  assert(L != NULL);
+  assert(lua_type(L,-1) == LUA_TSTRING);
+  
+  lua_createtable(L,1,0);
+  lua_insert(L,-2);
+  lua_rawseti(L,-2,1);
+  luaL_getmetatable(L,CBOR_RAW);
+  lua_setmetatable(L,-2);
+}
+
+/******************************************************************
+* Usage:	raw = cbor_c.raw(blob[,validate])
+* Desc:		Wrap an encoded CBOR data item for encoding as is
+* Input:	blob (binary) a single encoded CBOR data item
+*		validate (boolean/optional) check blob first
+* Return:	raw (table) raw value
+*
+* Note:		If validate is true, blob must be exactly one well formed
+*		CBOR data item, otherwise an error is thrown.  Without it,
+*		blob is trusted.
+*******************************************************************/
+
+static int cbor_clua_raw(lua_State *L)
+{
+  char const *s;
+  size_t      len;
+  
+  assert(L != NULL);
+  
+  s = luaL_checklstring(L,1,&len);
+  
+  if (lua_toboolean(L,2))
+  {
+    size_t pos = 0;
+    int    rc  = cbor_cL_skip(L,s,len,&pos);
+    
+    if (rc != CBOR_OKAY)
+      return luaL_error(L,"raw: %s at %d",m_cbor_errors[rc],(int)pos + 1);
+    if (pos != len)
+      return luaL_error(L,"raw: more than one item");
+  }
+  
+  lua_settop(L,1);
+  cbor_cL_toraw(L);
+  return 1;
+}
+
+/**************************************************************************
+* __tocbor() for raw values, for encoders that don't know about them.
+***************************************************************************/
+
+static int cbor_clua_raw___tocbor(lua_State *L)
+{
+  assert(L != NULL);
+  
+  luaL_checktype(L,1,LUA_TTABLE);
+  lua_rawgeti(L,1,1);
+  return 1;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_raw_meta[] =
+{
+  { "__tocbor"	, cbor_clua_raw___tocbor	} ,
+  { NULL	, NULL				}
+};
+
+/**************************************************************************
+*
+*                      NATIVE WHOLE ITEM DECODING
+*
+* The routines in this section decode a complete CBOR data item (arrays,
+* maps and all) in one call, directly building the Lua values on the stack.
+* The only time we drop back into Lua is to call a TAG handler or a
+* conversion routine.
+*
+***************************************************************************/
+
+#ifndef CBOR_MAXPRESIZE
+#  define CBOR_MAXPRESIZE 4096
+#endif
+
+enum
+{
+  CT_UINT,
+  CT_NINT,
+  CT_BIN,
+  CT_TEXT,
+  CT_ARRAY,
+  CT_MAP,
+  CT_SIMPLE,
+  CT_FALSE,
+  CT_TRUE,
+  CT_NULL,
+  CT_UNDEFINED,
+  CT_HALF,
+  CT_SINGLE,
+  CT_DOUBLE,
+  CT_BREAK,
+  CT_TAG,       /* name is whatever the TAG handler returned */
+};
+
+static char const *const m_ctypes[] =
+{
+  "UINT",
+  "NINT",
+  "BIN",
+  "TEXT",
+  "ARRAY",
+  "MAP",
+  "SIMPLE",
+  "false",
+  "true",
+  "null",
+  "undefined",
+  "half",
+  "single",
+  "double",
+  "__break",
+};
+
+typedef struct
+{
+  lua_State              *L;
+  char const             *packet;
+  size_t                  packlen;
+  size_t                  pos;
+  int                     idx_packet;
+  int                     idx_conv;
+  int                     idx_ref;
+  int                     idx_tag;
+  int                     idx_null;
+  int                     idx_undefined;
+  int                     idx_stringref;
+  int                     idx_sharedref;
+  refs__s                *refs;         /* if _stringref is a context */
+  stats__s               *stats;        /* NULL if not collecting statistics */
+  limits__s const        *limits;
+  bool                    convs;
+  bool                    raw;          /* conv._raw is a table */
+  bool                    pool;         /* conv._pool is a table */
+  int                     depth;
+  int                     base;         /* depth if called from a TAG handler, else -1 */
+  unsigned long long int  items;        /* items decoded so far */
+} decode__s;
+
+/**************************************************************************
+* Decodes waiting on a TAG handler, indexed by reference table (see
+* cbor_cL_decode_tag()).  The keys are weak.
+***************************************************************************/
+
+#define CBOR_NEST	"org.conman.cbor_c:nest"
+
+/**************************************************************************
+* Throw an error the same way cbor.lua does---a table with the position
+* (1-based) of the error and the error message.
+***************************************************************************/
+
+static int cbor_cL_throw(lua_State *L,lua_Integer pos,char const *fmt,...)
+{
+  va_list ap;
+  
+  assert(L   != NULL);
+  assert(fmt != NULL);
+  
+  lua_createtable(L,0,2);
+  lua_pushinteger(L,pos);
+  lua_setfield(L,-2,"pos");
+  va_start(ap,fmt);
+  lua_pushvfstring(L,fmt,ap);
+  va_end(ap);
+  lua_setfield(L,-2,"msg");
+  return lua_error(L);
+}
+
+/**************************************************************************
+* Return the minimum length a string should have to be worth a reference,
+* given the number of strings already referenced (see mstrlen() in
+* cbor.lua).
+***************************************************************************/
+
+static size_t cbor_ci_mstrlen(size_t cnt)
+{
+  if (cnt < 24uLL)
+    return 3;
+  else if (cnt < 256uLL)
+    return 4;
+  else if (cnt < 65536uLL)
+    return 5;
+  else if (cnt < 4294967296uLL)
+    return 7;
+  else
+    return 11;
+}
+
+/**************************************************************************
+* Support for _stringref and _nthstring [1].  This mimics decbintext() in
+* cbor.lua---strings shorter than the reference mark are not recorded.
+*
+* [1] http://cbor.schmorp.de/stringref
+***************************************************************************/
+
+static void cbor_cL_stringref(decode__s *d,size_t start,int ct)
+{
+  lua_State  *L = d->L;
+  char const *s;
+  size_t      len;
+  size_t      cnt;
+  
+  assert(d != NULL);
+  assert((ct == CT_BIN) || (ct == CT_TEXT));
+  assert(lua_type(L,-1) == LUA_TSTRING);
+  
+  s = lua_tolstring(L,-1,&len);
+  if (len < 3)
+    return;
+  
+  if (d->refs != NULL)
+  {
+    cnt = cbor_ci_refs_count(d->refs);
+    if (len >= cbor_ci_mstrlen(cnt))
+    {
+      uint32_t hash = cbor_ci_hash(s,len);
+      if (cbor_ci_refs_find(d->refs,s,len,hash) == 0)
+      {
+        if (cnt >= d->limits->refs)
+          cbor_cL_throw(L,start + 1,"%s: too many references",m_ctypes[ct]);
+        cbor_cL_refs_add(L,d->refs,d->idx_stringref,-1,hash,ct == CT_TEXT);
+        if (d->stats != NULL)
+          d->stats->stringrefs++;
+      }
+    }
+    return;
+  }
+  
+  cnt = lua_rawlen(L,d->idx_stringref);
+  if (len < cbor_ci_mstrlen(cnt))
+    return;
+  
+  lua_pushvalue(L,-1);
+  lua_rawget(L,d->idx_stringref);
+  if (lua_toboolean(L,-1))
+  {
+    lua_pop(L,1);
+    return;
+  }
+  lua_pop(L,1);
+  
+  if (cnt >= d->limits->refs)
+    cbor_cL_throw(L,start + 1,"%s: too many references",m_ctypes[ct]);
+  
+  lua_createtable(L,0,2);
+  lua_pushstring(L,m_ctypes[ct]);
+  lua_setfield(L,-2,"ctype");
+  lua_pushvalue(L,-2);
+  lua_setfield(L,-2,"value");
+  lua_rawseti(L,d->idx_stringref,cnt + 1);
+  lua_pushvalue(L,-1);
+  lua_pushboolean(L,1);
+  lua_rawset(L,d->idx_stringref);
+  
+  if (d->stats != NULL)
+    d->stats->stringrefs++;
+}
+
+/**************************************************************************/
+
+static int cbor_cL_decode_item(decode__s *,bool,bool);
+
+/**************************************************************************
+* Decode a BIN or TEXT.  Indefinite strings are made up of definite chunks
+* of the same major type, terminated with a __break.
+***************************************************************************/
+
+static void cbor_cL_decode_bintext(
+        decode__s              *d,
+        size_t                  start,
+        int                     type,
+        int                     info,
+        unsigned long long int  value
+)
+{
+  lua_State *L  = d->L;
+  int        ct = type == 0x40 ? CT_BIN : CT_TEXT;
+  
+  assert(d != NULL);
+  assert((type == 0x40) || (type == 0x60));
+  
+  if (info < 31)
+  {
+    if (value > d->packlen - d->pos)
+      cbor_cL_throw(L,start + 1,"%s: no more input",m_ctypes[ct]);
+    if (value > d->limits->bytes)
+      cbor_cL_throw(L,start + 1,"%s: too long",m_ctypes[ct]);
+  
+    lua_pushlstring(L,&d->packet[d->pos],value);
+    d->pos += value;
+    if (d->stats != NULL)
+    {
+      d->stats->strings++;
+      d->stats->bytes += value;
+    }
+    cbor_cL_stringref(d,start,ct);
+  }
+  else
+  {
+    unsigned long long int total = 0;
+    luaL_Buffer            buf;
+  
+    luaL_buffinit(L,&buf);
+  
+    while(true)
+    {
+      int                    ctype;
+      int                    cinfo;
+      unsigned long long int len;
+      size_t                 cpos = d->pos;
+      int                    rc   = cbor_ci_header(&ctype,&cinfo,&len,d->packet,d->packlen,&d->pos);
+  
+      if (rc != CBOR_OKAY)
+        cbor_cL_throw(L,cpos + 1,"%s",m_cbor_errors[rc]);
+  
+      if ((ctype == 0xE0) && (cinfo == 31))
+        break;
+  
+      if ((ctype != type) || (cinfo == 31))
+        cbor_cL_throw(L,cpos + 1,"%s: expecting %s chunk",m_ctypes[ct],m_ctypes[ct]);
+  
+      if (len > d->packlen - d->pos)
+        cbor_cL_throw(L,cpos + 1,"%s: no more input",m_ctypes[ct]);
+      if (len > d->limits->bytes - total)
+        cbor_cL_throw(L,cpos + 1,"%s: too long",m_ctypes[ct]);
+      total += len;
+  
+      /*-----------------------------------------------------------------
+      ; Chunks are treated like any other string for string references,
+      ; which is what decbintext() in cbor.lua has always done.
+      ;------------------------------------------------------------------*/
+  
+      lua_pushlstring(L,&d->packet[d->pos],len);
+      d->pos += len;
+      if (d->stats != NULL)
+      {
+        d->stats->strings++;
+        d->stats->bytes += len;
+      }
+      cbor_cL_stringref(d,cpos,ct);
+      luaL_addvalue(&buf);
+    }
+  
+    luaL_pushresult(&buf);
+    if (d->stats != NULL)
+      d->stats->strings++;
+  }
+}
+
+/**************************************************************************
+* Return how many slots to preallocate for an ARRAY or MAP of count items,
+* where each item takes at least size bytes and avail bytes of input are
+* left.  A hostile count can't claim more than the input could possibly
+* hold, or more than CBOR_MAXPRESIZE; past that, the table grows as usual.
+***************************************************************************/
+
+static int cbor_ci_presize(unsigned long long int count,size_t avail,size_t size)
+{
+  assert(size > 0);
+  
+  avail /= size;
+  if (count > avail)
+    count = avail;
+  if (count > CBOR_MAXPRESIZE)
+    count = CBOR_MAXPRESIZE;
+  return (int)count;
+}
+
+/**************************************************************************
+* Clear the table at index t (an absolute index), adding it to the pool at
+* index pool if put is true.  If pool isn't 0, the tables inside it (those
+* without a metatable) are cleared and added to the pool as well, with the
+* table at index seen recording those already done, since decoded data can
+* have cycles.  Past CBOR_MAXDEPTH levels, inner tables are left alone.
+***************************************************************************/
+
+static void cbor_cL_recycle(lua_State *L,int t,int pool,int seen,bool put,int depth)
+{
+  assert(L != NULL);
+  assert(t > 0);
+  
+  if (pool != 0)
+  {
+    lua_pushvalue(L,t);
+    lua_rawget(L,seen);
+    if (lua_toboolean(L,-1))
+    {
+      lua_pop(L,1);
+      return;
+    }
+    lua_pop(L,1);
+    lua_pushvalue(L,t);
+    lua_pushboolean(L,true);
+    lua_rawset(L,seen);
+  }
+  
+  luaL_checkstack(L,6,"recycle: too deep");
+  
+  /*---------------------------------------------------------------------
+  ; Setting existing fields to nil is allowed while traversing a table with
+  ; lua_next().
+  ;----------------------------------------------------------------------*/
+  
+  lua_pushnil(L);
+  while(lua_next(L,t) != 0)
+  {
+    if ((pool != 0) && (depth < CBOR_MAXDEPTH) && lua_istable(L,-1))
+    {
+      if (lua_getmetatable(L,-1))
+        lua_pop(L,1);
+      else
+        cbor_cL_recycle(L,lua_gettop(L),pool,seen,true,depth + 1);
+    }
+    lua_pop(L,1);
+    lua_pushvalue(L,-1);
+    lua_pushnil(L);
+    lua_rawset(L,t);
+  }
+  
+  if (put && (pool != 0))
+  {
+    lua_pushvalue(L,t);
+    lua_rawseti(L,pool,lua_rawlen(L,pool) + 1);
+  }
+}
+
+/**************************************************************************
+* Per [1], shared references need to exist before the decoding process.
+* ref._sharedref.REF will be such a reference.  If it doesn't exist, then
+* take a table from conv._pool, or create a table presized for narr array
+* items and nrec hash items.  Once used, the reference is cleared so it
+* doesn't leak into the next ARRAY or MAP.
+*
+* [1] http://cbor.schmorp.de/value-sharing
+***************************************************************************/
+
+static void cbor_cL_newtable(decode__s *d,int narr,int nrec)
+{
+  lua_State *L = d->L;
+  
+  assert(d != NULL);
+  
+  lua_getfield(L,d->idx_sharedref,"REF");
+  if (lua_isnil(L,-1))
+  {
+    lua_pop(L,1);
+    if (d->pool)
+    {
+      size_t n;
+      
+      lua_getfield(L,d->idx_conv,"_pool");
+      n = lua_rawlen(L,-1);
+      if (n > 0)
+      {
+        lua_rawgeti(L,-1,n);
+        lua_pushnil(L);
+        lua_rawseti(L,-3,n);
+        lua_remove(L,-2);
+        if (d->stats != NULL)
+          d->stats->reused++;
+        return;
+      }
+      lua_pop(L,1);
+    }
+    lua_createtable(L,narr,nrec);
+    if (d->stats != NULL)
+      d->stats->tables++;
+  }
+  else
+  {
+    lua_pushnil(L);
+    lua_setfield(L,d->idx_sharedref,"REF");
+  }
+}
+
+/**************************************************************************/
+
+static void cbor_cL_decode_array(
+        decode__s              *d,
+        size_t                  start,
+        int                     info,
+        unsigned long long int  value
+)
+{
+  lua_State              *L = d->L;
+  unsigned long long int  i;
+  
+  assert(d != NULL);
+  
+  if (info != 31)
+  {
+    if (value > d->packlen - d->pos)
+      cbor_cL_throw(L,start + 1,"ARRAY: count exceeds input");
+    if (value > d->limits->items - d->items)
+      cbor_cL_throw(L,start + 1,"ARRAY: too many items");
+  }
+  
+  cbor_cL_newtable(d,info == 31 ? 0 : cbor_ci_presize(value,d->packlen - d->pos,1),0);
+  
+  for (i = 1 ; (info == 31) || (i <= value) ; i++)
+  {
+    if (cbor_cL_decode_item(d,false,false) == CT_BREAK)
+    {
+      lua_pop(L,1);
+      if (info != 31)
+        cbor_cL_throw(L,start + 1,"ARRAY: unexpected __break");
+      break;
+    }
+    lua_rawseti(L,-2,i);
+  }
+}
+
+/**************************************************************************
+* Return true if the MAP key at the top of the stack is in conv._raw, in
+* which case its value is returned as a raw value.
+***************************************************************************/
+
+static bool cbor_cL_decode_israw(decode__s *d)
+{
+  lua_State *L = d->L;
+  bool       raw;
+  
+  assert(d != NULL);
+  
+  lua_getfield(L,d->idx_conv,"_raw");
+  lua_pushvalue(L,-2);
+  lua_rawget(L,-2);
+  raw = lua_toboolean(L,-1);
+  lua_pop(L,2);
+  return raw;
+}
+
+/**************************************************************************/
+
+static void cbor_cL_decode_map(
+        decode__s              *d,
+        size_t                  start,
+        int                     info,
+        unsigned long long int  value
+)
+{
+  lua_State              *L = d->L;
+  unsigned long long int  i;
+  
+  assert(d != NULL);
+  
+  if (info != 31)
+  {
+    if (value > (d->packlen - d->pos) / 2)
+      cbor_cL_throw(L,start + 1,"MAP: count exceeds input");
+    if (value > (d->limits->items - d->items) / 2)
+      cbor_cL_throw(L,start + 1,"MAP: too many items");
+  }
+  
+  cbor_cL_newtable(d,0,info == 31 ? 0 : cbor_ci_presize(value,d->packlen - d->pos,2));
+  
+  for (i = 1 ; (info == 31) || (i <= value) ; i++)
+  {
+    size_t kpos = d->pos;
+  
+    if (cbor_cL_decode_item(d,true,false) == CT_BREAK)
+    {
+      lua_pop(L,1);
+      if (info != 31)
+        cbor_cL_throw(L,start + 1,"MAP: unexpected __break");
+      break;
+    }
+  
+    if (lua_isnil(L,-1))
+      cbor_cL_throw(L,kpos + 1,"MAP: nil key");
+    if ((lua_type(L,-1) == LUA_TNUMBER) && (lua_tonumber(L,-1) != lua_tonumber(L,-1)))
+      cbor_cL_throw(L,kpos + 1,"MAP: NaN key");
+  
+    if (d->raw && cbor_cL_decode_israw(d))
+    {
+      size_t vpos = d->pos;
+      int    rc   = cbor_cL_skip(L,d->packet,d->packlen,&d->pos);
+      
+      if (rc != CBOR_OKAY)
+        cbor_cL_throw(L,d->pos + 1,"%s",m_cbor_errors[rc]);
+      lua_pushlstring(L,d->packet + vpos,d->pos - vpos);
+      cbor_cL_toraw(L);
+    }
+    else if (cbor_cL_decode_item(d,false,false) == CT_BREAK)
+      cbor_cL_throw(L,kpos + 1,"MAP: missing value");
+    lua_rawset(L,-3);
+  }
+}
+
+/**************************************************************************
+* Native TAG handling.  cbor_c.tags() records the stock handlers from
+* cbor.TAG (and its __index method, as -1) in the registry under
+* CBOR_TAGS, mapped to the tag they handle.  When the decoder finds one of
+* these, it does the work itself, without calling back into Lua.
+***************************************************************************/
+
+#define CBOR_TAGS	"org.conman.cbor_c:tags"
+
+static int const m_ntags[] = { 0 , 1 , 2 , 3 , 4 , 5 , 24 , 25 , 28 , 29 , 256 , 55799 };
+
+/**************************************************************************
+* With the handler for a tag (or nil) at the top of the stack, return true
+* if it's a stock handler, setting *ptag to the tag it handles (-1 for the
+* __index method), and pop it.  Otherwise, leave it.
+***************************************************************************/
+
+static bool cbor_cL_decode_stock(decode__s *d,lua_Integer *ptag)
+{
+  lua_State *L = d->L;
+  
+  assert(d    != NULL);
+  assert(ptag != NULL);
+  
+  if (lua_isnil(L,-1))
+  {
+    if (!lua_getmetatable(L,d->idx_tag))
+      return false;
+    lua_getfield(L,-1,"__index");
+    lua_replace(L,-2);
+  }
+  else
+    lua_pushvalue(L,-1);
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_TAGS);
+  if (!lua_istable(L,-1))
+  {
+    lua_pop(L,2);
+    return false;
+  }
+  
+  lua_insert(L,-2);
+  lua_rawget(L,-2);
+  if (lua_type(L,-1) != LUA_TNUMBER)
+  {
+    lua_pop(L,2);
+    return false;
+  }
+  
+  *ptag = lua_tointeger(L,-1);
+  lua_pop(L,3);
+  return true;
+}
+
+/**************************************************************************
+* Decode the item a tag applies to, as a TAG handler calling cbor.decode()
+* would, leaving the value and its ctype name on the stack.  The name is
+* returned.
+***************************************************************************/
+
+static char const *cbor_cL_decode_tagged(decode__s *d)
+{
+  lua_State  *L = d->L;
+  char const *name;
+  int         ct;
+  
+  assert(d != NULL);
+  
+  ct = cbor_cL_decode_item(d,false,true);
+  if (ct != CT_TAG)
+    lua_pushstring(L,m_ctypes[ct]);
+  name = lua_tostring(L,-1);
+  return name != NULL ? name : luaL_typename(L,-1);
+}
+
+/**************************************************************************
+* Check the name of the item a tag applies to against want (or numbers,
+* if want is NULL), and if it's good, replace it with the name of the tag.
+***************************************************************************/
+
+static void cbor_cL_decode_want(
+        decode__s  *d,
+        size_t      pos,
+        char const *tname,
+        char const *want
+)
+{
+  lua_State  *L    = d->L;
+  char const *name = cbor_cL_decode_tagged(d);
+  
+  assert(tname != NULL);
+  
+  if (want != NULL)
+  {
+    if (strcmp(name,want) != 0)
+      cbor_cL_throw(L,pos,"%s: wanted %s, got %s",tname,want,name);
+  }
+  else if (
+               (strcmp(name,"UINT")   != 0)
+            && (strcmp(name,"NINT")   != 0)
+            && (strcmp(name,"half")   != 0)
+            && (strcmp(name,"single") != 0)
+            && (strcmp(name,"double") != 0)
+          )
+    cbor_cL_throw(L,pos,"%s: wanted number, got %s",tname,name);
+  
+  lua_pushstring(L,tname);
+  lua_replace(L,-2);
+}
+
+/**************************************************************************
+* Return true if the value at idx is an integer, as math.type() in cbor.lua
+* would have it.
+***************************************************************************/
+
+static bool cbor_cL_decode_isinteger(lua_State *L,int idx)
+{
+  assert(L != NULL);
+  
+#if LUA_VERSION_NUM >= 503
+  return lua_isinteger(L,idx);
+#else
+  if (lua_type(L,idx) == LUA_TNUMBER)
+  {
+    lua_Number n = lua_tonumber(L,idx);
+    return (n >= -9007199254740992.0) && (n <= 9007199254740992.0) && (floor(n) == n);
+  }
+  return false;
+#endif
+}
+
+/**************************************************************************
+* Check the ARRAY of a _decimalfraction or _bigfloat, replacing its name
+* with that of the tag.  The exponent of a _bigfloat can be any number.
+***************************************************************************/
+
+static void cbor_cL_decode_fraction(decode__s *d,size_t pos,char const *tname,bool anyexp)
+{
+  lua_State  *L    = d->L;
+  char const *name = cbor_cL_decode_tagged(d);
+  
+  assert(tname != NULL);
+  
+  if (strcmp(name,"ARRAY") != 0)
+    cbor_cL_throw(L,pos,"%s: wanted ARRAY, got %s",tname,name);
+  if (lua_rawlen(L,-2) != 2)
+    cbor_cL_throw(L,pos,"%s: wanted ARRAY[2], got ARRAY[%d]",tname,(int)lua_rawlen(L,-2));
+  
+  lua_rawgeti(L,-2,1);
+  lua_rawgeti(L,-3,2);
+  if (anyexp ? (lua_type(L,-2) != LUA_TNUMBER) : !cbor_cL_decode_isinteger(L,-2))
+    cbor_cL_throw(L,pos,"%s: wanted %s for exp, got %s",tname,anyexp ? "number" : "integer",luaL_typename(L,-2));
+  if (!cbor_cL_decode_isinteger(L,-1))
+    cbor_cL_throw(L,pos,"%s: wanted integer for mantissa, got %s",tname,luaL_typename(L,-1));
+  lua_pop(L,3);
+  lua_pushstring(L,tname);
+}
+
+/**************************************************************************
+* Return the index from the UINT a _nthstring or _sharedref tag applies to,
+* popping it.
+***************************************************************************/
+
+static size_t cbor_cL_decode_refindex(decode__s *d,size_t pos,char const *tname)
+{
+  lua_State  *L    = d->L;
+  char const *name = cbor_cL_decode_tagged(d);
+  lua_Number  n;
+  
+  assert(tname != NULL);
+  
+  if ((strcmp(name,"UINT") != 0) || (lua_type(L,-2) != LUA_TNUMBER))
+    cbor_cL_throw(L,pos,"%s: wanted UINT, got %s",tname,name);
+  n = lua_tonumber(L,-2);
+  lua_pop(L,2);
+  return (n >= 0) && (n < (lua_Number)SIZE_MAX) ? (size_t)n : SIZE_MAX;
+}
+
+/**************************************************************************
+* Do the work of the stock handler for tag, leaving the value and ctype
+* name on the stack, as the handler would have returned them.  These
+* follow the handlers in cbor.TAG, so see there for the details.  The name
+* for tags without a handler is only made if it might be used.
+***************************************************************************/
+
+static void cbor_cL_decode_native(
+        decode__s              *d,
+        size_t                  start,
+        lua_Integer             tag,
+        unsigned long long int  value,
+        bool                    wantname
+)
+{
+  lua_State  *L   = d->L;
+  size_t      pos = d->pos + 1; /* as given to the handler */
+  char const *name;
+  size_t      n;
+  int         prev;
+  int         idx;
+  
+  assert(d != NULL);
+  
+  switch(tag)
+  {
+    case     0: cbor_cL_decode_want(d,pos,"_datetime","TEXT"); break;
+    case     1: cbor_cL_decode_want(d,pos,"_epoch",NULL);      break;
+    case     2: cbor_cL_decode_want(d,pos,"_pbignum","BIN");   break;
+    case     3: cbor_cL_decode_want(d,pos,"_nbignum","BIN");   break;
+    case     4: cbor_cL_decode_fraction(d,pos,"_decimalfraction",false); break;
+    case     5: cbor_cL_decode_fraction(d,pos,"_bigfloat",true);         break;
+    case    24: cbor_cL_decode_want(d,pos,"_cbor","BIN");      break;
+    
+    case 55799:
+         lua_pushliteral(L,"_magic_cbor");
+         lua_pushliteral(L,"_magic_cbor");
+         break;
+         
+    case 25:
+         n = cbor_cL_decode_refindex(d,pos,"_nthstring");
+         if (d->refs != NULL)
+         {
+           if (n >= cbor_ci_refs_count(d->refs))
+             cbor_cL_throw(L,pos,"_nthstring: invalid index %d",(int)n);
+           cbor_cL_refs_anchor(L,d->idx_stringref,1);
+           lua_rawgeti(L,-1,d->refs->base + n + 1);
+           lua_remove(L,-2);
+           lua_pushstring(L,d->refs->ent[d->refs->base + n].text ? "TEXT" : "BIN");
+         }
+         else
+         {
+           if (n >= lua_rawlen(L,d->idx_stringref))
+             cbor_cL_throw(L,pos,"_nthstring: invalid index %d",(int)n);
+           lua_rawgeti(L,d->idx_stringref,n + 1);
+           lua_getfield(L,-1,"value");
+           lua_getfield(L,-2,"ctype");
+           lua_remove(L,-3);
+         }
+         break;
+         
+    case 28:
+         lua_createtable(L,0,2);
+         lua_newtable(L);
+         lua_pushvalue(L,-1);
+         lua_setfield(L,d->idx_sharedref,"REF");
+         lua_setfield(L,-2,"value");
+         n = lua_rawlen(L,d->idx_sharedref) + 1;
+         lua_rawseti(L,d->idx_sharedref,n);
+         
+         name = cbor_cL_decode_tagged(d);
+         if ((strcmp(name,"ARRAY") != 0) && (strcmp(name,"MAP") != 0))
+           cbor_cL_throw(L,pos,"_shareable: wanted ARRAY or MAP, got %s",name);
+         
+         lua_rawgeti(L,d->idx_sharedref,n);
+         lua_pushvalue(L,-2);
+         lua_setfield(L,-2,"ctype");
+         lua_pop(L,1);
+         
+         if (lua_rawlen(L,d->idx_sharedref) > d->limits->refs)
+           cbor_cL_throw(L,start + 1,"TAG: too many references");
+         break;
+         
+    case 29:
+         n = cbor_cL_decode_refindex(d,pos,"_sharedref");
+         if (n >= lua_rawlen(L,d->idx_sharedref))
+           cbor_cL_throw(L,pos,"_sharedref: invalid index %d",(int)n);
+         lua_rawgeti(L,d->idx_sharedref,n + 1);
+         lua_getfield(L,-1,"value");
+         lua_getfield(L,-2,"ctype");
+         lua_remove(L,-3);
+         break;
+         
+    case 256:
+         if (d->refs != NULL)
+         {
+           lua_pushcfunction(L,cbor_clua_refs_push);
+           lua_pushvalue(L,d->idx_stringref);
+           lua_call(L,1,0);
+           d->refs->nsopen++;
+           cbor_cL_decode_tagged(d);
+           lua_pushcfunction(L,cbor_clua_refs_pop);
+           lua_pushvalue(L,d->idx_stringref);
+           lua_call(L,1,0);
+           d->refs->nsopen--;
+         }
+         else
+         {
+           lua_newtable(L);
+           lua_pushvalue(L,-1);
+           lua_setfield(L,d->idx_ref,"_stringref");
+           prev             = d->idx_stringref;
+           idx              = lua_gettop(L);
+           d->idx_stringref = idx;
+           cbor_cL_decode_tagged(d);
+           d->idx_stringref = prev;
+           lua_pushvalue(L,prev);
+           lua_setfield(L,d->idx_ref,"_stringref");
+           lua_remove(L,idx);
+         }
+         break;
+         
+    default:
+         if (cbor_cL_decode_item(d,false,false) == CT_BREAK)
+           cbor_cL_throw(L,pos,"invalid data");
+         if (wantname || d->convs)
+         {
+           char buf[32];
+           snprintf(buf,sizeof(buf),"TAG_%llu",value);
+           lua_pushstring(L,buf);
+         }
+         else
+           lua_pushnil(L);
+         break;
+  }
+}
+
+/**************************************************************************
+* Call the TAG handler (from cbor.TAG) for the given tag value.  It's
+* called as TAG[value](packet,pos,conv,ref) and returns value,pos2,ctype,
+* unless it's a stock handler, which is done natively.  Without a TAG
+* table, tags are skipped and the tagged item returned as is.
+***************************************************************************/
+
+static int cbor_cL_decode_tag(
+        decode__s              *d,
+        size_t                  start,
+        unsigned long long int  value,
+        bool                    iskey,
+        bool                    wantname
+)
+{
+  lua_State   *L = d->L;
+  lua_Integer  npos;
+  lua_Integer  tag;
+  int          nest;
+  int          rc;
+  
+  assert(d != NULL);
+  
+  if (d->idx_tag == 0)
+    return cbor_cL_decode_item(d,iskey,false);
+  
+  cbor_cL_pushuint(L,value);
+  lua_rawget(L,d->idx_tag);
+  
+  if (cbor_cL_decode_stock(d,&tag))
+  {
+    if (d->stats != NULL)
+      cbor_cL_stats_tag(L,d->stats,value);
+    cbor_cL_decode_native(d,start,tag,value,wantname);
+    return CT_TAG;
+  }
+  
+  if (lua_isnil(L,-1))
+  {
+    lua_pop(L,1);
+    cbor_cL_pushuint(L,value);
+    lua_gettable(L,d->idx_tag);
+    if (lua_isnil(L,-1))
+      cbor_cL_throw(L,start + 1,"TAG_%d: no handler",(int)value);
+  }
+  
+  if (d->stats != NULL)
+    cbor_cL_stats_tag(L,d->stats,value);
+  
+  /*----------------------------------------------------------------------
+  ; The handler will most likely call back into cbor.decode(), so this
+  ; decode is recorded in CBOR_NEST under the reference table; the nested
+  ; call carries on from its depth and item count, and updates the item
+  ; count.  The handler is called protected so the previous entry is put
+  ; back however it returns, and nothing is left in the reference table.
+  ;-----------------------------------------------------------------------*/
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_NEST);
+  nest = lua_gettop(L);
+  lua_pushvalue(L,d->idx_ref);
+  lua_rawget(L,nest);
+  lua_pushvalue(L,d->idx_ref);
+  lua_pushlightuserdata(L,d);
+  lua_rawset(L,nest);
+  
+  lua_pushvalue(L,nest - 1);
+  lua_pushvalue(L,d->idx_packet);
+  lua_pushinteger(L,d->pos + 1);
+  lua_pushvalue(L,d->idx_conv);
+  lua_pushvalue(L,d->idx_ref);
+  rc = lua_pcall(L,4,3,0);
+  
+  lua_pushvalue(L,d->idx_ref);
+  lua_pushvalue(L,nest + 1);
+  lua_rawset(L,nest);
+  if (rc != 0)
+    return lua_error(L);
+  
+  lua_remove(L,nest + 1);
+  lua_remove(L,nest);
+  lua_remove(L,nest - 1);
+  
+  if (lua_rawlen(L,d->idx_sharedref) > d->limits->refs)
+    cbor_cL_throw(L,start + 1,"TAG: too many references");
+  
+  npos = lua_tointeger(L,-2);
+  if ((npos < 1) || ((size_t)npos > d->packlen + 1))
+    cbor_cL_throw(L,start + 1,"TAG: bad position from handler");
+  
+  d->pos = (size_t)npos - 1;
+  lua_remove(L,-2);
+  return CT_TAG;
+}
+
+/**************************************************************************
+* Decode a single CBOR data item, leaving the resulting Lua value on the top
+* of the stack, and return the CT_* value of the item.  If wantname is
+* true, the ctype name of a tagged item is left above the value (for
+* everything else, m_ctypes[] has the name).  Conversion routines are
+* applied here.
+***************************************************************************/
+
+static int cbor_cL_decode_item(decode__s *d,bool iskey,bool wantname)
+{
+  lua_State              *L     = d->L;
+  size_t                  start = d->pos;
+  int                     type;
+  int                     info;
+  unsigned long long int  value;
+  int                     rc;
+  int                     ct;
+  
+  assert(d != NULL);
+  
+  if ((d->depth >= d->limits->depth) || !lua_checkstack(L,8))
+    cbor_cL_throw(L,start + 1,"nesting too deep");
+  
+  rc = cbor_ci_header(&type,&info,&value,d->packet,d->packlen,&d->pos);
+  if (rc != CBOR_OKAY)
+    cbor_cL_throw(L,start + 1,"%s",m_cbor_errors[rc]);
+  
+  if (((type != 0xE0) || (info != 31)) && (++d->items > d->limits->items))
+    cbor_cL_throw(L,start + 1,"too many items");
+  
+  if (d->stats != NULL)
+    d->stats->items[type >> 5]++;
+  
+  d->depth++;
+  
+  switch(type)
+  {
+    case 0x00:
+         if (info == 31)
+           cbor_cL_throw(L,start + 1,"invalid data");
+         cbor_cL_pushuint(L,value);
+         ct = CT_UINT;
+         break;
+  
+    case 0x20:
+         if (info == 31)
+           cbor_cL_throw(L,start + 1,"invalid data");
+         cbor_cL_pushnint(L,value);
+         ct = CT_NINT;
+         break;
+  
+    case 0x40:
+         cbor_cL_decode_bintext(d,start,type,info,value);
+         ct = CT_BIN;
+         break;
+  
+    case 0x60:
+         cbor_cL_decode_bintext(d,start,type,info,value);
+         ct = CT_TEXT;
+         break;
+  
+    case 0x80:
+         cbor_cL_decode_array(d,start,info,value);
+         ct = CT_ARRAY;
+         break;
+  
+    case 0xA0:
+         cbor_cL_decode_map(d,start,info,value);
+         ct = CT_MAP;
+         break;
+  
+    case 0xC0:
+         if (info == 31)
+           cbor_cL_throw(L,start + 1,"invalid data");
+         ct = cbor_cL_decode_tag(d,start,value,iskey,wantname);
+         if (d->idx_tag == 0) /* transparent tag, already converted */
+         {
+           d->depth--;
+           return ct;
+         }
+         break;
+  
+    case 0xE0:
+         switch(info)
+         {
+           case 20: lua_pushboolean(L,0);               ct = CT_FALSE;     break;
+           case 21: lua_pushboolean(L,1);               ct = CT_TRUE;      break;
+           case 22: lua_pushvalue(L,d->idx_null);       ct = CT_NULL;      break;
+           case 23: lua_pushvalue(L,d->idx_undefined);  ct = CT_UNDEFINED; break;
+           case 25: lua_pushnumber(L,cbor_ci_double(info,value)); ct = CT_HALF;   break;
+           case 26: lua_pushnumber(L,cbor_ci_double(info,value)); ct = CT_SINGLE; break;
+           case 27: lua_pushnumber(L,cbor_ci_double(info,value)); ct = CT_DOUBLE; break;
+           case 31:
+                lua_pushboolean(L,0);
+                d->depth--;
+                return CT_BREAK;
+           default: cbor_cL_pushuint(L,value); ct = CT_SIMPLE; break;
+         }
+         break;
+  
+    default:
+         assert(0);
+         ct = CT_SIMPLE;
+         break;
+  }
+  
+  /*----------------------------------------------------------------------
+  ; Apply any conversion routine.  For tagged items, the ctype name (from
+  ; the TAG handler) is above the value on the stack.
+  ;-----------------------------------------------------------------------*/
+  
+  if (d->convs)
+  {
+    if (ct == CT_TAG)
+    {
+      lua_pushvalue(L,-1);
+      lua_gettable(L,d->idx_conv);
+    }
+    else
+      lua_getfield(L,d->idx_conv,m_ctypes[ct]);
+  
+    if (lua_isnil(L,-1))
+      lua_pop(L,1);
+    else
+    {
+      lua_pushvalue(L,ct == CT_TAG ? -3 : -2);
+      lua_pushboolean(L,iskey);
+      
+      if (d->stats != NULL)
+      {
+        clock_t begin = clock();
+        lua_call(L,2,1);
+        d->stats->convs++;
+        d->stats->convtime += (double)(clock() - begin) / CLOCKS_PER_SEC;
+      }
+      else
+        lua_call(L,2,1);
+      
+      lua_replace(L,ct == CT_TAG ? -3 : -2);
+    }
+  }
+  
+  if ((ct == CT_TAG) && !wantname)
+    lua_pop(L,1);
+  
+  d->depth--;
+  return ct;
+}
+
+/**************************************************************************
+* Set up a decode__s from the arguments of cbor_c.decode_all() (which must
+* be at indices 1 through 8, with the starting position in pos).  The
+* position is checked by the caller.
+***************************************************************************/
+
+static void cbor_cL_decode_init(decode__s *d,lua_State *L)
+{
+  assert(d != NULL);
+  assert(L != NULL);
+  
+  d->L             = L;
+  d->packet        = cbor_cL_checkblob(L,1,&d->packlen);
+  d->idx_packet    = 1;
+  d->idx_conv      = 3;
+  d->idx_ref       = 4;
+  d->idx_tag       = lua_isnil(L,6) ? 0 : 6;
+  d->idx_null      = 7;
+  d->idx_undefined = 8;
+  d->idx_stringref = 0;
+  d->idx_sharedref = 0;
+  d->refs          = NULL;
+  d->stats         = cbor_cL_stats(L);
+  d->limits        = cbor_cL_limits(L);
+  d->depth         = 0;
+  d->base          = -1;
+  d->items         = 0;
+  d->convs         = false;
+  d->raw           = false;
+  d->pool          = false;
+  
+  if (d->stats != NULL)
+    d->stats->calls++;
+  
+  /*---------------------------------------------------------------------
+  ; conv._raw, conv._pool and conv._into aren't conversion routines, so if
+  ; they're the only entries, we can still skip looking up conversions.
+  ;----------------------------------------------------------------------*/
+  
+  if (!lua_isnil(L,3))
+  {
+    luaL_checktype(L,3,LUA_TTABLE);
+    lua_getfield(L,3,"_raw");
+    d->raw = lua_istable(L,-1);
+    lua_getfield(L,3,"_pool");
+    d->pool = lua_istable(L,-1);
+    lua_pop(L,2);
+    
+    lua_pushnil(L);
+    while (lua_next(L,3) != 0)
+    {
+      char const *key;
+      
+      lua_pop(L,1);
+      key = lua_type(L,-1) == LUA_TSTRING ? lua_tostring(L,-1) : "";
+      if ((strcmp(key,"_raw") != 0) && (strcmp(key,"_pool") != 0) && (strcmp(key,"_into") != 0))
+      {
+        d->convs = true;
+        lua_pop(L,1);
+        break;
+      }
+    }
+  }
+}
+
+/**************************************************************************
+* Push the _stringref and _sharedref tables of the reference table, making
+* a new reference table first if there isn't one.
+***************************************************************************/
+
+static void cbor_cL_decode_refs(decode__s *d)
+{
+  lua_State *L = d->L;
+  
+  assert(d != NULL);
+  
+  if (lua_isnil(L,4))
+  {
+    lua_newtable(L);
+    lua_replace(L,4);
+  }
+  else
+    luaL_checktype(L,4,LUA_TTABLE);
+  
+  lua_getfield(L,4,"_stringref");
+  if (lua_isnil(L,-1))
+  {
+    lua_pop(L,1);
+    lua_newtable(L);
+    lua_pushvalue(L,-1);
+    lua_setfield(L,4,"_stringref");
+  }
+  
+  lua_getfield(L,4,"_sharedref");
+  if (lua_isnil(L,-1))
+  {
+    lua_pop(L,1);
+    lua_newtable(L);
+    lua_pushvalue(L,-1);
+    lua_setfield(L,4,"_sharedref");
+  }
+  
+  d->idx_sharedref = lua_gettop(L);
+  d->idx_stringref = d->idx_sharedref - 1;
+  d->refs          = cbor_cL_torefs(L,d->idx_stringref);
+}
+
+/**************************************************************************
+* A decode that threw inside a _stringref leaves its namespaces pushed on
+* a reference context.  Nothing can be in progress when a top level decode
+* starts, so pop them then, leaving any the caller pushed.
+***************************************************************************/
+
+static void cbor_cL_decode_unwind(decode__s *d)
+{
+  lua_State *L = d->L;
+  
+  assert(d != NULL);
+  
+  if (d->refs == NULL)
+    return;
+  
+  for ( ; d->refs->nsopen > 0 ; d->refs->nsopen--)
+  {
+    lua_pushcfunction(L,cbor_clua_refs_pop);
+    lua_pushvalue(L,d->idx_stringref);
+    lua_call(L,1,0);
+  }
+}
+
+/******************************************************************
+* Usage:	value,pos2,ctype = cbor_c.decode_all(blob[,pos][,conv][,ref][,iskey][,TAG][,null][,undefined])
+* Desc:		Decode a complete CBOR data item
+* Input:	blob (binary) binary CBOR sludge
+*		pos (integer/optional) position to start decoding from
+*		conv (table/optional) conversion routines (see cbor.decode())
+*		ref (table/optional) reference table (see cbor.decode())
+*		iskey (boolean/optional) item is a key in a MAP
+*		TAG (table/optional) TAG handlers (see cbor.TAG)
+*		null (any/optional) value to use for CBOR null
+*		undefined (any/optional) value to use for CBOR undefined
+* Return:	value (any) decoded value
+*		pos2 (integer) position past decoded data
+*		ctype (enum/cbor) CBOR type of value
+*
+* Note:		This is the engine behind cbor.decode().  Arrays, maps,
+*		strings, numbers and simple types are decoded here; TAGs
+*		are handed off to TAG[n](blob,pos,conv,ref).  If TAG is nil,
+*		tags are skipped and the tagged item is returned.
+*
+* Note:		Throws an error of the form { pos = n , msg = "text" }.
+*******************************************************************/
+
+static int cbor_clua_decode_all(lua_State *L)
+{
+  decode__s   d;
+  decode__s  *parent;
+  lua_Integer pos;
+  int         ct;
+  
+  assert(L != NULL);
+  
+  lua_settop(L,8);
+  cbor_cL_decode_init(&d,L);
+  pos = luaL_optinteger(L,2,1);
+  
+  if ((pos < 1) || ((size_t)pos > d.packlen))
+    return cbor_cL_throw(L,pos,"no input");
+  
+  d.pos = (size_t)pos - 1;
+  cbor_cL_decode_refs(&d);
+  
+  /*---------------------------------------------------------------------
+  ; If called from a TAG handler (see cbor_cL_decode_tag()), carry on with
+  ; the depth and item count of the calling decode.
+  ;----------------------------------------------------------------------*/
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_NEST);
+  lua_pushvalue(L,4);
+  lua_rawget(L,-2);
+  parent = lua_touserdata(L,-1);
+  lua_pop(L,2);
+  
+  if (parent != NULL)
+  {
+    d.depth = d.base = parent->depth;
+    d.items = parent->items;
+  }
+  else
+    cbor_cL_decode_unwind(&d);
+  
+  /*---------------------------------------------------------------------
+  ; Decode an ARRAY or MAP into conv._into, clearing it first.  It's handed
+  ; to cbor_cL_newtable() as if it were a shared reference.  This only
+  ; applies to the top level call, not those from TAG handlers.
+  ;----------------------------------------------------------------------*/
+  
+  if ((d.base < 0) && !lua_isnil(L,3))
+  {
+    unsigned char major = (unsigned char)d.packet[d.pos] & 0xE0;
+    
+    lua_getfield(L,3,"_into");
+    if (lua_istable(L,-1) && ((major == 0x80) || (major == 0xA0)))
+    {
+      int t = lua_gettop(L);
+      
+      if (d.pool)
+      {
+        lua_getfield(L,3,"_pool");
+        lua_newtable(L);
+        cbor_cL_recycle(L,t,t + 1,t + 2,false,0);
+        lua_pop(L,2);
+      }
+      else
+        cbor_cL_recycle(L,t,0,0,false,0);
+      lua_setfield(L,d.idx_sharedref,"REF");
+    }
+    else
+      lua_pop(L,1);
+  }
+  
+  ct = cbor_cL_decode_item(&d,lua_toboolean(L,5),true);
+  
+  if (parent != NULL)
+    parent->items = d.items;
+  
+  if (ct == CT_TAG)
+  {
+    lua_pushinteger(L,d.pos + 1);
+    lua_insert(L,-2);
+  }
+  else
+  {
+    lua_pushinteger(L,d.pos + 1);
+    lua_pushstring(L,m_ctypes[ct]);
+  }
+  
+  return 3;
+}
+
+/******************************************************************
+* Usage:	cbor_c.tags(TAG)
+* Desc:		Record the stock TAG handlers, to be done natively
+* Input:	TAG (table) TAG handlers (see cbor.TAG)
+*
+* Note:		The handlers for tags 0, 1, 2, 3, 4, 5, 24, 25, 28, 29, 256
+*		and 55799, and the __index method of TAG (for tags without a
+*		handler), are recorded.  cbor_c.decode_all() does their work
+*		itself, with the same results, so long as they're still the
+*		ones in TAG; replace one and it's called as usual.
+*******************************************************************/
+
+static int cbor_clua_tags(lua_State *L)
+{
+  assert(L != NULL);
+  
+  luaL_checktype(L,1,LUA_TTABLE);
+  lua_settop(L,1);
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_TAGS);
+  if (lua_isnil(L,-1))
+  {
+    lua_pop(L,1);
+    lua_newtable(L);
+    lua_pushvalue(L,-1);
+    lua_setfield(L,LUA_REGISTRYINDEX,CBOR_TAGS);
+  }
+  
+  for (size_t i = 0 ; i < sizeof(m_ntags) / sizeof(m_ntags[0]) ; i++)
+  {
+    lua_rawgeti(L,1,m_ntags[i]);
+    if (lua_isfunction(L,-1))
+    {
+      lua_pushinteger(L,m_ntags[i]);
+      lua_rawset(L,2);
+    }
+    else
+      lua_pop(L,1);
+  }
+  
+  if (lua_getmetatable(L,1))
+  {
+    lua_getfield(L,-1,"__index");
+    if (lua_isfunction(L,-1))
+    {
+      lua_pushinteger(L,-1);
+      lua_rawset(L,2);
+    }
+    else
+      lua_pop(L,1);
+  }
+  
+  return 0;
+}
+
+/**************************************************************************
+* Convert a table size from Lua, capped to CBOR_MAXPRESIZE.  Anything that
+* isn't a sensible size (negative, NaN or the HUGE_VAL cbor_c.decode()
+* returns for indefinite ARRAYs and MAPs) is 0.
+***************************************************************************/
+
+static int cbor_cL_presize(lua_State *L,int idx)
+{
+  lua_Number n = luaL_optnumber(L,idx,0);
+  
+  if (!(n > 0))
+    return 0;
+  if (n > CBOR_MAXPRESIZE)
+    return CBOR_MAXPRESIZE;
+  return (int)n;
+}
+
+/******************************************************************
+* Usage:	t = cbor_c.newtable([narr][,nrec])
+* Desc:		Create a table presized for the given number of items
+* Input:	narr (number/optional) number of array items
+*		nrec (number/optional) number of hash items
+* Return:	t (table) empty table
+*
+* Note:		The sizes are capped (currently at 4096), to protect
+*		against hostile ARRAY and MAP counts; a table still grows
+*		past its presize as needed.
+*******************************************************************/
+
+static int cbor_clua_newtable(lua_State *L)
+{
+  assert(L != NULL);
+  lua_createtable(L,cbor_cL_presize(L,1),cbor_cL_presize(L,2));
+  return 1;
+}
+
+/******************************************************************
+* Usage:	cbor_c.recycle(pool,t)
+* Desc:		Return a decoded table, and the tables inside it, to a pool
+* Input:	pool (table) array of tables (see conv._pool in cbor.decode())
+*		t (table) table no longer in use
+*
+* Note:		t and every table inside it without a metatable are
+*		cleared and added to pool; tables with a metatable (say,
+*		from a conversion routine) are left alone, and t itself
+*		is only cleared.  Nothing else may still refer to these
+*		tables, as the decoder will hand them out again.
+*******************************************************************/
+
+static int cbor_clua_recycle(lua_State *L)
+{
+  bool put;
+  
+  assert(L != NULL);
+  
+  luaL_checktype(L,1,LUA_TTABLE);
+  luaL_checktype(L,2,LUA_TTABLE);
+  lua_settop(L,2);
+  put = !lua_getmetatable(L,2);
+  lua_settop(L,2);
+  lua_newtable(L);
+  cbor_cL_recycle(L,2,1,3,put,0);
+  return 0;
+}
+
+/**************************************************************************
+* State for cbor_c.decode_seq(), kept outside the protected call so we
+* know how far we got if an item fails to decode.
+***************************************************************************/
+
+typedef struct
+{
+  size_t pos;
+  size_t count;
+  size_t max;
+} seq__s;
+
+/**************************************************************************
+* Decode items for cbor_c.decode_seq().  On the stack are the eight
+* arguments of cbor_c.decode_all() (with max in place of iskey), then the
+* seq__s and the result array.  If no reference table was given, each item
+* gets a fresh one, just as if cbor.decode() was called in a loop.
+***************************************************************************/
+
+static int cbor_clua_decode_seqP(lua_State *L)
+{
+  seq__s    *s     = lua_touserdata(L,9);
+  bool       fresh = lua_isnil(L,4);
+  decode__s  d;
+  
+  assert(s != NULL);
+  
+  cbor_cL_decode_init(&d,L);
+  d.pos = s->pos;
+  
+  while((s->count < s->max) && (d.pos < d.packlen))
+  {
+    size_t start = d.pos;
+    
+    lua_settop(L,10);
+    if (fresh)
+    {
+      lua_pushnil(L);
+      lua_replace(L,4);
+    }
+    
+    cbor_cL_decode_refs(&d);
+    cbor_cL_decode_unwind(&d);
+    d.depth = 0;
+    d.items = 0;
+    
+    if (cbor_cL_decode_item(&d,false,false) == CT_BREAK)
+      cbor_cL_throw(L,start + 1,"invalid data");
+    
+    lua_rawseti(L,10,++s->count);
+    s->pos = d.pos;
+  }
+  
+  return 0;
+}
+
+/******************************************************************
+* Usage:	items,pos2[,epos,err] = cbor_c.decode_seq(blob[,pos][,conv][,ref][,max][,TAG][,null][,undefined])
+* Desc:		Decode a CBOR sequence (RFC-8742)
+* Input:	blob (binary) binary CBOR sludge
+*		pos (integer/optional) position to start decoding from
+*		conv (table/optional) conversion routines (see cbor.decode())
+*		ref (table/optional) reference table (see cbor.decode())
+*		max (integer/optional) maximum number of items to decode
+*		TAG (table/optional) TAG handlers (see cbor.TAG)
+*		null (any/optional) value to use for CBOR null
+*		undefined (any/optional) value to use for CBOR undefined
+* Return:	items (table) array of decoded values (count in field 'n')
+*		pos2 (integer) position past the last item decoded
+*		epos (integer/optional) position of error
+*		err (string/optional) error message
+*
+* Note:		Decoding stops at the end of blob, after max items, or at
+*		the first item that fails to decode; items holds everything
+*		before that.
+*******************************************************************/
+
+static int cbor_clua_decode_seq(lua_State *L)
+{
+  seq__s      s;
+  size_t      packlen;
+  lua_Integer pos;
+  lua_Integer max;
+  int         rc;
+  
+  assert(L != NULL);
+  
+  lua_settop(L,8);
+  cbor_cL_checkblob(L,1,&packlen);
+  pos = luaL_optinteger(L,2,1);
+  max = luaL_optinteger(L,5,-1);
+  
+  if ((pos < 1) || ((size_t)pos > packlen + 1))
+    return luaL_argerror(L,2,"position out of range");
+  
+  s.pos   = (size_t)pos - 1;
+  s.count = 0;
+  s.max   = max < 0 ? SIZE_MAX : (size_t)max;
+  
+  lua_newtable(L);
+  lua_insert(L,1);
+  lua_pushcfunction(L,cbor_clua_decode_seqP);
+  lua_insert(L,2);
+  lua_pushlightuserdata(L,&s);
+  lua_pushvalue(L,1);
+  rc = lua_pcall(L,10,0,0);
+  
+  lua_pushinteger(L,s.count);
+  lua_setfield(L,1,"n");
+  lua_pushinteger(L,s.pos + 1);
+  
+  if (rc == 0)
+    return 2;
+  
+  /*---------------------------------------------------------------------
+  ; Decoding errors are { pos = n , msg = "text" }.  TAG handlers and
+  ; conversion routines may throw strings, which we take as being at the
+  ; start of the item.  Anything else (say, out of memory) is passed on.
+  ;----------------------------------------------------------------------*/
+  
+  if (lua_istable(L,2))
+  {
+    lua_getfield(L,2,"pos");
+    lua_getfield(L,2,"msg");
+  }
+  else if (lua_type(L,2) == LUA_TSTRING)
+  {
+    lua_pushinteger(L,s.pos + 1);
+    lua_pushvalue(L,2);
+  }
+  else
+  {
+    lua_pushvalue(L,2);
+    return lua_error(L);
+  }
+  
+  lua_remove(L,2);
+  return 4;
+}
+
+/**************************************************************************
+*
+*                      NATIVE WHOLE ITEM ENCODING
+*
+* The routines in this section encode a complete Lua value (tables and all)
+* in one call into a growable buffer.  We can't use a luaL_Buffer here as
+* it requires exclusive use of the top of the stack, and the encoder needs
+* the stack for table traversal.  The buffer memory comes from the Lua
+* allocator and is anchored in a userdata, so it's reclaimed even if an
+* error is thrown mid-encode.
+*
+***************************************************************************/
+
+#define CBOR_BUFFER	"org.conman.cbor_c:buffer"
+
+typedef struct
+{
+  char   *data;
+  size_t  used;
+  size_t  size;
+} buffer__s;
+
+/**************************************************************************
+* For packed encoding (see cbor_cL_encode_packed()), a first pass counts
+* the tables and records the strings encoded, to work out which references
+* actually save space.
+***************************************************************************/
+
+typedef struct
+{
+  size_t count;         /* times encoded */
+  size_t size;          /* encoded size, the first time */
+  bool   open;          /* being encoded */
+  bool   cycle;         /* found inside itself */
+} tabinfo__s;
+
+typedef struct
+{
+  size_t id;
+  size_t len;
+} strocc__s;
+
+typedef struct
+{
+  int        idx_tabs;  /* table -> id, and id -> table */
+  int        idx_strs;  /* string -> id */
+  buffer__s *tabs;      /* tabinfo__s, by id - 1 */
+  buffer__s *seq;       /* strocc__s, in encoding order */
+  size_t     ntabs;
+  size_t     nstrs;
+  size_t     raws;      /* raw values, each put in a _stringref namespace */
+  bool       counting;  /* counting tables as well as recording strings */
+} auto__s;
+
+typedef struct
+{
+  lua_State *L;
+  buffer__s *buf;
+  int        idx_sref;
+  int        idx_stref;
+  int        idx_map;
+  int        idx_stock;
+  int        idx_null;
+  int        idx_undefined;
+  int        idx_share; /* tables to share, if packed (else 0) */
+  refs__s   *srefs;     /* if sref is a context */
+  refs__s   *strefs;    /* if stref is a context */
+  buffer__s *slots;     /* MAP entries to sort, if canonical */
+  auto__s   *au;        /* if recording for packed encoding */
+  bool       plain;
+  bool       packed;
+  bool       hookstr;   /* TYPE.TEXT or TYPE.BIN replaced */
+  bool       hooktab;   /* TYPE.ARRAY or TYPE.MAP replaced */
+  int        depth;
+} encode__s;
+
+typedef struct
+{
+  char const *key;
+  size_t      klen;
+  size_t      off;
+  size_t      len;
+} slot__s;
+
+/**************************************************************************/
+
+static void cbor_cB_free(lua_State *L,buffer__s *buf)
+{
+  lua_Alloc  allocf;
+  void      *ud;
+  
+  assert(L   != NULL);
+  assert(buf != NULL);
+  
+  if (buf->data != NULL)
+  {
+    allocf = lua_getallocf(L,&ud);
+    (*allocf)(ud,buf->data,buf->size,0);
+  }
+  
+  buf->data = NULL;
+  buf->used = 0;
+  buf->size = 0;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_buffer___gc(lua_State *L)
+{
+  cbor_cB_free(L,luaL_checkudata(L,1,CBOR_BUFFER));
+  return 0;
+}
+
+/**************************************************************************/
+
+static buffer__s *cbor_cL_newbuffer(lua_State *L)
+{
+  buffer__s *buf;
+  
+  assert(L != NULL);
+  
+  buf       = lua_newuserdata(L,sizeof(buffer__s));
+  buf->data = NULL;
+  buf->used = 0;
+  buf->size = 0;
+  luaL_getmetatable(L,CBOR_BUFFER);
+  lua_setmetatable(L,-2);
+  return buf;
+}
+
+/**************************************************************************
+* Make sure there's room for len more bytes in the buffer.  The buffer is
+* doubled in size as required.
+***************************************************************************/
+
+static void cbor_cB_reserve(lua_State *L,buffer__s *buf,size_t len)
+{
+  lua_Alloc  allocf;
+  void      *ud;
+  size_t     nsize;
+  char      *ndata;
+  
+  assert(L   != NULL);
+  assert(buf != NULL);
+  
+  if (buf->size - buf->used >= len)
+    return;
+  
+  if (len > SIZE_MAX - buf->used)
+    luaL_error(L,"not enough memory");
+  
+  for (nsize = buf->size ? buf->size : 256 ; nsize - buf->used < len ; )
+  {
+    if (nsize > SIZE_MAX / 2)
+    {
+      nsize = buf->used + len;
+      break;
+    }
+    nsize *= 2;
+  }
+  
+  allocf = lua_getallocf(L,&ud);
+  ndata  = (*allocf)(ud,buf->data,buf->size,nsize);
+  if (ndata == NULL)
+    luaL_error(L,"not enough memory");
+  
+  buf->data = ndata;
+  buf->size = nsize;
+}
+
+/**************************************************************************/
+
+static void cbor_cB_addlstring(
+        lua_State  *L,
+        buffer__s  *buf,
+        char const *s,
+        size_t      len
+)
+{
+  assert(L   != NULL);
+  assert(buf != NULL);
+  assert(s   != NULL);
+  
+  cbor_cB_reserve(L,buf,len);
+  memcpy(&buf->data[buf->used],s,len);
+  buf->used += len;
+}
+
+/**************************************************************************/
+
+static void cbor_cB_addvalue(
+        lua_State              *L,
+        buffer__s              *buf,
+        int                     type,
+        unsigned long long int  value
+)
+{
+  assert(L   != NULL);
+  assert(buf != NULL);
+  
+  cbor_cB_reserve(L,buf,sizeof(buffer__u));
+  buf->used += cbor_ci_putvalue((uint8_t *)&buf->data[buf->used],type,value);
+}
+
+/**************************************************************************/
+
+static void cbor_cB_addfloat(lua_State *L,buffer__s *buf,double value)
+{
+  assert(L   != NULL);
+  assert(buf != NULL);
+  
+  cbor_cB_reserve(L,buf,sizeof(buffer__u));
+  buf->used += cbor_ci_putfloat((uint8_t *)&buf->data[buf->used],value);
+}
+
+/**************************************************************************
+* Insert a value header at offset start, moving everything encoded since
+* then down.  This is used when we don't know the number of items in an
+* ARRAY or MAP until after they've been encoded.
+***************************************************************************/
+
+static void cbor_cB_insertvalue(
+        lua_State              *L,
+        buffer__s              *buf,
+        size_t                  start,
+        int                     type,
+        unsigned long long int  value
+)
+{
+  buffer__u hdr;
+  size_t    len;
+  
+  assert(L     != NULL);
+  assert(buf   != NULL);
+  assert(start <= buf->used);
+  
+  len = cbor_ci_putvalue(hdr.b,type,value);
+  cbor_cB_reserve(L,buf,len);
+  memmove(&buf->data[start + len],&buf->data[start],buf->used - start);
+  memcpy(&buf->data[start],hdr.c,len);
+  buf->used += len;
+}
+
+/**************************************************************************
+* Return the length of the leading run of printable ASCII (0x20 - 0x7E).
+* This is checked 32 (AVX2), 16 (SSE2) or 8 (everything else) bytes at a
+* time, since text is mostly ASCII.  A block is only skipped if every byte
+* in it is printable; anything else is left to the caller.
+***************************************************************************/
+
+static size_t cbor_ci_printable(uint8_t const *s,size_t len)
+{
+  size_t i = 0;
+  
+#if defined(__AVX2__)
+  __m256i const lo32 = _mm256_set1_epi8(0x1F);
+  __m256i const hi32 = _mm256_set1_epi8(0x7F);
+  
+  for ( ; len - i >= 32 ; i += 32)
+  {
+    __m256i v  = _mm256_loadu_si256((__m256i const *)&s[i]);
+    __m256i ok = _mm256_and_si256(
+                        _mm256_cmpgt_epi8(v,lo32),
+                        _mm256_cmpgt_epi8(hi32,v)
+                 );
+    if ((uint32_t)_mm256_movemask_epi8(ok) != 0xFFFFFFFFu)
+      break;
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i const lo16 = _mm_set1_epi8(0x1F);
+  __m128i const hi16 = _mm_set1_epi8(0x7F);
+  
+  for ( ; len - i >= 16 ; i += 16)
+  {
+    __m128i v  = _mm_loadu_si128((__m128i const *)&s[i]);
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v,lo16),_mm_cmplt_epi8(v,hi16));
+    if (_mm_movemask_epi8(ok) != 0xFFFF)
+      break;
+  }
+#endif
+  
+  for ( ; len - i >= 8 ; i += 8)
+  {
+    uint64_t w;
+    uint64_t bad;
+    
+    /*---------------------------------------------------------------------
+    ; Flag any byte with the high bit set, any byte below 0x20, and any
+    ; 0x7F.  The borrow from a flagged byte may flag others above it, but
+    ; an unflagged word is always all printable, which is all we need.
+    ;----------------------------------------------------------------------*/
+    
+    memcpy(&w,&s[i],sizeof(w));
+    bad = w
+        | ((w - 0x2020202020202020uLL) & ~w)
+        | (((w ^ 0x7F7F7F7F7F7F7F7FuLL) - 0x0101010101010101uLL) & ~(w ^ 0x7F7F7F7F7F7F7F7FuLL));
+    if ((bad & 0x8080808080808080uLL) != 0)
+      break;
+  }
+  
+  while((i < len) && (s[i] >= 0x20) && (s[i] <= 0x7E))
+    i++;
+    
+  return i;
+}
+
+/**************************************************************************
+* Check for valid UTF-8.  This follows the LPeg UTF8 expression that used
+* to live in cbor.lua exactly, including the allowed set of C0 control
+* codes (0x07 - 0x0D) and the lack of support for F4 lead bytes.  Runs of
+* printable ASCII go through cbor_ci_printable(); everything else is
+* checked one character at a time.
+***************************************************************************/
+
+static bool cbor_ci_isutf8(uint8_t const *s,size_t len)
+{
+  size_t i = 0;
+  
+  assert(s != NULL);
+  
+  while(i < len)
+  {
+    uint8_t c;
+    uint8_t lo   = 0x80;
+    uint8_t hi   = 0xBF;
+    size_t  more;
+    
+    if ((s[i] >= 0x20) && (s[i] <= 0x7E))
+    {
+      i += cbor_ci_printable(&s[i],len - i);
+      if (i == len)
+        break;
+    }
+    
+    c = s[i++];
+    
+    if (((c >= 0x07) && (c <= 0x0D)) || ((c >= 0x20) && (c <= 0x7E)))
+      continue;
+    else if ((c >= 0xC2) && (c <= 0xDF))
+      more = 1;
+    else if (c == 0xE0)
+    {
+      /*-------------------------------------------------------------------
+      ; The UTF8 expression also accepts E0 80..8E xx xx, so we follow suit.
+      ;--------------------------------------------------------------------*/
+      
+      if (i == len)
+        return false;
+      if (s[i] >= 0xA0)
+      {
+        more = 2;
+        lo   = 0xA0;
+      }
+      else
+      {
+        more = 3;
+        hi   = 0x8E;
+      }
+    }
+    else if ((c >= 0xE1) && (c <= 0xEC))
+      more = 2;
+    else if (c == 0xED)
+    {
+      more = 2;
+      hi   = 0x9F;
+    }
+    else if ((c >= 0xEE) && (c <= 0xEF))
+      more = 2;
+    else if (c == 0xF0)
+    {
+      more = 3;
+      lo   = 0x90;
+    }
+    else if ((c >= 0xF1) && (c <= 0xF3))
+      more = 3;
+    else
+      return false;
+    
+    if (len - i < more)
+      return false;
+    if ((s[i] < lo) || (s[i] > hi))
+      return false;
+    for (size_t j = 1 ; j < more ; j++)
+      if ((s[i + j] < 0x80) || (s[i + j] > 0xBF))
+        return false;
+    i += more;
+  }
+  
+  return true;
+}
+
+/******************************************************************
+* Usage:	okay = cbor_c.isutf8(s)
+* Desc:		Check if a string is valid UTF-8 text (as far as CBOR
+*		TEXT is concerned)
+* Input:	s (string) string to check
+* Return:	okay (boolean) true if valid UTF-8, false otherwise
+* Note:		This accepts the C0 control codes 0x07 through 0x0D and
+*		rejects the other C0 codes.
+*******************************************************************/
+
+static int cbor_clua_isutf8(lua_State *L)
+{
+  size_t      len;
+  char const *s = luaL_checklstring(L,1,&len);
+  
+  lua_pushboolean(L,cbor_ci_isutf8((uint8_t const *)s,len));
+  return 1;
+}
+
+/**************************************************************************
+* A key set holds the encoded form of a fixed set of MAP keys, computed
+* once.  The keys are kept in the user value of the key set, with [i] the
+* ith key, and [key] the encoded key.
+***************************************************************************/
+
+#define CBOR_KEYS	"org.conman.cbor_c:keys"
+
+typedef struct
+{
+  size_t count;
+  bool   ordered;
+} keys__s;
+
+/**************************************************************************
+* Return the key set at idx, or NULL if it isn't one.
+***************************************************************************/
+
+static keys__s *cbor_cL_tokeys(lua_State *L,int idx)
+{
+  keys__s *k;
+  
+  assert(L != NULL);
+  
+  k = lua_touserdata(L,idx);
+  if ((k == NULL) || !lua_getmetatable(L,idx))
+    return NULL;
+  luaL_getmetatable(L,CBOR_KEYS);
+  if (!lua_rawequal(L,-1,-2))
+    k = NULL;
+  lua_pop(L,2);
+  return k;
+}
+
+/******************************************************************
+* Usage:	ks = cbor_c.keys(list[,ordered])
+* Desc:		Create a key set for encoding MAPs
+* Input:	list (array) keys (strings)
+*		ordered (boolean/optional) encode keys in list order
+* Return:	ks (userdata) key set
+*
+* Note:		When encoding a MAP with a key set, keys in the set are
+*		copied as pre-encoded bytes.  If ordered, the keys in the
+*		set are encoded first, in list order, followed by any other
+*		keys.
+*******************************************************************/
+
+static int cbor_clua_keys(lua_State *L)
+{
+  keys__s *k;
+  size_t   n;
+  
+  assert(L != NULL);
+  
+  luaL_checktype(L,1,LUA_TTABLE);
+  lua_settop(L,2);
+  n = lua_rawlen(L,1);
+  
+  k          = lua_newuserdata(L,sizeof(keys__s));
+  k->count   = 0;
+  k->ordered = lua_toboolean(L,2);
+  luaL_getmetatable(L,CBOR_KEYS);
+  lua_setmetatable(L,-2);
+  
+  lua_createtable(L,n,n);
+  
+  for (size_t i = 1 ; i <= n ; i++)
+  {
+    buffer__u   hdr;
+    luaL_Buffer buf;
+    char const *s;
+    size_t      len;
+    size_t      hlen;
+    
+    lua_rawgeti(L,1,i);
+    if (lua_type(L,-1) != LUA_TSTRING)
+      return luaL_error(L,"key %d: expected string, got %s",(int)i,luaL_typename(L,-1));
+    
+    lua_pushvalue(L,-1);
+    lua_rawget(L,4);
+    if (!lua_isnil(L,-1))
+      return luaL_error(L,"key %d: duplicate key",(int)i);
+    lua_pop(L,1);
+    
+    s    = lua_tolstring(L,-1,&len);
+    hlen = cbor_ci_putvalue(hdr.b,cbor_ci_isutf8((uint8_t const *)s,len) ? 0x60 : 0x40,len);
+    
+    lua_pushvalue(L,-1);
+    lua_rawseti(L,4,++k->count);
+    luaL_buffinit(L,&buf);
+    luaL_addlstring(&buf,hdr.c,hlen);
+    luaL_addlstring(&buf,s,len);
+    luaL_pushresult(&buf);
+    lua_rawset(L,4);
+  }
+  
+#if LUA_VERSION_NUM == 501
+  lua_setfenv(L,3);
+#else
+  lua_setuservalue(L,3);
+#endif
+  return 1;
+}
+
+/**************************************************************************/
+
+static void cbor_cL_encode_value(encode__s *,int);
+
+/**************************************************************************
+* Append the string result of a Lua encoding function to the buffer, and
+* pop it from the stack.
+***************************************************************************/
+
+static void cbor_cL_encode_result(encode__s *e,char const *what)
+{
+  lua_State  *L = e->L;
+  char const *s;
+  size_t      len;
+  
+  assert(e    != NULL);
+  assert(what != NULL);
+  
+  if (lua_type(L,-1) != LUA_TSTRING)
+    luaL_error(L,"%s: expected string, got %s",what,luaL_typename(L,-1));
+  s = lua_tolstring(L,-1,&len);
+  cbor_cB_addlstring(L,e->buf,s,len);
+  lua_pop(L,1);
+}
+
+/**************************************************************************
+* Support for _shareable and _sharedref [1].  If the table at idx has
+* already been encoded, the _sharedref is encoded and true is returned.
+* Otherwise, it's marked as _shareable and recorded.  For packed encoding,
+* only the tables picked out to share are.
+*
+* [1] http://cbor.schmorp.de/value-sharing
+***************************************************************************/
+
+static bool cbor_cL_encode_sref(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  size_t     cnt;
+  
+  assert(e != NULL);
+  
+  if (!lua_toboolean(L,e->idx_sref))
+    return false;
+  
+  if (e->idx_share != 0)
+  {
+    lua_pushvalue(L,idx);
+    lua_rawget(L,e->idx_share);
+    if (lua_isnil(L,-1))
+    {
+      lua_pop(L,1);
+      return false;
+    }
+    lua_pop(L,1);
+  }
+  
+  if (e->srefs != NULL)
+  {
+    cbor_cL_refs_anchor(L,e->idx_sref,2);
+    lua_pushvalue(L,idx);
+    lua_rawget(L,-2);
+    if (!lua_isnil(L,-1))
+    {
+      cbor_cB_addvalue(L,e->buf,0xC0,29);
+      cbor_cB_addvalue(L,e->buf,0x00,(unsigned long long int)lua_tonumber(L,-1));
+      lua_pop(L,2);
+      return true;
+    }
+    lua_pop(L,1);
+    
+    cbor_cB_addvalue(L,e->buf,0xC0,28);
+    lua_pushvalue(L,idx);
+    lua_pushinteger(L,e->srefs->tcount++);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+    return false;
+  }
+  
+  lua_pushvalue(L,idx);
+  lua_rawget(L,e->idx_sref);
+  if (!lua_isnil(L,-1))
+  {
+    cbor_cB_addvalue(L,e->buf,0xC0,29);
+    cbor_cL_encode_value(e,-1);
+    lua_pop(L,1);
+    return true;
+  }
+  lua_pop(L,1);
+  
+  cbor_cB_addvalue(L,e->buf,0xC0,28);
+  cnt = lua_rawlen(L,e->idx_sref);
+  lua_pushvalue(L,idx);
+  lua_rawseti(L,e->idx_sref,cnt + 1);
+  lua_pushvalue(L,idx);
+  lua_pushinteger(L,cnt);
+  lua_rawset(L,e->idx_sref);
+  return false;
+}
+
+/**************************************************************************
+* Canonical encoding (RFC-8949 section 4.2.1).  Integers and floats are
+* always in their shortest form, so all that's left is to sort the keys of
+* each MAP by their encoded bytes.  Each entry is encoded in place, and
+* its position recorded as a slot.  Once the MAP is done, the slots are
+* sorted, the entries copied in order past the end of the buffer, and then
+* moved back.  The slots are kept in a stack, so nested MAPs just push
+* theirs on top.
+***************************************************************************/
+
+static void cbor_cL_encode_slot(encode__s *e,size_t koff,size_t voff)
+{
+  slot__s slot;
+  
+  assert(e    != NULL);
+  assert(koff <= voff);
+  
+  if (e->slots == NULL)
+    return;
+  
+  slot.key  = NULL;
+  slot.klen = voff - koff;
+  slot.off  = koff;
+  slot.len  = 0;
+  cbor_cB_addlstring(e->L,e->slots,(char const *)&slot,sizeof(slot));
+}
+
+/**************************************************************************/
+
+static int cbor_ci_encode_slotcmp(void const *a,void const *b)
+{
+  slot__s const *s1 = a;
+  slot__s const *s2 = b;
+  int            rc = memcmp(s1->key,s2->key,s1->klen < s2->klen ? s1->klen : s2->klen);
+  
+  if (rc != 0)
+    return rc;
+  return s1->klen < s2->klen ? -1 : s1->klen > s2->klen ? 1 : 0;
+}
+
+/**************************************************************************
+* Sort the MAP entries encoded from start, whose slots begin at base.
+***************************************************************************/
+
+static void cbor_cL_encode_sort(encode__s *e,size_t start,size_t base)
+{
+  lua_State *L = e->L;
+  slot__s   *slot;
+  size_t     n;
+  size_t     len;
+  char      *dst;
+  
+  assert(e != NULL);
+  
+  if (e->slots == NULL)
+    return;
+  
+  n   = (e->slots->used - base) / sizeof(slot__s);
+  len = e->buf->used - start;
+  
+  if (n > 1)
+  {
+    cbor_cB_reserve(L,e->buf,len);
+    slot = (slot__s *)&e->slots->data[base];
+    
+    for (size_t i = 0 ; i < n ; i++)
+    {
+      slot[i].key = &e->buf->data[slot[i].off];
+      slot[i].len = (i + 1 < n ? slot[i + 1].off : e->buf->used) - slot[i].off;
+    }
+    
+    qsort(slot,n,sizeof(slot__s),cbor_ci_encode_slotcmp);
+    dst = &e->buf->data[e->buf->used];
+    
+    for (size_t i = 0 ; i < n ; i++)
+    {
+      if ((i > 0) && (cbor_ci_encode_slotcmp(&slot[i - 1],&slot[i]) == 0))
+        luaL_error(L,"duplicate MAP key");
+      memcpy(dst,slot[i].key,slot[i].len);
+      dst += slot[i].len;
+    }
+    
+    memmove(&e->buf->data[start],&e->buf->data[e->buf->used],len);
+  }
+  
+  e->slots->used = base;
+}
+
+/**************************************************************************/
+
+static void cbor_cL_encode_enter(encode__s *e)
+{
+  assert(e != NULL);
+  
+  if (++e->depth > CBOR_MAXDEPTH)
+    luaL_error(e->L,"nesting too deep");
+  luaL_checkstack(e->L,8,"nesting too deep");
+}
+
+/**************************************************************************
+* Encode the items returned from a __pairs (or under Lua 5.2, __ipairs)
+* metamethod, which has been pushed onto the stack.  As we don't know the
+* count up front, the header is inserted after the fact.
+***************************************************************************/
+
+#if LUA_VERSION_NUM >= 502
+static void cbor_cL_encode_iter(encode__s *e,int idx,int type)
+{
+  lua_State              *L     = e->L;
+  size_t                  start = e->buf->used;
+  size_t                  sbase = e->slots != NULL ? e->slots->used : 0;
+  unsigned long long int  cnt   = 0;
+  int                     base;
+  
+  assert(e != NULL);
+  assert((type == 0x80) || (type == 0xA0));
+  
+  lua_pushvalue(L,idx);
+  lua_call(L,1,3);
+  base = lua_gettop(L) - 2;
+  
+  while(true)
+  {
+    lua_pushvalue(L,base);
+    lua_pushvalue(L,base + 1);
+    lua_pushvalue(L,base + 2);
+    lua_call(L,2,2);
+    if (lua_isnil(L,-2))
+    {
+      lua_pop(L,2);
+      break;
+    }
+    
+    if (type == 0xA0)
+    {
+      size_t koff = e->buf->used;
+      
+      cbor_cL_encode_value(e,-2);
+      cbor_cL_encode_slot(e,koff,e->buf->used);
+    }
+    cbor_cL_encode_value(e,-1);
+    lua_pop(L,1);
+    lua_replace(L,base + 2);
+    cnt++;
+  }
+  
+  lua_pop(L,3);
+  if (type == 0xA0)
+    cbor_cL_encode_sort(e,start,sbase);
+  cbor_cB_insertvalue(L,e->buf,start,type,cnt);
+}
+#endif
+
+/**************************************************************************/
+
+static void cbor_cL_encode_array(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  size_t     n;
+  
+  assert(e != NULL);
+  
+  if (cbor_cL_encode_sref(e,idx))
+    return;
+  
+  cbor_cL_encode_enter(e);
+  
+#if LUA_VERSION_NUM == 502
+  if (luaL_getmetafield(L,idx,"__ipairs"))
+  {
+    cbor_cL_encode_iter(e,idx,0x80);
+    e->depth--;
+    return;
+  }
+#endif
+  
+#if LUA_VERSION_NUM == 501
+  if ((lua_type(L,idx) != LUA_TTABLE) && luaL_callmeta(L,idx,"__len"))
+  {
+    n = lua_tointeger(L,-1);
+    lua_pop(L,1);
+  }
+  else
+    n = lua_rawlen(L,idx);
+#else
+  n = luaL_len(L,idx);
+#endif
+  
+  cbor_cB_addvalue(L,e->buf,0x80,n);
+  
+  for (size_t i = 1 ; i <= n ; i++)
+  {
+#if LUA_VERSION_NUM >= 503
+    lua_geti(L,idx,i);
+#else
+    if (lua_type(L,idx) == LUA_TTABLE)
+      lua_rawgeti(L,idx,i);
+    else
+    {
+      lua_pushinteger(L,i);
+      lua_gettable(L,idx);
+    }
+#endif
+    cbor_cL_encode_value(e,-1);
+    lua_pop(L,1);
+  }
+  
+  e->depth--;
+}
+
+/**************************************************************************/
+
+static void cbor_cL_encode_map(encode__s *e,int idx)
+{
+  lua_State              *L = e->L;
+  unsigned long long int  cnt;
+  size_t                  start;
+  size_t                  sbase;
+  
+  assert(e != NULL);
+  
+  if (cbor_cL_encode_sref(e,idx))
+    return;
+  
+  cbor_cL_encode_enter(e);
+  
+#if LUA_VERSION_NUM >= 502
+  if (luaL_getmetafield(L,idx,"__pairs"))
+  {
+    cbor_cL_encode_iter(e,idx,0xA0);
+    e->depth--;
+    return;
+  }
+#endif
+  
+  luaL_checktype(L,idx,LUA_TTABLE);
+  
+  cnt = 0;
+  lua_pushnil(L);
+  while(lua_next(L,idx) != 0)
+  {
+    lua_pop(L,1);
+    cnt++;
+  }
+  
+  cbor_cB_addvalue(L,e->buf,0xA0,cnt);
+  start = e->buf->used;
+  sbase = e->slots != NULL ? e->slots->used : 0;
+  
+  lua_pushnil(L);
+  while(lua_next(L,idx) != 0)
+  {
+    size_t koff = e->buf->used;
+    
+    cbor_cL_encode_value(e,-2);
+    cbor_cL_encode_slot(e,koff,e->buf->used);
+    cbor_cL_encode_value(e,-1);
+    lua_pop(L,1);
+  }
+  
+  cbor_cL_encode_sort(e,start,sbase);
+  e->depth--;
+}
+
+/**************************************************************************
+* Encode the table at idx as a MAP using the key set at kidx.  Keys in the
+* set are copied pre-encoded, unless string references are in use (since
+* the keys then need to be recorded).
+***************************************************************************/
+
+static void cbor_cL_encode_keyed(encode__s *e,int idx,int kidx)
+{
+  lua_State              *L = e->L;
+  keys__s                *k = lua_touserdata(L,kidx);
+  unsigned long long int  cnt;
+  size_t                  start;
+  size_t                  sbase;
+  bool                    copy;
+  int                     tidx;
+  
+  assert(e != NULL);
+  assert(k != NULL);
+  
+  idx  = lua_absindex(L,idx);
+  kidx = lua_absindex(L,kidx);
+  
+  if (cbor_cL_encode_sref(e,idx))
+    return;
+  
+  cbor_cL_encode_enter(e);
+  luaL_checktype(L,idx,LUA_TTABLE);
+  
+  copy = !lua_toboolean(L,e->idx_stref) && (e->au == NULL);
+  
+#if LUA_VERSION_NUM == 501
+  lua_getfenv(L,kidx);
+#else
+  lua_getuservalue(L,kidx);
+#endif
+  tidx  = lua_gettop(L);
+  cnt   = 0;
+  start = e->buf->used;
+  sbase = e->slots != NULL ? e->slots->used : 0;
+  
+  if (k->ordered)
+  {
+    for (size_t i = 1 ; i <= k->count ; i++)
+    {
+      lua_rawgeti(L,tidx,i);
+      lua_pushvalue(L,-1);
+      lua_rawget(L,idx);
+      if (!lua_isnil(L,-1))
+      {
+        size_t koff = e->buf->used;
+        
+        if (copy)
+        {
+          size_t      len;
+          char const *enc;
+          
+          lua_pushvalue(L,-2);
+          lua_rawget(L,tidx);
+          enc = lua_tolstring(L,-1,&len);
+          cbor_cB_addlstring(L,e->buf,enc,len);
+          lua_pop(L,1);
+        }
+        else
+          cbor_cL_encode_value(e,-2);
+        cbor_cL_encode_slot(e,koff,e->buf->used);
+        cbor_cL_encode_value(e,-1);
+        cnt++;
+      }
+      lua_pop(L,2);
+    }
+  }
+  
+  lua_pushnil(L);
+  while(lua_next(L,idx) != 0)
+  {
+    size_t koff  = e->buf->used;
+    bool   inset = false;
+    
+    if (lua_type(L,-2) == LUA_TSTRING)
+    {
+      lua_pushvalue(L,-2);
+      lua_rawget(L,tidx);
+      inset = !lua_isnil(L,-1);
+      if (inset && !k->ordered)
+      {
+        if (copy)
+        {
+          size_t      len;
+          char const *enc = lua_tolstring(L,-1,&len);
+          cbor_cB_addlstring(L,e->buf,enc,len);
+        }
+        else
+          cbor_cL_encode_value(e,-3);
+        cbor_cL_encode_slot(e,koff,e->buf->used);
+        cbor_cL_encode_value(e,-2);
+        cnt++;
+      }
+      lua_pop(L,1);
+    }
+    
+    if (!inset)
+    {
+      cbor_cL_encode_value(e,-2);
+      cbor_cL_encode_slot(e,koff,e->buf->used);
+      cbor_cL_encode_value(e,-1);
+      cnt++;
+    }
+    lua_pop(L,1);
+  }
+  
+  lua_pop(L,1);
+  cbor_cL_encode_sort(e,start,sbase);
+  cbor_cB_insertvalue(L,e->buf,start,0xA0,cnt);
+  e->depth--;
+}
+
+/**************************************************************************
+* Copy the raw value at idx into the output.  Strings inside it aren't
+* known to the string references being used, so it's placed in a new
+* _stringref namespace, keeping the decoder's references in step.
+***************************************************************************/
+
+static void cbor_cL_encode_raw(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  
+  assert(e != NULL);
+  
+  if (e->au != NULL)
+    e->au->raws++;
+  if (lua_toboolean(L,e->idx_stref))
+    cbor_cB_addvalue(L,e->buf,0xC0,256);
+  lua_rawgeti(L,idx,1);
+  cbor_cL_encode_result(e,"raw");
+}
+
+/**************************************************************************
+* Mimic generic() in cbor.lua (or the 'table' encoder in cbor_s.lua if
+* we're in plain mode).
+***************************************************************************/
+
+static void cbor_cL_encode_generic(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  
+  assert(e != NULL);
+  
+  if (!lua_getmetatable(L,idx))
+  {
+    if (lua_type(L,idx) != LUA_TTABLE)
+      luaL_error(L,"Cannot encode %s",luaL_typename(L,idx));
+    if (lua_rawlen(L,idx) > 0)
+      cbor_cL_encode_array(e,idx);
+    else
+      cbor_cL_encode_map(e,idx);
+    return;
+  }
+  
+  luaL_getmetatable(L,CBOR_RAW);
+  if (lua_rawequal(L,-1,-2))
+  {
+    lua_pop(L,2);
+    cbor_cL_encode_raw(e,idx);
+    return;
+  }
+  lua_pop(L,1);
+  
+  lua_getfield(L,-1,"__cborkeys");
+  if (cbor_cL_tokeys(L,-1) != NULL)
+  {
+    cbor_cL_encode_keyed(e,idx,-1);
+    lua_pop(L,2);
+    return;
+  }
+  lua_pop(L,1);
+  
+  lua_getfield(L,-1,"__tocbor");
+  if (!lua_isnil(L,-1))
+  {
+    lua_pushvalue(L,idx);
+    if (e->plain)
+      lua_call(L,1,1);
+    else
+    {
+      lua_pushvalue(L,e->idx_sref);
+      lua_pushvalue(L,e->idx_stref);
+      lua_call(L,3,1);
+    }
+    cbor_cL_encode_result(e,"__tocbor");
+    lua_pop(L,1);
+    return;
+  }
+  lua_pop(L,1);
+  
+  if (e->plain)
+  {
+    lua_pop(L,1);
+    if (lua_type(L,idx) != LUA_TTABLE)
+      luaL_error(L,"Cannot encode %s",luaL_typename(L,idx));
+#if LUA_VERSION_NUM == 501
+    if (lua_rawlen(L,idx) > 0)
+#else
+    if (luaL_len(L,idx) > 0)
+#endif
+      cbor_cL_encode_array(e,idx);
+    else
+      cbor_cL_encode_map(e,idx);
+    return;
+  }
+  
+  lua_getfield(L,-1,"__len");
+#if LUA_VERSION_NUM == 502
+  if (lua_isnil(L,-1))
+  {
+    lua_pop(L,1);
+    lua_getfield(L,-1,"__ipairs");
+  }
+#endif
+  if (!lua_isnil(L,-1))
+  {
+    lua_pop(L,2);
+    cbor_cL_encode_array(e,idx);
+    return;
+  }
+  lua_pop(L,1);
+  
+#if LUA_VERSION_NUM >= 502
+  lua_getfield(L,-1,"__pairs");
+  if (!lua_isnil(L,-1))
+  {
+    lua_pop(L,2);
+    cbor_cL_encode_map(e,idx);
+    return;
+  }
+  lua_pop(L,1);
+#endif
+  
+  lua_pop(L,1);
+  luaL_error(L,"Cannot encode %s",luaL_typename(L,idx));
+}
+
+/**************************************************************************/
+
+static void cbor_cL_encode_number(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  
+  assert(e != NULL);
+  
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L,idx))
+  {
+    lua_Integer i = lua_tointeger(L,idx);
+    if (i < 0)
+      cbor_cB_addvalue(L,e->buf,0x20,(unsigned long long int)~i);
+    else
+      cbor_cB_addvalue(L,e->buf,0x00,(unsigned long long int)i);
+    return;
+  }
+#else
+  {
+    lua_Number n = lua_tonumber(L,idx);
+    if ((n >= -9007199254740992.0) && (n <= 9007199254740992.0) && (floor(n) == n))
+    {
+      if (n < 0)
+        cbor_cB_addvalue(L,e->buf,0x20,(unsigned long long int)(-1.0 - n));
+      else
+        cbor_cB_addvalue(L,e->buf,0x00,(unsigned long long int)n);
+      return;
+    }
+  }
+#endif
+  
+  cbor_cB_addfloat(L,e->buf,lua_tonumber(L,idx));
+}
+
+/**************************************************************************
+* Record the string at idx for packed encoding.  Strings too short to ever
+* be referenced aren't.
+***************************************************************************/
+
+static void cbor_cL_encode_record(encode__s *e,int idx,size_t len)
+{
+  lua_State *L  = e->L;
+  auto__s   *au = e->au;
+  strocc__s  occ;
+  
+  assert(e  != NULL);
+  assert(au != NULL);
+  
+  if (len < cbor_ci_mstrlen(0))
+    return;
+  
+  lua_pushvalue(L,idx);
+  lua_rawget(L,au->idx_strs);
+  if (lua_isnil(L,-1))
+  {
+    occ.id = au->nstrs++;
+    lua_pushvalue(L,idx);
+    lua_pushinteger(L,occ.id);
+    lua_rawset(L,au->idx_strs);
+  }
+  else
+    occ.id = (size_t)lua_tointeger(L,-1);
+  lua_pop(L,1);
+  
+  occ.len = len;
+  cbor_cB_addlstring(L,au->seq,(char const *)&occ,sizeof(occ));
+}
+
+/**************************************************************************
+* Encode the table at idx for the first pass of packed encoding, counting
+* it, and noting its size the first time through.  A table found inside
+* itself isn't encoded again (it will have to be shared).
+***************************************************************************/
+
+static void cbor_cL_encode_counted(encode__s *e,int idx)
+{
+  lua_State  *L  = e->L;
+  auto__s    *au = e->au;
+  tabinfo__s *ti;
+  size_t      id;
+  size_t      start;
+  
+  assert(e  != NULL);
+  assert(au != NULL);
+  
+  lua_pushvalue(L,idx);
+  lua_rawget(L,au->idx_tabs);
+  if (lua_isnil(L,-1))
+  {
+    tabinfo__s nti = { 0 , 0 , false , false };
+    
+    cbor_cB_addlstring(L,au->tabs,(char const *)&nti,sizeof(nti));
+    id = ++au->ntabs;
+    lua_pushvalue(L,idx);
+    lua_pushinteger(L,id);
+    lua_rawset(L,au->idx_tabs);
+    lua_pushvalue(L,idx);
+    lua_rawseti(L,au->idx_tabs,id);
+  }
+  else
+    id = (size_t)lua_tointeger(L,-1);
+  lua_pop(L,1);
+  
+  ti = &((tabinfo__s *)au->tabs->data)[id - 1];
+  ti->count++;
+  if (ti->open)
+  {
+    ti->cycle = true;
+    return;
+  }
+  
+  ti->open = true;
+  start    = e->buf->used;
+  cbor_cL_encode_generic(e,idx);
+  
+  /*---------------------------------------------------------------------
+  ; The tabinfo__s array may have moved while encoding.
+  ;----------------------------------------------------------------------*/
+  
+  ti       = &((tabinfo__s *)au->tabs->data)[id - 1];
+  ti->open = false;
+  if (ti->count == 1)
+    ti->size = e->buf->used - start;
+}
+
+/**************************************************************************
+* Encode a string as TEXT or BIN (type of 0x60 or 0x40; if -1, TEXT if valid
+* UTF-8, else BIN), taking string references into account (see encbintext()
+* in cbor.lua).
+***************************************************************************/
+
+static void cbor_cL_encode_string(encode__s *e,int idx,int type)
+{
+  lua_State  *L = e->L;
+  char const *s;
+  size_t      len;
+  size_t      cnt;
+  
+  assert(e != NULL);
+  assert((type == -1) || (type == 0x40) || (type == 0x60));
+  
+  s = lua_tolstring(L,idx,&len);
+  
+  if (e->au != NULL)
+    cbor_cL_encode_record(e,idx,len);
+  
+  if (e->strefs != NULL)
+  {
+    uint32_t hash = cbor_ci_hash(s,len);
+    size_t   ref  = cbor_ci_refs_find(e->strefs,s,len,hash);
+    
+    if (ref > 0)
+    {
+      cbor_cB_addvalue(L,e->buf,0xC0,25);
+      cbor_cB_addvalue(L,e->buf,0x00,ref - 1);
+      return;
+    }
+    
+    if (type == -1)
+      type = cbor_ci_isutf8((uint8_t const *)s,len) ? 0x60 : 0x40;
+    if (len >= cbor_ci_mstrlen(cbor_ci_refs_count(e->strefs)))
+      cbor_cL_refs_add(L,e->strefs,e->idx_stref,idx,hash,type == 0x60);
+  }
+  else if (lua_toboolean(L,e->idx_stref))
+  {
+    lua_pushvalue(L,idx);
+    lua_rawget(L,e->idx_stref);
+    if (lua_type(L,-1) == LUA_TNUMBER)
+    {
+      cbor_cB_addvalue(L,e->buf,0xC0,25);
+      cbor_cB_addvalue(L,e->buf,0x00,(unsigned long long int)lua_tonumber(L,-1));
+      lua_pop(L,1);
+      return;
+    }
+    lua_pop(L,1);
+    
+    cnt = lua_rawlen(L,e->idx_stref);
+    if (len >= cbor_ci_mstrlen(cnt))
+    {
+      lua_pushvalue(L,idx);
+      lua_rawseti(L,e->idx_stref,cnt + 1);
+      lua_pushvalue(L,idx);
+      lua_pushinteger(L,cnt);
+      lua_rawset(L,e->idx_stref);
+    }
+  }
+  
+  if (type == -1)
+    type = cbor_ci_isutf8((uint8_t const *)s,len) ? 0x60 : 0x40;
+  cbor_cB_addvalue(L,e->buf,type,len);
+  cbor_cB_addlstring(L,e->buf,s,len);
+}
+
+/**************************************************************************
+* Encode the value at idx.  This mimics encode() in cbor.lua, only calling
+* into Lua if a function in __ENCODE_MAP has been replaced.
+***************************************************************************/
+
+static void cbor_cL_encode_value(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  int        type;
+  
+  assert(e != NULL);
+  
+  idx = lua_absindex(L,idx);
+  
+  if (lua_rawequal(L,idx,e->idx_null))
+  {
+    cbor_cB_addlstring(L,e->buf,"\xF6",1);
+    return;
+  }
+  
+  if (lua_rawequal(L,idx,e->idx_undefined))
+  {
+    cbor_cB_addlstring(L,e->buf,"\xF7",1);
+    return;
+  }
+  
+  type = lua_type(L,idx);
+  lua_getfield(L,e->idx_map,lua_typename(L,type));
+  lua_getfield(L,e->idx_stock,lua_typename(L,type));
+  
+  if (
+          !lua_rawequal(L,-1,-2)
+       || ((type == LUA_TSTRING) && e->hookstr)
+       || ((type == LUA_TTABLE)  && e->hooktab)
+     )
+  {
+    lua_pop(L,1);
+    lua_pushvalue(L,idx);
+    lua_pushvalue(L,e->idx_sref);
+    lua_pushvalue(L,e->idx_stref);
+    lua_call(L,3,1);
+    cbor_cL_encode_result(e,"__ENCODE_MAP");
+    return;
+  }
+  lua_pop(L,2);
+  
+  switch(type)
+  {
+    case LUA_TNIL:
+         cbor_cB_addlstring(L,e->buf,"\xF6",1);
+         break;
+         
+    case LUA_TBOOLEAN:
+         cbor_cB_addlstring(L,e->buf,lua_toboolean(L,idx) ? "\xF5" : "\xF4",1);
+         break;
+         
+    case LUA_TNUMBER:
+         cbor_cL_encode_number(e,idx);
+         break;
+         
+    case LUA_TSTRING:
+         cbor_cL_encode_string(e,idx,-1);
+         break;
+         
+    case LUA_TTABLE:
+         if ((e->au != NULL) && e->au->counting)
+           cbor_cL_encode_counted(e,idx);
+         else
+           cbor_cL_encode_generic(e,idx);
+         break;
+         
+    default:
+         cbor_cL_encode_generic(e,idx);
+         break;
+  }
+}
+
+/**************************************************************************
+* Check if ctx.TYPE[name] (at -2) has been replaced, that is, it's not the
+* same as ctx.STOCKTYPE[name] (at -1).
+***************************************************************************/
+
+static bool cbor_cL_encode_hooked(lua_State *L,char const *name)
+{
+  bool same;
+  
+  assert(L    != NULL);
+  assert(name != NULL);
+  
+  lua_getfield(L,-2,name);
+  lua_getfield(L,-2,name);
+  same = lua_rawequal(L,-1,-2);
+  lua_pop(L,2);
+  return !same;
+}
+
+/**************************************************************************
+* Set up an encode__s from the encoding context at ctx, and the sref and
+* stref tables at the given indices.  The fields of the context are pushed
+* onto the stack, followed by the slot buffer for canonical encoding (or
+* nil); the caller supplies the buffer.
+***************************************************************************/
+
+static void cbor_cL_encode_init(
+        encode__s *e,
+        lua_State *L,
+        int        ctx,
+        int        sref,
+        int        stref
+)
+{
+  int top;
+  
+  assert(e != NULL);
+  assert(L != NULL);
+  
+  luaL_checktype(L,ctx,LUA_TTABLE);
+  lua_getfield(L,ctx,"packed");
+  e->packed = lua_toboolean(L,-1);
+  lua_pop(L,1);
+  
+  /*---------------------------------------------------------------------
+  ; If cbor.TYPE.TEXT(), BIN(), ARRAY() or MAP() have been replaced,
+  ; strings (or tables) go through __ENCODE_MAP, which calls them.
+  ;----------------------------------------------------------------------*/
+  
+  e->hookstr = false;
+  e->hooktab = false;
+  lua_getfield(L,ctx,"TYPE");
+  lua_getfield(L,ctx,"STOCKTYPE");
+  if (lua_istable(L,-2) && lua_istable(L,-1))
+  {
+    e->hookstr = cbor_cL_encode_hooked(L,"TEXT")  || cbor_cL_encode_hooked(L,"BIN");
+    e->hooktab = cbor_cL_encode_hooked(L,"ARRAY") || cbor_cL_encode_hooked(L,"MAP");
+  }
+  lua_pop(L,2);
+  top = lua_gettop(L);
+  
+  lua_getfield(L,ctx,"__ENCODE_MAP");
+  lua_getfield(L,ctx,"STOCK");
+  lua_getfield(L,ctx,"null");
+  lua_getfield(L,ctx,"undefined");
+  lua_getfield(L,ctx,"plain");
+  lua_getfield(L,ctx,"canonical");
+  
+  e->L             = L;
+  e->buf           = NULL;
+  e->idx_sref      = sref;
+  e->idx_stref     = stref;
+  e->idx_map       = top + 1;
+  e->idx_stock     = top + 2;
+  e->idx_null      = top + 3;
+  e->idx_undefined = top + 4;
+  e->idx_share     = 0;
+  e->srefs         = cbor_cL_torefs(L,sref);
+  e->strefs        = cbor_cL_torefs(L,stref);
+  e->slots         = NULL;
+  e->au            = NULL;
+  e->plain         = lua_toboolean(L,-2);
+  e->depth         = 0;
+  
+  luaL_checktype(L,e->idx_map,LUA_TTABLE);
+  luaL_checktype(L,e->idx_stock,LUA_TTABLE);
+  
+  if (e->packed && (lua_toboolean(L,sref) || lua_toboolean(L,stref)))
+    luaL_error(L,"packed encoding makes its own references");
+  
+  /*---------------------------------------------------------------------
+  ; References are numbered in the order they're encoded, which sorting
+  ; the MAP keys would upset.
+  ;----------------------------------------------------------------------*/
+  
+  if (lua_toboolean(L,-1))
+  {
+    if (lua_toboolean(L,sref) || lua_toboolean(L,stref))
+      luaL_error(L,"canonical encoding doesn't support references");
+    lua_pop(L,2);
+    e->slots = cbor_cL_newbuffer(L);
+  }
+  else
+  {
+    lua_pop(L,2);
+    lua_pushnil(L);
+  }
+}
+
+/**************************************************************************
+* Encode the value at idx as cbor.encode() would, including the _stringref
+* tag when string references are in use.
+***************************************************************************/
+
+static void cbor_cL_encode_top(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  
+  assert(e != NULL);
+  
+  /*--------------------------------------------------------------
+  ; Per encode() in cbor.lua, null and undefined don't trigger the
+  ; _stringref tag.
+  ;---------------------------------------------------------------*/
+  
+  if (
+          lua_toboolean(L,e->idx_stref)
+       && !lua_rawequal(L,idx,e->idx_null)
+       && !lua_rawequal(L,idx,e->idx_undefined)
+     )
+  {
+    if (e->strefs != NULL)
+    {
+      if (!e->strefs->seen)
+      {
+        cbor_cB_addvalue(L,e->buf,0xC0,256);
+        e->strefs->seen = true;
+      }
+    }
+    else
+    {
+      lua_getfield(L,e->idx_stref,"SEEN");
+      if (!lua_toboolean(L,-1))
+      {
+        cbor_cB_addvalue(L,e->buf,0xC0,256);
+        lua_pushboolean(L,1);
+        lua_setfield(L,e->idx_stref,"SEEN");
+      }
+      lua_pop(L,1);
+    }
+  }
+  
+  cbor_cL_encode_value(e,idx);
+}
+
+/**************************************************************************
+* The CBOR header for a length of n takes cbor_ci_mstrlen(n) - 2 bytes; a
+* reference (_nthstring or _sharedref) to index n takes cbor_ci_mstrlen(n)
+* bytes (two for the tag).
+*
+* Push a table of the tables worth sharing after the first pass of packed
+* encoding, and return how many there are.  A table found inside itself has
+* to be shared; otherwise, it's shared if the references cost less than
+* encoding it again each time.
+***************************************************************************/
+
+static size_t cbor_cL_encode_shares(lua_State *L,auto__s const *au)
+{
+  tabinfo__s const *ti = (tabinfo__s const *)au->tabs->data;
+  size_t            n  = 0;
+  
+  assert(L  != NULL);
+  assert(au != NULL);
+  
+  lua_newtable(L);
+  
+  for (size_t id = 1 ; id <= au->ntabs ; id++ , ti++)
+  {
+    size_t again = ti->count - 1;
+    
+    if (
+            ti->cycle
+         || ((again > 0) && (again * ti->size > 2 + again * cbor_ci_mstrlen(n)))
+       )
+    {
+      lua_rawgeti(L,au->idx_tabs,id);
+      lua_pushboolean(L,true);
+      lua_rawset(L,-3);
+      n++;
+    }
+  }
+  
+  return n;
+}
+
+/**************************************************************************
+* Return true if string references would save space.  The strings recorded
+* are replayed in order, assigning references as the decoder would (every
+* string long enough gets one, used or not), against the cost of the
+* _stringref tag, and the one around each raw value.
+***************************************************************************/
+
+static bool cbor_cL_encode_profitable(lua_State *L,auto__s const *au)
+{
+  strocc__s const *occ  = (strocc__s const *)au->seq->data;
+  size_t           n    = au->seq->used / sizeof(strocc__s);
+  size_t           cost = 3 + 3 * au->raws;
+  size_t           save = 0;
+  size_t           cnt  = 0;
+  buffer__s       *buf;
+  size_t          *refs;
+  
+  assert(L  != NULL);
+  assert(au != NULL);
+  
+  if (n < 2)
+    return false;
+  
+  buf = cbor_cL_newbuffer(L);
+  cbor_cB_reserve(L,buf,au->nstrs * sizeof(size_t));
+  refs = (size_t *)buf->data;
+  memset(refs,0,au->nstrs * sizeof(size_t));
+  
+  for (size_t i = 0 ; i < n ; i++ , occ++)
+  {
+    size_t ref = refs[occ->id];
+    
+    if (ref > 0)
+      save += cbor_ci_mstrlen(occ->len) - 2 + occ->len - cbor_ci_mstrlen(ref - 1);
+    else if (occ->len >= cbor_ci_mstrlen(cnt))
+      refs[occ->id] = ++cnt;
+  }
+  
+  cbor_cB_free(L,buf);
+  lua_pop(L,1);
+  return save > cost;
+}
+
+/**************************************************************************
+* Encode the value at idx, using _sharedref and _stringref only where they
+* pay for themselves.  The first pass encodes without references, counting
+* the tables and recording the strings.  If any tables are worth sharing,
+* a second pass encodes with those shared, to record the strings as they'll
+* actually be encoded.  Then, if string references save space, a last pass
+* encodes with them.  Each pass starts the buffer afresh, and the result of
+* the last one stands.
+***************************************************************************/
+
+static void cbor_cL_encode_packed(encode__s *e,int idx)
+{
+  lua_State *L = e->L;
+  auto__s    au;
+  bool       share;
+  
+  assert(e != NULL);
+  
+  lua_newtable(L);
+  au.idx_tabs = lua_gettop(L);
+  lua_newtable(L);
+  au.idx_strs = lua_gettop(L);
+  au.tabs     = cbor_cL_newbuffer(L);
+  au.seq      = cbor_cL_newbuffer(L);
+  au.ntabs    = 0;
+  au.nstrs    = 0;
+  au.raws     = 0;
+  au.counting = true;
+  
+  e->au = &au;
+  cbor_cL_encode_value(e,idx);
+  
+  share = cbor_cL_encode_shares(L,&au) > 0;
+  if (share)
+  {
+    e->idx_share = lua_gettop(L);
+    lua_newtable(L);
+    lua_replace(L,e->idx_sref);
+    e->buf->used = 0;
+    au.seq->used = 0;
+    au.raws      = 0;
+    au.counting  = false;
+    cbor_cL_encode_value(e,idx);
+  }
+  e->au = NULL;
+  
+  if (cbor_cL_encode_profitable(L,&au))
+  {
+    if (share)
+    {
+      lua_newtable(L);
+      lua_replace(L,e->idx_sref);
+    }
+    lua_newtable(L);
+    lua_replace(L,e->idx_stref);
+    e->buf->used = 0;
+    cbor_cL_encode_top(e,idx);
+  }
+}
+
+/******************************************************************
+* Usage:	blob = cbor_c.encode_all(value,sref,stref,ctx[,how][,keys])
+* Desc:		Encode a complete Lua value into CBOR
+* Input:	value (any) value to encode
+*		sref (table/optional) shared reference table
+*		stref (table/optional) shared string reference table
+*		ctx (table) encoding context (see note)
+*		how (integer/optional) 0x80 or 0xA0 (see note)
+*		keys (userdata/optional) key set for MAP (see cbor_c.keys())
+* Return:	blob (binary) CBOR encoded value
+*
+* Note:		ctx.__ENCODE_MAP is consulted for each value.  If the
+*		function for a type is the same as ctx.STOCK[type], the
+*		value is encoded natively; otherwise the function is called.
+*		Strings (or tables) also go through ctx.__ENCODE_MAP if
+*		ctx.TYPE.TEXT or BIN (or ARRAY or MAP) differ from those in
+*		ctx.STOCKTYPE.  ctx.null and ctx.undefined are the sentinel
+*		values for the CBOR null and undefined values (compared with
+*		rawequal()).  If ctx.plain is true, only
+*		__tocbor(value) is supported on tables; otherwise the rules
+*		of generic() in cbor.lua are followed.  If ctx.canonical is
+*		true, the keys of MAPs are sorted by their encoded bytes
+*		(RFC-8949 deterministic encoding).  If ctx.packed is true
+*		(and how is nil), _sharedref and _stringref are used only
+*		where they save space; sref and stref must then be nil.
+*
+*		If how is nil, this behaves as cbor.encode(); if 0x40, 0x60,
+*		0x80 or 0xA0, value is encoded as a CBOR BIN, TEXT, ARRAY or
+*		MAP (as cbor.TYPE.BIN() and the rest).
+*
+*		sref and stref can also be reference contexts (see
+*		cbor_c.refs()).  A table whose metatable has a __cborkeys
+*		field holding a key set is encoded as a MAP with that key
+*		set.
+*
+* Note:		Throws on error.
+*******************************************************************/
+
+static int cbor_clua_encode_all(lua_State *L)
+{
+  encode__s e;
+  
+  assert(L != NULL);
+  
+  lua_settop(L,6);
+  cbor_cL_encode_init(&e,L,4,2,3);
+  e.buf = cbor_cL_newbuffer(L);
+  
+  if (lua_isnil(L,5))
+  {
+    if (e.packed)
+      cbor_cL_encode_packed(&e,1);
+    else
+      cbor_cL_encode_top(&e,1);
+  }
+  else
+  {
+    switch(luaL_checkinteger(L,5))
+    {
+      case 0x40:
+      case 0x60: luaL_checktype(L,1,LUA_TSTRING);
+                 cbor_cL_encode_string(&e,1,lua_tointeger(L,5));
+                 break;
+      case 0x80: cbor_cL_encode_array(&e,1);                    break;
+      case 0xA0: if (cbor_cL_tokeys(L,6) != NULL)
+                   cbor_cL_encode_keyed(&e,1,6);
+                 else
+                   cbor_cL_encode_map(&e,1);
+                 break;
+      default:   return luaL_error(L,"invalid type %d",lua_tointeger(L,5));
+    }
+  }
+  
+  lua_pushlstring(L,e.buf->data != NULL ? e.buf->data : "",e.buf->used);
+  cbor_cB_free(L,e.buf);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	blob = cbor_c.encode_seq(list,sref,stref,ctx)
+* Desc:		Encode an array of values as a CBOR sequence (RFC-8742)
+* Input:	list (table) array of values (count in field 'n' if present)
+*		sref (table/optional) shared reference table
+*		stref (table/optional) shared string reference table
+*		ctx (table) encoding context (see cbor_c.encode_all())
+* Return:	blob (binary) CBOR encoded values, back to back
+*
+* Note:		This is the same as calling cbor_c.encode_all() on each
+*		value in turn with the same sref and stref, but into one
+*		buffer.  Throws on error.
+*******************************************************************/
+
+static int cbor_clua_encode_seq(lua_State *L)
+{
+  encode__s e;
+  size_t    n;
+  
+  assert(L != NULL);
+  
+  lua_settop(L,6);
+  luaL_checktype(L,1,LUA_TTABLE);
+  cbor_cL_encode_init(&e,L,4,2,3);
+  e.buf = cbor_cL_newbuffer(L);
+  
+  lua_getfield(L,1,"n");
+  if (lua_isnumber(L,-1))
+  {
+    lua_Number cnt = lua_tonumber(L,-1);
+    
+    luaL_argcheck(L,(cnt >= 0) && (cnt <= INT_MAX) && (floor(cnt) == cnt),1,"bad count in field 'n'");
+    n = (size_t)cnt;
+  }
+  else
+    n = lua_rawlen(L,1);
+  lua_pop(L,1);
+  
+  for (size_t i = 1 ; i <= n ; i++)
+  {
+    lua_rawgeti(L,1,i);
+    cbor_cL_encode_top(&e,lua_gettop(L));
+    lua_pop(L,1);
+  }
+  
+  lua_pushlstring(L,e.buf->data != NULL ? e.buf->data : "",e.buf->used);
+  cbor_cB_free(L,e.buf);
+  return 1;
+}
+
+/**************************************************************************
+*
+*                            OUTPUT BUFFERS
+*
+* cbor_c.buffer() hands the internal buffer to Lua, with methods to append
+* each CBOR type.  A message can then be built up without creating (and
+* concatenating) a Lua string for each piece, and the buffer reused with
+* b:reset() so its memory is only allocated once.
+*
+***************************************************************************/
+
+/**************************************************************************
+* Return the bytes of a string, or of a buffer, at idx.
+***************************************************************************/
+
+static char const *cbor_cL_checkbytes(lua_State *L,int idx,size_t *plen)
+{
+  assert(L    != NULL);
+  assert(plen != NULL);
+  
+  if (lua_type(L,idx) == LUA_TUSERDATA)
+  {
+    buffer__s *buf = luaL_checkudata(L,idx,CBOR_BUFFER);
+    *plen = buf->used;
+    return buf->data != NULL ? buf->data : "";
+  }
+  
+  return luaL_checklstring(L,idx,plen);
+}
+
+/**************************************************************************
+* Return the value at idx as a CBOR integer value.  Lua 5.3 and higher
+* keep all 64 bits of integers (which may wrap, as with cbor_cL_pushuint()).
+***************************************************************************/
+
+static unsigned long long int cbor_cL_checkvalue(lua_State *L,int idx)
+{
+  assert(L != NULL);
+  
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L,idx))
+    return (unsigned long long int)lua_tointeger(L,idx);
+#endif
+  return (unsigned long long int)luaL_checknumber(L,idx);
+}
+
+/******************************************************************
+* Usage:	b = cbor_c.buffer()
+* Desc:		Create an empty output buffer
+* Return:	b (userdata) buffer
+*******************************************************************/
+
+static int cbor_clua_buffer(lua_State *L)
+{
+  cbor_cL_newbuffer(L);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	b = b:uint(n)
+*		b = b:nint(n)
+*		b = b:tag(n)
+*		b = b:simple(n)
+* Desc:		Append a CBOR UINT, NINT (n is negative), TAG or SIMPLE
+* Input:	n (integer) value
+* Return:	b (userdata) buffer
+*******************************************************************/
+
+static int cbor_clua_buffer_uint(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  cbor_cB_addvalue(L,buf,0x00,cbor_cL_checkvalue(L,2));
+  lua_settop(L,1);
+  return 1;
+}
+
+static int cbor_clua_buffer_nint(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  
+  unsigned long long int value;
+  
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L,2))
+    value = (unsigned long long int)~lua_tointeger(L,2); /* -1 - n */
+  else
+#endif
+  value = (unsigned long long int)(-1.0 - luaL_checknumber(L,2));
+  
+  cbor_cB_addvalue(L,buf,0x20,value);
+  lua_settop(L,1);
+  return 1;
+}
+
+static int cbor_clua_buffer_tag(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  cbor_cB_addvalue(L,buf,0xC0,cbor_cL_checkvalue(L,2));
+  lua_settop(L,1);
+  return 1;
+}
+
+static int cbor_clua_buffer_simple(lua_State *L)
+{
+  buffer__s   *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  lua_Integer  n   = luaL_checkinteger(L,2);
+  
+  luaL_argcheck(L,(n >= 0) && (n <= 255) && ((n < 24) || (n > 31)),2,"invalid SIMPLE value");
+  cbor_cB_addvalue(L,buf,0xE0,(unsigned long long int)n);
+  lua_settop(L,1);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	b = b:bin([s])
+*		b = b:text([s])
+* Desc:		Append a CBOR BIN or TEXT
+* Input:	s (string/optional) string, nil to start an indefinite one
+* Return:	b (userdata) buffer
+*
+* Note:		b:text() throws if s isn't valid UTF-8.
+*******************************************************************/
+
+static int cbor_cL_buffer_string(lua_State *L,int type)
+{
+  buffer__s  *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  char const *s;
+  size_t      len;
+  
+  if (lua_isnoneornil(L,2))
+  {
+    cbor_cB_reserve(L,buf,1);
+    buf->data[buf->used++] = (char)(type | 31);
+  }
+  else
+  {
+    s = luaL_checklstring(L,2,&len);
+    if ((type == 0x60) && !cbor_ci_isutf8((uint8_t const *)s,len))
+      return luaL_error(L,"TEXT: not UTF-8 text");
+    cbor_cB_addvalue(L,buf,type,len);
+    cbor_cB_addlstring(L,buf,s,len);
+  }
+  
+  lua_settop(L,1);
+  return 1;
+}
+
+static int cbor_clua_buffer_bin(lua_State *L)
+{
+  return cbor_cL_buffer_string(L,0x40);
+}
+
+static int cbor_clua_buffer_text(lua_State *L)
+{
+  return cbor_cL_buffer_string(L,0x60);
+}
+
+/******************************************************************
+* Usage:	b = b:array([n])
+*		b = b:map([n])
+* Desc:		Append a CBOR ARRAY or MAP header
+* Input:	n (integer/optional) number of items (pairs for MAP)
+* Return:	b (userdata) buffer
+*
+* Note:		If n is nil, an indefinite ARRAY or MAP is started.
+*******************************************************************/
+
+static int cbor_cL_buffer_header(lua_State *L,int type)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  
+  if (lua_isnoneornil(L,2))
+  {
+    cbor_cB_reserve(L,buf,1);
+    buf->data[buf->used++] = (char)(type | 31);
+  }
+  else
+    cbor_cB_addvalue(L,buf,type,cbor_cL_checkvalue(L,2));
+  
+  lua_settop(L,1);
+  return 1;
+}
+
+static int cbor_clua_buffer_array(lua_State *L)
+{
+  return cbor_cL_buffer_header(L,0x80);
+}
+
+static int cbor_clua_buffer_map(lua_State *L)
+{
+  return cbor_cL_buffer_header(L,0xA0);
+}
+
+/******************************************************************
+* Usage:	b = b:float(n)
+*		b = b:__break()
+* Desc:		Append a CBOR float (in the shortest form that doesn't lose
+*		precision) or a __break
+* Input:	n (number) value
+* Return:	b (userdata) buffer
+*******************************************************************/
+
+static int cbor_clua_buffer_float(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  cbor_cB_addfloat(L,buf,luaL_checknumber(L,2));
+  lua_settop(L,1);
+  return 1;
+}
+
+static int cbor_clua_buffer___break(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  cbor_cB_reserve(L,buf,1);
+  buf->data[buf->used++] = (char)0xFF;
+  lua_settop(L,1);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	b = b:raw(blob)
+* Desc:		Append already encoded CBOR data
+* Input:	blob (binary/userdata) CBOR data, or another buffer
+* Return:	b (userdata) buffer
+*******************************************************************/
+
+static int cbor_clua_buffer_raw(lua_State *L)
+{
+  buffer__s  *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  size_t      len;
+  char const *blob = cbor_cL_checkbytes(L,2,&len);
+  
+  /*-----------------------------------------------------------------
+  ; b:raw(b) would have the source move out from under us when the
+  ; buffer grows, so make room first.
+  ;------------------------------------------------------------------*/
+  
+  if (lua_rawequal(L,1,2))
+  {
+    cbor_cB_reserve(L,buf,len);
+    blob = buf->data;
+  }
+  
+  if (len > 0)
+    cbor_cB_addlstring(L,buf,blob,len);
+  lua_settop(L,1);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	b = b:reset()
+* Desc:		Empty the buffer, keeping its memory for reuse
+* Return:	b (userdata) buffer
+*******************************************************************/
+
+static int cbor_clua_buffer_reset(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  buf->used = 0;
+  lua_settop(L,1);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_buffer___tostring(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  lua_pushlstring(L,buf->data != NULL ? buf->data : "",buf->used);
+  return 1;
+}
+
+static int cbor_clua_buffer___len(lua_State *L)
+{
+  buffer__s *buf = luaL_checkudata(L,1,CBOR_BUFFER);
+  lua_pushinteger(L,buf->used);
+  return 1;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_buffer_meta[] =
+{
+  { "uint"	, cbor_clua_buffer_uint		} ,
+  { "nint"	, cbor_clua_buffer_nint		} ,
+  { "bin"	, cbor_clua_buffer_bin		} ,
+  { "text"	, cbor_clua_buffer_text		} ,
+  { "array"	, cbor_clua_buffer_array	} ,
+  { "map"	, cbor_clua_buffer_map		} ,
+  { "tag"	, cbor_clua_buffer_tag		} ,
+  { "simple"	, cbor_clua_buffer_simple	} ,
+  { "float"	, cbor_clua_buffer_float	} ,
+  { "__break"	, cbor_clua_buffer___break	} ,
+  { "raw"	, cbor_clua_buffer_raw		} ,
+  { "reset"	, cbor_clua_buffer_reset	} ,
+  { "__tostring", cbor_clua_buffer___tostring	} ,
+  { "__len"	, cbor_clua_buffer___len	} ,
+  { "__gc"	, cbor_clua_buffer___gc		} ,
+  { NULL	, NULL				}
+};
+
+/**************************************************************************
+*
+*                      RFC-8746 TYPED ARRAYS
+*
+* A typed array is a BIN holding packed numbers, with the TAG (64 through
+* 87) giving the format of the numbers.  The bits of the TAG are
+*
+*		010fsell
+*
+* where f is set for floating point, s set for signed integers, e set for
+* little endian and ll gives the size (for integers, 1, 2, 4 or 8 bytes;
+* for floats, 2, 4, 8 or 16 bytes).  The routines here convert between a
+* Lua array of numbers and the BIN payload in one call.  TAG 76 is reserved
+* and 128-bit floats (TAG 83 and 87) aren't supported.
+*
+***************************************************************************/
+
+typedef struct
+{
+  size_t len;
+  bool   isfloat;
+  bool   issigned;
+  bool   isle;
+  bool   clamped;
+} typed__s;
+
+/**************************************************************************/
+
+static void cbor_cL_typed(lua_State *L,int idx,typed__s *ty)
+{
+  lua_Integer tag = luaL_checkinteger(L,idx);
+  int         bits;
+  
+  assert(ty != NULL);
+  
+  if ((tag < 64) || (tag > 87) || (tag == 76) || (tag == 83) || (tag == 87))
+    luaL_argerror(L,idx,"unsupported typed array");
+    
+  bits         = (int)tag - 64;
+  ty->isfloat  = (bits & 0x10) != 0;
+  ty->issigned = (bits & 0x08) != 0;
+  ty->isle     = (bits & 0x04) != 0;
+  ty->clamped  = (tag == 68);
+  ty->len      = ty->isfloat ? 2u << (bits & 3) : 1u << (bits & 3);
+}
+
+/**************************************************************************
+* Store or fetch len bytes of an integer in the given byte order.  These
+* are written so the compiler can turn them into a plain (or byte swapped)
+* load or store.
+***************************************************************************/
+
+static void cbor_ci_putbytes(uint8_t *p,unsigned long long int v,size_t len,bool isle)
+{
+  if (isle)
+    for (size_t i = 0 ; i < len ; i++ , v >>= 8)
+      p[i] = (uint8_t)v;
+  else
+    for (size_t i = len ; i > 0 ; i-- , v >>= 8)
+      p[i - 1] = (uint8_t)v;
+}
+
+static unsigned long long int cbor_ci_getbytes(uint8_t const *p,size_t len,bool isle)
+{
+  unsigned long long int v = 0;
+  
+  if (isle)
+    for (size_t i = len ; i > 0 ; i--)
+      v = (v << 8) | p[i - 1];
+  else
+    for (size_t i = 0 ; i < len ; i++)
+      v = (v << 8) | p[i];
+  
+  return v;
+}
+
+/**************************************************************************
+* Store or fetch an element of len bytes in the native byte order.  The
+* whole array is then swapped (if needed) in one go by cbor_ci_bswap().
+***************************************************************************/
+
+static void cbor_ci_putnative(uint8_t *p,unsigned long long int v,size_t len)
+{
+  uint8_t  v8  = (uint8_t)v;
+  uint16_t v16 = (uint16_t)v;
+  uint32_t v32 = (uint32_t)v;
+  uint64_t v64 = (uint64_t)v;
+  
+  switch(len)
+  {
+    case 1:  memcpy(p,&v8, sizeof(v8));  break;
+    case 2:  memcpy(p,&v16,sizeof(v16)); break;
+    case 4:  memcpy(p,&v32,sizeof(v32)); break;
+    default: memcpy(p,&v64,sizeof(v64)); break;
+  }
+}
+
+static unsigned long long int cbor_ci_getnative(uint8_t const *p,size_t len)
+{
+  uint8_t  v8;
+  uint16_t v16;
+  uint32_t v32;
+  uint64_t v64;
+  
+  switch(len)
+  {
+    case 1:  memcpy(&v8, p,sizeof(v8));  return v8;
+    case 2:  memcpy(&v16,p,sizeof(v16)); return v16;
+    case 4:  memcpy(&v32,p,sizeof(v32)); return v32;
+    default: memcpy(&v64,p,sizeof(v64)); return v64;
+  }
+}
+
+/**************************************************************************/
+
+static bool cbor_ci_hostle(void)
+{
+  uint16_t const one = 1;
+  uint8_t        b;
+  
+  memcpy(&b,&one,1);
+  return b == 1;
+}
+
+/**************************************************************************
+* Reverse the bytes of each of the n elements (of len bytes) in p.  This
+* is done 32 (AVX2) or 16 (SSSE3, NEON) bytes at a time with a byte
+* shuffle, since elements never straddle a block.
+***************************************************************************/
+
+static void cbor_ci_bswap(uint8_t *p,size_t n,size_t len)
+{
+  size_t total = n * len;
+  size_t i     = 0;
+  
+  assert(p != NULL || n == 0);
+  
+  if (len == 1)
+    return;
+    
+#if defined(__SSSE3__)
+  static uint8_t const m_rev[3][16] =
+  {
+    { 1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14 } ,
+    { 3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12 } ,
+    { 7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8 } ,
+  };
+  __m128i const rev16 = _mm_loadu_si128((__m128i const *)m_rev[len == 2 ? 0 : len == 4 ? 1 : 2]);
+  
+#  if defined(__AVX2__)
+  __m256i const rev32 = _mm256_broadcastsi128_si256(rev16);
+  
+  for ( ; total - i >= 32 ; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)&p[i]);
+    _mm256_storeu_si256((__m256i *)&p[i],_mm256_shuffle_epi8(v,rev32));
+  }
+#  endif
+  
+  for ( ; total - i >= 16 ; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i const *)&p[i]);
+    _mm_storeu_si128((__m128i *)&p[i],_mm_shuffle_epi8(v,rev16));
+  }
+  
+#elif defined(__aarch64__)
+  for ( ; total - i >= 16 ; i += 16)
+  {
+    uint8x16_t v = vld1q_u8(&p[i]);
+    
+    if (len == 2)
+      v = vrev16q_u8(v);
+    else if (len == 4)
+      v = vrev32q_u8(v);
+    else
+      v = vrev64q_u8(v);
+    vst1q_u8(&p[i],v);
+  }
+#endif
+  
+  for ( ; i < total ; i += len)
+  {
+    for (size_t a = i , b = i + len - 1 ; a < b ; a++ , b--)
+    {
+      uint8_t c = p[a];
+      p[a] = p[b];
+      p[b] = c;
+    }
+  }
+}
+
+/**************************************************************************
+* Convert n doubles to half-precision, returning the index of the first
+* one that can't be converted without losing precision (or n if they all
+* convert).  With F16C or NEON, blocks of 8 (or 4) are converted through
+* single-precision and back, and a block goes through cbor_ci_tohalf() if
+* any value doesn't survive the round trip exactly (which includes NaNs,
+* so their payloads are handled the same as a single value).
+***************************************************************************/
+
+static size_t cbor_ci_tohalfs(uint16_t *dst,double const *src,size_t n)
+{
+  size_t i = 0;
+  
+  assert(dst != NULL || n == 0);
+  assert(src != NULL || n == 0);
+  
+  while(i < n)
+  {
+    size_t end;
+    
+#if defined(__F16C__)
+    for ( ; n - i >= 8 ; i += 8)
+    {
+      __m256d a = _mm256_loadu_pd(&src[i]);
+      __m256d b = _mm256_loadu_pd(&src[i + 4]);
+      __m256  f = _mm256_insertf128_ps(
+                        _mm256_castps128_ps256(_mm256_cvtpd_ps(a)),
+                        _mm256_cvtpd_ps(b),
+                        1
+                  );
+      __m128i h = _mm256_cvtps_ph(f,_MM_FROUND_TO_NEAREST_INT);
+      __m256  r = _mm256_cvtph_ps(h);
+      int     ok;
+      
+      ok = _mm256_movemask_pd(_mm256_cmp_pd(a,_mm256_cvtps_pd(_mm256_castps256_ps128(r)),_CMP_EQ_OQ))
+         & _mm256_movemask_pd(_mm256_cmp_pd(b,_mm256_cvtps_pd(_mm256_extractf128_ps(r,1)),_CMP_EQ_OQ));
+      if (ok != 0x0F)
+        break;
+      _mm_storeu_si128((__m128i *)&dst[i],h);
+    }
+#elif defined(__aarch64__)
+    for ( ; n - i >= 4 ; i += 4)
+    {
+      float64x2_t a = vld1q_f64(&src[i]);
+      float64x2_t b = vld1q_f64(&src[i + 2]);
+      float16x4_t h = vcvt_f16_f32(vcvt_high_f32_f64(vcvt_f32_f64(a),b));
+      float32x4_t r = vcvt_f32_f16(h);
+      uint64x2_t  ok;
+      
+      ok = vandq_u64(
+                vceqq_f64(a,vcvt_f64_f32(vget_low_f32(r))),
+                vceqq_f64(b,vcvt_high_f64_f32(r))
+           );
+      if (vminvq_u32(vreinterpretq_u32_u64(ok)) == 0)
+        break;
+      vst1_u16(&dst[i],vreinterpret_u16_f16(h));
+    }
+#endif
+    
+    /*---------------------------------------------------------------------
+    ; Whatever the vector code couldn't do (or everything, without it) is
+    ; done here, a block of 8 at a time so the vector code can pick up
+    ; again after a troublesome block.
+    ;----------------------------------------------------------------------*/
+    
+    end = n - i > 8 ? i + 8 : n;
+    for ( ; i < end ; i++)
+      if (!cbor_ci_tohalf(&dst[i],src[i]))
+        return i;
+  }
+  
+  return n;
+}
+
+/**************************************************************************
+* Convert n half-precision values to doubles.  As with cbor_ci_tohalfs(),
+* a block with a NaN is left to cbor_ci_fromhalf(), so NaN payloads come
+* out the same either way.
+***************************************************************************/
+
+static void cbor_ci_fromhalfs(double *dst,uint16_t const *src,size_t n)
+{
+  size_t i = 0;
+  
+  assert(dst != NULL || n == 0);
+  assert(src != NULL || n == 0);
+  
+  while(i < n)
+  {
+    size_t end;
+    
+#if defined(__F16C__)
+    for ( ; n - i >= 8 ; i += 8)
+    {
+      __m256 r = _mm256_cvtph_ps(_mm_loadu_si128((__m128i const *)&src[i]));
+      
+      if (_mm256_movemask_ps(_mm256_cmp_ps(r,r,_CMP_ORD_Q)) != 0xFF)
+        break;
+      _mm256_storeu_pd(&dst[i],    _mm256_cvtps_pd(_mm256_castps256_ps128(r)));
+      _mm256_storeu_pd(&dst[i + 4],_mm256_cvtps_pd(_mm256_extractf128_ps(r,1)));
+    }
+#elif defined(__aarch64__)
+    for ( ; n - i >= 4 ; i += 4)
+    {
+      float32x4_t r = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(&src[i])));
+      
+      if (vminvq_u32(vceqq_f32(r,r)) == 0)
+        break;
+      vst1q_f64(&dst[i],    vcvt_f64_f32(vget_low_f32(r)));
+      vst1q_f64(&dst[i + 2],vcvt_high_f64_f32(r));
+    }
+#endif
+    
+    end = n - i > 8 ? i + 8 : n;
+    for ( ; i < end ; i++)
+      dst[i] = cbor_ci_fromhalf(src[i]);
+  }
+}
+
+/**************************************************************************
+* Convert the number at the top of the stack (element i of the array) into
+* the raw bits for the given type.  Integer types need integral values in
+* range (except for clamped, which rounds and clamps like an Uint8Clamped
+* array), and floating point types need values that convert without loss
+* of precision.  Half-precision arrays don't come through here, but go
+* through cbor_ci_tohalfs() all at once.
+***************************************************************************/
+
+static unsigned long long int cbor_cL_typedvalue(
+        lua_State       *L,
+        typed__s const  *ty,
+        size_t           i
+)
+{
+  lua_Number n;
+  double__u  d;
+  float__u   f;
+  
+  assert(L  != NULL);
+  assert(ty != NULL);
+  
+  if (lua_type(L,-1) != LUA_TNUMBER)
+    luaL_error(L,"element %d: expected number, got %s",(int)i,luaL_typename(L,-1));
+  
+  if (ty->isfloat)
+  {
+    assert(ty->len != 2);
+    
+    d.d = lua_tonumber(L,-1);
+    if (ty->len == 8)
+      return d.i;
+    if (!cbor_ci_tosingle(&f,d.d))
+      luaL_error(L,"element %d: cannot convert to single-precision",(int)i);
+    return f.i;
+  }
+  
+  if (ty->clamped)
+  {
+    n = lua_tonumber(L,-1);
+    if (!(n > 0.0)) /* also catches NaN */
+      return 0;
+    else if (n >= 255.0)
+      return 255;
+    else
+      return (unsigned long long int)nearbyint(n);
+  }
+  
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L,-1))
+  {
+    lua_Integer v = lua_tointeger(L,-1);
+    
+    /*---------------------------------------------------------------------
+    ; 64-bit unsigned values past the integer range come back from decoding
+    ; as negative integers (see cbor_cL_pushuint()), so they're accepted here
+    ; as well.
+    ;----------------------------------------------------------------------*/
+    
+    if (ty->len == 8)
+      return (unsigned long long int)v;
+    else if (ty->issigned)
+    {
+      lua_Integer lim = (lua_Integer)1 << (ty->len * 8 - 1);
+      if ((v < -lim) || (v >= lim))
+        luaL_error(L,"element %d: out of range",(int)i);
+    }
+    else if ((v < 0) || (v >= (lua_Integer)1 << (ty->len * 8)))
+      luaL_error(L,"element %d: out of range",(int)i);
+    
+    return (unsigned long long int)v;
+  }
+#endif
+  
+  n = lua_tonumber(L,-1);
+  if (floor(n) != n)
+    luaL_error(L,"element %d: expected integer",(int)i);
+  
+  if (ty->issigned)
+  {
+    lua_Number lim = ldexp(1.0,(int)ty->len * 8 - 1);
+    if ((n < -lim) || (n >= lim))
+      luaL_error(L,"element %d: out of range",(int)i);
+    return (unsigned long long int)(long long int)n;
+  }
+  else
+  {
+    if ((n < 0.0) || (n >= ldexp(1.0,(int)ty->len * 8)))
+      luaL_error(L,"element %d: out of range",(int)i);
+    return (unsigned long long int)n;
+  }
+}
+
+/**************************************************************************
+* Push the raw bits of an element as a Lua number.  As with
+* cbor_cL_typedvalue(), half-precision is handled elsewhere.
+***************************************************************************/
+
+static void cbor_cL_pushtyped(
+        lua_State              *L,
+        typed__s const         *ty,
+        unsigned long long int  v
+)
+{
+  assert(L  != NULL);
+  assert(ty != NULL);
+  
+  if (ty->isfloat)
+  {
+    double__u d;
+    
+    assert(ty->len != 2);
+    
+    if (ty->len == 4)
+      lua_pushnumber(L,cbor_ci_fromsingle((uint32_t)v));
+    else
+    {
+      d.i = v;
+      lua_pushnumber(L,d.d);
+    }
+  }
+  else if (ty->issigned)
+  {
+    unsigned long long int sign = 1uLL << (ty->len * 8 - 1);
+    long long int          sv   = (long long int)((v ^ sign) - sign);
+    
+#if LUA_VERSION_NUM < 503
+    lua_pushnumber(L,(lua_Number)sv);
+#else
+    lua_pushinteger(L,(lua_Integer)sv);
+#endif
+  }
+  else
+    cbor_cL_pushuint(L,v);
+}
+
+/******************************************************************
+* Usage:	bin = cbor_c.encode_typed(tag,array)
+* Desc:		Pack an array of numbers into a typed array payload
+* Input:	tag (integer) RFC-8746 TAG (64 through 87)
+*		array (table) array of numbers
+* Return:	bin (binary) packed numbers (without the BIN header)
+*
+* Note:		Throws on an unsupported TAG, or an element that can't
+*		be stored in the given type.
+*******************************************************************/
+
+static int cbor_clua_encode_typed(lua_State *L)
+{
+  typed__s   ty;
+  buffer__s *buf;
+  uint8_t   *p;
+  size_t     n;
+  
+  cbor_cL_typed(L,1,&ty);
+  luaL_checktype(L,2,LUA_TTABLE);
+  lua_settop(L,2);
+  
+  n   = lua_rawlen(L,2);
+  buf = cbor_cL_newbuffer(L);
+  
+  if (n > 0)
+  {
+    if (n > SIZE_MAX / sizeof(double))
+      return luaL_error(L,"array too large");
+    cbor_cB_reserve(L,buf,n * ty.len);
+  }
+  
+  p         = (uint8_t *)buf->data;
+  buf->used = n * ty.len;
+  
+  /*---------------------------------------------------------------------
+  ; Everything is stored in native byte order and swapped afterwards (if
+  ; need be) in one go.  Half-precision values are collected as doubles
+  ; first, so they too can be converted all at once.
+  ;----------------------------------------------------------------------*/
+  
+  if (ty.isfloat && (ty.len == 2))
+  {
+    buffer__s *tmp = cbor_cL_newbuffer(L);
+    double    *dv;
+    size_t     bad;
+    
+    if (n > 0)
+      cbor_cB_reserve(L,tmp,n * sizeof(double));
+    dv = (double *)tmp->data;
+    
+    for (size_t i = 1 ; i <= n ; i++)
+    {
+      lua_rawgeti(L,2,i);
+      if (lua_type(L,-1) != LUA_TNUMBER)
+        return luaL_error(L,"element %d: expected number, got %s",(int)i,luaL_typename(L,-1));
+      dv[i - 1] = lua_tonumber(L,-1);
+      lua_pop(L,1);
+    }
+    
+    bad = cbor_ci_tohalfs((uint16_t *)p,dv,n);
+    cbor_cB_free(L,tmp);
+    if (bad < n)
+      return luaL_error(L,"element %d: cannot convert to half-precision",(int)(bad + 1));
+  }
+  else
+  {
+    for (size_t i = 1 ; i <= n ; i++)
+    {
+      lua_rawgeti(L,2,i);
+      cbor_ci_putnative(&p[(i - 1) * ty.len],cbor_cL_typedvalue(L,&ty,i),ty.len);
+      lua_pop(L,1);
+    }
+  }
+  
+  if (ty.isle != cbor_ci_hostle())
+    cbor_ci_bswap(p,n,ty.len);
+  
+  lua_pushlstring(L,buf->data != NULL ? buf->data : "",buf->used);
+  cbor_cB_free(L,buf);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	array = cbor_c.decode_typed(tag,bin)
+* Desc:		Unpack a typed array payload into an array of numbers
+* Input:	tag (integer) RFC-8746 TAG (64 through 87)
+*		bin (binary) packed numbers
+* Return:	array (table) array of numbers, nil if the length of bin
+*		isn't a multiple of the element size
+*
+* Note:		Throws on an unsupported TAG.
+*******************************************************************/
+
+static int cbor_clua_decode_typed(lua_State *L)
+{
+  typed__s       ty;
+  size_t         len;
+  uint8_t const *p;
+  buffer__s     *buf;
+  buffer__s     *tmp = NULL;
+  double        *dv  = NULL;
+  size_t         n;
+  
+  cbor_cL_typed(L,1,&ty);
+  p = (uint8_t const *)luaL_checklstring(L,2,&len);
+  
+  if (len % ty.len != 0)
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+  
+  /*---------------------------------------------------------------------
+  ; The payload is copied (which also takes care of alignment) and put
+  ; into native byte order in one go, and half-precision values are
+  ; converted all at once, before anything is pushed.
+  ;----------------------------------------------------------------------*/
+  
+  n   = len / ty.len;
+  buf = cbor_cL_newbuffer(L);
+  
+  if (n > 0)
+  {
+    cbor_cB_reserve(L,buf,len);
+    memcpy(buf->data,p,len);
+    buf->used = len;
+    if (ty.isle != cbor_ci_hostle())
+      cbor_ci_bswap((uint8_t *)buf->data,n,ty.len);
+  }
+  
+  p = (uint8_t const *)buf->data;
+  
+  if (ty.isfloat && (ty.len == 2))
+  {
+    tmp = cbor_cL_newbuffer(L);
+    if (n > 0)
+      cbor_cB_reserve(L,tmp,n * sizeof(double));
+    dv = (double *)tmp->data;
+    cbor_ci_fromhalfs(dv,(uint16_t const *)p,n);
+  }
+  
+  lua_createtable(L,n > INT_MAX ? INT_MAX : (int)n,0);
+  
+  for (size_t i = 1 ; i <= n ; i++ , p += ty.len)
+  {
+    if (dv != NULL)
+      lua_pushnumber(L,dv[i - 1]);
+    else
+      cbor_cL_pushtyped(L,&ty,cbor_ci_getnative(p,ty.len));
+    lua_rawseti(L,-2,i);
+  }
+  
+  if (tmp != NULL)
+    cbor_cB_free(L,tmp);
+  cbor_cB_free(L,buf);
+  return 1;
+}
+
+/**************************************************************************
+*
+*                         INCREMENTAL SCANNING
+*
+* The scanner finds the end of a complete CBOR data item without creating
+* any Lua values.  All of its state is kept in a scan__s, so when it runs
+* out of input, it can be resumed where it left off once more data comes
+* in---nothing is scanned twice.
+*
+* The stack of open ARRAYs, MAPs and indefinite strings isn't part of the
+* scan__s, so it's cheap to have one on the C stack.  Scans that can't
+* call back into Lua all share one stack, CBOR_MAXDEPTH deep, kept in the
+* registry under CBOR_FRAMES (see cbor_cL_scan_init()).  Scans that can
+* outlive a call (dec:feed()) or run outside the Lua state (the index
+* threads) bring their own.  Either way, a scan only goes as deep as the
+* cbor.limits() depth.
+*
+***************************************************************************/
+
+typedef struct
+{
+  unsigned long long int left;  /* items left, or items seen if indef */
+  int                    type;
+  bool                   indef;
+} frame__s;
+
+typedef struct
+{
+  unsigned long long int need;  /* string data yet to be skipped */
+  bool                   instring;
+  size_t                 tags;          /* TAGs on the item to come */
+  size_t                 depth;
+  size_t                 maxdepth;
+  frame__s              *frame;         /* maxdepth frames */
+} scan__s;
+
+#define CBOR_FRAMES	"org.conman.cbor_c:frames"
+
+/**************************************************************************/
+
+static void cbor_ci_scan_reset(scan__s *s)
+{
+  assert(s != NULL);
+  
+  s->need     = 0;
+  s->instring = false;
+  s->tags     = 0;
+  s->depth    = 0;
+}
+
+/**************************************************************************/
+
+static void cbor_ci_scan_init(scan__s *s,frame__s *frame,size_t maxdepth)
+{
+  assert(s     != NULL);
+  assert(frame != NULL);
+  
+  s->frame    = frame;
+  s->maxdepth = maxdepth;
+  cbor_ci_scan_reset(s);
+}
+
+/**************************************************************************
+* Set up a scan using the shared frames.  It's only good until the next
+* call into Lua.
+***************************************************************************/
+
+static void cbor_cL_scan_init(lua_State *L,scan__s *s)
+{
+  frame__s *frame;
+  
+  assert(L != NULL);
+  assert(s != NULL);
+  
+  lua_getfield(L,LUA_REGISTRYINDEX,CBOR_FRAMES);
+  frame = lua_touserdata(L,-1);
+  lua_pop(L,1);
+  assert(frame != NULL);
+  cbor_ci_scan_init(s,frame,(size_t)cbor_cL_limits(L)->depth);
+}
+
+/**************************************************************************/
+
+static int cbor_ci_scan_push(
+        scan__s                *s,
+        int                     type,
+        bool                    indef,
+        unsigned long long int  left
+)
+{
+  assert(s != NULL);
+  
+  if (s->depth == s->maxdepth)
+    return CBOR_ETOODEEP;
+  
+  s->frame[s->depth].left  = left;
+  s->frame[s->depth].type  = type;
+  s->frame[s->depth].indef = indef;
+  s->depth++;
+  return CBOR_OKAY;
+}
+
+/**************************************************************************
+* Scan packet from *ppos (0-based).  Returns CBOR_OKAY when a complete data
+* item ends at *ppos.  If the input runs out first, CBOR_EMOREINPUT is
+* returned, *ppos is left where scanning should resume, and the next call
+* (with the same scan__s and more data appended to packet) picks up from
+* there.  Any other return is an error, with *ppos at the offending byte.
+***************************************************************************/
+
+static int cbor_ci_scan(
+        scan__s    *s,
+        char const *packet,
+        size_t      packlen,
+        size_t     *ppos
+)
+{
+  size_t pos;
+  
+  assert(s      != NULL);
+  assert(packet != NULL);
+  assert(ppos   != NULL);
+  assert(*ppos  <= packlen);
+  
+  pos = *ppos;
+  
+  while(true)
+  {
+    if (s->instring)
+    {
+      if (s->need > packlen - pos)
+      {
+        s->need -= packlen - pos;
+        *ppos    = packlen;
+        return CBOR_EMOREINPUT;
+      }
+      
+      pos         += s->need;
+      s->need      = 0;
+      s->instring  = false;
+    }
+    else
+    {
+      unsigned long long int  value;
+      frame__s               *top   = s->depth > 0 ? &s->frame[s->depth - 1] : NULL;
+      size_t                  start = pos;
+      int                     type;
+      int                     info;
+      int                     rc;
+      
+      rc = cbor_ci_header(&type,&info,&value,packet,packlen,&pos);
+      if (rc != CBOR_OKAY)
+      {
+        *ppos = start;
+        return rc == CBOR_ENOINPUT ? CBOR_EMOREINPUT : rc;
+      }
+      
+      /*------------------------------------------------------------------
+      ; Inside an indefinite string, only definite strings of the same
+      ; type (or a __break) are allowed.
+      ;-------------------------------------------------------------------*/
+      
+      if ((top != NULL) && top->indef && ((top->type == 0x40) || (top->type == 0x60)))
+      {
+        if (!((type == 0xE0) && (info == 31)) && ((type != top->type) || (info == 31)))
+        {
+          *ppos = start;
+          return CBOR_EINVALID;
+        }
+      }
+      
+      switch(type)
+      {
+        case 0x00:
+        case 0x20:
+             if (info == 31)
+             {
+               *ppos = start;
+               return CBOR_EINVALID;
+             }
+             break;
+             
+        case 0x40:
+        case 0x60:
+             s->tags = 0;
+             if (info == 31)
+             {
+               if ((rc = cbor_ci_scan_push(s,type,true,0)) != CBOR_OKAY)
+               {
+                 *ppos = start;
+                 return rc;
+               }
+               continue;
+             }
+             s->need     = value;
+             s->instring = true;
+             continue;
+             
+        case 0x80:
+        case 0xA0:
+             s->tags = 0;
+             if (info == 31)
+               rc = cbor_ci_scan_push(s,type,true,0);
+             else if (value == 0)
+               break;
+             else if ((type == 0xA0) && (value > ULLONG_MAX / 2))
+               rc = CBOR_EINVALID;
+             else
+               rc = cbor_ci_scan_push(s,type,false,type == 0xA0 ? value * 2 : value);
+             
+             if (rc != CBOR_OKAY)
+             {
+               *ppos = start;
+               return rc;
+             }
+             continue;
+             
+        case 0xC0:
+             if (info == 31)
+             {
+               *ppos = start;
+               return CBOR_EINVALID;
+             }
+             
+             /*---------------------------------------------------------
+             ; Each TAG counts as a level, so a long run of them can't
+             ; go on for free.
+             ;----------------------------------------------------------*/
+             
+             if (s->depth + s->tags >= s->maxdepth)
+             {
+               *ppos = start;
+               return CBOR_ETOODEEP;
+             }
+             s->tags++;
+             continue;
+             
+        case 0xE0:
+             if (info == 31)
+             {
+               /*---------------------------------------------------------
+               ; A __break can only end an indefinite item, it can't be
+               ; tagged, and it can't end a MAP between key and value.
+               ;----------------------------------------------------------*/
+               
+               if (
+                       (top == NULL)
+                    || !top->indef
+                    || (s->tags > 0)
+                    || ((top->type == 0xA0) && (top->left % 2 != 0))
+                  )
+               {
+                 *ppos = start;
+                 return CBOR_EINVALID;
+               }
+               s->depth--;
+             }
+             break;
+             
+        default:
+             assert(0);
+             *ppos = start;
+             return CBOR_EINVALID;
+      }
+    }
+    
+    /*------------------------------------------------------------------
+    ; An item has been completed.  This may in turn complete one or more
+    ; containers.  If we're back at the top level, we're done.
+    ;-------------------------------------------------------------------*/
+    
+    s->tags = 0;
+    
+    while(s->depth > 0)
+    {
+      frame__s *top = &s->frame[s->depth - 1];
+      
+      if (top->indef)
+      {
+        top->left++;
+        break;
+      }
+      
+      if (--top->left > 0)
+        break;
+      
+      s->depth--;
+    }
+    
+    if (s->depth == 0)
+    {
+      *ppos = pos;
+      return CBOR_OKAY;
+    }
+  }
+}
+
+/**************************************************************************
+* Scan a complete item from a packet, starting at Lua position pos.  On
+* success, *ppos is the 0-based position just past the item; otherwise,
+* it's the 0-based position of the error.
+***************************************************************************/
+
+static int cbor_cL_scanitem(lua_State *L,size_t *ppos)
+{
+  scan__s     scan;
+  char const *packet;
+  size_t      packlen;
+  lua_Integer pos;
+  int         rc;
+  
+  assert(L    != NULL);
+  assert(ppos != NULL);
+  
+  packet = cbor_cL_checkblob(L,1,&packlen);
+  pos    = luaL_optinteger(L,2,1);
+  
+  if ((pos < 1) || ((size_t)pos > packlen))
+  {
+    *ppos = pos < 1 ? 0 : packlen;
+    return CBOR_ENOINPUT;
+  }
+  
+  *ppos = (size_t)pos - 1;
+  cbor_cL_scan_init(L,&scan);
+  rc = cbor_ci_scan(&scan,packet,packlen,ppos);
+  
+  /*----------------------------------------------------------------------
+  ; The scanner can skip over a string it doesn't have all the data for,
+  ; so point to the end in that case.
+  ;-----------------------------------------------------------------------*/
+  
+  if ((rc == CBOR_EMOREINPUT) && scan.instring)
+    *ppos = packlen;
+  return rc;
+}
+
+/******************************************************************
+* Usage:	pos2 = cbor_c.skip(blob[,pos])
+* Desc:		Find the end of a complete CBOR data item
+* Input:	blob (binary) binary CBOR sludge
+*		pos (integer/optional) position of item
+* Return:	pos2 (integer) position just past the item
+*
+* Note:		No Lua values are created.  Nested ARRAYs, MAPs, TAGs and
+*		indefinite items are all skipped.
+*
+* Note:		Throws an error of the form { pos = n , msg = "text" }.
+*******************************************************************/
+
+static int cbor_clua_skip(lua_State *L)
+{
+  size_t pos;
+  int    rc = cbor_cL_scanitem(L,&pos);
+  
+  if (rc != CBOR_OKAY)
+    return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[rc]);
+  lua_pushinteger(L,pos + 1);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	pos2[,epos,err] = cbor_c.validate(blob[,pos])
+* Desc:		Check a complete CBOR data item for well-formedness
+* Input:	blob (binary) binary CBOR sludge
+*		pos (integer/optional) position of item
+* Return:	pos2 (integer) position just past the item, nil on error
+*		epos (integer/optional) position of error
+*		err (string/optional) error message
+*******************************************************************/
+
+static int cbor_clua_validate(lua_State *L)
+{
+  size_t pos;
+  int    rc = cbor_cL_scanitem(L,&pos);
+  
+  if (rc != CBOR_OKAY)
+  {
+    lua_pushnil(L);
+    lua_pushinteger(L,pos + 1);
+    lua_pushstring(L,m_cbor_errors[rc]);
+    return 3;
+  }
+  
+  lua_pushinteger(L,pos + 1);
+  return 1;
+}
+
+/**************************************************************************
+* Skip a complete item at *ppos (0-based) in packet, using the frames of
+* scan s (which is reset first).
+***************************************************************************/
+
+static int cbor_ci_skip(scan__s *s,char const *packet,size_t packlen,size_t *ppos)
+{
+  assert(s      != NULL);
+  assert(packet != NULL);
+  assert(ppos   != NULL);
+  
+  cbor_ci_scan_reset(s);
+  return cbor_ci_scan(s,packet,packlen,ppos);
+}
+
+/**************************************************************************/
+
+static int cbor_cL_skip(lua_State *L,char const *packet,size_t packlen,size_t *ppos)
+{
+  scan__s scan;
+  
+  cbor_cL_scan_init(L,&scan);
+  return cbor_ci_scan(&scan,packet,packlen,ppos);
+}
+
+/**************************************************************************
+* Follow the steps in the table at index path from the item at *ppos.  If
+* the item is found, *ppos is updated and true returned.  Errors are
+* thrown as with cbor_c.locate().
+***************************************************************************/
+
+static bool cbor_cL_locate(
+        lua_State  *L,
+        char const *packet,
+        size_t      packlen,
+        size_t     *ppos,
+        int         path
+)
+{
+  scan__s scan;
+  size_t  pos;
+  size_t  n;
+  
+  assert(L      != NULL);
+  assert(packet != NULL);
+  assert(ppos   != NULL);
+  
+  cbor_cL_scan_init(L,&scan);
+  pos = *ppos;
+  n   = lua_rawlen(L,path);
+  
+  for (size_t i = 1 ; i <= n ; i++)
+  {
+    unsigned long long int  value;
+    unsigned long long int  cnt;
+    size_t                  start;
+    int                     type;
+    int                     info;
+    int                     rc;
+    
+    do
+    {
+      start = pos;
+      rc    = cbor_ci_header(&type,&info,&value,packet,packlen,&pos);
+      if (rc != CBOR_OKAY)
+        return cbor_cL_throw(L,start + 1,"%s",m_cbor_errors[rc == CBOR_ENOINPUT ? CBOR_EMOREINPUT : rc]);
+    } while(type == 0xC0);
+    
+    lua_rawgeti(L,path,i);
+    
+    if (type == 0x80)
+    {
+      lua_Integer idx;
+      
+      if (lua_type(L,-1) != LUA_TNUMBER)
+        goto notfound;
+      idx = lua_tointeger(L,-1);
+      if ((idx < 1) || ((info < 31) && ((unsigned long long int)idx > value)))
+        goto notfound;
+      
+      for (cnt = 1 ; ; cnt++)
+      {
+        if (pos >= packlen)
+          return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[CBOR_EMOREINPUT]);
+        if ((info == 31) && ((unsigned char)packet[pos] == 0xFF))
+          goto notfound;
+        if (cnt == (unsigned long long int)idx)
+          break;
+        if ((rc = cbor_ci_skip(&scan,packet,packlen,&pos)) != CBOR_OKAY)
+          return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[rc]);
+      }
+    }
+    else if (type == 0xA0)
+    {
+      buffer__u    ikey;
+      char const  *key;
+      size_t       klen;
+      
+      if (lua_type(L,-1) == LUA_TSTRING)
+        key = lua_tolstring(L,-1,&klen);
+      else if (lua_type(L,-1) == LUA_TNUMBER)
+      {
+        lua_Integer k = lua_tointeger(L,-1);
+        if (k < 0)
+          klen = cbor_ci_putvalue(ikey.b,0x20,(unsigned long long int)~k);
+        else
+          klen = cbor_ci_putvalue(ikey.b,0x00,(unsigned long long int)k);
+        key = ikey.c;
+      }
+      else
+        goto notfound;
+      
+      for (cnt = 0 ; ; cnt++)
+      {
+        if ((info < 31) && (cnt == value))
+          goto notfound;
+        if (pos >= packlen)
+          return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[CBOR_EMOREINPUT]);
+        if ((info == 31) && ((unsigned char)packet[pos] == 0xFF))
+          goto notfound;
+        
+        start = pos;
+        if ((rc = cbor_ci_skip(&scan,packet,packlen,&pos)) != CBOR_OKAY)
+          return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[rc]);
+        if ((pos - start == klen) && (memcmp(&packet[start],key,klen) == 0))
+          break;
+        if ((rc = cbor_ci_skip(&scan,packet,packlen,&pos)) != CBOR_OKAY)
+          return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[rc]);
+      }
+    }
+    else
+      goto notfound;
+    
+    lua_pop(L,1);
+  }
+  
+  *ppos = pos;
+  return true;
+  
+notfound:
+  lua_pop(L,1);
+  return false;
+}
+
+/******************************************************************
+* Usage:	pos2 = cbor_c.locate(blob,pos,path)
+* Desc:		Locate an item in a CBOR data item without decoding
+* Input:	blob (binary) binary CBOR sludge
+*		pos (integer) position of item
+*		path (array) steps (see note)
+* Return:	pos2 (integer) position of item, nil if not found
+*
+* Note:		Each step in path is either a string, which is compared
+*		against the encoded bytes of MAP keys, or an integer, which
+*		is an index (1-based) into an ARRAY, or compared against
+*		encoded integer MAP keys.  Tags on ARRAYs and MAPs along
+*		the path are skipped.
+*
+* Note:		Throws an error of the form { pos = n , msg = "text" }.
+*******************************************************************/
+
+static int cbor_clua_locate(lua_State *L)
+{
+  char const  *packet;
+  size_t       packlen;
+  lua_Integer  ipos;
+  size_t       pos;
+  
+  packet = cbor_cL_checkblob(L,1,&packlen);
+  ipos   = luaL_optinteger(L,2,1);
+  luaL_checktype(L,3,LUA_TTABLE);
+  
+  if ((ipos < 1) || ((size_t)ipos > packlen))
+    return cbor_cL_throw(L,ipos,"no input");
+  
+  pos = (size_t)ipos - 1;
+  if (cbor_cL_locate(L,packet,packlen,&pos,3))
+    lua_pushinteger(L,pos + 1);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+/**************************************************************************
+*
+*                           PARALLEL INDEXING
+*
+* Find (and validate) every item in a CBOR sequence, producing an index of
+* item offsets.  Large inputs are split into chunks, one per thread.  The
+* first chunk starts on an item boundary, but the others start at some
+* arbitrary byte, so their threads scan speculatively---if an item fails
+* to scan, they move on a byte and try again.  Once a scan does start on a
+* true boundary, it stays on them.  Failed attempts can each scan a long
+* way (a BIN full of TAG bytes, say), so a thread gives up on its chunk
+* once they've cost as much as scanning the whole chunk would, and leaves
+* the rest to be scanned in order.  The results are then stitched together
+* in order: starting from the end of the last known good item, we look up
+* the items the thread for that chunk found, and follow them; if there
+* isn't a matching item, we scan one ourselves and look again.  So the
+* index is exactly what a single scan would produce, no matter where the
+* chunks fall.
+*
+* The threads can't touch the Lua state (or its allocator), so all memory
+* here comes from malloc().
+*
+* An index can be packed, optionally with the encoded value of a key field
+* from each item, and saved alongside the data.  The packed form is used
+* in place (a string, or a memory mapped file), so opening even a huge
+* index reads nothing more than the header.  All integers are unsigned
+* 64-bit little endian:
+*
+*	"CBORIDX1"
+*	n	number of items
+*	nkeys	number of keys
+*	klen	size of key data
+*	off	n + 1 offsets; item i runs from off[i] to off[i+1]
+*	kpos	nkeys + 1 offsets into key data
+*	kitem	nkeys item numbers (0-based)
+*	kdata	encoded keys, sorted by their bytes
+*
+***************************************************************************/
+
+#define CBOR_INDEX	"org.conman.cbor_c:index"
+
+#ifndef CBOR_MINCHUNK
+#  define CBOR_MINCHUNK (1024uL * 1024uL)
+#endif
+
+#ifndef CBOR_MAXTHREADS
+#  define CBOR_MAXTHREADS 256
+#endif
+
+#define CBOR_INDEXMAGIC	"CBORIDX1"
+#define CBOR_INDEXHDR	32
+
+typedef struct
+{
+  size_t         n;     /* number of items */
+  size_t        *off;   /* n + 1 offsets; item i is off[i] to off[i+1] */
+  uint8_t const *data;  /* packed offsets, if off is NULL */
+  size_t         nkeys; /* number of keys (packed indexes only) */
+  uint8_t const *kpos;
+  uint8_t const *kitem;
+  uint8_t const *kdata;
+  size_t         klen;
+} index__s;
+
+typedef struct
+{
+  char const *key;
+  size_t      len;
+  size_t      item;
+} ikey__s;
+
+typedef struct
+{
+  char const *packet;
+  size_t      limit;    /* speculative items can't extend past this */
+  size_t      start;
+  size_t      end;
+  bool        exact;    /* start is known to be on an item boundary */
+  size_t     *item;     /* start,end pairs */
+  size_t      n;
+  size_t      size;
+  bool        nomem;
+  scan__s     scan;     /* with its own frames */
+} ichunk__s;
+
+/**************************************************************************/
+
+static bool cbor_ci_index_add(size_t **pdata,size_t *psize,size_t n,size_t need)
+{
+  assert(pdata != NULL);
+  assert(psize != NULL);
+  
+  if (n + need > *psize)
+  {
+    size_t  nsize = *psize ? *psize * 2 : 1024;
+    size_t *ndata;
+    
+    while(nsize < n + need)
+      nsize *= 2;
+    
+    ndata = realloc(*pdata,nsize * sizeof(size_t));
+    if (ndata == NULL)
+      return false;
+    *pdata = ndata;
+    *psize = nsize;
+  }
+  
+  return true;
+}
+
+/**************************************************************************
+* Scan the items starting in a chunk.  This runs in its own thread.
+***************************************************************************/
+
+static void *cbor_ci_index_chunk(void *arg)
+{
+  ichunk__s *c = arg;
+  size_t     budget;
+  size_t     pos;
+  
+  assert(c != NULL);
+  
+  if (c->nomem)
+    return NULL;
+  
+  budget = c->end - c->start;
+  
+  for (pos = c->start ; pos < c->end ; )
+  {
+    size_t npos = pos;
+    
+    if (cbor_ci_skip(&c->scan,c->packet,c->limit,&npos) != CBOR_OKAY)
+    {
+      size_t cost = npos - pos + 1;
+      
+      if (c->exact || (cost >= budget))
+        break;
+      budget -= cost;
+      pos++;
+      continue;
+    }
+    
+    if (!cbor_ci_index_add(&c->item,&c->size,c->n,2))
+    {
+      c->nomem = true;
+      break;
+    }
+    
+    c->item[c->n++] = pos;
+    c->item[c->n++] = npos;
+    pos             = npos;
+  }
+  
+  return NULL;
+}
+
+/**************************************************************************
+* Find the item starting at pos in a chunk, returning its index (in
+* pairs), or the number of items if there isn't one.
+***************************************************************************/
+
+static size_t cbor_ci_index_find(ichunk__s const *c,size_t pos)
+{
+  size_t lo = 0;
+  size_t hi = c->n / 2;
+  
+  assert(c != NULL);
+  
+  while(lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    
+    if (c->item[mid * 2] < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  
+  return (lo < c->n / 2) && (c->item[lo * 2] == pos) ? lo : c->n / 2;
+}
+
+/**************************************************************************/
+
+static lua_Integer cbor_ci_ncpus(void)
+{
+#if defined(CBOR_HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+/**************************************************************************/
+
+static index__s *cbor_cL_newindex(lua_State *L)
+{
+  index__s *idx;
+  
+  assert(L != NULL);
+  
+  idx        = lua_newuserdata(L,sizeof(index__s));
+  idx->n     = 0;
+  idx->off   = NULL;
+  idx->data  = NULL;
+  idx->nkeys = 0;
+  idx->kpos  = NULL;
+  idx->kitem = NULL;
+  idx->kdata = NULL;
+  idx->klen  = 0;
+  luaL_getmetatable(L,CBOR_INDEX);
+  lua_setmetatable(L,-2);
+  return idx;
+}
+
+/**************************************************************************
+* Return entry i of a packed table of 64-bit values, or SIZE_MAX if it
+* is out of range.
+***************************************************************************/
+
+static size_t cbor_ci_index_get(uint8_t const *table,size_t i)
+{
+  unsigned long long int v;
+  
+  assert(table != NULL);
+  
+  v = cbor_ci_getbytes(&table[i * 8],8,true);
+  return v < SIZE_MAX ? (size_t)v : SIZE_MAX;
+}
+
+/**************************************************************************
+* Return the start and end of item i (0-based), checking them if the
+* index is packed (since it came from outside).
+***************************************************************************/
+
+static void cbor_cL_index_item(
+        lua_State      *L,
+        index__s const *idx,
+        size_t          i,
+        size_t         *pstart,
+        size_t         *pend
+)
+{
+  assert(L      != NULL);
+  assert(idx    != NULL);
+  assert(i      <  idx->n);
+  assert(pstart != NULL);
+  assert(pend   != NULL);
+  
+  if (idx->off != NULL)
+  {
+    *pstart = idx->off[i];
+    *pend   = idx->off[i + 1];
+  }
+  else
+  {
+    *pstart = cbor_ci_index_get(idx->data,i);
+    *pend   = cbor_ci_index_get(idx->data,i + 1);
+    if ((*pstart >= *pend) || (*pend == SIZE_MAX))
+      luaL_error(L,"invalid index");
+  }
+}
+
+/**************************************************************************
+* Return key i (in sorted order) of a packed index.
+***************************************************************************/
+
+static char const *cbor_cL_index_key(
+        lua_State      *L,
+        index__s const *idx,
+        size_t          i,
+        size_t         *plen
+)
+{
+  size_t start;
+  size_t end;
+  
+  assert(L    != NULL);
+  assert(idx  != NULL);
+  assert(i    <  idx->nkeys);
+  assert(plen != NULL);
+  
+  start = cbor_ci_index_get(idx->kpos,i);
+  end   = cbor_ci_index_get(idx->kpos,i + 1);
+  if ((start > end) || (end > idx->klen))
+    luaL_error(L,"invalid index");
+  
+  *plen = end - start;
+  return (char const *)&idx->kdata[start];
+}
+
+/**************************************************************************/
+
+static int cbor_ci_index_keycmp(
+        char const *key1,
+        size_t      len1,
+        char const *key2,
+        size_t      len2
+)
+{
+  int rc = memcmp(key1,key2,len1 < len2 ? len1 : len2);
+  
+  if (rc != 0)
+    return rc;
+  return len1 < len2 ? -1 : len1 > len2 ? 1 : 0;
+}
+
+/**************************************************************************/
+
+static int cbor_ci_index_sortkeys(void const *a,void const *b)
+{
+  ikey__s const *k1 = a;
+  ikey__s const *k2 = b;
+  int            rc = cbor_ci_index_keycmp(k1->key,k1->len,k2->key,k2->len);
+  
+  if (rc != 0)
+    return rc;
+  return k1->item < k2->item ? -1 : k1->item > k2->item ? 1 : 0;
+}
+
+/******************************************************************
+* Usage:	idx[,epos,err] = cbor_c.index(blob[,threads])
+* Desc:		Validate a CBOR sequence and index the items in it
+* Input:	blob (binary) binary CBOR sludge (string or mmap)
+*		threads (integer/optional) number of threads to use
+*		(default is the number of CPUs)
+* Return:	idx (userdata) index of items
+*		epos (integer/optional) position of error
+*		err (string/optional) error message
+*
+* Note:		On error, idx has every item before the error.
+*******************************************************************/
+
+static int cbor_clua_index(lua_State *L)
+{
+  char const  *packet;
+  size_t       packlen;
+  lua_Integer  nthreads;
+  ichunk__s   *chunk;
+  size_t       nchunk;
+  size_t       size;
+  size_t       pos;
+  size_t       k;
+  index__s    *idx;
+  scan__s      scan;
+  int          rc;
+  
+  assert(L != NULL);
+  
+  packet   = cbor_cL_checkblob(L,1,&packlen);
+  nthreads = luaL_optinteger(L,2,cbor_ci_ncpus());
+  lua_settop(L,2);
+  cbor_cL_scan_init(L,&scan);
+  idx      = cbor_cL_newindex(L);
+  chunk    = NULL;
+  nchunk   = packlen / CBOR_MINCHUNK;
+  size     = 0;
+  rc       = CBOR_OKAY;
+  
+  if (nthreads > CBOR_MAXTHREADS)
+    nthreads = CBOR_MAXTHREADS;
+  if ((lua_Integer)nchunk > nthreads)
+    nchunk = nthreads < 1 ? 1 : (size_t)nthreads;
+  
+  if (nchunk > 1)
+    chunk = malloc(nchunk * sizeof(ichunk__s));
+  
+  if (chunk != NULL)
+  {
+#ifdef CBOR_HAVE_PTHREAD
+    pthread_t tid[CBOR_MAXTHREADS];
+    bool      started[CBOR_MAXTHREADS];
+#endif
+  
+    for (k = 0 ; k < nchunk ; k++)
+    {
+      chunk[k].packet = packet;
+      chunk[k].start  = packlen / nchunk * k;
+      chunk[k].end    = k == nchunk - 1 ? packlen : packlen / nchunk * (k + 1);
+      chunk[k].limit  = chunk[k].end + (chunk[k].end - chunk[k].start);
+      chunk[k].exact  = k == 0;
+      chunk[k].item   = NULL;
+      chunk[k].n      = 0;
+      chunk[k].size   = 0;
+      chunk[k].nomem  = false;
+      
+      if (chunk[k].limit > packlen)
+        chunk[k].limit = packlen;
+      
+      /*-----------------------------------------------------------------
+      ; If there's no memory for the frames, the chunk is simply left to
+      ; the stitching below.
+      ;------------------------------------------------------------------*/
+      
+      chunk[k].scan.frame = malloc(scan.maxdepth * sizeof(frame__s));
+      if (chunk[k].scan.frame != NULL)
+        cbor_ci_scan_init(&chunk[k].scan,chunk[k].scan.frame,scan.maxdepth);
+      else
+        chunk[k].nomem = true;
+    }
+    
+    /*-------------------------------------------------------------------
+    ; If a thread can't be started, its chunk is scanned here instead.
+    ;--------------------------------------------------------------------*/
+    
+#ifdef CBOR_HAVE_PTHREAD
+    for (k = 1 ; k < nchunk ; k++)
+      started[k] = pthread_create(&tid[k],NULL,cbor_ci_index_chunk,&chunk[k]) == 0;
+#endif
+    
+    cbor_ci_index_chunk(&chunk[0]);
+    
+    for (k = 1 ; k < nchunk ; k++)
+    {
+#ifdef CBOR_HAVE_PTHREAD
+      if (started[k])
+        pthread_join(tid[k],NULL);
+      else
+#endif
+        cbor_ci_index_chunk(&chunk[k]);
+    }
+  }
+  
+  /*---------------------------------------------------------------------
+  ; Stitch the chunks together.  Anything the threads didn't find (or
+  ; found wrongly) is scanned here, which is also where errors are caught.
+  ;----------------------------------------------------------------------*/
+  
+  for (pos = 0 , k = 0 ; pos < packlen ; )
+  {
+    size_t npos;
+    
+    if (chunk != NULL)
+    {
+      size_t j;
+      bool   found = false;
+      
+      while((k + 1 < nchunk) && (pos >= chunk[k + 1].start))
+        k++;
+      
+      for (j = cbor_ci_index_find(&chunk[k],pos) ; (j < chunk[k].n / 2) && (chunk[k].item[j * 2] == pos) ; j++)
+      {
+        if (!cbor_ci_index_add(&idx->off,&size,idx->n,2))
+          goto nomem;
+        idx->off[idx->n++] = pos;
+        pos                = chunk[k].item[j * 2 + 1];
+        found              = true;
+      }
+      
+      if (found)
+        continue;
+    }
+    
+    npos = pos;
+    rc   = cbor_ci_skip(&scan,packet,packlen,&npos);
+    if (rc != CBOR_OKAY)
+    {
+      lua_pushinteger(L,npos + 1);
+      lua_pushstring(L,m_cbor_errors[rc]);
+      break;
+    }
+    
+    if (!cbor_ci_index_add(&idx->off,&size,idx->n,2))
+      goto nomem;
+    idx->off[idx->n++] = pos;
+    pos                = npos;
+  }
+  
+  if (!cbor_ci_index_add(&idx->off,&size,idx->n,1))
+    goto nomem;
+  idx->off[idx->n] = pos;
+  
+  if (chunk != NULL)
+  {
+    for (k = 0 ; k < nchunk ; k++)
+    {
+      free(chunk[k].item);
+      free(chunk[k].scan.frame);
+    }
+    free(chunk);
+  }
+  
+  if (rc != CBOR_OKAY)
+  {
+    lua_pushvalue(L,3);
+    lua_insert(L,4);
+    return 3;
+  }
+  return 1;
+  
+nomem:
+  if (chunk != NULL)
+  {
+    for (k = 0 ; k < nchunk ; k++)
+    {
+      free(chunk[k].item);
+      free(chunk[k].scan.frame);
+    }
+    free(chunk);
+  }
+  return luaL_error(L,"not enough memory");
+}
+
+/******************************************************************
+* Usage:	idx[,err] = cbor_c.loadindex(s)
+* Desc:		Open an index from idx:pack()
+* Input:	s (binary) packed index (string or mmap)
+* Return:	idx (userdata) index, nil on error
+*		err (string/optional) error message
+*
+* Note:		The index is used in place, and holds a reference to s.
+*		Only the header is checked here; offsets and keys are
+*		checked as they are used.
+*******************************************************************/
+
+static int cbor_clua_loadindex(lua_State *L)
+{
+  size_t         len;
+  uint8_t const *s = (uint8_t const *)cbor_cL_checkblob(L,1,&len);
+  index__s      *idx;
+  size_t         n;
+  size_t         nkeys;
+  size_t         klen;
+  
+  if ((len < CBOR_INDEXHDR) || (memcmp(s,CBOR_INDEXMAGIC,8) != 0))
+    goto invalid;
+  
+  n     = cbor_ci_index_get(s,1);
+  nkeys = cbor_ci_index_get(s,2);
+  klen  = cbor_ci_index_get(s,3);
+  
+  /*---------------------------------------------------------------------
+  ; Check each count against the length first, so the total size can't
+  ; overflow.
+  ;----------------------------------------------------------------------*/
+  
+  if ((n >= len / 8) || (nkeys >= len / 16) || (klen > len))
+    goto invalid;
+  if (len - klen != CBOR_INDEXHDR + (n + 1) * 8 + (nkeys + 1) * 8 + nkeys * 8)
+    goto invalid;
+  
+  lua_settop(L,1);
+  idx        = cbor_cL_newindex(L);
+  idx->n     = n;
+  idx->data  = s + CBOR_INDEXHDR;
+  idx->nkeys = nkeys;
+  idx->kpos  = idx->data + (n + 1) * 8;
+  idx->kitem = idx->kpos + (nkeys + 1) * 8;
+  idx->kdata = idx->kitem + nkeys * 8;
+  idx->klen  = klen;
+  
+  lua_createtable(L,1,0);
+  lua_pushvalue(L,1);
+  lua_rawseti(L,-2,1);
+#if LUA_VERSION_NUM == 501
+  lua_setfenv(L,2);
+#else
+  lua_setuservalue(L,2);
+#endif
+  return 1;
+  
+invalid:
+  lua_pushnil(L);
+  lua_pushliteral(L,"invalid index");
+  return 2;
+}
+
+/******************************************************************
+* Usage:	pos,pos2 = idx:item(i)
+* Desc:		Return the position of an item
+* Input:	i (integer) item number (1-based)
+* Return:	pos (integer) position of the item, nil if no such item
+*		pos2 (integer) position just past the item
+*******************************************************************/
+
+static int cbor_clua_index_item(lua_State *L)
+{
+  index__s    *idx = luaL_checkudata(L,1,CBOR_INDEX);
+  lua_Integer  i   = luaL_checkinteger(L,2);
+  size_t       start;
+  size_t       end;
+  
+  if ((i < 1) || ((size_t)i > idx->n))
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+  
+  cbor_cL_index_item(L,idx,(size_t)i - 1,&start,&end);
+  lua_pushinteger(L,start + 1);
+  lua_pushinteger(L,end + 1);
+  return 2;
+}
+
+/******************************************************************
+* Usage:	list = idx:find(key)
+* Desc:		Find the items with a given key
+* Input:	key (binary) encoded key
+* Return:	list (array) item numbers, in order, nil if none
+*
+* Note:		Only packed indexes with keys (see idx:pack()) can be
+*		searched.  The search is a binary search on the bytes of
+*		the keys, so key has to be encoded the same way.
+*******************************************************************/
+
+static int cbor_clua_index_find(lua_State *L)
+{
+  index__s   *idx = luaL_checkudata(L,1,CBOR_INDEX);
+  size_t      len;
+  char const *key = luaL_checklstring(L,2,&len);
+  size_t      lo  = 0;
+  size_t      hi  = idx->nkeys;
+  lua_Integer cnt = 0;
+  
+  while(lo < hi)
+  {
+    size_t      mid = lo + (hi - lo) / 2;
+    size_t      klen;
+    char const *k   = cbor_cL_index_key(L,idx,mid,&klen);
+    
+    if (cbor_ci_index_keycmp(k,klen,key,len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  
+  for ( ; lo < idx->nkeys ; lo++)
+  {
+    size_t      klen;
+    char const *k = cbor_cL_index_key(L,idx,lo,&klen);
+    size_t      item;
+    
+    if (cbor_ci_index_keycmp(k,klen,key,len) != 0)
+      break;
+    item = cbor_ci_index_get(idx->kitem,lo);
+    if (item >= idx->n)
+      return luaL_error(L,"invalid index");
+    if (cnt == 0)
+      lua_newtable(L);
+    lua_pushinteger(L,item + 1);
+    lua_rawseti(L,-2,++cnt);
+  }
+  
+  if (cnt == 0)
+    lua_pushnil(L);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	s = idx:pack([blob,path])
+* Desc:		Return the index in a portable form
+* Input:	blob (binary/optional) the indexed data (string or mmap)
+*		path (array/optional) path to a key in each item (see
+*		cbor_c.locate())
+* Return:	s (binary) packed index
+*
+* Note:		Pass s to cbor_c.loadindex() (in the same, or another, Lua
+*		state) to open the index.  If a path is given, the encoded
+*		key found in each item is saved (sorted) as well, for use
+*		by idx:find().  Items without the key are left out of the
+*		keys.
+*******************************************************************/
+
+static int cbor_clua_index_pack(lua_State *L)
+{
+  index__s    *idx     = luaL_checkudata(L,1,CBOR_INDEX);
+  char const  *packet  = NULL;
+  size_t       packlen = 0;
+  ikey__s     *keys    = NULL;
+  size_t       nkeys   = 0;
+  size_t       klen    = 0;
+  luaL_Buffer  buf;
+  uint8_t      b[8];
+  size_t       start;
+  size_t       end;
+  size_t       i;
+  
+  if (!lua_isnoneornil(L,3))
+  {
+    packet = cbor_cL_checkblob(L,2,&packlen);
+    luaL_checktype(L,3,LUA_TTABLE);
+    
+    /*-------------------------------------------------------------------
+    ; The keys are gathered in a userdata, which the garbage collector
+    ; will clean up if an error is thrown.
+    ;--------------------------------------------------------------------*/
+    
+    if (idx->n > SIZE_MAX / sizeof(ikey__s))
+      return luaL_error(L,"not enough memory");
+    keys = lua_newuserdata(L,idx->n * sizeof(ikey__s) + 1);
+    
+    for (i = 0 ; i < idx->n ; i++)
+    {
+      size_t pos;
+      int    rc;
+      
+      cbor_cL_index_item(L,idx,i,&start,&end);
+      if (end > packlen)
+        return luaL_error(L,"index doesn't match data");
+      
+      pos = start;
+      if (!cbor_cL_locate(L,packet,end,&pos,3))
+        continue;
+      
+      start = pos;
+      if ((rc = cbor_cL_skip(L,packet,end,&pos)) != CBOR_OKAY)
+        return cbor_cL_throw(L,pos + 1,"%s",m_cbor_errors[rc]);
+      
+      keys[nkeys].key  = &packet[start];
+      keys[nkeys].len  = pos - start;
+      keys[nkeys].item = i;
+      klen            += pos - start;
+      nkeys++;
+    }
+    
+    qsort(keys,nkeys,sizeof(ikey__s),cbor_ci_index_sortkeys);
+  }
+  
+  luaL_buffinit(L,&buf);
+  luaL_addlstring(&buf,CBOR_INDEXMAGIC,8);
+  cbor_ci_putbytes(b,idx->n,8,true);
+  luaL_addlstring(&buf,(char *)b,8);
+  cbor_ci_putbytes(b,nkeys,8,true);
+  luaL_addlstring(&buf,(char *)b,8);
+  cbor_ci_putbytes(b,klen,8,true);
+  luaL_addlstring(&buf,(char *)b,8);
+  
+  for (i = 0 ; i < idx->n ; i++)
+  {
+    cbor_cL_index_item(L,idx,i,&start,&end);
+    cbor_ci_putbytes(b,start,8,true);
+    luaL_addlstring(&buf,(char *)b,8);
+  }
+  
+  if (idx->n > 0)
+    cbor_cL_index_item(L,idx,idx->n - 1,&start,&end);
+  else
+    end = idx->off != NULL ? idx->off[0] : cbor_ci_index_get(idx->data,0);
+  cbor_ci_putbytes(b,end,8,true);
+  luaL_addlstring(&buf,(char *)b,8);
+  
+  for (i = 0 , start = 0 ; i <= nkeys ; i++)
+  {
+    cbor_ci_putbytes(b,start,8,true);
+    luaL_addlstring(&buf,(char *)b,8);
+    if (i < nkeys)
+      start += keys[i].len;
+  }
+  
+  for (i = 0 ; i < nkeys ; i++)
+  {
+    cbor_ci_putbytes(b,keys[i].item,8,true);
+    luaL_addlstring(&buf,(char *)b,8);
+  }
+  
+  for (i = 0 ; i < nkeys ; i++)
+    luaL_addlstring(&buf,keys[i].key,keys[i].len);
+  
+  luaL_pushresult(&buf);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_index___len(lua_State *L)
+{
+  index__s *idx = luaL_checkudata(L,1,CBOR_INDEX);
+  lua_pushinteger(L,idx->n);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_index___gc(lua_State *L)
+{
+  index__s *idx = luaL_checkudata(L,1,CBOR_INDEX);
+  free(idx->off);
+  idx->off = NULL;
+  idx->n   = 0;
+  return 0;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_index_meta[] =
+{
+  { "item"	, cbor_clua_index_item	} ,
+  { "find"	, cbor_clua_index_find	} ,
+  { "pack"	, cbor_clua_index_pack	} ,
+  { "__len"	, cbor_clua_index___len	} ,
+  { "__gc"	, cbor_clua_index___gc	} ,
+  { NULL	, NULL			}
+};
+
+/**************************************************************************
+*
+*                         STREAMING DECODER
+*
+* A decoder object buffers partial input until a complete item has been
+* received, and returns each complete item as its own CBOR string (to be
+* handed to cbor_c.decode_all() or any other decoder).
+*
+***************************************************************************/
+
+#define CBOR_DECODER	"org.conman.cbor_c:decoder"
+
+typedef struct
+{
+  buffer__s buf;
+  size_t    start;      /* start of the current item in buf */
+  size_t    pos;        /* where scanning resumes in buf */
+  size_t    offset;     /* stream offset of buf.data[0] */
+  int       error;      /* once an error, always an error */
+  size_t    errpos;
+  scan__s   scan;       /* frames follow the decoder__s */
+} decoder__s;
+
+/******************************************************************
+* Usage:	dec = cbor_c.decoder()
+* Desc:		Create a streaming decoder
+* Return:	dec (userdata) decoder
+*******************************************************************/
+
+static int cbor_clua_decoder(lua_State *L)
+{
+  decoder__s *dec;
+  size_t      depth;
+  
+  assert(L != NULL);
+  
+  depth         = (size_t)cbor_cL_limits(L)->depth;
+  dec           = lua_newuserdata(L,sizeof(decoder__s) + depth * sizeof(frame__s));
+  dec->buf.data = NULL;
+  dec->buf.used = 0;
+  dec->buf.size = 0;
+  dec->start    = 0;
+  dec->pos      = 0;
+  dec->offset   = 0;
+  dec->error    = CBOR_OKAY;
+  dec->errpos   = 0;
+  cbor_ci_scan_init(&dec->scan,(frame__s *)(dec + 1),depth);
+  luaL_getmetatable(L,CBOR_DECODER);
+  lua_setmetatable(L,-2);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	items = dec:feed(data)
+* Desc:		Feed more data into the decoder
+* Input:	data (binary) more CBOR data
+* Return:	items (table) array of complete items (CBOR encoded)
+*
+* Note:		The number of items is in field 'n'.
+*
+* Note:		Throws an error of the form { pos = n , msg = "text" },
+*		where pos is the offset into the stream.  If data completes
+*		items before the error, they're returned, and the error is
+*		thrown by the next call.  Once an error is thrown, any
+*		further call will throw the same error.
+*******************************************************************/
+
+static int cbor_clua_decoder_feed(lua_State *L)
+{
+  decoder__s  *dec = luaL_checkudata(L,1,CBOR_DECODER);
+  char const  *data;
+  size_t       len;
+  lua_Integer  n   = 0;
+  
+  data = luaL_checklstring(L,2,&len);
+  
+  if (dec->error != CBOR_OKAY)
+    return cbor_cL_throw(L,dec->errpos,"%s",m_cbor_errors[dec->error]);
+  
+  lua_settop(L,2);
+  lua_newtable(L);
+  
+  if (len > 0)
+    cbor_cB_addlstring(L,&dec->buf,data,len);
+  
+  while(dec->pos < dec->buf.used)
+  {
+    int rc = cbor_ci_scan(&dec->scan,dec->buf.data,dec->buf.used,&dec->pos);
+    
+    if (rc == CBOR_EMOREINPUT)
+      break;
+    
+    if (rc != CBOR_OKAY)
+    {
+      dec->error  = rc;
+      dec->errpos = dec->offset + dec->pos + 1;
+      if (n == 0)
+        return cbor_cL_throw(L,dec->errpos,"%s",m_cbor_errors[rc]);
+      break; /* hand back what we have; the next call throws */
+    }
+    
+    lua_pushlstring(L,&dec->buf.data[dec->start],dec->pos - dec->start);
+    lua_rawseti(L,3,++n);
+    dec->start = dec->pos;
+  }
+  
+  /*---------------------------------------------------------------------
+  ; Drop the items we've returned.  This only moves the data of a partial
+  ; item once, as afterwards it starts at the front of the buffer.
+  ;----------------------------------------------------------------------*/
+  
+  if (dec->start > 0)
+  {
+    memmove(dec->buf.data,&dec->buf.data[dec->start],dec->buf.used - dec->start);
+    dec->buf.used -= dec->start;
+    dec->pos      -= dec->start;
+    dec->offset   += dec->start;
+    dec->start     = 0;
+  }
+  
+  lua_pushinteger(L,n);
+  lua_setfield(L,3,"n");
+  return 1;
+}
+
+/******************************************************************
+* Usage:	size = dec:buffered()
+* Desc:		Return the amount of data buffered for a partial item
+* Return:	size (integer) number of bytes buffered
+*******************************************************************/
+
+static int cbor_clua_decoder_buffered(lua_State *L)
+{
+  decoder__s *dec = luaL_checkudata(L,1,CBOR_DECODER);
+  lua_pushinteger(L,dec->buf.used - dec->start);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_decoder___gc(lua_State *L)
+{
+  decoder__s *dec = luaL_checkudata(L,1,CBOR_DECODER);
+  cbor_cB_free(L,&dec->buf);
+  return 0;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_decoder_meta[] =
+{
+  { "feed"	, cbor_clua_decoder_feed	} ,
+  { "buffered"	, cbor_clua_decoder_buffered	} ,
+  { "__gc"	, cbor_clua_decoder___gc	} ,
+  { NULL	, NULL				}
+};
+
+/**************************************************************************
+*
+*                           STREAMING ENCODER
+*
+* A writer encodes values straight into its own buffer, and hands the
+* buffer to a sink (a function, or anything with a write() method, like a
+* file) once it fills past a high-water mark.  The buffer is reused after
+* each flush, so memory use stays around the high-water mark no matter how
+* much is written.  Indefinite ARRAYs and MAPs can be opened and closed
+* around the values.
+*
+***************************************************************************/
+
+#define CBOR_WRITER	"org.conman.cbor_c:writer"
+
+typedef struct
+{
+  buffer__s buf;
+  size_t    hiwater;
+  size_t    mark;       /* start of the value being encoded */
+  bool      busy;       /* set while encoding a value */
+  size_t    depth;      /* number of open indefinite items */
+} writer__s;
+
+/**************************************************************************
+* Return the writer at index 1.  If the last value failed to encode, its
+* partial encoding is dropped here, so a thrown error never leaves half a
+* value in the output.
+***************************************************************************/
+
+static writer__s *cbor_cL_towriter(lua_State *L)
+{
+  writer__s *w = luaL_checkudata(L,1,CBOR_WRITER);
+  
+  if (w->busy)
+  {
+    w->buf.used = w->mark;
+    w->busy     = false;
+  }
+  
+  return w;
+}
+
+/**************************************************************************
+* Push field n (1 for the sink, 2 for the encoding context) of the writer
+* at index 1.
+***************************************************************************/
+
+static void cbor_cL_writer_field(lua_State *L,int n)
+{
+  assert(L != NULL);
+  
+#if LUA_VERSION_NUM == 501
+  lua_getfenv(L,1);
+#else
+  lua_getuservalue(L,1);
+#endif
+  lua_rawgeti(L,-1,n);
+  lua_replace(L,-2);
+}
+
+/**************************************************************************
+* Hand any buffered data to the sink.  The sink can signal an error by
+* returning nil (or false) and an error; the data then stays buffered.
+***************************************************************************/
+
+static void cbor_cL_writer_flush(lua_State *L,writer__s *w)
+{
+  int top = lua_gettop(L);
+  
+  assert(L != NULL);
+  assert(w != NULL);
+  
+  if (w->buf.used == 0)
+    return;
+  
+  cbor_cL_writer_field(L,1);
+  if (lua_isfunction(L,-1))
+  {
+    lua_pushlstring(L,w->buf.data,w->buf.used);
+    lua_call(L,1,2);
+  }
+  else
+  {
+    lua_getfield(L,-1,"write");
+    lua_insert(L,-2);
+    lua_pushlstring(L,w->buf.data,w->buf.used);
+    lua_call(L,2,2);
+  }
+  
+  if (!lua_toboolean(L,-2) && !lua_isnil(L,-1))
+    lua_error(L);
+  
+  lua_settop(L,top);
+  w->buf.used = 0;
+}
+
+/**************************************************************************/
+
+static int cbor_cL_writer_done(lua_State *L,writer__s *w)
+{
+  if (w->buf.used >= w->hiwater)
+    cbor_cL_writer_flush(L,w);
+  lua_settop(L,1);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	w = cbor_c.writer(sink,ctx[,size])
+* Desc:		Create a streaming encoder
+* Input:	sink (function/table/userdata) receiver of encoded data
+*		ctx (table) encoding context (see cbor_c.encode_all())
+*		size (integer/optional) high-water mark (default 65536)
+* Return:	w (userdata) writer
+*
+* Note:		If sink is a function, it's called as sink(data);
+*		otherwise, as sink:write(data).  Either way, returning nil
+*		(or false) and an error will throw the error.
+*******************************************************************/
+
+static int cbor_clua_writer(lua_State *L)
+{
+  lua_Integer  size = luaL_optinteger(L,3,65536);
+  writer__s   *w;
+  
+  assert(L != NULL);
+  
+  luaL_checkany(L,1);
+  luaL_checktype(L,2,LUA_TTABLE);
+  luaL_argcheck(L,size > 0,3,"high-water mark must be positive");
+  
+  w           = lua_newuserdata(L,sizeof(writer__s));
+  w->buf.data = NULL;
+  w->buf.used = 0;
+  w->buf.size = 0;
+  w->hiwater  = (size_t)size;
+  w->mark     = 0;
+  w->busy     = false;
+  w->depth    = 0;
+  luaL_getmetatable(L,CBOR_WRITER);
+  lua_setmetatable(L,-2);
+  
+  lua_createtable(L,2,0);
+  lua_pushvalue(L,1);
+  lua_rawseti(L,-2,1);
+  lua_pushvalue(L,2);
+  lua_rawseti(L,-2,2);
+#if LUA_VERSION_NUM == 501
+  lua_setfenv(L,-2);
+#else
+  lua_setuservalue(L,-2);
+#endif
+  return 1;
+}
+
+/******************************************************************
+* Usage:	w = w:encode(value[,sref][,stref])
+* Desc:		Encode a value (as cbor.encode()) to the writer
+* Input:	value (any) value to encode
+*		sref (table/optional) shared reference table
+*		stref (table/optional) shared string reference table
+* Return:	w (userdata) the writer
+*******************************************************************/
+
+static int cbor_clua_writer_encode(lua_State *L)
+{
+  writer__s *w = cbor_cL_towriter(L);
+  encode__s  e;
+  
+  lua_settop(L,4);
+  cbor_cL_writer_field(L,2);
+  cbor_cL_encode_init(&e,L,5,3,4);
+  e.buf = &w->buf;
+  
+  w->mark = w->buf.used;
+  w->busy = true;
+  cbor_cL_encode_top(&e,2);
+  w->busy = false;
+  
+  return cbor_cL_writer_done(L,w);
+}
+
+/******************************************************************
+* Usage:	w = w:raw(blob)
+* Desc:		Write already encoded CBOR data to the writer
+* Input:	blob (binary) CBOR encoded data
+* Return:	w (userdata) the writer
+*******************************************************************/
+
+static int cbor_clua_writer_raw(lua_State *L)
+{
+  writer__s  *w = cbor_cL_towriter(L);
+  size_t      len;
+  char const *blob = cbor_cL_checkbytes(L,2,&len);
+  
+  cbor_cB_addlstring(L,&w->buf,blob,len);
+  return cbor_cL_writer_done(L,w);
+}
+
+/******************************************************************
+* Usage:	w = w:array()
+*		w = w:map()
+* Desc:		Open an indefinite ARRAY or MAP
+* Return:	w (userdata) the writer
+*
+* Note:		Close it with w:close().  For a MAP, encode the keys and
+*		values in turn.
+*******************************************************************/
+
+static int cbor_cL_writer_open(lua_State *L,int type)
+{
+  writer__s *w = cbor_cL_towriter(L);
+  
+  if (w->depth >= CBOR_MAXDEPTH)
+    return luaL_error(L,"nesting too deep");
+  
+  cbor_cB_reserve(L,&w->buf,1);
+  w->buf.data[w->buf.used++] = (char)(type | 31);
+  w->depth++;
+  return cbor_cL_writer_done(L,w);
+}
+
+static int cbor_clua_writer_array(lua_State *L)
+{
+  return cbor_cL_writer_open(L,0x80);
+}
+
+static int cbor_clua_writer_map(lua_State *L)
+{
+  return cbor_cL_writer_open(L,0xA0);
+}
+
+/******************************************************************
+* Usage:	w = w:close()
+* Desc:		Close the most recently opened indefinite ARRAY or MAP
+* Return:	w (userdata) the writer
+*******************************************************************/
+
+static int cbor_clua_writer_close(lua_State *L)
+{
+  writer__s *w = cbor_cL_towriter(L);
+  
+  if (w->depth == 0)
+    return luaL_error(L,"nothing to close");
+  
+  cbor_cB_reserve(L,&w->buf,1);
+  w->buf.data[w->buf.used++] = (char)0xFF;
+  w->depth--;
+  return cbor_cL_writer_done(L,w);
+}
+
+/******************************************************************
+* Usage:	w = w:flush()
+* Desc:		Hand any buffered data to the sink
+* Return:	w (userdata) the writer
+*******************************************************************/
+
+static int cbor_clua_writer_flush(lua_State *L)
+{
+  writer__s *w = cbor_cL_towriter(L);
+  
+  lua_settop(L,1);
+  cbor_cL_writer_flush(L,w);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	size,depth = w:buffered()
+* Desc:		Return the amount of data buffered, and the number of open
+*		indefinite items
+* Return:	size (integer) bytes buffered
+*		depth (integer) number of open ARRAYs and MAPs
+*******************************************************************/
+
+static int cbor_clua_writer_buffered(lua_State *L)
+{
+  writer__s *w = cbor_cL_towriter(L);
+  
+  lua_pushinteger(L,w->buf.used);
+  lua_pushinteger(L,w->depth);
+  return 2;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_writer___gc(lua_State *L)
+{
+  writer__s *w = luaL_checkudata(L,1,CBOR_WRITER);
+  cbor_cB_free(L,&w->buf);
+  return 0;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_writer_meta[] =
+{
+  { "encode"	, cbor_clua_writer_encode	} ,
+  { "raw"	, cbor_clua_writer_raw		} ,
+  { "array"	, cbor_clua_writer_array	} ,
+  { "map"	, cbor_clua_writer_map		} ,
+  { "close"	, cbor_clua_writer_close	} ,
+  { "flush"	, cbor_clua_writer_flush	} ,
+  { "buffered"	, cbor_clua_writer_buffered	} ,
+  { "__gc"	, cbor_clua_writer___gc		} ,
+  { NULL	, NULL				}
+};
+
+/**************************************************************************
+*
+*                           JSON TRANSCODING
+*
+* CBOR is converted straight to JSON text (and back) in one buffer,
+* without building any Lua values in between.  CBOR to JSON follows
+* RFC-8949 section 6.1:  BINs become base64url strings (without padding),
+* bignums (tags 2 and 3) base64url strings (with a leading "~" for tag 3),
+* tags 21 to 23 select the encoding of the BINs they cover, other tags are
+* dropped, and NaN, the infinities, undefined and the other simple values
+* become null.  MAP keys that are integers or BINs are turned into
+* strings; any other non-TEXT key is an error.  JSON to CBOR gives
+* integers where they fit, floats in their shortest form otherwise, and
+* definite length TEXT, ARRAYs and MAPs.
+*
+***************************************************************************/
+
+typedef struct
+{
+  lua_State  *L;
+  buffer__s  *buf;
+  buffer__s  *tmp;      /* indefinite strings, escaped text, numbers */
+  char const *packet;
+  size_t      packlen;
+  size_t      pos;
+  int         depth;
+  int         maxdepth;
+  int         names;    /* the rest are only used for diagnostic output */
+  size_t      max;
+  bool        full;
+} json__s;
+
+static char const m_b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static char const m_b64[]    = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char const m_b16[]    = "0123456789ABCDEF";
+
+/**************************************************************************/
+
+static void cbor_cL_json_error(json__s *j,size_t pos,int rc)
+{
+  assert(j != NULL);
+  cbor_cL_throw(j->L,pos + 1,"%s",m_cbor_errors[rc]);
+}
+
+/**************************************************************************/
+
+static void cbor_cL_json_enter(json__s *j,size_t start)
+{
+  assert(j != NULL);
+  
+  if (++j->depth > j->maxdepth)
+    cbor_cL_json_error(j,start,CBOR_ETOODEEP);
+  luaL_checkstack(j->L,4,"nesting too deep");
+}
+
+/**************************************************************************/
+
+static void cbor_cL_json_add(json__s *j,char const *s,size_t len)
+{
+  assert(j != NULL);
+  cbor_cB_addlstring(j->L,j->buf,s,len);
+}
+
+/**************************************************************************
+* Read the next CBOR header, throwing on error.
+***************************************************************************/
+
+static void cbor_cL_json_header(
+        json__s                *j,
+        int                    *ptype,
+        int                    *pinfo,
+        unsigned long long int *pvalue
+)
+{
+  size_t start;
+  int    rc;
+  
+  assert(j != NULL);
+  
+  start = j->pos;
+  rc    = cbor_ci_header(ptype,pinfo,pvalue,j->packet,j->packlen,&j->pos);
+  if (rc != CBOR_OKAY)
+    cbor_cL_json_error(j,start,rc == CBOR_ENOINPUT ? CBOR_EMOREINPUT : rc);
+}
+
+/**************************************************************************
+* Return the contents of a BIN or TEXT.  The chunks of an indefinite
+* string are gathered into the scratch buffer.
+***************************************************************************/
+
+static char const *cbor_cL_json_bytes(
+        json__s                *j,
+        int                     type,
+        int                     info,
+        unsigned long long int  value,
+        size_t                 *plen
+)
+{
+  char const *s;
+  
+  assert(j    != NULL);
+  assert(plen != NULL);
+  
+  if (info < 31)
+  {
+    if (value > j->packlen - j->pos)
+      cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+    s       = &j->packet[j->pos];
+    *plen   = (size_t)value;
+    j->pos += (size_t)value;
+    return s;
+  }
+  
+  j->tmp->used = 0;
+  
+  while(true)
+  {
+    size_t start = j->pos;
+    int    ctype;
+    int    cinfo;
+    
+    if (j->pos >= j->packlen)
+      cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+    if ((unsigned char)j->packet[j->pos] == 0xFF)
+    {
+      j->pos++;
+      break;
+    }
+    
+    cbor_cL_json_header(j,&ctype,&cinfo,&value);
+    if ((ctype != type) || (cinfo == 31))
+      cbor_cL_json_error(j,start,CBOR_EINVALID);
+    if (value > j->packlen - j->pos)
+      cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+    cbor_cB_addlstring(j->L,j->tmp,&j->packet[j->pos],(size_t)value);
+    j->pos += (size_t)value;
+  }
+  
+  *plen = j->tmp->used;
+  return j->tmp->used > 0 ? j->tmp->data : "";
+}
+
+/**************************************************************************
+* Add bytes as base64url (the default), base64 (tag 22) or base16 (tag
+* 23).  Only base64 is padded.
+***************************************************************************/
+
+static void cbor_cL_json_base(json__s *j,char const *src,size_t len,int enc)
+{
+  uint8_t const *s = (uint8_t const *)src;
+  char const    *alphabet;
+  char          *d;
+  size_t         i;
+  
+  assert(j != NULL);
+  assert(s != NULL);
+  
+  if (enc == 23)
+  {
+    if (len > SIZE_MAX / 2)
+      luaL_error(j->L,"not enough memory");
+    cbor_cB_reserve(j->L,j->buf,len * 2);
+    d = &j->buf->data[j->buf->used];
+    for (i = 0 ; i < len ; i++)
+    {
+      *d++ = m_b16[s[i] >> 4];
+      *d++ = m_b16[s[i] & 15];
+    }
+    j->buf->used += len * 2;
+    return;
+  }
+  
+  alphabet = enc == 22 ? m_b64 : m_b64url;
+  if (len / 3 > SIZE_MAX / 4 - 1)
+    luaL_error(j->L,"not enough memory");
+  cbor_cB_reserve(j->L,j->buf,(len / 3 + 1) * 4);
+  d = &j->buf->data[j->buf->used];
+  
+  for (i = 0 ; len - i >= 3 ; i += 3)
+  {
+    *d++ = alphabet[s[i] >> 2];
+    *d++ = alphabet[((s[i] & 3) << 4) | (s[i + 1] >> 4)];
+    *d++ = alphabet[((s[i + 1] & 15) << 2) | (s[i + 2] >> 6)];
+    *d++ = alphabet[s[i + 2] & 63];
+  }
+  
+  if (len - i == 1)
+  {
+    *d++ = alphabet[s[i] >> 2];
+    *d++ = alphabet[(s[i] & 3) << 4];
+    if (enc == 22)
+    {
+      *d++ = '=';
+      *d++ = '=';
+    }
+  }
+  else if (len - i == 2)
+  {
+    *d++ = alphabet[s[i] >> 2];
+    *d++ = alphabet[((s[i] & 3) << 4) | (s[i + 1] >> 4)];
+    *d++ = alphabet[(s[i + 1] & 15) << 2];
+    if (enc == 22)
+      *d++ = '=';
+  }
+  
+  j->buf->used = (size_t)(d - j->buf->data);
+}
+
+/**************************************************************************
+* Add a JSON string.  Runs of characters that don't need escaping are
+* checked with cbor_ci_isutf8() and copied in one go; false is returned if
+* one isn't UTF-8.  Control codes never appear inside a UTF-8 sequence, so
+* splitting the runs at them (and at DEL, which is escaped here since
+* cbor_ci_isutf8() doesn't take it) can't hide a bad one.
+***************************************************************************/
+
+static bool cbor_cL_json_text(json__s *j,char const *s,size_t len)
+{
+  size_t i = 0;
+  
+  assert(j != NULL);
+  assert(s != NULL);
+  
+  cbor_cL_json_add(j,"\"",1);
+  
+  while(i < len)
+  {
+    size_t        run = i;
+    unsigned char c;
+    
+    while((run < len) && ((unsigned char)s[run] >= 0x20) && (s[run] != 0x7F) && (s[run] != '"') && (s[run] != '\\'))
+      run++;
+    if (run > i)
+    {
+      if (!cbor_ci_isutf8((uint8_t const *)&s[i],run - i))
+        return false;
+      cbor_cL_json_add(j,&s[i],run - i);
+      i = run;
+      if (i == len)
+        break;
+    }
+    
+    c = (unsigned char)s[i++];
+    switch(c)
+    {
+      case '"':  cbor_cL_json_add(j,"\\\"",2); break;
+      case '\\': cbor_cL_json_add(j,"\\\\",2); break;
+      case '\b': cbor_cL_json_add(j,"\\b",2);  break;
+      case '\f': cbor_cL_json_add(j,"\\f",2);  break;
+      case '\n': cbor_cL_json_add(j,"\\n",2);  break;
+      case '\r': cbor_cL_json_add(j,"\\r",2);  break;
+      case '\t': cbor_cL_json_add(j,"\\t",2);  break;
+      default:
+           {
+             char esc[8];
+             
+             esc[0] = '\\';
+             esc[1] = 'u';
+             esc[2] = '0';
+             esc[3] = '0';
+             esc[4] = m_b16[c >> 4];
+             esc[5] = m_b16[c & 15];
+             cbor_cL_json_add(j,esc,6);
+           }
+           break;
+    }
+  }
+  
+  cbor_cL_json_add(j,"\"",1);
+  return true;
+}
+
+/**************************************************************************
+* Add a float, with the fewest digits that give the same value back.  The
+* decimal point from the C locale is swapped for a period.
+***************************************************************************/
+
+static void cbor_cL_json_float(json__s *j,double value)
+{
+  char  num[40];
+  char  dp;
+  int   len = 0;
+  
+  assert(j != NULL);
+  
+  if (!isfinite(value))
+  {
+    cbor_cL_json_add(j,"null",4);
+    return;
+  }
+  
+  for (int prec = 15 ; prec <= 17 ; prec++)
+  {
+    len = snprintf(num,sizeof(num),"%.*g",prec,value);
+    if (strtod(num,NULL) == value)
+      break;
+  }
+  
+  dp = localeconv()->decimal_point[0];
+  if (dp != '.')
+  {
+    char *p = memchr(num,dp,(size_t)len);
+    if (p != NULL)
+      *p = '.';
+  }
+  
+  cbor_cL_json_add(j,num,(size_t)len);
+}
+
+/**************************************************************************
+* Convert the CBOR item at j->pos to JSON.  enc is the encoding for BINs
+* (0 for the default, or tag 21, 22 or 23).
+***************************************************************************/
+
+static void cbor_cL_json_item(json__s *j,int enc,bool iskey)
+{
+  unsigned long long int  value;
+  size_t                  start;
+  size_t                  len;
+  char const             *s;
+  char                    num[32];
+  int                     type;
+  int                     info;
+  
+  assert(j != NULL);
+  
+  start = j->pos;
+  cbor_cL_json_header(j,&type,&info,&value);
+  
+  switch(type)
+  {
+    case 0x00:
+         cbor_cL_json_add(j,num,(size_t)snprintf(num,sizeof(num),iskey ? "\"%llu\"" : "%llu",value));
+         break;
+         
+    case 0x20:
+         if (value == ULLONG_MAX)
+           cbor_cL_json_add(j,num,(size_t)snprintf(num,sizeof(num),iskey ? "\"-%s\"" : "-%s","18446744073709551616"));
+         else
+           cbor_cL_json_add(j,num,(size_t)snprintf(num,sizeof(num),iskey ? "\"-%llu\"" : "-%llu",value + 1));
+         break;
+         
+    case 0x40:
+         s = cbor_cL_json_bytes(j,type,info,value,&len);
+         cbor_cL_json_add(j,"\"",1);
+         cbor_cL_json_base(j,s,len,enc);
+         cbor_cL_json_add(j,"\"",1);
+         break;
+         
+    case 0x60:
+         s = cbor_cL_json_bytes(j,type,info,value,&len);
+         if (!cbor_cL_json_text(j,s,len))
+           cbor_cL_throw(j->L,start + 1,"TEXT: not UTF-8 text");
+         break;
+         
+    case 0x80:
+    case 0xA0:
+         if (iskey)
+           cbor_cL_throw(j->L,start + 1,"MAP: key can't be converted to JSON");
+         
+         cbor_cL_json_enter(j,start);
+         cbor_cL_json_add(j,type == 0x80 ? "[" : "{",1);
+         
+         for (unsigned long long int cnt = 0 ; (info == 31) || (cnt < value) ; cnt++)
+         {
+           if (info == 31)
+           {
+             if (j->pos >= j->packlen)
+               cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+             if ((unsigned char)j->packet[j->pos] == 0xFF)
+             {
+               j->pos++;
+               break;
+             }
+           }
+           
+           if (cnt > 0)
+             cbor_cL_json_add(j,",",1);
+           if (type == 0xA0)
+           {
+             cbor_cL_json_item(j,enc,true);
+             cbor_cL_json_add(j,":",1);
+           }
+           cbor_cL_json_item(j,enc,false);
+         }
+         
+         cbor_cL_json_add(j,type == 0x80 ? "]" : "}",1);
+         j->depth--;
+         break;
+         
+    case 0xC0:
+         cbor_cL_json_enter(j,start);
+         if (
+                 ((value == 2) || (value == 3))
+              && (j->pos < j->packlen)
+              && (((unsigned char)j->packet[j->pos] & 0xE0) == 0x40)
+            )
+         {
+           bool neg = value == 3;
+           
+           cbor_cL_json_header(j,&type,&info,&value);
+           s = cbor_cL_json_bytes(j,0x40,info,value,&len);
+           cbor_cL_json_add(j,neg ? "\"~" : "\"",neg ? 2 : 1);
+           cbor_cL_json_base(j,s,len,0);
+           cbor_cL_json_add(j,"\"",1);
+         }
+         else
+           cbor_cL_json_item(j,(value >= 21) && (value <= 23) ? (int)value : enc,iskey);
+         j->depth--;
+         break;
+         
+    case 0xE0:
+         if (info == 31)
+           cbor_cL_json_error(j,start,CBOR_EINVALID);
+         if (iskey)
+           cbor_cL_throw(j->L,start + 1,"MAP: key can't be converted to JSON");
+         if (info == 20)
+           cbor_cL_json_add(j,"false",5);
+         else if (info == 21)
+           cbor_cL_json_add(j,"true",4);
+         else if ((info >= 25) && (info <= 27))
+           cbor_cL_json_float(j,cbor_ci_double(info,value));
+         else
+           cbor_cL_json_add(j,"null",4);
+         break;
+         
+    default:
+         assert(0);
+         break;
+  }
+}
+
+/**************************************************************************/
+
+static void cbor_cL_json_ws(json__s *j)
+{
+  assert(j != NULL);
+  
+  while(
+            (j->pos < j->packlen)
+         && (
+                 (j->packet[j->pos] == ' ')
+              || (j->packet[j->pos] == '\t')
+              || (j->packet[j->pos] == '\n')
+              || (j->packet[j->pos] == '\r')
+            )
+       )
+    j->pos++;
+}
+
+/**************************************************************************
+* Return the next character (after any whitespace), throwing if the text
+* has run out.
+***************************************************************************/
+
+static char cbor_cL_json_peek(json__s *j)
+{
+  assert(j != NULL);
+  
+  cbor_cL_json_ws(j);
+  if (j->pos >= j->packlen)
+    cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+  return j->packet[j->pos];
+}
+
+/**************************************************************************/
+
+static int cbor_ci_json_hex(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  else if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  else if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  else
+    return -1;
+}
+
+/**************************************************************************
+* Read the four hex digits of a \u escape.
+***************************************************************************/
+
+static unsigned long cbor_cL_json_u4(json__s *j)
+{
+  unsigned long u = 0;
+  
+  assert(j != NULL);
+  
+  if (j->packlen - j->pos < 4)
+    cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+  
+  for (int i = 0 ; i < 4 ; i++)
+  {
+    int h = cbor_ci_json_hex(j->packet[j->pos]);
+    if (h < 0)
+      cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+    u = (u << 4) | (unsigned long)h;
+    j->pos++;
+  }
+  
+  return u;
+}
+
+/**************************************************************************
+* Convert a JSON string (j->pos is at the opening quote) to a CBOR TEXT.
+* A string without escapes is copied straight from the input.
+***************************************************************************/
+
+static void cbor_cL_json_string(json__s *j)
+{
+  size_t begin;
+  
+  assert(j != NULL);
+  assert(j->packet[j->pos] == '"');
+  
+  begin = ++j->pos;
+  while(
+            (j->pos < j->packlen)
+         && (j->packet[j->pos] != '"')
+         && (j->packet[j->pos] != '\\')
+         && ((unsigned char)j->packet[j->pos] >= 0x20)
+       )
+    j->pos++;
+  
+  if (j->pos >= j->packlen)
+    cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+  
+  if (j->packet[j->pos] == '"')
+  {
+    cbor_cB_addvalue(j->L,j->buf,0x60,j->pos - begin);
+    cbor_cB_addlstring(j->L,j->buf,&j->packet[begin],j->pos - begin);
+    j->pos++;
+    return;
+  }
+  
+  j->tmp->used = 0;
+  cbor_cB_addlstring(j->L,j->tmp,&j->packet[begin],j->pos - begin);
+  
+  while(true)
+  {
+    unsigned long  u;
+    char           utf8[4];
+    size_t         len;
+    char           c;
+    
+    if (j->pos >= j->packlen)
+      cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+    
+    c = j->packet[j->pos];
+    if (c == '"')
+    {
+      j->pos++;
+      break;
+    }
+    
+    if ((unsigned char)c < 0x20)
+      cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+    
+    if (c != '\\')
+    {
+      cbor_cB_addlstring(j->L,j->tmp,&j->packet[j->pos++],1);
+      continue;
+    }
+    
+    if (++j->pos >= j->packlen)
+      cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+    
+    switch(j->packet[j->pos++])
+    {
+      case '"':  cbor_cB_addlstring(j->L,j->tmp,"\"",1); continue;
+      case '\\': cbor_cB_addlstring(j->L,j->tmp,"\\",1); continue;
+      case '/':  cbor_cB_addlstring(j->L,j->tmp,"/",1);  continue;
+      case 'b':  cbor_cB_addlstring(j->L,j->tmp,"\b",1); continue;
+      case 'f':  cbor_cB_addlstring(j->L,j->tmp,"\f",1); continue;
+      case 'n':  cbor_cB_addlstring(j->L,j->tmp,"\n",1); continue;
+      case 'r':  cbor_cB_addlstring(j->L,j->tmp,"\r",1); continue;
+      case 't':  cbor_cB_addlstring(j->L,j->tmp,"\t",1); continue;
+      case 'u':  break;
+      default:   cbor_cL_json_error(j,j->pos - 1,CBOR_EINVALID);
+    }
+    
+    /*-------------------------------------------------------------------
+    ; A high surrogate has to be followed by an escaped low surrogate; a
+    ; low surrogate on its own is invalid.
+    ;--------------------------------------------------------------------*/
+    
+    u = cbor_cL_json_u4(j);
+    if ((u >= 0xD800) && (u <= 0xDBFF))
+    {
+      unsigned long lo;
+      
+      if ((j->packlen - j->pos < 2) || (j->packet[j->pos] != '\\') || (j->packet[j->pos + 1] != 'u'))
+        cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+      j->pos += 2;
+      lo = cbor_cL_json_u4(j);
+      if ((lo < 0xDC00) || (lo > 0xDFFF))
+        cbor_cL_json_error(j,j->pos - 4,CBOR_EINVALID);
+      u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+    }
+    else if ((u >= 0xDC00) && (u <= 0xDFFF))
+      cbor_cL_json_error(j,j->pos - 4,CBOR_EINVALID);
+    
+    if (u < 0x80)
+    {
+      utf8[0] = (char)u;
+      len     = 1;
+    }
+    else if (u < 0x800)
+    {
+      utf8[0] = (char)(0xC0 | (u >> 6));
+      utf8[1] = (char)(0x80 | (u & 0x3F));
+      len     = 2;
+    }
+    else if (u < 0x10000)
+    {
+      utf8[0] = (char)(0xE0 | (u >> 12));
+      utf8[1] = (char)(0x80 | ((u >> 6) & 0x3F));
+      utf8[2] = (char)(0x80 | (u & 0x3F));
+      len     = 3;
+    }
+    else
+    {
+      utf8[0] = (char)(0xF0 | (u >> 18));
+      utf8[1] = (char)(0x80 | ((u >> 12) & 0x3F));
+      utf8[2] = (char)(0x80 | ((u >> 6) & 0x3F));
+      utf8[3] = (char)(0x80 | (u & 0x3F));
+      len     = 4;
+    }
+    cbor_cB_addlstring(j->L,j->tmp,utf8,len);
+  }
+  
+  cbor_cB_addvalue(j->L,j->buf,0x60,j->tmp->used);
+  if (j->tmp->used > 0)
+    cbor_cB_addlstring(j->L,j->buf,j->tmp->data,j->tmp->used);
+}
+
+/**************************************************************************
+* Convert a JSON number.  Integers that fit in 64 bits (plus the sign)
+* become UINT or NINT; everything else a float.
+***************************************************************************/
+
+static void cbor_cL_json_number(json__s *j)
+{
+  unsigned long long int value = 0;
+  bool                   isint = true;
+  bool                   neg   = false;
+  bool                   max   = false; /* -2^64, which only just fits */
+  size_t                 begin = j->pos;
+  char                   dp;
+  char                  *p;
+  
+  assert(j != NULL);
+  
+  if (j->packet[j->pos] == '-')
+  {
+    neg = true;
+    j->pos++;
+  }
+  
+  if ((j->pos >= j->packlen) || (j->packet[j->pos] < '0') || (j->packet[j->pos] > '9'))
+    cbor_cL_json_error(j,j->pos,j->pos >= j->packlen ? CBOR_EMOREINPUT : CBOR_EINVALID);
+  
+  if (j->packet[j->pos] == '0')
+    j->pos++;
+  else
+  {
+    while((j->pos < j->packlen) && (j->packet[j->pos] >= '0') && (j->packet[j->pos] <= '9'))
+    {
+      unsigned int d = (unsigned int)(j->packet[j->pos++] - '0');
+      
+      if (max || (value > (ULLONG_MAX - d) / 10))
+      {
+        if (neg && !max && (value == ULLONG_MAX / 10) && (d == ULLONG_MAX % 10 + 1))
+        {
+          max   = true;
+          value = ULLONG_MAX;
+        }
+        else
+          isint = false;
+      }
+      else
+        value = value * 10 + d;
+    }
+  }
+  
+  if ((j->pos < j->packlen) && (j->packet[j->pos] == '.'))
+  {
+    isint = false;
+    j->pos++;
+    if ((j->pos >= j->packlen) || (j->packet[j->pos] < '0') || (j->packet[j->pos] > '9'))
+      cbor_cL_json_error(j,j->pos,j->pos >= j->packlen ? CBOR_EMOREINPUT : CBOR_EINVALID);
+    while((j->pos < j->packlen) && (j->packet[j->pos] >= '0') && (j->packet[j->pos] <= '9'))
+      j->pos++;
+  }
+  
+  if ((j->pos < j->packlen) && ((j->packet[j->pos] == 'e') || (j->packet[j->pos] == 'E')))
+  {
+    isint = false;
+    j->pos++;
+    if ((j->pos < j->packlen) && ((j->packet[j->pos] == '+') || (j->packet[j->pos] == '-')))
+      j->pos++;
+    if ((j->pos >= j->packlen) || (j->packet[j->pos] < '0') || (j->packet[j->pos] > '9'))
+      cbor_cL_json_error(j,j->pos,j->pos >= j->packlen ? CBOR_EMOREINPUT : CBOR_EINVALID);
+    while((j->pos < j->packlen) && (j->packet[j->pos] >= '0') && (j->packet[j->pos] <= '9'))
+      j->pos++;
+  }
+  
+  if (isint)
+  {
+    if (!neg)
+    {
+      cbor_cB_addvalue(j->L,j->buf,0x00,value);
+      return;
+    }
+    if (value == 0) /* -0 */
+    {
+      cbor_cB_addvalue(j->L,j->buf,0x00,0);
+      return;
+    }
+    cbor_cB_addvalue(j->L,j->buf,0x20,max ? value : value - 1);
+    return;
+  }
+  
+  /*---------------------------------------------------------------------
+  ; strtod() wants the decimal point of the C locale, and a terminated
+  ; string, so the number is copied to the scratch buffer.
+  ;----------------------------------------------------------------------*/
+  
+  j->tmp->used = 0;
+  cbor_cB_addlstring(j->L,j->tmp,&j->packet[begin],j->pos - begin);
+  cbor_cB_addlstring(j->L,j->tmp,"",1);
+  
+  dp = localeconv()->decimal_point[0];
+  if ((dp != '.') && ((p = strchr(j->tmp->data,'.')) != NULL))
+    *p = dp;
+  
+  cbor_cB_addfloat(j->L,j->buf,strtod(j->tmp->data,NULL));
+}
+
+/**************************************************************************
+* Convert the JSON value at j->pos to CBOR.  The counts of ARRAYs and MAPs
+* aren't known until the end, so their headers are inserted afterwards.
+***************************************************************************/
+
+static void cbor_cL_json_value(json__s *j)
+{
+  unsigned long long int  cnt;
+  size_t                  start;
+  char                    c;
+  
+  assert(j != NULL);
+  
+  c     = cbor_cL_json_peek(j);
+  start = j->pos;
+  
+  switch(c)
+  {
+    case '[':
+    case '{':
+         cbor_cL_json_enter(j,start);
+         j->pos++;
+         cnt   = 0;
+         start = j->buf->used;
+         
+         if (cbor_cL_json_peek(j) == (c == '[' ? ']' : '}'))
+           j->pos++;
+         else
+         {
+           while(true)
+           {
+             if (c == '{')
+             {
+               if (cbor_cL_json_peek(j) != '"')
+                 cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+               cbor_cL_json_string(j);
+               if (cbor_cL_json_peek(j) != ':')
+                 cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+               j->pos++;
+             }
+             
+             cbor_cL_json_value(j);
+             cnt++;
+             
+             if (cbor_cL_json_peek(j) == ',')
+             {
+               j->pos++;
+               continue;
+             }
+             if (j->packet[j->pos] != (c == '[' ? ']' : '}'))
+               cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+             j->pos++;
+             break;
+           }
+         }
+         
+         cbor_cB_insertvalue(j->L,j->buf,start,c == '[' ? 0x80 : 0xA0,cnt);
+         j->depth--;
+         break;
+         
+    case '"':
+         cbor_cL_json_string(j);
+         break;
+         
+    case 't':
+    case 'f':
+    case 'n':
+         {
+           char const *word = c == 't' ? "true" : c == 'f' ? "false" : "null";
+           size_t      len  = strlen(word);
+           
+           if ((j->packlen - j->pos < len) || (memcmp(&j->packet[j->pos],word,len) != 0))
+             cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+           j->pos += len;
+           cbor_cB_addlstring(j->L,j->buf,c == 't' ? "\xF5" : c == 'f' ? "\xF4" : "\xF6",1);
+         }
+         break;
+         
+    default:
+         if ((c == '-') || ((c >= '0') && (c <= '9')))
+           cbor_cL_json_number(j);
+         else
+           cbor_cL_json_error(j,j->pos,CBOR_EINVALID);
+         break;
+  }
+}
+
+/**************************************************************************
+* Return an optional depth argument.  The JSON code recurses on the C
+* stack, so it's held to CBOR_MAXDEPTH like cbor_c.limits().
+***************************************************************************/
+
+static lua_Integer cbor_cL_optdepth(lua_State *L,int idx,int def)
+{
+  lua_Integer depth = luaL_optinteger(L,idx,def);
+  
+  luaL_argcheck(L,(1 <= depth) && (depth <= CBOR_MAXDEPTH),idx,"depth out of range");
+  return depth;
+}
+
+/**************************************************************************/
+
+static void cbor_cL_json_init(json__s *j,lua_State *L,int depth)
+{
+  limits__s const *lim;
+  
+  assert(j != NULL);
+  assert(L != NULL);
+  
+  lim         = cbor_cL_limits(L);
+  j->L        = L;
+  j->depth    = 0;
+  j->maxdepth = (int)cbor_cL_optdepth(L,depth,lim->depth);
+  j->names    = 0;
+  j->max      = 0;
+  j->full     = false;
+  j->buf      = cbor_cL_newbuffer(L);
+  j->tmp      = cbor_cL_newbuffer(L);
+}
+
+/******************************************************************
+* Usage:	json,pos2 = cbor_c.tojson(blob[,pos][,depth])
+* Desc:		Convert a CBOR data item to JSON
+* Input:	blob (binary) binary CBOR sludge (string or mmap)
+*		pos (integer/optional) position of item
+*		depth (integer/optional) maximum nesting depth, 1 to
+*		CBOR_MAXDEPTH (default is the depth limit from
+*		cbor_c.limits())
+* Return:	json (string) JSON text
+*		pos2 (integer) position past the item
+*
+* Note:		TEXT that isn't UTF-8 is an error.
+*
+* Note:		Throws an error of the form { pos = n , msg = "text" }.
+*******************************************************************/
+
+static int cbor_clua_tojson(lua_State *L)
+{
+  json__s     j;
+  lua_Integer ipos;
+  
+  assert(L != NULL);
+  
+  j.packet = cbor_cL_checkblob(L,1,&j.packlen);
+  ipos     = luaL_optinteger(L,2,1);
+  lua_settop(L,3);
+  
+  if ((ipos < 1) || ((size_t)ipos > j.packlen))
+    return cbor_cL_throw(L,ipos,"%s",m_cbor_errors[CBOR_ENOINPUT]);
+  
+  j.pos = (size_t)ipos - 1;
+  cbor_cL_json_init(&j,L,3);
+  cbor_cL_json_item(&j,0,false);
+  
+  lua_pushlstring(L,j.buf->data != NULL ? j.buf->data : "",j.buf->used);
+  lua_pushinteger(L,j.pos + 1);
+  cbor_cB_free(L,j.buf);
+  cbor_cB_free(L,j.tmp);
+  return 2;
+}
+
+/******************************************************************
+* Usage:	blob,pos2 = cbor_c.fromjson(json[,pos][,depth])
+* Desc:		Convert a JSON value to CBOR
+* Input:	json (string) JSON text
+*		pos (integer/optional) position of value
+*		depth (integer/optional) maximum nesting depth, 1 to
+*		CBOR_MAXDEPTH (default is the depth limit from
+*		cbor_c.limits())
+* Return:	blob (binary) CBOR encoded value
+*		pos2 (integer) position past the value (and any whitespace
+*		after it)
+*
+* Note:		Throws an error of the form { pos = n , msg = "text" }.
+*******************************************************************/
+
+static int cbor_clua_fromjson(lua_State *L)
+{
+  json__s     j;
+  lua_Integer ipos;
+  
+  assert(L != NULL);
+  
+  j.packet = luaL_checklstring(L,1,&j.packlen);
+  ipos     = luaL_optinteger(L,2,1);
+  lua_settop(L,3);
+  
+  if ((ipos < 1) || ((size_t)ipos > j.packlen))
+    return cbor_cL_throw(L,ipos,"%s",m_cbor_errors[CBOR_ENOINPUT]);
+  
+  j.pos = (size_t)ipos - 1;
+  cbor_cL_json_init(&j,L,3);
+  cbor_cL_json_value(&j);
+  cbor_cL_json_ws(&j);
+  
+  lua_pushlstring(L,j.buf->data != NULL ? j.buf->data : "",j.buf->used);
+  lua_pushinteger(L,j.pos + 1);
+  cbor_cB_free(L,j.buf);
+  cbor_cB_free(L,j.tmp);
+  return 2;
+}
+
+/**************************************************************************
+*
+*                         DIAGNOSTIC NOTATION
+*
+* The CBOR diagnostic notation (RFC-8949 section 8), as produced by
+* cbormisc.diagnostic() (which now calls this) over the transcoding state
+* above.  Strings are escaped as the old safestring() in cbormisc.lua did,
+* and indefinite strings are written as (_ chunk, chunk).  Output can be
+* limited to a maximum length, in which case everything past the limit is
+* only skipped over, so even a huge item costs little more than a
+* cbor_c.skip() once the limit is reached.
+*
+***************************************************************************/
+
+static void cbor_cL_diag_add(json__s *j,char const *s,size_t len)
+{
+  assert(j != NULL);
+  
+  if (j->full)
+    return;
+  
+  if ((j->max > 0) && (len > j->max - j->buf->used))
+  {
+    len     = j->max - j->buf->used;
+    j->full = true;
+  }
+  
+  cbor_cB_addlstring(j->L,j->buf,s,len);
+}
+
+/**************************************************************************/
+
+static void cbor_cL_diag_bin(json__s *j,char const *src,size_t len)
+{
+  uint8_t const *s = (uint8_t const *)src;
+  char           hex[64];
+  size_t         n = 0;
+  
+  assert(j != NULL);
+  
+  cbor_cL_diag_add(j,"h'",2);
+  for (size_t i = 0 ; (i < len) && !j->full ; i++)
+  {
+    hex[n++] = m_b16[s[i] >> 4];
+    hex[n++] = m_b16[s[i] & 15];
+    if (n == sizeof(hex))
+    {
+      cbor_cL_diag_add(j,hex,n);
+      n = 0;
+    }
+  }
+  cbor_cL_diag_add(j,hex,n);
+  cbor_cL_diag_add(j,"'",1);
+}
+
+/**************************************************************************/
+
+static void cbor_cL_diag_text(json__s *j,char const *s,size_t len)
+{
+  size_t i = 0;
+  
+  assert(j != NULL);
+  assert(s != NULL);
+  
+  cbor_cL_diag_add(j,"\"",1);
+  
+  while((i < len) && !j->full)
+  {
+    size_t        run = i;
+    unsigned char c;
+    char          esc[8];
+    
+    while((run < len) && ((unsigned char)s[run] >= 32) && ((unsigned char)s[run] <= 126) && (s[run] != '"') && (s[run] != '\\'))
+      run++;
+    if (run > i)
+    {
+      cbor_cL_diag_add(j,&s[i],run - i);
+      i = run;
+      if (i == len)
+        break;
+    }
+    
+    c = (unsigned char)s[i++];
+    switch(c)
+    {
+      case '\a': cbor_cL_diag_add(j,"\\a",2);  break;
+      case '\b': cbor_cL_diag_add(j,"\\b",2);  break;
+      case '\t': cbor_cL_diag_add(j,"\\t",2);  break;
+      case '\n': cbor_cL_diag_add(j,"\\n",2);  break;
+      case '\v': cbor_cL_diag_add(j,"\\v",2);  break;
+      case '\f': cbor_cL_diag_add(j,"\\f",2);  break;
+      case '\r': cbor_cL_diag_add(j,"\\r",2);  break;
+      case '"':  cbor_cL_diag_add(j,"\\\"",2); break;
+      case '\\': cbor_cL_diag_add(j,"\\\\",2); break;
+      default:
+           esc[0] = '\\';
+           esc[1] = (char)('0' + c / 100);
+           esc[2] = (char)('0' + c / 10 % 10);
+           esc[3] = (char)('0' + c % 10);
+           cbor_cL_diag_add(j,esc,4);
+           break;
+    }
+  }
+  
+  cbor_cL_diag_add(j,"\"",1);
+}
+
+/**************************************************************************
+* Write a BIN or TEXT, definite or not.
+***************************************************************************/
+
+static void cbor_cL_diag_bintext(
+        json__s                *j,
+        int                     type,
+        int                     info,
+        unsigned long long int  value
+)
+{
+  char const *s;
+  size_t      len;
+  
+  assert(j != NULL);
+  
+  if (info == 31)
+  {
+    bool first = true;
+    
+    cbor_cL_diag_add(j,"(_ ",3);
+    
+    while(!j->full)
+    {
+      size_t start = j->pos;
+      int    ctype;
+      int    cinfo;
+      
+      if (j->pos >= j->packlen)
+        cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+      if ((unsigned char)j->packet[j->pos] == 0xFF)
+      {
+        j->pos++;
+        break;
+      }
+      
+      cbor_cL_json_header(j,&ctype,&cinfo,&value);
+      if ((ctype != type) || (cinfo == 31))
+        cbor_cL_json_error(j,start,CBOR_EINVALID);
+      if (!first)
+        cbor_cL_diag_add(j,", ",2);
+      cbor_cL_diag_bintext(j,type,cinfo,value);
+      first = false;
+    }
+    
+    cbor_cL_diag_add(j,")",1);
+    return;
+  }
+  
+  s = cbor_cL_json_bytes(j,type,info,value,&len);
+  if (type == 0x40)
+    cbor_cL_diag_bin(j,s,len);
+  else
+    cbor_cL_diag_text(j,s,len);
+}
+
+/**************************************************************************
+* Write the name of a tag, from the names table if it has one.
+***************************************************************************/
+
+static void cbor_cL_diag_tag(json__s *j,unsigned long long int tag)
+{
+  char num[32];
+  
+  assert(j != NULL);
+  
+  if ((j->names != 0) && (tag <= INT_MAX))
+  {
+    lua_rawgeti(j->L,j->names,(int)tag);
+    if (lua_type(j->L,-1) == LUA_TSTRING)
+    {
+      size_t      len;
+      char const *name = lua_tolstring(j->L,-1,&len);
+      
+      cbor_cL_diag_add(j,name,len);
+      lua_pop(j->L,1);
+      return;
+    }
+    lua_pop(j->L,1);
+  }
+  
+  cbor_cL_diag_add(j,num,(size_t)snprintf(num,sizeof(num),"%llu",tag));
+}
+
+/**************************************************************************/
+
+static void cbor_cL_diag_item(json__s *j)
+{
+  unsigned long long int  value;
+  size_t                  start;
+  char                    num[32];
+  int                     type;
+  int                     info;
+  
+  assert(j != NULL);
+  
+  if (j->full)
+    return;
+  
+  start = j->pos;
+  cbor_cL_json_header(j,&type,&info,&value);
+  
+  switch(type)
+  {
+    case 0x00:
+         cbor_cL_diag_add(j,num,(size_t)snprintf(num,sizeof(num),"%llu",value));
+         break;
+         
+    case 0x20:
+         if (value == ULLONG_MAX)
+           cbor_cL_diag_add(j,"-18446744073709551616",21);
+         else
+           cbor_cL_diag_add(j,num,(size_t)snprintf(num,sizeof(num),"-%llu",value + 1));
+         break;
+         
+    case 0x40:
+    case 0x60:
+         cbor_cL_diag_bintext(j,type,info,value);
+         break;
+         
+    case 0x80:
+    case 0xA0:
+         cbor_cL_json_enter(j,start);
+         cbor_cL_diag_add(j,type == 0x80 ? "[" : "{",1);
+         if (info == 31)
+           cbor_cL_diag_add(j,"_ ",2);
+         
+         for (unsigned long long int cnt = 0 ; ((info == 31) || (cnt < value)) && !j->full ; cnt++)
+         {
+           if (info == 31)
+           {
+             if (j->pos >= j->packlen)
+               cbor_cL_json_error(j,j->pos,CBOR_EMOREINPUT);
+             if ((unsigned char)j->packet[j->pos] == 0xFF)
+             {
+               j->pos++;
+               break;
+             }
+           }
+           
+           if (cnt > 0)
+             cbor_cL_diag_add(j,", ",2);
+           if (type == 0xA0)
+           {
+             cbor_cL_diag_item(j);
+             cbor_cL_diag_add(j,": ",2);
+           }
+           cbor_cL_diag_item(j);
+         }
+         
+         cbor_cL_diag_add(j,type == 0x80 ? "]" : "}",1);
+         j->depth--;
+         break;
+         
+    case 0xC0:
+         cbor_cL_json_enter(j,start);
+         cbor_cL_diag_tag(j,value);
+         cbor_cL_diag_add(j,"(",1);
+         cbor_cL_diag_item(j);
+         cbor_cL_diag_add(j,")",1);
+         j->depth--;
+         break;
+         
+    case 0xE0:
+         if ((info >= 25) && (info <= 27))
+         {
+           double d = cbor_ci_double(info,value);
+           
+           if (d != d)
+             cbor_cL_diag_add(j,"NaN",3);
+           else if (d == HUGE_VAL)
+             cbor_cL_diag_add(j,"Infinity",8);
+           else if (d == -HUGE_VAL)
+             cbor_cL_diag_add(j,"-Infinity",9);
+           else
+           {
+             char fnum[400];
+             cbor_cL_diag_add(j,fnum,(size_t)snprintf(fnum,sizeof(fnum),"%f",d));
+           }
+         }
+         else if (info == 31)
+           cbor_cL_json_error(j,start,CBOR_EINVALID);
+         else if (value == 20)
+           cbor_cL_diag_add(j,"false",5);
+         else if (value == 21)
+           cbor_cL_diag_add(j,"true",4);
+         else if (value == 22)
+           cbor_cL_diag_add(j,"null",4);
+         else if (value == 23)
+           cbor_cL_diag_add(j,"undefined",9);
+         else
+           cbor_cL_diag_add(j,num,(size_t)snprintf(num,sizeof(num),"simple(%llu)",value));
+         break;
+         
+    default:
+         assert(0);
+         break;
+  }
+}
+
+/******************************************************************
+* Usage:	diag,pos2,truncated = cbor_c.diagnostic(blob[,pos][,names][,max])
+* Desc:		Write a CBOR data item in diagnostic notation
+* Input:	blob (binary) binary CBOR sludge (string or mmap)
+*		pos (integer/optional) position of item
+*		names (table/optional) tag names, indexed by tag
+*		max (integer/optional) maximum length of output
+* Return:	diag (string) item in diagnostic notation
+*		pos2 (integer) position past the item
+*		truncated (boolean) true if diag was cut short at max
+*
+* Note:		Tags without a name in names are written as numbers.  The
+*		whole item is still checked if the output is truncated.
+*		Throws an error of the form { pos = n , msg = "text" }.
+*******************************************************************/
+
+static int cbor_clua_diagnostic(lua_State *L)
+{
+  json__s     j;
+  lua_Integer ipos;
+  lua_Integer max;
+  
+  assert(L != NULL);
+  
+  j.packet = cbor_cL_checkblob(L,1,&j.packlen);
+  ipos     = luaL_optinteger(L,2,1);
+  max      = luaL_optinteger(L,4,0);
+  lua_settop(L,4);
+  
+  if ((ipos < 1) || ((size_t)ipos > j.packlen))
+    return cbor_cL_throw(L,ipos,"%s",m_cbor_errors[CBOR_ENOINPUT]);
+  
+  j.pos = (size_t)ipos - 1;
+  cbor_cL_json_init(&j,L,5);
+  
+  if (!lua_isnil(L,3))
+  {
+    luaL_checktype(L,3,LUA_TTABLE);
+    j.names = 3;
+  }
+  if (max > 0)
+    j.max = (size_t)max;
+  
+  cbor_cL_diag_item(&j);
+  
+  if (j.full)
+  {
+    int rc;
+    
+    j.pos = (size_t)ipos - 1;
+    rc    = cbor_cL_skip(L,j.packet,j.packlen,&j.pos);
+    if (rc != CBOR_OKAY)
+      return cbor_cL_throw(L,j.pos + 1,"%s",m_cbor_errors[rc]);
+  }
+  
+  lua_pushlstring(L,j.buf->data != NULL ? j.buf->data : "",j.buf->used);
+  lua_pushinteger(L,j.pos + 1);
+  lua_pushboolean(L,j.full);
+  cbor_cB_free(L,j.buf);
+  cbor_cB_free(L,j.tmp);
+  return 3;
+}
+
+/**************************************************************************
+*
+*                          BIGNUMS AND FRACTIONS
+*
+* Conversions for bignums (tags 2 and 3), decimal fractions (tag 4) and
+* bigfloats (tag 5).  Bignums are big-endian magnitudes, and a negative
+* bignum n stands for -1 - n.  Arithmetic is done on base 10^9 limbs
+* (least significant first) kept in a buffer, which is plenty fast for the
+* sizes seen in practice, and keeps the decimal conversions trivial.
+*
+***************************************************************************/
+
+#ifndef CBOR_MAXEXP
+#  define CBOR_MAXEXP 4096
+#endif
+
+#define CBOR_LIMB	1000000000uL
+
+typedef struct
+{
+  buffer__s *buf;
+  size_t     n;
+} limbs__s;
+
+/**************************************************************************/
+
+static uint32_t *cbor_cL_limbs_grow(lua_State *L,limbs__s *x,size_t more)
+{
+  assert(x != NULL);
+  
+  if (more > (SIZE_MAX / sizeof(uint32_t)) - x->n)
+    luaL_error(L,"not enough memory");
+  cbor_cB_reserve(L,x->buf,(x->n + more) * sizeof(uint32_t));
+  return (uint32_t *)x->buf->data;
+}
+
+/**************************************************************************
+* x = x * mul + add, where mul and add are no more than CBOR_LIMB * 4.
+***************************************************************************/
+
+static void cbor_cL_limbs_muladd(lua_State *L,limbs__s *x,uint64_t mul,uint64_t add)
+{
+  uint32_t *d = (uint32_t *)x->buf->data;
+  uint64_t  carry = add;
+  
+  for (size_t i = 0 ; i < x->n ; i++)
+  {
+    uint64_t v = (uint64_t)d[i] * mul + carry;
+    d[i]  = (uint32_t)(v % CBOR_LIMB);
+    carry = v / CBOR_LIMB;
+  }
+  
+  while (carry > 0)
+  {
+    d          = cbor_cL_limbs_grow(L,x,1);
+    d[x->n++]  = (uint32_t)(carry % CBOR_LIMB);
+    carry     /= CBOR_LIMB;
+  }
+}
+
+/**************************************************************************
+* Set x to the magnitude (big-endian) of a bignum, plus one if neg.
+***************************************************************************/
+
+static void cbor_cL_limbs_frombig(
+        lua_State     *L,
+        limbs__s      *x,
+        uint8_t const *s,
+        size_t         len,
+        bool           neg
+)
+{
+  assert(x != NULL);
+  assert(s != NULL);
+  
+  x->n = 0;
+  
+  for (size_t i = 0 ; i < len ; i++)
+    cbor_cL_limbs_muladd(L,x,256,s[i]);
+  if (neg)
+    cbor_cL_limbs_muladd(L,x,1,1);
+}
+
+/**************************************************************************
+* Add the decimal digits of x, padded with zeros to at least min digits.
+***************************************************************************/
+
+static void cbor_cL_limbs_todec(lua_State *L,limbs__s *x,buffer__s *out,size_t min)
+{
+  uint32_t const *d = (uint32_t const *)x->buf->data;
+  char            tmp[16];
+  size_t          digits;
+  int             len;
+  
+  assert(x   != NULL);
+  assert(out != NULL);
+  
+  if (x->n == 0)
+    len = snprintf(tmp,sizeof(tmp),"0");
+  else
+    len = snprintf(tmp,sizeof(tmp),"%lu",(unsigned long)d[x->n - 1]);
+  
+  digits = (size_t)len + (x->n > 0 ? (x->n - 1) * 9 : 0);
+  for ( ; min > digits ; min--)
+    cbor_cB_addlstring(L,out,"0",1);
+  
+  cbor_cB_addlstring(L,out,tmp,len);
+  for (size_t i = x->n > 0 ? x->n - 1 : 0 ; i-- > 0 ; )
+  {
+    len = snprintf(tmp,sizeof(tmp),"%09lu",(unsigned long)d[i]);
+    cbor_cB_addlstring(L,out,tmp,len);
+  }
+}
+
+/**************************************************************************
+* Return the bytes of a Lua string, without leading zeros.
+***************************************************************************/
+
+static uint8_t const *cbor_cL_big_check(lua_State *L,int idx,size_t *plen)
+{
+  uint8_t const *s = (uint8_t const *)luaL_checklstring(L,idx,plen);
+  
+  assert(plen != NULL);
+  
+  while ((*plen > 0) && (*s == 0))
+  {
+    s++;
+    (*plen)--;
+  }
+  return s;
+}
+
+/**************************************************************************
+* Push the decimal text of a bignum.
+***************************************************************************/
+
+static void cbor_cL_big_pushdec(lua_State *L,uint8_t const *s,size_t len,bool neg)
+{
+  limbs__s   x;
+  buffer__s *out;
+  
+  x.buf = cbor_cL_newbuffer(L);
+  out   = cbor_cL_newbuffer(L);
+  
+  cbor_cL_limbs_frombig(L,&x,s,len,neg);
+  if (neg)
+    cbor_cB_addlstring(L,out,"-",1);
+  cbor_cL_limbs_todec(L,&x,out,0);
+  
+  lua_pushlstring(L,out->data,out->used);
+  cbor_cB_free(L,x.buf);
+  cbor_cB_free(L,out);
+  lua_replace(L,-3);
+  lua_pop(L,1);
+}
+
+/******************************************************************
+* Usage:	text = cbor_c.bigtostring(bin[,neg])
+* Desc:		Convert a bignum to decimal text
+* Input:	bin (binary) magnitude of the bignum (big-endian)
+*		neg (boolean/optional) bin is from a _nbignum
+* Return:	text (string) decimal text
+*
+* Note:		A _nbignum of n is -1 - n.
+*******************************************************************/
+
+static int cbor_clua_bigtostring(lua_State *L)
+{
+  uint8_t const *s;
+  size_t         len;
+  
+  s = cbor_cL_big_check(L,1,&len);
+  cbor_cL_big_pushdec(L,s,len,lua_toboolean(L,2));
+  return 1;
+}
+
+/******************************************************************
+* Usage:	bin,neg = cbor_c.bigfromstring(text)
+* Desc:		Convert decimal text to a bignum
+* Input:	text (string) decimal integer, with an optional sign
+* Return:	bin (binary) magnitude of the bignum (big-endian)
+*		neg (boolean) true for a _nbignum, false for _pbignum
+*
+* Note:		Throws an error if text isn't a decimal integer.
+*******************************************************************/
+
+static int cbor_clua_bigfromstring(lua_State *L)
+{
+  char const *s;
+  size_t      len;
+  size_t      i;
+  buffer__s  *buf;
+  uint8_t    *b;
+  bool        neg;
+  
+  s   = luaL_checklstring(L,1,&len);
+  neg = (len > 0) && (s[0] == '-');
+  i   = (len > 0) && ((s[0] == '-') || (s[0] == '+')) ? 1 : 0;
+  
+  if (i == len)
+    return luaL_error(L,"bigfromstring: not a decimal integer");
+  
+  /*---------------------------------------------------------------------
+  ; The bytes are built little-endian, nine digits at a time, and then
+  ; reversed.
+  ;----------------------------------------------------------------------*/
+  
+  buf = cbor_cL_newbuffer(L);
+  
+  while (i < len)
+  {
+    uint64_t mul   = 1;
+    uint64_t carry = 0;
+    
+    for (int k = 0 ; (k < 9) && (i < len) ; k++ , i++)
+    {
+      if ((s[i] < '0') || (s[i] > '9'))
+        return luaL_error(L,"bigfromstring: not a decimal integer");
+      mul   *= 10;
+      carry  = carry * 10 + (uint64_t)(s[i] - '0');
+    }
+    
+    b = (uint8_t *)buf->data;
+    for (size_t j = 0 ; j < buf->used ; j++)
+    {
+      uint64_t v = (uint64_t)b[j] * mul + carry;
+      b[j]  = (uint8_t)(v & 255);
+      carry = v >> 8;
+    }
+    
+    for ( ; carry > 0 ; carry >>= 8)
+    {
+      uint8_t c = (uint8_t)(carry & 255);
+      cbor_cB_addlstring(L,buf,(char *)&c,1);
+    }
+  }
+  
+  b = (uint8_t *)buf->data;
+  while ((buf->used > 0) && (b[buf->used - 1] == 0))
+    buf->used--;
+  
+  if (buf->used == 0)
+    neg = false;
+  
+  if (neg) /* a _nbignum is one less than the magnitude */
+  {
+    for (size_t j = 0 ; b[j]-- == 0 ; j++)
+      ;
+    while ((buf->used > 0) && (b[buf->used - 1] == 0))
+      buf->used--;
+  }
+  
+  for (size_t j = 0 ; j < buf->used / 2 ; j++)
+  {
+    uint8_t c = b[j];
+    b[j] = b[buf->used - 1 - j];
+    b[buf->used - 1 - j] = c;
+  }
+  
+  lua_pushlstring(L,buf->data != NULL ? buf->data : "",buf->used);
+  lua_pushboolean(L,neg);
+  cbor_cB_free(L,buf);
+  return 2;
+}
+
+/******************************************************************
+* Usage:	n,exact = cbor_c.bigtonumber(bin[,neg])
+* Desc:		Convert a bignum to a Lua number
+* Input:	bin (binary) magnitude of the bignum (big-endian)
+*		neg (boolean/optional) bin is from a _nbignum
+* Return:	n (number) value
+*		exact (boolean) true if n is an integer of the same value
+*
+* Note:		If the value doesn't fit in a Lua integer, n is the
+*		nearest float.
+*******************************************************************/
+
+static int cbor_clua_bigtonumber(lua_State *L)
+{
+  uint8_t const *s;
+  size_t         len;
+  bool           neg;
+  
+  s   = cbor_cL_big_check(L,1,&len);
+  neg = lua_toboolean(L,2);
+  
+  if (len <= 8)
+  {
+    unsigned long long int v = 0;
+    
+    for (size_t i = 0 ; i < len ; i++)
+      v = (v << 8) | s[i];
+      
+#if LUA_VERSION_NUM >= 503
+    if (v <= (unsigned long long int)LUA_MAXINTEGER)
+#else
+    if (v < 9007199254740992uLL)
+#endif
+    {
+      if (neg)
+        cbor_cL_pushnint(L,v);
+      else
+        cbor_cL_pushuint(L,v);
+      lua_pushboolean(L,1);
+      return 2;
+    }
+  }
+  
+  cbor_cL_big_pushdec(L,s,len,neg);
+  lua_pushnumber(L,strtod(lua_tostring(L,-1),NULL));
+  lua_pushboolean(L,0);
+  return 2;
+}
+
+/******************************************************************
+* Usage:	x = cbor_c.fraction(exp,mant,base[,exact])
+* Desc:		Convert a decimal fraction or bigfloat to a number
+* Input:	exp (integer) exponent
+*		mant (integer) mantissa
+*		base (integer) 10 (_decimalfraction) or 2 (_bigfloat)
+*		exact (boolean/optional) return exact decimal text
+* Return:	x (number/string) mant * base ^ exp
+*
+* Note:		The float is correctly rounded for base 10.  The exact
+*		text keeps the scale of the fraction, so { -2 , 150 } is
+*		"1.50".  Exact text is limited to exponents of +/- 4096 (by
+*		default), and an error is thrown past that.
+*******************************************************************/
+
+static int cbor_clua_fraction(lua_State *L)
+{
+  long long int           exp  = (long long int)luaL_checkinteger(L,1);
+  long long int           mant = (long long int)luaL_checkinteger(L,2);
+  lua_Integer             base = luaL_checkinteger(L,3);
+  unsigned long long int  m;
+  limbs__s                x;
+  buffer__s              *out;
+  buffer__s              *digits;
+  uint32_t               *d;
+  size_t                  scale;
+  
+  luaL_argcheck(L,(base == 2) || (base == 10),3,"base must be 2 or 10");
+  
+  if (!lua_toboolean(L,4))
+  {
+    if (base == 10)
+    {
+      char tmp[64];
+      snprintf(tmp,sizeof(tmp),"%lldE%lld",mant,exp);
+      lua_pushnumber(L,strtod(tmp,NULL));
+    }
+    else
+      lua_pushnumber(L,ldexp((double)mant,exp < INT_MIN ? INT_MIN : exp > INT_MAX ? INT_MAX : (int)exp));
+    return 1;
+  }
+  
+  if ((exp < -CBOR_MAXEXP) || (exp > CBOR_MAXEXP))
+    return luaL_error(L,"fraction: exponent too large");
+  
+  /*---------------------------------------------------------------------
+  ; Work out the digits of mant * base ^ exp as an integer, with scale
+  ; digits after the decimal point.  For a bigfloat with a negative
+  ; exponent, mant * 2^-k is mant * 5^k / 10^k.
+  ;----------------------------------------------------------------------*/
+  
+  m      = mant < 0 ? 0uLL - (unsigned long long int)mant : (unsigned long long int)mant;
+  x.buf  = cbor_cL_newbuffer(L);
+  x.n    = 0;
+  out    = cbor_cL_newbuffer(L);
+  digits = cbor_cL_newbuffer(L);
+  scale  = exp < 0 ? (size_t)-exp : 0;
+  
+  for ( ; m > 0 ; m /= CBOR_LIMB)
+  {
+    d         = cbor_cL_limbs_grow(L,&x,1);
+    d[x.n++]  = (uint32_t)(m % CBOR_LIMB);
+  }
+  
+  if ((base == 2) && (x.n > 0))
+  {
+    long long int k    = exp < 0 ? -exp : exp;
+    uint64_t      step = exp < 0 ? 1220703125uLL : 536870912uLL; /* 5^13, 2^29 */
+    int           per  = exp < 0 ? 13 : 29;
+    
+    for ( ; k >= per ; k -= per)
+      cbor_cL_limbs_muladd(L,&x,step,0);
+    for ( ; k > 0 ; k--)
+      cbor_cL_limbs_muladd(L,&x,exp < 0 ? 5 : 2,0);
+  }
+  
+  if ((mant < 0) && (x.n > 0))
+    cbor_cB_addlstring(L,out,"-",1);
+  
+  cbor_cL_limbs_todec(L,&x,digits,scale + 1);
+  
+  if (scale > 0)
+  {
+    cbor_cB_addlstring(L,out,digits->data,digits->used - scale);
+    cbor_cB_addlstring(L,out,".",1);
+    cbor_cB_addlstring(L,out,digits->data + digits->used - scale,scale);
+  }
+  else
+  {
+    cbor_cB_addlstring(L,out,digits->data,digits->used);
+    if ((base == 10) && (x.n > 0))
+      for (long long int i = 0 ; i < exp ; i++)
+        cbor_cB_addlstring(L,out,"0",1);
+  }
+  
+  lua_pushlstring(L,out->data,out->used);
+  cbor_cB_free(L,x.buf);
+  cbor_cB_free(L,out);
+  cbor_cB_free(L,digits);
+  return 1;
+}
+
+/**************************************************************************
+*
+*                           COMPILED SCHEMAS
+*
+* A schema describes a record of known shape---a MAP of TEXT keys, each
+* with a fixed type and an optional TAG.  It's compiled once into the
+* encoded MAP header and the encoded keys (with their TAGs), so encoding a
+* record is copying those out with the values, and decoding one is a
+* memcmp() of the same bytes plus a check of each value's header.  There's
+* no general dispatch on type.  TEXT and BIN values are told apart with
+* cbor_ci_isutf8() when encoding, as cbor.encode() would, but TEXT isn't
+* checked when decoding.  Names have to be UTF-8, since they're always
+* encoded as TEXT.
+*
+* Anything that doesn't fit the schema returns nil, and cbor.schema() then
+* falls back to cbor.encode() or cbor.decode().
+*
+***************************************************************************/
+
+#define CBOR_SCHEMA	"org.conman.cbor_c:schema"
+
+enum
+{
+  SF_UINT,
+  SF_NINT,
+  SF_INTEGER,
+  SF_FLOAT,
+  SF_NUMBER,
+  SF_BIN,
+  SF_TEXT,
+  SF_BOOLEAN,
+};
+
+static char const *const m_sftypes[] =
+{
+  "UINT",
+  "NINT",
+  "integer",
+  "float",
+  "number",
+  "BIN",
+  "TEXT",
+  "boolean",
+  NULL
+};
+
+typedef struct
+{
+  int    type;
+  size_t off;           /* of the encoded key (and TAG) */
+  size_t len;
+} sfield__s;
+
+typedef struct
+{
+  buffer__s buf;        /* reused by each encode */
+  size_t    hlen;       /* length of encoded MAP header */
+  size_t    n;
+  sfield__s field[];
+} schema__s;
+
+/**************************************************************************
+* The user value of a schema is a table with the encoded headers and keys
+* at index 1, and the field names from index 2.
+***************************************************************************/
+
+static void cbor_cL_schema_proto(lua_State *L,int idx)
+{
+  assert(L != NULL);
+  
+#if LUA_VERSION_NUM == 501
+  lua_getfenv(L,idx);
+#else
+  lua_getuservalue(L,idx);
+#endif
+  lua_rawgeti(L,-1,1);
+}
+
+/**************************************************************************
+* Check that the value at idx is an integer, returning it as a CBOR UINT
+* or NINT value.
+***************************************************************************/
+
+static bool cbor_cL_schema_integer(
+        lua_State              *L,
+        int                     idx,
+        bool                   *pneg,
+        unsigned long long int *pvalue
+)
+{
+  assert(L      != NULL);
+  assert(pneg   != NULL);
+  assert(pvalue != NULL);
+  
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L,idx))
+  {
+    lua_Integer i = lua_tointeger(L,idx);
+    *pneg   = i < 0;
+    *pvalue = i < 0 ? (unsigned long long int)~i : (unsigned long long int)i;
+    return true;
+  }
+#else
+  if (lua_type(L,idx) == LUA_TNUMBER)
+  {
+    lua_Number n = lua_tonumber(L,idx);
+    if ((n >= -9007199254740992.0) && (n <= 9007199254740992.0) && (floor(n) == n))
+    {
+      *pneg   = n < 0;
+      *pvalue = n < 0 ? (unsigned long long int)(-1.0 - n) : (unsigned long long int)n;
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+/******************************************************************
+* Usage:	sc = cbor_c.schema(fields)
+* Desc:		Compile a schema for records of a fixed shape
+* Input:	fields (table) array of { name , type [, tag] }, where
+*		name (string) is the key, type (string) one of "UINT",
+*		"NINT", "integer", "float", "number", "BIN", "TEXT" or
+*		"boolean", and tag (integer/optional) a TAG for the value
+* Return:	sc (userdata) compiled schema
+*
+* Note:		Throws on a bad schema, including a name that isn't
+*		UTF-8.
+*******************************************************************/
+
+static int cbor_clua_schema(lua_State *L)
+{
+  schema__s *sc;
+  buffer__s *proto;
+  size_t     n;
+  size_t     i;
+  
+  assert(L != NULL);
+  
+  luaL_checktype(L,1,LUA_TTABLE);
+  lua_settop(L,1);
+  n = lua_rawlen(L,1);
+  
+  sc           = lua_newuserdata(L,sizeof(schema__s) + n * sizeof(sfield__s));
+  sc->buf.data = NULL;
+  sc->buf.used = 0;
+  sc->buf.size = 0;
+  sc->n        = n;
+  luaL_getmetatable(L,CBOR_SCHEMA);
+  lua_setmetatable(L,2);
+  
+  lua_createtable(L,(int)n + 1,0);
+  proto = cbor_cL_newbuffer(L);
+  cbor_cB_addvalue(L,proto,0xA0,n);
+  sc->hlen = proto->used;
+  
+  for (i = 0 ; i < n ; i++)
+  {
+    char const *name;
+    char const *type;
+    size_t      len;
+    int         t;
+    
+    lua_rawgeti(L,1,i + 1);
+    if (!lua_istable(L,5))
+      return luaL_error(L,"schema: field %d: expected table",(int)i + 1);
+    lua_rawgeti(L,5,1);
+    lua_rawgeti(L,5,2);
+    lua_rawgeti(L,5,3);
+    
+    if (lua_type(L,6) != LUA_TSTRING)
+      return luaL_error(L,"schema: field %d: expected name",(int)i + 1);
+    name = lua_tolstring(L,6,&len);
+    type = lua_tostring(L,7);
+    
+    if (!cbor_ci_isutf8((uint8_t const *)name,len))
+      return luaL_error(L,"schema: field %d: name not UTF-8",(int)i + 1);
+    
+    for (t = 0 ; m_sftypes[t] != NULL ; t++)
+      if ((type != NULL) && (strcmp(type,m_sftypes[t]) == 0))
+        break;
+    if (m_sftypes[t] == NULL)
+      return luaL_error(L,"schema: %s: bad type",name);
+    
+    lua_pushvalue(L,6);
+    lua_rawget(L,3);
+    if (!lua_isnil(L,-1))
+      return luaL_error(L,"schema: %s: duplicate field",name);
+    lua_pop(L,1);
+    lua_pushvalue(L,6);
+    lua_pushboolean(L,1);
+    lua_rawset(L,3);
+    
+    sc->field[i].type = t;
+    sc->field[i].off  = proto->used;
+    cbor_cB_addvalue(L,proto,0x60,len);
+    cbor_cB_addlstring(L,proto,name,len);
+    
+    if (!lua_isnil(L,8))
+    {
+      if (!lua_isnumber(L,8) || (lua_tonumber(L,8) < 0))
+        return luaL_error(L,"schema: %s: bad tag",name);
+      cbor_cB_addvalue(L,proto,0xC0,(unsigned long long int)lua_tonumber(L,8));
+    }
+    
+    sc->field[i].len = proto->used - sc->field[i].off;
+    lua_pushvalue(L,6);
+    lua_rawseti(L,3,i + 2);
+    lua_settop(L,4);
+  }
+  
+  /*---------------------------------------------------------------------
+  ; The names were also used as keys to catch duplicates; clear those out
+  ; before storing the encoded headers.
+  ;----------------------------------------------------------------------*/
+  
+  for (i = 0 ; i < n ; i++)
+  {
+    lua_rawgeti(L,3,i + 2);
+    lua_pushnil(L);
+    lua_rawset(L,3);
+  }
+  
+  lua_pushlstring(L,proto->data,proto->used);
+  lua_rawseti(L,3,1);
+  cbor_cB_free(L,proto);
+  lua_pop(L,1);
+#if LUA_VERSION_NUM == 501
+  lua_setfenv(L,2);
+#else
+  lua_setuservalue(L,2);
+#endif
+  return 1;
+}
+
+/******************************************************************
+* Usage:	blob = sc:encode(rec)
+* Desc:		Encode a record with a compiled schema
+* Input:	rec (table) record
+* Return:	blob (binary) CBOR encoded record, nil if rec doesn't fit
+*
+* Note:		Only the fields in the schema are read (raw); anything else
+*		in rec is ignored.
+*******************************************************************/
+
+static int cbor_clua_schema_encode(lua_State *L)
+{
+  schema__s              *sc = luaL_checkudata(L,1,CBOR_SCHEMA);
+  char const             *proto;
+  size_t                  i;
+  bool                    neg;
+  unsigned long long int  value;
+  
+  luaL_checktype(L,2,LUA_TTABLE);
+  lua_settop(L,2);
+  cbor_cL_schema_proto(L,1);
+  proto = lua_tostring(L,4);
+  
+  sc->buf.used = 0;
+  cbor_cB_addlstring(L,&sc->buf,proto,sc->hlen);
+  
+  for (i = 0 ; i < sc->n ; i++)
+  {
+    sfield__s const *f = &sc->field[i];
+    
+    lua_rawgeti(L,3,i + 2);
+    lua_rawget(L,2);
+    cbor_cB_addlstring(L,&sc->buf,&proto[f->off],f->len);
+    
+    switch(f->type)
+    {
+      case SF_UINT:
+      case SF_NINT:
+      case SF_INTEGER:
+           if (!cbor_cL_schema_integer(L,5,&neg,&value))
+             goto mismatch;
+           if ((neg && (f->type == SF_UINT)) || (!neg && (f->type == SF_NINT)))
+             goto mismatch;
+           cbor_cB_addvalue(L,&sc->buf,neg ? 0x20 : 0x00,value);
+           break;
+           
+      case SF_FLOAT:
+           if (lua_type(L,5) != LUA_TNUMBER)
+             goto mismatch;
+           cbor_cB_addfloat(L,&sc->buf,lua_tonumber(L,5));
+           break;
+           
+      case SF_NUMBER:
+           if (lua_type(L,5) != LUA_TNUMBER)
+             goto mismatch;
+           if (cbor_cL_schema_integer(L,5,&neg,&value))
+             cbor_cB_addvalue(L,&sc->buf,neg ? 0x20 : 0x00,value);
+           else
+             cbor_cB_addfloat(L,&sc->buf,lua_tonumber(L,5));
+           break;
+           
+      case SF_BIN:
+      case SF_TEXT:
+           if (lua_type(L,5) != LUA_TSTRING)
+             goto mismatch;
+           else
+           {
+             size_t      len;
+             char const *s = lua_tolstring(L,5,&len);
+             
+             /*-------------------------------------------------------
+             ; cbor.encode() writes a string as TEXT if it's valid
+             ; UTF-8, else as BIN, so anything else has to go to it.
+             ;--------------------------------------------------------*/
+             
+             if (cbor_ci_isutf8((uint8_t const *)s,len) != (f->type == SF_TEXT))
+               goto mismatch;
+             cbor_cB_addvalue(L,&sc->buf,f->type == SF_BIN ? 0x40 : 0x60,len);
+             cbor_cB_addlstring(L,&sc->buf,s,len);
+           }
+           break;
+           
+      case SF_BOOLEAN:
+           if (lua_type(L,5) != LUA_TBOOLEAN)
+             goto mismatch;
+           cbor_cB_addvalue(L,&sc->buf,0xE0,lua_toboolean(L,5) ? 21 : 20);
+           break;
+           
+      default:
+           assert(0);
+           goto mismatch;
+    }
+    
+    lua_pop(L,1);
+  }
+  
+  lua_pushlstring(L,sc->buf.data,sc->buf.used);
+  return 1;
+  
+mismatch:
+  lua_pushnil(L);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	rec,pos2 = sc:decode(blob[,pos])
+* Desc:		Decode a record with a compiled schema
+* Input:	blob (binary) binary CBOR sludge
+*		pos (integer/optional) position to start decoding from
+* Return:	rec (table) decoded record, nil if blob doesn't fit
+*		pos2 (integer) position past the record
+*
+* Note:		The MAP must have the fields in schema order, with minimal
+*		length headers (as cbor.encode() produces).  TAGs are
+*		checked but not interpreted---the value is returned as is.
+*******************************************************************/
+
+static int cbor_clua_schema_decode(lua_State *L)
+{
+  schema__s   *sc = luaL_checkudata(L,1,CBOR_SCHEMA);
+  char const  *proto;
+  char const  *packet;
+  size_t       packlen;
+  size_t       pos;
+  lua_Integer  ipos;
+  size_t       i;
+  
+  packet = cbor_cL_checkblob(L,2,&packlen);
+  ipos   = luaL_optinteger(L,3,1);
+  
+  if ((ipos < 1) || ((size_t)ipos > packlen + 1))
+    return luaL_argerror(L,3,"position out of range");
+  
+  lua_settop(L,3);
+  cbor_cL_schema_proto(L,1);
+  proto = lua_tostring(L,5);
+  pos   = (size_t)ipos - 1;
+  
+  if ((sc->hlen > packlen - pos) || (memcmp(&packet[pos],proto,sc->hlen) != 0))
+    goto mismatch;
+  pos += sc->hlen;
+  
+  lua_createtable(L,0,(int)sc->n);
+  
+  for (i = 0 ; i < sc->n ; i++)
+  {
+    sfield__s const        *f = &sc->field[i];
+    int                     type;
+    int                     info;
+    unsigned long long int  value;
+    
+    if ((f->len > packlen - pos) || (memcmp(&packet[pos],&proto[f->off],f->len) != 0))
+      goto mismatch;
+    pos += f->len;
+    
+    if (cbor_ci_header(&type,&info,&value,packet,packlen,&pos) != CBOR_OKAY)
+      goto mismatch;
+    
+    switch(f->type)
+    {
+      case SF_UINT:
+      case SF_NINT:
+      case SF_INTEGER:
+           if ((info == 31) || ((type != 0x00) && (type != 0x20)))
+             goto mismatch;
+           if ((type == 0x00) && (f->type == SF_NINT))
+             goto mismatch;
+           if ((type == 0x20) && (f->type == SF_UINT))
+             goto mismatch;
+           if (type == 0x00)
+             cbor_cL_pushuint(L,value);
+           else
+             cbor_cL_pushnint(L,value);
+           break;
+           
+      case SF_NUMBER:
+           if ((type == 0x00) && (info != 31))
+           {
+             cbor_cL_pushuint(L,value);
+             break;
+           }
+           if ((type == 0x20) && (info != 31))
+           {
+             cbor_cL_pushnint(L,value);
+             break;
+           }
+           /* FALLTHROUGH */
+           
+      case SF_FLOAT:
+           if ((type != 0xE0) || (info < 25) || (info > 27))
+             goto mismatch;
+           lua_pushnumber(L,cbor_ci_double(info,value));
+           break;
+           
+      case SF_BIN:
+      case SF_TEXT:
+           if ((type != (f->type == SF_BIN ? 0x40 : 0x60)) || (info == 31) || (value > packlen - pos))
+             goto mismatch;
+           lua_pushlstring(L,&packet[pos],value);
+           pos += value;
+           break;
+           
+      case SF_BOOLEAN:
+           if ((type != 0xE0) || ((info != 20) && (info != 21)))
+             goto mismatch;
+           lua_pushboolean(L,info == 21);
+           break;
+           
+      default:
+           assert(0);
+           goto mismatch;
+    }
+    
+    lua_rawgeti(L,4,i + 2);
+    lua_insert(L,-2);
+    lua_rawset(L,6);
+  }
+  
+  lua_pushinteger(L,pos + 1);
+  return 2;
+  
+mismatch:
+  lua_pushnil(L);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_schema___gc(lua_State *L)
+{
+  schema__s *sc = luaL_checkudata(L,1,CBOR_SCHEMA);
+  cbor_cB_free(L,&sc->buf);
+  return 0;
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_schema_meta[] =
+{
+  { "encode"	, cbor_clua_schema_encode	} ,
+  { "decode"	, cbor_clua_schema_decode	} ,
+  { "__gc"	, cbor_clua_schema___gc		} ,
+  { NULL	, NULL				}
+};
+
+/**************************************************************************
+*
+*                         MEMORY MAPPED FILES
+*
+* A file is mapped read-only into memory, and the mapping can then be passed
+* to anything that decodes CBOR data in place of a string.  Only the pages
+* actually touched are read in, and the kernel is free to drop them again,
+* so a large file never has to be loaded into one large Lua string.  The
+* mapping goes away when the userdata is collected.
+*
+***************************************************************************/
+
+/**************************************************************************
+* Convert a string.sub() style range into a 0-based start and a length.
+***************************************************************************/
+
+static void cbor_cL_mmap_range(
+        lua_State *L,
+        size_t     size,
+        size_t    *pstart,
+        size_t    *plen,
+        bool       isbyte
+)
+{
+  lua_Integer i = luaL_checkinteger(L,2);
+  lua_Integer j = luaL_optinteger(L,3,isbyte ? i : -1);
+  
+  assert(pstart != NULL);
+  assert(plen   != NULL);
+  
+  if (i < 0)
+    i = (lua_Integer)size + i + 1;
+  if (j < 0)
+    j = (lua_Integer)size + j + 1;
+  if (i < 1)
+    i = 1;
+  if (j > (lua_Integer)size)
+    j = (lua_Integer)size;
+  
+  *pstart = i > j ? 0 : (size_t)i - 1;
+  *plen   = i > j ? 0 : (size_t)(j - i + 1);
+}
+
+/******************************************************************
+* Usage:	s = m:sub(i[,j])
+* Desc:		Return a substring of the mapped file (as string.sub())
+* Input:	i (integer) starting position
+*		j (integer/optional) ending position
+* Return:	s (binary) data
+*******************************************************************/
+
+static int cbor_clua_mmap_sub(lua_State *L)
+{
+  mmap__s *m = luaL_checkudata(L,1,CBOR_MMAP);
+  size_t   start;
+  size_t   len;
+  
+  cbor_cL_mmap_range(L,m->size,&start,&len,false);
+  lua_pushlstring(L,&m->data[start],len);
+  return 1;
+}
+
+/******************************************************************
+* Usage:	b... = m:byte(i[,j])
+* Desc:		Return bytes of the mapped file (as string.byte())
+* Input:	i (integer) starting position
+*		j (integer/optional) ending position
+* Return:	b... (integer) byte values
+*******************************************************************/
+
+static int cbor_clua_mmap_byte(lua_State *L)
+{
+  mmap__s *m = luaL_checkudata(L,1,CBOR_MMAP);
+  size_t   start;
+  size_t   len;
+  
+  cbor_cL_mmap_range(L,m->size,&start,&len,true);
+  if (len > INT_MAX)
+    return luaL_error(L,"string slice too long");
+  luaL_checkstack(L,(int)len,"string slice too long");
+  for (size_t i = 0 ; i < len ; i++)
+    lua_pushinteger(L,(unsigned char)m->data[start + i]);
+  return (int)len;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_mmap___len(lua_State *L)
+{
+  mmap__s *m = luaL_checkudata(L,1,CBOR_MMAP);
+  lua_pushinteger(L,m->size);
+  return 1;
+}
+
+/**************************************************************************/
+
+static int cbor_clua_mmap___gc(lua_State *L)
+{
+  mmap__s *m = luaL_checkudata(L,1,CBOR_MMAP);
+  
+#ifdef CBOR_HAVE_MMAP
+  if (m->size > 0)
+    munmap((void *)m->data,m->size);
+#endif
+  
+  m->data = "";
+  m->size = 0;
+  return 0;
+}
+
+/******************************************************************
+* Usage:	m[,err] = cbor_c.mmap(filename)
+* Desc:		Map a file into memory
+* Input:	filename (string) file to map
+* Return:	m (userdata) mapped file, nil on error
+*		err (string/optional) error message
+*
+* Note:		m can be passed in place of a string to cbor_c.decode(),
+*		cbor_c.decode_all(), cbor_c.decode_seq(), cbor_c.skip(),
+*		cbor_c.validate() and cbor_c.locate(), and it also
+*		supports #m, m:sub() and m:byte().
+*******************************************************************/
+
+static int cbor_clua_mmap(lua_State *L)
+{
+  char const *fname = luaL_checkstring(L,1);
+  
+#ifdef CBOR_HAVE_MMAP
+  mmap__s     *m;
+  struct stat  info;
+  int          fh;
+  int          err;
+  
+  m       = lua_newuserdata(L,sizeof(mmap__s));
+  m->data = "";
+  m->size = 0;
+  luaL_getmetatable(L,CBOR_MMAP);
+  lua_setmetatable(L,-2);
+  
+  fh = open(fname,O_RDONLY);
+  if (fh == -1)
+    goto failed;
+    
+  if (fstat(fh,&info) == -1)
+    goto failed_close;
+  
+  if (!S_ISREG(info.st_mode))
+  {
+    errno = EINVAL;
+    goto failed_close;
+  }
+  
+  if ((uintmax_t)info.st_size > SIZE_MAX)
+  {
+    errno = EFBIG;
+    goto failed_close;
+  }
+  
+  if (info.st_size > 0)
+  {
+    void *data = mmap(NULL,(size_t)info.st_size,PROT_READ,MAP_SHARED,fh,0);
+    if (data == MAP_FAILED)
+      goto failed_close;
+    m->data = data;
+    m->size = (size_t)info.st_size;
+  }
+  
+  close(fh);
+  return 1;
+  
+failed_close:
+  err = errno;
+  close(fh);
+  errno = err;
+failed:
+  lua_pushnil(L);
+  lua_pushfstring(L,"%s: %s",fname,strerror(errno));
+  return 2;
+#else
+  lua_pushnil(L);
+  lua_pushfstring(L,"%s: not supported on this system",fname);
+  return 2;
+#endif
+}
+
+/**************************************************************************/
+
+static const luaL_Reg m_mmap_meta[] =
+{
+  { "sub"	, cbor_clua_mmap_sub	} ,
+  { "byte"	, cbor_clua_mmap_byte	} ,
+  { "__len"	, cbor_clua_mmap___len	} ,
+  { "__gc"	, cbor_clua_mmap___gc	} ,
+  { NULL	, NULL			}
+};
+
+/**************************************************************************/
+
+static const luaL_Reg cbor_c_reg[] =
+{
+  { "encode"	, cbor_clua_encode	} ,
+  { "decode"	, cbor_clua_decode	} ,
+  { "decode_all", cbor_clua_decode_all	} ,
+  { "tags"	, cbor_clua_tags	} ,
+  { "decode_seq", cbor_clua_decode_seq	} ,
+  { "encode_all", cbor_clua_encode_all	} ,
+  { "encode_seq", cbor_clua_encode_seq	} ,
+  { "decoder"	, cbor_clua_decoder	} ,
+  { "skip"	, cbor_clua_skip	} ,
+  { "validate"	, cbor_clua_validate	} ,
+  { "locate"	, cbor_clua_locate	} ,
+  { "refs"	, cbor_clua_refs	} ,
+  { "keys"	, cbor_clua_keys	} ,
+  { "raw"	, cbor_clua_raw	} ,
+  { "isutf8"	, cbor_clua_isutf8	} ,
+  { "encode_typed", cbor_clua_encode_typed } ,
+  { "decode_typed", cbor_clua_decode_typed } ,
+  { "mmap"	, cbor_clua_mmap	} ,
+  { "writer"	, cbor_clua_writer	} ,
+  { "buffer"	, cbor_clua_buffer	} ,
+  { "stats"	, cbor_clua_stats	} ,
+  { "newtable"	, cbor_clua_newtable	} ,
+  { "recycle"	, cbor_clua_recycle	} ,
+  { "limits"	, cbor_clua_limits	} ,
+  { "schema"	, cbor_clua_schema	} ,
+  { "index"	, cbor_clua_index	} ,
+  { "loadindex"	, cbor_clua_loadindex	} ,
+  { "tojson"	, cbor_clua_tojson	} ,
+  { "fromjson"	, cbor_clua_fromjson	} ,
+  { "diagnostic", cbor_clua_diagnostic	} ,
+  { "bigtostring", cbor_clua_bigtostring } ,
+  { "bigfromstring", cbor_clua_bigfromstring } ,
+  { "bigtonumber", cbor_clua_bigtonumber } ,
+  { "fraction"	, cbor_clua_fraction	} ,
+  { NULL	, NULL			}
+};
+
+int luaopen_org_conman_cbor_c(lua_State *L)
 {
 #if LUA_VERSION_NUM == 501
   luaL_register(L,"org.conman.cbor_c",cbor_c_reg);
@@ -458,6 +10233,95 @@ int luaopen_org_conman_cbor_c(lua_State *L)
   luaL_newlib(L,cbor_c_reg);
 #endif
   
+  luaL_newmetatable(L,CBOR_BUFFER);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_buffer_meta);
+#else
+  luaL_setfuncs(L,m_buffer_meta,0);
+#endif
+  lua_pushvalue(L,-1);
+  lua_setfield(L,-2,"__index");
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_REFS);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_refs_meta);
+#else
+  luaL_setfuncs(L,m_refs_meta,0);
+#endif
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_KEYS);
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_NEST);
+  lua_pushliteral(L,"k");
+  lua_setfield(L,-2,"__mode");
+  lua_pushvalue(L,-1);
+  lua_setmetatable(L,-2);
+  lua_pop(L,1);
+  
+  lua_newuserdata(L,CBOR_MAXDEPTH * sizeof(frame__s));
+  lua_setfield(L,LUA_REGISTRYINDEX,CBOR_FRAMES);
+  
+  luaL_newmetatable(L,CBOR_RAW);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_raw_meta);
+#else
+  luaL_setfuncs(L,m_raw_meta,0);
+#endif
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_DECODER);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_decoder_meta);
+#else
+  luaL_setfuncs(L,m_decoder_meta,0);
+#endif
+  lua_pushvalue(L,-1);
+  lua_setfield(L,-2,"__index");
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_WRITER);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_writer_meta);
+#else
+  luaL_setfuncs(L,m_writer_meta,0);
+#endif
+  lua_pushvalue(L,-1);
+  lua_setfield(L,-2,"__index");
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_INDEX);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_index_meta);
+#else
+  luaL_setfuncs(L,m_index_meta,0);
+#endif
+  lua_pushvalue(L,-1);
+  lua_setfield(L,-2,"__index");
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_SCHEMA);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_schema_meta);
+#else
+  luaL_setfuncs(L,m_schema_meta,0);
+#endif
+  lua_pushvalue(L,-1);
+  lua_setfield(L,-2,"__index");
+  lua_pop(L,1);
+  
+  luaL_newmetatable(L,CBOR_MMAP);
+#if LUA_VERSION_NUM == 501
+  luaL_register(L,NULL,m_mmap_meta);
+#else
+  luaL_setfuncs(L,m_mmap_meta,0);
+#endif
+  lua_pushvalue(L,-1);
+  lua_setfield(L,-2,"__index");
+  lua_pop(L,1);
+  
   lua_pushliteral(L,VERSION);
   lua_setfield(L,-2,"_VERSION");
   
@@ -21,21 +21,16 @@
 --
 -- A simpler CBOR encoding/decoding module
 --
--- luacheck: globals _ENV _VERSION decode encode pdecode pencode
+-- luacheck: globals _ENV _M _VERSION decode encode pdecode pencode
 -- luacheck: ignore 611
 -- ***************************************************************
 
 local math   = require "math"
 local table  = require "table"
-local lpeg   = require "lpeg"
 local cbor_c = require "org.conman.cbor_c"
 
 local LUA_VERSION  = _VERSION
-local getmetatable = getmetatable
 local setmetatable = setmetatable
-local ipairs       = ipairs
-local pairs        = pairs
-local type         = type
 local pcall        = pcall
 
 if LUA_VERSION < "Lua 5.3" then
@@ -56,23 +51,17 @@ end
 
 _VERSION = cbor_c._VERSION
 
+local M = _M or _ENV -- the module table, for the native encoder
+local ENCODER        -- encoding context for cbor_c.encode_all()
+
 -- ***************************************************************
 -- UTF-8 defintion from RFC-3629.  There's a deviation from the RFC
 -- specification in that I only allow certain codes from the US-ASCII C0
--- range (control codes) that are in common use.
+-- range (control codes) that are in common use.  The check itself is
+-- done natively by cbor_c.isutf8().
 -- ***********************************************************************
 
-local UTF8 = (
-                 lpeg.R("\7\13"," ~")
-               + lpeg.R("\194\223") * lpeg.R("\128\191")
-               + lpeg.P("\224")     * lpeg.R("\160\191") * lpeg.R("\128\191")
-               + lpeg.R("\225\236") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.P("\237")     * lpeg.R("\128\159") * lpeg.R("\128\191")
-               + lpeg.R("\238\239") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.P("\240")     * lpeg.R("\144\191") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.R("\241\243") * lpeg.R("\128\191") * lpeg.R("\128\191") * lpeg.R("\128\191")
-               + lpeg.P("\224")     * lpeg.R("\128\142") * lpeg.R("\128\191") * lpeg.R("\128\191")
-             )^0
+local UTF8 = cbor_c.isutf8
              
 -- ***********************************************************************
 -- usage:       value2,pos2,ctype2 = bintext(packet,pos,info,value,ctype)
@@ -183,7 +172,7 @@ local TYPE =
   end,
   
   [0x80] = function(packet,pos,_,value,conv)
-    local array = {}
+    local array = cbor_c.newtable(math.min(value,#packet - pos + 1))
     for _ = 1 , value do
       local val,npos,ctype = decode(packet,pos,conv)
       if ctype == '__break' then break end
@@ -194,7 +183,7 @@ local TYPE =
   end,
   
   [0xA0] = function(packet,pos,_,value,conv)
-    local map = {}
+    local map = cbor_c.newtable(0,math.min(value,(#packet - pos + 1) / 2))
     for _ = 1 , value do
       local name,npos,ctype = decode(packet,pos,conv)
       if ctype == '__break' then break end
@@ -320,7 +309,7 @@ local ENCODE_MAP =
   end,
   
   ['string'] = function(value)
-    if UTF8:match(value) > #value then
+    if UTF8(value) then
       return cbor_c.encode(0x60,#value) .. value
     else
       return cbor_c.encode(0x40,#value) .. value
@@ -328,28 +317,7 @@ local ENCODE_MAP =
   end,
   
   ['table'] = function(value)
-    local mt = getmetatable(value)
-    if mt and mt.__tocbor then
-      return mt.__tocbor(value)
-    else
-      if #value > 0 then
-        local res = cbor_c.encode(0x80,#value)
-        for _,item in ipairs(value) do
-          res = res .. encode(item)
-        end
-        return res
-      else
-        local res = ""
-        local cnt = 0
-        
-        for key,item in pairs(value) do
-          res = res .. encode(key)
-          res = res .. encode(item)
-          cnt = cnt + 1
-        end
-        return cbor_c.encode(0xA0,cnt) .. res
-      end
-    end
+    return cbor_c.encode_all(value,nil,nil,ENCODER)
   end,
   
   ['function'] = function()
@@ -365,6 +333,27 @@ local ENCODE_MAP =
   end,
 }
 
+-- ***********************************************************************
+-- The native encoder handles nil, boolean, number, string and table
+-- values; only __tocbor is supported on tables (plain mode).
+-- ***********************************************************************
+
+ENCODER = setmetatable(
+  {
+    __ENCODE_MAP = ENCODE_MAP,
+    STOCK        =
+    {
+      ['nil']     = ENCODE_MAP['nil'],
+      ['boolean'] = ENCODE_MAP['boolean'],
+      ['number']  = ENCODE_MAP['number'],
+      ['string']  = ENCODE_MAP['string'],
+      ['table']   = ENCODE_MAP['table'],
+    },
+    plain        = true,
+  },
+  { __index = M }
+)
+
 -- ***************************************************************
 -- Usage:       blob = cbor.encode(value[,tag])
 -- Desc:        Encode a Lua type into a CBOR type
@@ -374,15 +363,7 @@ local ENCODE_MAP =
 -- ***********************************************************************
 
 function encode(value,tag)
-  local blob do
-    if value == null then
-      blob = "\246"
-    elseif value == undefined then
-      blob = "\247"
-    else
-      blob = ENCODE_MAP[type(value)](value)
-    end
-  end
+  local blob = cbor_c.encode_all(value,nil,nil,ENCODER)
   
   if tag then
     return cbor_c.encode(0xC0,tag) .. blob
@@ -33,6 +33,7 @@ local _VERSION     = _VERSION
 local setmetatable = setmetatable
 local tostring     = tostring
 local pcall        = pcall
+local type         = type
 
 if _VERSION == "Lua 5.1" then
   module "org.conman.cbormisc" -- luacheck: ignore
@@ -41,137 +42,8 @@ else
 end
 
 -- ***************************************************************
-
-local char_trans =
-{
-  ['\a'] = '\\a',
-  ['\b'] = '\\b',
-  ['\t'] = '\\t',
-  ['\n'] = '\\n',
-  ['\v'] = '\\v',
-  ['\f'] = '\\f',
-  ['\r'] = '\\r',
-  ['"']  = '\\"',
-  ['\\'] = '\\\\',
-}
-
-local function safestring(v)
-  if type(v) == 'string' then
-    return '"' .. v:gsub(".",function(c)
-      if char_trans[c] then
-        return char_trans[c]
-      end
-      
-      local b = c:byte()
-      
-      if b < 32 or b > 126 then
-        return string.format("\\%03d",b)
-      else
-        return c
-      end
-    end) .. '"'
-  else
-    return tostring(v)
-  end
-end
-
--- *************************************************************
-
-local function bintext(packet,pos,info,value,ctype,f)
-  if info == 31 then
-    local res   = "(_ "
-    local comma = ""
-    
-    while true do
-      local ltype,nvalue,npos = diagnostic(packet,pos)
-      if ltype == '__break' then
-        return ctype,res .. ")",npos
-      end
-      res = res .. comma .. nvalue
-      comma = ", "
-      pos   = npos
-    end
-  end
-  
-  local bt = packet:sub(pos,pos + value - 1)
-  return ctype,f(bt),pos + value
-end
-
--- ***************************************************************
-
-TYPE =
-{
-  [0x00] = function(_,pos,_,value)
-    return 'UINT',tostring(value),pos
-  end,
-  
-  [0x20] = function(_,pos,_,value)
-    return 'NINT',tostring(-1 - value),pos
-  end,
-  
-  [0x40] = function(packet,pos,info,value)
-    return bintext(packet,pos,info,value,'BIN',function(c)
-      c = c:gsub(".",function(ch)
-        return string.format("%02X",ch:byte())
-      end)
-      return string.format("h'%s'",c)
-    end)
-  end,
-  
-  [0x60] = function(packet,pos,info,value)
-    return bintext(packet,pos,info,value,'TEXT',safestring)
-  end,
-  
-  [0x80] = function(packet,pos,info,value)
-    local res = "["
-    if info == 31 then
-      res = res .. "_ "
-    end
-    
-    for i = 1 , value do
-      local ctype,s,npos = diagnostic(packet,pos)
-      if ctype == '__break' then break end
-      res = res .. s
-      if i < value then res = res .. ", " end
-      pos = npos
-    end
-    return 'ARRAY',res .. "]",pos
-  end,
-  
-  [0xA0] = function(packet,pos,info,value)
-    local res = "{"
-    if info == 31 then
-      res = res .. "_ "
-    end
-    
-    for i = 1 , value do
-      local ctypen,name,npos = diagnostic(packet,pos)
-      if ctypen == '__break' then break end
-      local _,val,npos2 = diagnostic(packet,npos)
-      res = res .. string.format("%s: %s",name,val)
-      if i < value then res = res .. ", " end
-      pos = npos2
-    end
-    return 'MAP',res .. "}",pos
-  end,
-  
-  [0xC0] = function(packet,pos,_,value)
-    local _,s,npos = diagnostic(packet,pos)
-    local ctype    = TAG[value]
-    return ctype,string.format("%s(%s)",ctype,s),npos
-  end,
-  
-  [0xE0] = function(_,pos,info,value)
-    if info >= 25 and info <= 27 then
-      return '__float',SIMPLE[info](value),pos
-    elseif info == 31 then
-      return '__break',math.huge,pos
-    else
-      return SIMPLE[value],SIMPLE[value],pos
-    end
-  end,
-}
-
+-- Names for tags in the output.  Tags not listed are written as
+-- numbers.
 -- ***************************************************************
 
 TAG = setmetatable(
@@ -215,6 +87,64 @@ TAG = setmetatable(
   }
 )
 
+-- ***************************************************************
+-- TYPE and SIMPLE are kept for code that called them directly.  Each
+-- TYPE entry is called, as before, with the results of
+-- cbor_c.decode(packet,pos) and returns ctype,diag,pos2.  All but the
+-- SIMPLE types hand the item to cbor_c.diagnostic(), which needs the
+-- start of the item, so the header is backed over first.
+-- ***************************************************************
+
+local HDRLEN = { [24] = 2 , [25] = 3 , [26] = 5 , [27] = 9 }
+
+local function item(packet,pos,info)
+  local diag,npos = cbor_c.diagnostic(packet,pos - (HDRLEN[info] or 1),TAG)
+  return diag,npos
+end
+
+-- ***************************************************************
+
+TYPE =
+{
+  [0x00] = function(packet,pos,info)
+    return 'UINT',item(packet,pos,info)
+  end,
+  
+  [0x20] = function(packet,pos,info)
+    return 'NINT',item(packet,pos,info)
+  end,
+  
+  [0x40] = function(packet,pos,info)
+    return 'BIN',item(packet,pos,info)
+  end,
+  
+  [0x60] = function(packet,pos,info)
+    return 'TEXT',item(packet,pos,info)
+  end,
+  
+  [0x80] = function(packet,pos,info)
+    return 'ARRAY',item(packet,pos,info)
+  end,
+  
+  [0xA0] = function(packet,pos,info)
+    return 'MAP',item(packet,pos,info)
+  end,
+  
+  [0xC0] = function(packet,pos,info,value)
+    return TAG[value],item(packet,pos,info)
+  end,
+  
+  [0xE0] = function(_,pos,info,value)
+    if info >= 25 and info <= 27 then
+      return '__float',SIMPLE[info](value),pos
+    elseif info == 31 then
+      return '__break',math.huge,pos
+    else
+      return SIMPLE[value],SIMPLE[value],pos
+    end
+  end,
+}
+
 -- ***************************************************************
 
 local function simple(value)
@@ -249,21 +179,29 @@ SIMPLE = setmetatable(
   }
 )
 
+-- ***************************************************************
+-- Usage:       diag,pos2,truncated = diagnostic(packet[,pos][,max])
+-- Desc:        Output CBOR encoded data in the CBOR diagnostic format
+-- Input:       packet (binary) CBOR encoded data
+--              pos (integer/optional) starting point for decoding
+--              max (integer/optional) maximum length of output
+-- Return:      diag (string) CBOR data in CBOR diagnostic format
+--              pos2 (integer) position past the data
+--              truncated (boolean) true if diag was cut at max
 -- ***************************************************************
 
-function diagnostic(packet,pos)
-  pos = pos or 1
-  
-  local ctype,info,value,npos = cbor_c.decode(packet,pos)
-  return TYPE[ctype](packet,npos,info,value)
+function diagnostic(packet,pos,max)
+  return cbor_c.diagnostic(packet,pos or 1,TAG,max)
 end
 
 -- ***************************************************************
 
-function pdiagnostic(packet,pos)
-  local okay,result = pcall(diagnostic,packet,pos)
+function pdiagnostic(packet,pos,max)
+  local okay,result,npos,truncated = pcall(diagnostic,packet,pos,max)
   if okay then
-    return result
+    return result,npos,truncated
+  elseif type(result) == 'table' then
+    return nil,result.msg,result.pos
   else
     return nil,result
   end
@@ -383,6 +383,42 @@ test('_mime',
         end)
 test('_magic_cbor',"D9D9F7","_magic_cbor",
         function() return cbor.TAG._magic_cbor() end)
+
+if _VERSION >= "Lua 5.3" then
+  test('UINT',"1B7FFFFFFFFFFFFFFF",math.maxinteger)
+  test('NINT',"3B7FFFFFFFFFFFFFFF",math.mininteger)
+end
+
+-- A replaced __ENCODE_MAP entry is called for nested values too.
+
+do
+  local string_encode = cbor.__ENCODE_MAP['string']
+  cbor.__ENCODE_MAP['string'] = function(value,sref,stref)
+    return cbor.TYPE.BIN(value,sref,stref)
+  end
+  test('ARRAY',"8241614162",{ "a" , "b" })
+  cbor.__ENCODE_MAP['string'] = string_encode
+end
+
+-- So are replaced TYPE.TEXT() and TYPE.ARRAY() functions.
+
+do
+  local text_encode  = cbor.TYPE.TEXT
+  local array_encode = cbor.TYPE.ARRAY
+  local arrays       = 0
+  
+  cbor.TYPE.TEXT = function(value,sref,stref)
+    return cbor.TYPE.BIN(value,sref,stref)
+  end
+  cbor.TYPE.ARRAY = function(value,sref,stref)
+    arrays = arrays + 1
+    return array_encode(value,sref,stref)
+  end
+  test('ARRAY',"8282416141624142",{ { "a" , "b" } , "B" })
+  cbor.TYPE.TEXT  = text_encode
+  cbor.TYPE.ARRAY = array_encode
+  assertf(arrays == 2,"TYPE.ARRAY called %d times",arrays)
+end
         
 -- _stringref and _nthstring tests
 -- http://cbor.schmorp.de/stringref
@@ -697,6 +733,661 @@ local q =
 test('_rains',"DA00E99BA8A100818204A3056F7777772E636F6E6D616E2E6F72672E0D81612E0E83010203"
         ,q,function() return cbor.TAG._rains(q) end)
 
+test('_uint16be',"D8414600010002FFFF",{ 1 , 2 , 65535 },
+        function() return cbor.TAG._uint16be { 1 , 2 , 65535 } end)
+test('_sint32le',"D84E48FFFFFFFF02000000",{ -1 , 2 },
+        function() return cbor.TAG._sint32le { -1 , 2 } end)
+test('_float16le',"D85446003C00C00038",{ 1.0 , -2.0 , 0.5 },
+        function() return cbor.TAG._float16le { 1.0 , -2.0 , 0.5 } end)
+
+-- *********************************************************************
+-- A message with nested ARRAYs and MAPs, and a short sequence, used by
+-- several of the following tests.
+-- *********************************************************************
+
+local MSG     = { hdr = { ts = 12345 , seq = 7 } , items = { "a" , "b" , { id = 3 } } , [5] = true }
+local MSGBLOB = cbor.encode(MSG)
+local SEQ     = { 1 , "two" , { 3 } , cbor.null , n = 4 }
+local SEQBLOB = hextobin "016374776F8103F6"
+
+-- *********************************************************************
+-- Streaming decoder---feed the data one byte at a time.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting decoder ...") io.stdout:flush()
+  local src  = { 1 , "two" , { three = 3.5 } , { 4 , 5 } }
+  local blob = cbor.encode(src) .. hextobin "9F01FF" .. hextobin "5F4101420203FF"
+  local dec  = cbor.decoder()
+  local got  = {}
+  
+  for i = 1 , #blob do
+    local items = dec:feed(blob:sub(i,i))
+    for j = 1 , items.n do
+      table.insert(got,items[j])
+    end
+  end
+  
+  assertf(#got == 3,"decoder: wanted 3 items, got %d",#got)
+  assertf(compare(got[1],src),"decoder: first item is different")
+  assertf(compare(got[2],{ 1 }),"decoder: second item is different")
+  assertf(got[3] == "\1\2\3","decoder: third item is different")
+  assertf(dec:buffered() == 0,"decoder: data left over")
+  assertf(not pcall(dec.feed,dec,"\255"),"decoder: __break accepted")
+  
+  dec = cbor.decoder()
+  local items = dec:feed(hextobin "0102FF03")
+  assertf(items.n == 2 and items[2] == 2,"decoder: items before an error lost")
+  local okay,err = pcall(dec.feed,dec,"")
+  assertf(not okay and err.pos == 3,"decoder: error not thrown on the next call")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Skipping and validating items without decoding them.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting skip/validate ...") io.stdout:flush()
+  local blob = hextobin "A26161019F0203FF62626305F6"
+  assertf(cbor_c.skip(blob) == 12,"skip: wrong position")
+  assertf(cbor_c.skip(blob,12) == 13,"skip: wrong position")
+  assertf(cbor_c.validate(blob) == 12,"validate: wrong position")
+  local pos,epos,err = cbor_c.validate(hextobin "8201FF")
+  assertf(pos == nil and epos == 3 and err == "invalid data","validate: __break accepted")
+  pos,epos,err = cbor_c.validate(hextobin "830102")
+  assertf(pos == nil and epos == 4 and err == "no more input","validate: short ARRAY accepted")
+  local okay,err = pcall(cbor_c.skip,hextobin "830102")
+  assertf(not okay and err.pos == 4,"skip: short ARRAY accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Lazy views.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting view ...") io.stdout:flush()
+  local v = cbor.view(MSGBLOB)
+  assertf(v.hdr.ts == 12345,"view: wrong hdr.ts")
+  assertf(v.items[2] == "b","view: wrong items[2]")
+  assertf(v.items[3].id == 3,"view: wrong items[3].id")
+  assertf(v.items[4] == nil,"view: items[4] exists")
+  assertf(v.nothere == nil,"view: key exists")
+  
+  -- Lua 5.1 doesn't check __len, __pairs or __ipairs on tables
+  
+  if _VERSION >= "Lua 5.2" then
+    local n = 0
+    for _ in pairs(v.hdr) do n = n + 1 end
+    assertf(#v.items == 3,"view: wrong length")
+    assertf(#v.hdr == 2,"view: wrong MAP length")
+    assertf(n == 2,"view: wrong number of pairs")
+  else
+    assertf(#v.items == 0,"view: __len called")
+    assertf(next(v.hdr) == nil,"view: has entries")
+  end
+  assertf(cbor.encode(v) == MSGBLOB,"view: re-encoding is different")
+  assertf(not pcall(function() v.items[1] = "x" end),"view: not read only")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Extracting single items by path.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting extract ...") io.stdout:flush()
+  local ID = cbor.path { "items" , 3 , "id" }
+  assertf(cbor.extract(MSGBLOB,ID) == 3,"extract: wrong items[3].id")
+  assertf(cbor.extract(MSGBLOB,{ "hdr" , "ts" }) == 12345,"extract: wrong hdr.ts")
+  assertf(cbor.extract(MSGBLOB,{ 5 }) == true,"extract: wrong [5]")
+  assertf(select('#',cbor.extract(MSGBLOB,{ "items" , 4 })) == 0,"extract: items[4] exists")
+  assertf(select('#',cbor.extract(MSGBLOB,{ "hdr" , "ts" , "x" })) == 0,"extract: hdr.ts.x exists")
+  assertf(not pcall(cbor.path,{ "items" , 1.5 }),"extract: bad step accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Reference contexts should work the same as the tables.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting refs ...") io.stdout:flush()
+  local shared = { "shared" }
+  local src    = { "hello" , "world" , "hello" , shared , shared , { "world" } }
+  local ctx    = cbor_c.refs()
+  
+  for _ = 1 , 2 do
+    local blob = cbor.encode(src,ctx,ctx)
+    assertf(blob == cbor.encode(src,{},{}),"refs: encoding is different")
+    ctx:reset()
+    local value = cbor.decode(blob,1,nil,{ _stringref = ctx , _sharedref = {} })
+    assertf(compare(value,src),"refs: decoding is different")
+    ctx:reset()
+  end
+  
+  local ref = { _stringref = ctx , _sharedref = {} }
+  assertf(not pcall(cbor.decode,hextobin "D901008263616263FF",1,nil,ref),"refs: bad item accepted")
+  assertf(not pcall(cbor.decode,hextobin "D81900",1,nil,ref),"refs: namespace left behind by error")
+  
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Key sets, in both orders.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting keys ...") io.stdout:flush()
+  local MSG  = cbor.keys({ "id" , "ts" , "name" },true)
+  local msg  = setmetatable({ name = "x" , id = 1 , ts = 2 },MSG)
+  assertf(cbor.encode(msg) == hextobin "A36269640162747302646E616D656178",
+          "keys: ordered encoding is different")
+  local ANY  = cbor.keys { "id" , "ts" }
+  local any  = setmetatable({ id = 1 , ts = 2 , [3] = "x" },ANY)
+  assertf(compare(cbor.decode(cbor.encode(any)),{ id = 1 , ts = 2 , [3] = "x" }),
+          "keys: unordered encoding is different")
+  assertf(not pcall(cbor.keys,{ "id" , "id" }),"keys: duplicate key accepted")
+  assertf(not pcall(cbor.keys,{ "id" , 2 }),"keys: non-string key accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- The native UTF-8 check, across both the bulk and per-character paths.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting isutf8 ...") io.stdout:flush()
+  local long = string.rep("The quick brown fox. ",8)
+  assertf(cbor_c.isutf8(""),"isutf8: empty string rejected")
+  assertf(cbor_c.isutf8(long),"isutf8: ASCII rejected")
+  assertf(cbor_c.isutf8(long .. "\t\r\n" .. long),"isutf8: C0 codes rejected")
+  assertf(cbor_c.isutf8(long .. "\206\177\226\130\172\240\159\152\128"),
+          "isutf8: multibyte rejected")
+  assertf(not cbor_c.isutf8(long .. "\0" .. long),"isutf8: NUL accepted")
+  assertf(not cbor_c.isutf8(long .. "\127"),"isutf8: DEL accepted")
+  assertf(not cbor_c.isutf8(long .. "\192\128"),"isutf8: overlong accepted")
+  assertf(not cbor_c.isutf8(long .. "\237\160\128"),"isutf8: surrogate accepted")
+  assertf(not cbor_c.isutf8(long .. "\226\130"),"isutf8: short sequence accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Typed arrays, converted in bulk, with a bad element.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting typed arrays ...") io.stdout:flush()
+  local halfs = {}
+  for i = 1 , 37 do halfs[i] = (i - 18) / 4 end
+  for _,tag in ipairs { 80 , 84 , 65 , 69 , 71 , 75 } do
+    local src = tag >= 80 and halfs or { 1 , 255 , 7 , 128 , 0 , 42 , 3 , 9 , 200 , 11 , 12 }
+    assertf(compare(cbor_c.decode_typed(tag,cbor_c.encode_typed(tag,src)),src),
+            "typed: %d did not round trip",tag)
+  end
+  assertf(cbor_c.encode_typed(80,halfs) == cbor_c.encode_typed(84,halfs):gsub("(.)(.)","%2%1"),
+          "typed: byte orders differ")
+  halfs[12] = 1/3
+  local okay,err = pcall(cbor_c.encode_typed,84,halfs)
+  assertf(not okay and err:match "element 12:","typed: bad element not caught")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- CBOR sequences, including a bad item at the end.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting sequences ...") io.stdout:flush()
+  local blob = cbor.encode_seq(SEQ)
+  assertf(blob == SEQBLOB,"encode_seq: encoding is different")
+  local items,pos,epos,err = cbor.decode_seq(blob .. hextobin "8201")
+  assertf(items.n == 4 and compare(items,SEQ),"decode_seq: decoding is different")
+  assertf(pos == #blob + 1 and epos == #blob + 1 and err == "ARRAY: count exceeds input",
+          "decode_seq: bad item not reported")
+  items,pos = cbor.decode_seq(blob,3,2)
+  assertf(items.n == 2 and items[1] == "two" and pos == 8,"decode_seq: max not honored")
+  assertf(not pcall(cbor.encode_seq,{ 1 , n = -1 }),"encode_seq: negative n accepted")
+  assertf(not pcall(cbor.encode_seq,{ 1 , n = 1.5 }),"encode_seq: fractional n accepted")
+  assertf(cbor.encode_seq { 1 , n = 0 } == "","encode_seq: n of 0 not honored")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Decoding straight out of a memory mapped file.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting mmap ...") io.stdout:flush()
+  local name = os.tmpname()
+  local f    = io.open(name,"wb")
+  f:write(SEQBLOB)
+  f:close()
+  
+  local m = cbor_c.mmap(name)
+  if m then
+    assertf(#m == #SEQBLOB and m:sub(2,-1) == SEQBLOB:sub(2,-1),"mmap: contents are different")
+    assertf(m:byte(1) == 1,"mmap: byte is different")
+    local items = cbor.decode_seq(m)
+    assertf(compare(items,SEQ),"mmap: decoding is different")
+    assertf(cbor_c.skip(m,2) == 6,"mmap: skip is different")
+    m = nil -- luacheck: ignore
+    collectgarbage()
+    io.stdout:write("GO!\n")
+  else
+    io.stdout:write("SKIPPED\n")
+  end
+  os.remove(name)
+  assertf(cbor_c.mmap(name) == nil,"mmap: missing file mapped")
+end
+
+-- *********************************************************************
+-- Streaming output, with a tiny high-water mark to force flushes.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting writer ...") io.stdout:flush()
+  local out = {}
+  local w   = cbor.writer(function(data) out[#out + 1] = data end,4)
+  
+  w:array():encode(1):encode("two"):map():encode("a"):encode(true):close()
+  assertf(pcall(w.encode,w,print) == false,"writer: function encoded")
+  w:encode(3):close():flush()
+  assertf(#out > 1,"writer: no flushes")
+  assertf(table.concat(out) == hextobin "9F016374776FBF6161F5FF03FF",
+          "writer: encoding is different")
+  assertf(w:buffered() == 0,"writer: data left in buffer")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Building a message piece by piece in a reusable buffer.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting buffer ...") io.stdout:flush()
+  local b = cbor_c.buffer()
+  
+  for _ = 1 , 2 do
+    b:reset():map(2):text("a"):nint(-500):text("b"):array()
+     :uint(1):float(1.5):bin("\0"):simple(22):__break()
+    assertf(tostring(b) == hextobin "A261613901F361629F01F93E004100F6FF",
+            "buffer: encoding is different")
+  end
+  
+  b:raw(b)
+  assertf(#b == 34,"buffer: raw copy of itself failed")
+  assertf(not pcall(b.text,b,"\255"),"buffer: bad TEXT accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Decoding statistics.  The TAG 1 handler calls back into cbor.decode()
+-- for the tagged value, which counts as another call.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting stats ...") io.stdout:flush()
+  local blob = hextobin "A26161830102036162C11A514B67B0"
+  local conv = { UINT = function(v) return v end }
+  
+  cbor.stats(true)
+  cbor.decode(blob,1,conv)
+  local st = cbor.stats(false)
+  
+  assertf(st.enabled and st.calls == 2,"stats: wrong number of calls")
+  assertf(st.items.UINT == 4 and st.items.TEXT == 2 and st.items.TAG == 1,
+          "stats: wrong item counts")
+  assertf(st.tables == 2 and st.strings == 2 and st.bytes == 2,"stats: wrong allocation counts")
+  assertf(st.tags[1] == 1 and st.convs == 4,"stats: wrong callback counts")
+  assertf(not math.type or math.type(st.tags[1]) == 'integer',"stats: tag count not an integer")
+  
+  cbor.decode(blob)
+  st = cbor.stats()
+  assertf(not st.enabled and st.calls == 2,"stats: counted while disabled")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- ARRAYs and MAPs claiming far more items than there is input shouldn't
+-- be presized for the claim.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting presize ...") io.stdout:flush()
+  local _,_,ctype = cbor.pdecode(hextobin "9B7FFFFFFFFFFFFFFF01")
+  assertf(ctype == '__error',"presize: hostile ARRAY accepted")
+  _,_,ctype = cbor.pdecode(hextobin "BB7FFFFFFFFFFFFFFF0102")
+  assertf(ctype == '__error',"presize: hostile MAP accepted")
+  assertf(type(cbor_c.newtable(math.huge,-1)) == 'table',"presize: bad sizes not ignored")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Decoding limits.  The errors must point to the offending header, even
+-- for items under a TAG, which are decoded by a call back into
+-- cbor.decode().
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting limits ...") io.stdout:flush()
+  local old = cbor.limits { depth = 3 , items = 6 , bytes = 4 , refs = 1 }
+  local _,pos,ctype,err
+  
+  _,_,ctype = cbor.pdecode(hextobin "83010203")
+  assertf(ctype == 'ARRAY',"limits: good ARRAY rejected")
+  _,pos,ctype,err = cbor.pdecode(hextobin "8181818100")
+  assertf(ctype == '__error' and pos == 4 and err == "nesting too deep","limits: depth not enforced")
+  _,pos,ctype,err = cbor.pdecode(hextobin "81C1818100")
+  assertf(ctype == '__error' and pos == 4 and err == "nesting too deep","limits: depth lost through TAG")
+  _,pos,_,err = cbor.pdecode(hextobin "820186010203040506")
+  assertf(pos == 3 and err == "ARRAY: too many items","limits: items not enforced")
+  _,pos,_,err = cbor.pdecode(hextobin "820145FFFFFFFFFF")
+  assertf(pos == 3 and err == "BIN: too long","limits: bytes not enforced")
+  _,pos,_,err = cbor.pdecode(hextobin "D9010083436162634364656643616263")
+  assertf(pos == 9 and err == "BIN: too many references","limits: refs not enforced")
+  
+  local ref = {}
+  cbor.TAG[1000] = function(packet,npos,conv,nref)
+    cbor.decode(packet,npos,conv,nref)
+    error { pos = npos , msg = "bad" }
+  end
+  assertf(not pcall(cbor.decode,hextobin "8181D903E800",1,nil,ref),"limits: handler error lost")
+  cbor.TAG[1000] = nil
+  _,_,ctype = cbor.pdecode(hextobin "818100",1,nil,ref)
+  assertf(ctype == 'ARRAY',"limits: depth left behind by TAG error")
+  
+  _,pos,err = cbor_c.validate(hextobin "8181818100")
+  assertf(pos == 4 and err == "nesting too deep","limits: depth not enforced by scanning")
+  assertf(cbor_c.validate(hextobin "818100") == 4,"limits: good scan rejected")
+  
+  cbor.limits(old)
+  _,_,ctype = cbor.pdecode(hextobin "8181818100")
+  assertf(ctype == 'ARRAY',"limits: not restored")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Compiled schemas, and falling back when a record doesn't fit.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting schema ...") io.stdout:flush()
+  local sc = cbor.schema {
+    { "id"   , "UINT"    } ,
+    { "temp" , "float"   } ,
+    { "ok"   , "boolean" } ,
+    { "when" , "UINT"    , 1 } ,
+  }
+  local rec  = { id = 7 , temp = 1.5 , ok = true , when = 1363896240 , extra = "x" }
+  local blob = sc:encode(rec)
+  
+  assertf(blob == hextobin "A4626964076474656D70F93E00626F6BF5647768656EC11A514B67B0",
+          "schema: encoding is different")
+  local value,pos,ctype = sc:decode(blob)
+  rec.extra = nil
+  assertf(compare(value,rec) and pos == #blob + 1 and ctype == 'MAP',
+          "schema: decoding is different")
+  
+  rec.id = "seven"
+  value  = sc:decode(sc:encode(rec))
+  assertf(compare(value,rec),"schema: no fallback for a bad record")
+  
+  local named = cbor.schema { { "name" , "TEXT" } }
+  assertf(named:encode { name = "\255" } == cbor.encode { name = "\255" },
+          "schema: non-UTF-8 TEXT encoded")
+  assertf(not pcall(cbor.schema,{ { "id" , "UINT" } , { "id" , "TEXT" } }),
+          "schema: duplicate field accepted")
+  assertf(not pcall(cbor.schema,{ { "\255" , "UINT" } }),
+          "schema: non-UTF-8 name accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Indexing a sequence.  It's big enough to be split up for threads, and
+-- there's a bad item at the end.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting index ...") io.stdout:flush()
+  local rec  = cbor.encode { "parallel" , { 1 , 2.5 , true } , string.rep("x",100) }
+  local blob = string.rep(rec,30000) .. hextobin "8201"
+  local idx,epos,err = cbor_c.index(blob,4)
+  
+  assertf(#idx == 30000 and epos == #blob + 1 and err == "no more input","index: wrong number of items")
+  local pos,pos2 = idx:item(12345)
+  assertf(pos == 12344 * #rec + 1 and pos2 == pos + #rec,"index: wrong position")
+  assertf(idx:item(30001) == nil,"index: item past the end")
+  
+  local idx2 = cbor_c.loadindex(idx:pack())
+  assertf(#idx2 == #idx and idx2:item(30000) == idx:item(30000),"index: pack and load differ")
+  assertf(cbor_c.loadindex("bogus") == nil,"index: bad index loaded")
+  
+  -- A BIN full of TAG bytes, straddling the chunks, costs the threads
+  -- far more than a serial scan if they don't give up on resyncing.
+  
+  blob = string.rep("\1",100) .. "\90\0\48\0\0" .. string.rep("\192",3 * 1024 * 1024) .. string.rep("\1",100)
+  idx  = cbor_c.index(blob,4)
+  assertf(#idx == 201 and idx:item(101) == 101 and idx:item(102) == #blob - 99,"index: resync went wrong")
+  
+  local old = cbor.limits { depth = 3 }
+  local _,tpos,terr = cbor_c.validate(hextobin "C1C1C1C100")
+  cbor.limits(old)
+  assertf(tpos == 4 and terr == "nesting too deep","index: TAGs not counted as levels")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Random access through a keyed index.  The keys are out of order, and
+-- one is missing.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting archive ...") io.stdout:flush()
+  local list = {}
+  for i = 1 , 1000 do
+    list[i] = { id = (i * 7919) % 1000 , name = "rec" .. i }
+  end
+  local missing = list[500].id
+  list[500].id  = nil
+  list[501].id  = list[502].id
+  
+  local blob = cbor.encode_seq(list)
+  local ar   = cbor.archive(blob,cbor.index(blob,{ "id" }))
+  
+  assertf(ar and ar:count() == 1000,"archive: wrong count")
+  assertf(ar:get(123).name == "rec123","archive: wrong item")
+  assertf(ar:get(1001) == nil,"archive: item past the end")
+  
+  local value,i = ar:find(list[777].id)
+  assertf(value and value.name == "rec777" and i == 777,"archive: key not found")
+  assertf(ar:find(missing) == nil,"archive: missing key found")
+  
+  local items = ar:items(list[502].id)
+  assertf(#items == 2 and items[1] == 501 and items[2] == 502,"archive: duplicate keys")
+  assertf(cbor.archive(blob,"bogus") == nil,"archive: bad index accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Canonical encoding sorts keys by their encoded bytes, so shorter keys
+-- come first, and nested MAPs are sorted too.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting canonical encoding ...") io.stdout:flush()
+  local value = { b = 1 , a = 2 , aa = 3 , [-1] = 4 , z = { y = 1 , x = 2 } }
+  local blob  = cbor.encode_canonical(value)
+  
+  assertf(blob == hextobin "A52004616102616201617AA261780261790162616103",
+          "canonical: wrong encoding")
+  assertf(compare(cbor.decode(blob),value),"canonical: doesn't decode")
+  
+  local a = setmetatable({},{ __tocbor = function() return cbor.encode "a" end })
+  assertf(not pcall(cbor.encode_canonical,{ a = 1 , [a] = 2 }),"canonical: duplicate key accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- JSON transcoding, both ways.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting JSON ...") io.stdout:flush()
+  local json = cbor.tojson(hextobin "83F97E00D74401020304A16161C349010000000000000000")
+  assertf(json == '[null,"01020304",{"a":"~AQAAAAAAAAAA"}]',"tojson: got %s",json)
+  
+  local blob,pos = cbor.fromjson(' {"a":[1,-2,1.5,"\\u00fc"]} ')
+  assertf(blob == hextobin "A16161840121F93E0062C3BC" and pos == 28,"fromjson: wrong encoding")
+  assertf(cbor.tojson(cbor.fromjson '{"x":[true,false,null]}') == '{"x":[true,false,null]}',
+          "json: no round trip")
+  
+  local okay,err = pcall(cbor.fromjson,"[1,]")
+  assertf(not okay and err.pos == 4,"fromjson: bad JSON accepted")
+  
+  assertf(not pcall(cbor.tojson,hextobin "8100",1,0),"tojson: depth of 0 accepted")
+  assertf(not pcall(cbor.tojson,hextobin "8100",1,1e9),"tojson: huge depth accepted")
+  assertf(not pcall(cbor.fromjson,"[]",1,1e9),"fromjson: huge depth accepted")
+  assertf(not pcall(cbor.tojson,hextobin "818100",1,1),"tojson: depth not enforced")
+  okay,err = pcall(cbor.tojson,hextobin "826161628080")
+  assertf(not okay and err.pos == 4,"tojson: bad UTF-8 accepted")
+  assertf(cbor.tojson(hextobin "62017F") == '"\\u0001\\u007F"',"tojson: control codes not escaped")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Diagnostic notation.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting diagnostic ...") io.stdout:flush()
+  local diag,pos,trunc = cbor_c.diagnostic(hextobin "9F018202039F0405FFFF")
+  assertf(diag == "[_ 1, [2, 3], [_ 4, 5]]" and pos == 11 and not trunc,"diagnostic: got %s",diag)
+  
+  diag = cbor_c.diagnostic(hextobin "C11A514B67B0",1,{ [1] = "_epoch" })
+  assertf(diag == "_epoch(1363896240)","diagnostic: got %s",diag)
+  
+  diag,pos,trunc = cbor_c.diagnostic(hextobin "9F018202039F0405FFFF",1,nil,5)
+  assertf(#diag <= 5 and pos == 11 and trunc,"diagnostic: not truncated")
+  assertf(not pcall(cbor_c.diagnostic,hextobin "8301",1,nil,2),"diagnostic: bad data accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Raw values, out and back in.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting raw ...") io.stdout:flush()
+  local r    = cbor.raw(hextobin "83010203",true)
+  local blob = cbor.encode({ a = r })
+  assertf(blob == hextobin "A1616183010203","raw: got %s",bintohex(blob))
+  
+  local v = cbor.decode(blob,1,{ _raw = { a = true } })
+  assertf(v.a[1] == hextobin "83010203","raw: not returned raw")
+  assertf(cbor.encode(v) == blob,"raw: no round trip")
+  
+  blob = cbor.encode({ r },nil,{})
+  assertf(blob == hextobin "D9010081D9010083010203","raw: got %s",bintohex(blob))
+  assertf(not pcall(cbor.raw,hextobin "8301",true),"raw: bad item accepted")
+  assertf(not pcall(cbor.raw,hextobin "0101",true),"raw: two items accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Tags handled natively, and a replaced handler.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting native TAGs ...") io.stdout:flush()
+  local value,_,ctype = cbor.decode(hextobin "D903E801")
+  assertf(value == 1 and ctype == 'TAG_1000',"TAG: got %s",tostring(ctype))
+  value = cbor.decode(hextobin "D903E801",1,{ TAG_1000 = function(v) return v + 1 end })
+  assertf(value == 2,"TAG: conversion not applied")
+  
+  local epoch = cbor.TAG[1]
+  cbor.TAG[1] = function(packet,pos,conv,ref)
+    local v,npos = cbor.decode(packet,pos,conv,ref)
+    return v * 2,npos,'_epoch'
+  end
+  value = cbor.decode(hextobin "C11A514B67B0")
+  cbor.TAG[1] = epoch
+  assertf(value == 2727792480,"TAG: replaced handler not called")
+  assertf(not pcall(cbor.decode,hextobin "C161FF"),"TAG: bad _epoch accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Bignums and decimal fractions, as numbers and as text.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting bignums ...") io.stdout:flush()
+  local blob  = hextobin "82C349010000000000000000C48221196AB3"
+  local value = cbor.decode(blob,1,cbor.numbers(true))
+  assertf(value[1] == "-18446744073709551617","bignum: got %s",tostring(value[1]))
+  assertf(value[2] == "273.15","decimalfraction: got %s",tostring(value[2]))
+  
+  value = cbor.decode(hextobin "82C2420100C48221196AB3",1,cbor.numbers())
+  assertf(value[1] == 256 and math.abs(value[2] - 273.15) < 1e-9,"numbers: wrong values")
+  
+  blob = cbor.encode(cbor.bignum "18446744073709551616")
+  assertf(blob == hextobin "C249010000000000000000","bignum: got %s",bintohex(blob))
+  assertf(cbor_c.bigtostring(cbor_c.bigfromstring "-12345678901234567890123",true)
+          == "-12345678901234567890123","bignum: no round trip")
+  assertf(not pcall(cbor_c.bigfromstring,"12a"),"bignum: bad text accepted")
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Decoding into a table, and recycling tables.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting table pool ...") io.stdout:flush()
+  local blob  = hextobin "A2616182010261628303040D"
+  local pool  = {}
+  local conv  = { _into = {} , _pool = pool }
+  local msg   = cbor.decode(blob,1,conv)
+  local inner = msg.a
+  assertf(msg == conv._into and msg.a[2] == 2 and msg.b[3] == 13,"_into: not decoded into")
+  
+  msg = cbor.decode(blob,1,conv)
+  assertf(msg == conv._into and (msg.a == inner or msg.b == inner),"_pool: table not reused")
+  assertf(#pool == 0 and #msg.a == 2 and #msg.b == 3,"_pool: wrong contents")
+  
+  local other = cbor.decode(blob)
+  cbor.recycle(pool,other)
+  assertf(#pool == 3 and next(other) == nil,"recycle: got %d tables",#pool)
+  io.stdout:write("GO!\n")
+end
+
+-- *********************************************************************
+-- Packed encoding, with references only where they pay.
+-- *********************************************************************
+
+do
+  io.stdout:write("\tTesting packed ...") io.stdout:flush()
+  local blob = cbor.encode_packed { "telemetry" , "telemetry" , "telemetry" }
+  assertf(blob == hextobin "D90100836974656C656D65747279D81900D81900","packed: got %s",bintohex(blob))
+  
+  blob = cbor.encode_packed { "alpha" , "bravo" }
+  assertf(blob == cbor.encode { "alpha" , "bravo" },"packed: one-off strings referenced")
+  
+  local sub   = { 1 , 2 , 3 , 4 , 5 , 6 , 7 , 8 }
+  local empty = {}
+  local value = cbor.decode(cbor.encode_packed { sub , sub , sub , empty , empty })
+  assertf(value[1] == value[3] and value[1][8] == 8,"packed: table not shared")
+  assertf(value[4] ~= value[5],"packed: empty table shared")
+  
+  local loop = { name = "loop" }
+  loop.self  = loop
+  value      = cbor.decode(cbor.encode_packed(loop))
+  assertf(value.self == value and value.name == "loop","packed: cycle not shared")
+  io.stdout:write("GO!\n")
+end
+
 -- *********************************************************************
 -- Test for a custom null and undefined values.  By default, Lua treats
 -- null and undefined as nil when decoding, and any nil value becomes null